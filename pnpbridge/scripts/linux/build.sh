@@ -14,6 +14,7 @@ build_amqp=ON
 build_http=ON
 build_mqtt=ON
 no_blob=OFF
+memory_accounting=OFF
 run_unittests=OFF
 build_python=OFF
 run_valgrind=0
@@ -49,6 +50,7 @@ usage ()
     echo " --no-logging                  Disable logging"
     echo " --provisioning                Use Provisioning with Flow"
     echo " --use-tpm-simulator           Build TPM simulator"
+    echo " --memory-accounting           Account heap use per bridge subsystem"
     echo " --use-edge-modules            Build Edge modules"    
     exit 1
 }
@@ -104,6 +106,7 @@ process_args ()
               "--provisioning" ) prov_auth=ON;;
               "--use-tpm-simulator" ) prov_use_tpm_simulator=ON;;
               "--run-sfc-tests" ) run_sfc_tests=ON;;
+              "--memory-accounting" ) memory_accounting=ON;;
               "--use-edge-modules") use_edge_modules=ON;;
               * ) usage;;
           esac
@@ -127,7 +130,7 @@ process_args $*
 rm -r -f $build_folder
 mkdir -p $build_folder
 pushd $build_folder
-cmake $toolchainfile $cmake_install_prefix -Drun_valgrind:BOOL=$run_valgrind -DcompileOption_C:STRING="$extracloptions" -Drun_e2e_tests:BOOL=$run_e2e_tests -Drun_sfc_tests:BOOL=$run-sfc-tests -Drun_longhaul_tests=$run_longhaul_tests -Duse_amqp:BOOL=$build_amqp -Duse_http:BOOL=$build_http -Duse_mqtt:BOOL=$build_mqtt -Ddont_use_uploadtoblob:BOOL=$no_blob -Drun_unittests:BOOL=$run_unittests -Dbuild_python:STRING=$build_python -Dno_logging:BOOL=$no_logging $build_root -Duse_prov_client:BOOL=$prov_auth -Duse_tpm_simulator:BOOL=$prov_use_tpm_simulator -Duse_edge_modules=$use_edge_modules
+cmake $toolchainfile $cmake_install_prefix -Drun_valgrind:BOOL=$run_valgrind -DcompileOption_C:STRING="$extracloptions" -Drun_e2e_tests:BOOL=$run_e2e_tests -Drun_sfc_tests:BOOL=$run-sfc-tests -Drun_longhaul_tests=$run_longhaul_tests -Duse_amqp:BOOL=$build_amqp -Duse_http:BOOL=$build_http -Duse_mqtt:BOOL=$build_mqtt -Ddont_use_uploadtoblob:BOOL=$no_blob -Drun_unittests:BOOL=$run_unittests -Dbuild_python:STRING=$build_python -Dno_logging:BOOL=$no_logging $build_root -Duse_prov_client:BOOL=$prov_auth -Duse_tpm_simulator:BOOL=$prov_use_tpm_simulator -Duse_edge_modules=$use_edge_modules -Duse_memory_accounting:BOOL=$memory_accounting
 
 if [ "$make" = true ]
 then
@@ -137,4 +137,6 @@ PNP_ADAPTER EnvironmentSensorInterface = {
     .initialize = EnvironmentSensor_Initialize,
     .shutdown = EnvironmentSensor_Shutdown,
     .createPnpInterface = EnvironmentSensor_CreatePnpInterface,
+    // The sensor is simulated, its interface doesn't need the discovery Context
+    .flags = PNPADAPTER_FLAG_JOURNAL_REPLAY,
 };
@@ -27,8 +27,6 @@ ENVIRONMENTSENSOR_DISCOVERY EnvironmentSensor_Context = { 0 };
 int EnvironmentSensor_DiscoveryWorker(void* context) {
     ENVIRONMENTSENSOR_DISCOVERY* envContext = context;
     PDEVICE_ADAPTER_PARMAETERS deviceArgs;
-    char* str;
-    JSON_Value* jdeviceArgsValue;
 
     if (NULL == envContext->DeviceArgs) {
         LogInfo("EnvironmentSensor_DiscoveryWorker: No device discovery parameters found in configuration.");
@@ -42,20 +40,12 @@ int EnvironmentSensor_DiscoveryWorker(void* context) {
 
     LogInfo("EnvironmentSensor_DiscoveryWorker: Found configuration parameters for %d devices", deviceArgs->Count);
 
-    // This discovery adapter examines the parameters reported for the first device at AdapterParameters[0]
+    // This discovery adapter examines the parameters reported for the first device.
     // It obtains the "sensor_id" parameter and reports a fake device to the bridge using
     // DiscoveryAdapter_ReportDevice
-    str = deviceArgs->AdapterParameters[0];
-
-    jdeviceArgsValue = json_parse_string(str);
-    if (NULL == jdeviceArgsValue) {
-        LogError("EnvironmentSensor_DiscoveryWorker: json_parse_string failed. Invalid discovery parameters");
-        return -1;
-    }
-
-    JSON_Object* jDeviceArgObject = json_value_get_object(jdeviceArgsValue);
+    const JSON_Object* jDeviceArgObject = DiscoveryAdapter_GetDeviceParameters(envContext->DeviceArgs, 0);
     if (NULL == jDeviceArgObject) {
-        LogError("EnvironmentSensor_DiscoveryWorker: json_value_get_object failed.  Invalid discovery parameters");
+        LogError("EnvironmentSensor_DiscoveryWorker: Invalid discovery parameters");
         return -1;
     }
 
@@ -73,20 +63,27 @@ int EnvironmentSensor_DiscoveryWorker(void* context) {
     // Create the device change PnP notification message
     PNPMESSAGE msg = NULL;
 
-    PnpMessage_CreateMessage(&msg);
-    
+    if (0 != PnpMessage_CreateMessage(&msg)) {
+        LogError("EnvironmentSensor_DiscoveryWorker: Failed to create the device change message");
+        return -1;
+    }
+
     size_t length = strlen(deviceChangeMessageformat) + strlen(sensorId) + 1;
     char *deviceChangeBuff = (char*) malloc(length * sizeof(char));
+    if (NULL == deviceChangeBuff) {
+        PnpMemory_ReleaseReference(msg);
+        return -1;
+    }
 
     sprintf_s(deviceChangeBuff, length * sizeof(char), deviceChangeMessageformat, sensorId);
-    PnpMessage_SetMessage(msg, deviceChangeBuff);
+
+    // The message frees deviceChangeBuff when it is released
+    PnpMessage_SetMessageOwned(msg, deviceChangeBuff);
 
     // Notify the pnpbridge of device discovery
     LogInfo("EnvironmentSensor_DiscoveryWorker: Reporting sensor ID %s to bridge", sensorId);
     DiscoveryAdapter_ReportDevice(msg);
 
-    free(deviceChangeBuff);
-
     // Drop reference on the PNPMESSAGE
     PnpMemory_ReleaseReference(msg);
 
@@ -155,11 +152,12 @@ int EnvironmentSensor_StopDiscovery() {
 DISCOVERY_ADAPTER EnvironmentSensorDiscovery = {
     .Identity = "environment-sensor-sample-discovery-adapter",
     .StartDiscovery = EnvironmentSensor_StartDiscovery,
-    .StopDiscovery = EnvironmentSensor_StopDiscovery
+    .StopDiscovery = EnvironmentSensor_StopDiscovery,
+    .Flags = DISCOVERY_ADAPTER_FLAG_PARSED_PARAMETERS
 };
 
 
 int main()
 {
-   PnpBridge_Main();
+   PnpBridge_Main(NULL, false);
 }
\ No newline at end of file
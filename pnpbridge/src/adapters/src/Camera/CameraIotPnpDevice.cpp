@@ -147,27 +147,27 @@ CameraIotPnpDevice::ReportTelemetry(
 {
     AutoLock lock(&m_lock);
 
-    DIGITALTWIN_CLIENT_RESULT result;
+    int result;
 
     RETURN_HR_IF_NULL (HRESULT_FROM_WIN32(ERROR_INVALID_HANDLE), m_PnpClientInterface);
 
     AZURE_UNREFERENCED_PARAMETER(messageDataLen);
 
-    result = DigitalTwin_InterfaceClient_SendTelemetryAsync(m_PnpClientInterface,
-                                                    telemetryName,
-                                                    (const char*)messageData,
-                                                    CameraIotPnpDevice_TelemetryCallback,
-                                                    (void*)telemetryName);
-    if (result != DIGITALTWIN_CLIENT_OK)
+    // Camera health is reported periodically, so an unsent report is
+    // superseded by the next one
+    result = PnpBridge_SendTelemetry(m_PnpClientInterface,
+                                     telemetryName,
+                                     (const char*)messageData,
+                                     PNPBRIDGE_TELEMETRY_FLAG_SAMPLE);
+    if (result != 0)
     {
-        LogError("DEVICE_INFO: Reporting telemetry=<%s> failed, error=<%s>", telemetryName, MU_ENUM_TO_STRING(DIGITALTWIN_CLIENT_RESULT, result));
-    }
-    else
-    {
-        LogInfo("DEVICE_INFO: Queued async report telemetry for %s", telemetryName);
+        LogError("DEVICE_INFO: Reporting telemetry=<%s> failed, error=<%d>", telemetryName, result);
+        return E_FAIL;
     }
 
-    return HResultFromPnpClient(result);
+    LogInfo("DEVICE_INFO: Queued async report telemetry for %s", telemetryName);
+
+    return S_OK;
 }
 
 HRESULT
@@ -349,14 +349,6 @@ CameraIotPnpDevice::CameraIotPnpDevice_PropertyCallback(
     LogInfo("%s:%d pnpstatus=%d,context=0x%p", __FUNCTION__, __LINE__, pnpReportedStatus, userContextCallback);
 }
 
-void __cdecl
-CameraIotPnpDevice::CameraIotPnpDevice_TelemetryCallback(
-    _In_ DIGITALTWIN_CLIENT_RESULT pnpTelemetryStatus,
-    _In_opt_ void* userContextCallback)
-{
-    LogInfo("%s:%d pnpstatus=%d,context=0x%p", __FUNCTION__, __LINE__, pnpTelemetryStatus, userContextCallback);
-}
-
 void __cdecl
 CameraIotPnpDevice::CameraIotPnpDevice_BlobUploadCallback(
     IOTHUB_CLIENT_FILE_UPLOAD_RESULT result, 
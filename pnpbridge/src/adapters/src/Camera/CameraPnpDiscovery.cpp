@@ -91,8 +91,7 @@ CameraPnpDiscovery::InitializePnpDiscovery(
         RETURN_IF_FAILED (pmatchjson->AddFormatString("hardware_id", "UVC_Webcam_00"));
         RETURN_IF_FAILED (pjson->AddObject("match_parameters", pmatchjson->GetMessageW()));
 
-        PnpMessage_CreateMessage(&payload);
-        PnpMessage_SetMessage(payload, pjson->GetMessageW());
+        RETURN_HR_IF (E_OUTOFMEMORY, 0 != PnpMessage_CreateMessageWithPayload(&payload, pjson->GetMessageW(), nullptr, nullptr));
         props = PnpMessage_AccessProperties(payload);
 
         props->Context = this;
@@ -290,8 +289,7 @@ CameraPnpDiscovery::OnWatcherNotification(
         RETURN_IF_FAILED (pjson->Initialize());
         RETURN_IF_FAILED (pjson->AddFormatString("HardwareId", "UVC_Webcam_00"));
 
-        PnpMessage_CreateMessage(&payload);
-        PnpMessage_SetMessage(payload, pjson->GetMessageW());
+        RETURN_HR_IF (E_OUTOFMEMORY, 0 != PnpMessage_CreateMessageWithPayload(&payload, pjson->GetMessageW(), nullptr, nullptr));
         props = PnpMessage_AccessProperties(payload);
         props->Context = this;
 
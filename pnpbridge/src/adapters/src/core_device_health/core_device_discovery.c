@@ -102,12 +102,21 @@ CoreDeviceDiscovery_NotifyPnpBridge(
                  strlen(STRING_c_str(sHardwareId)) + strlen(STRING_c_str(sSymbolicLink)) + 1;
 
     msg = malloc(msgLen * sizeof(char));
+    if (NULL == msg) {
+        goto exit;
+    }
     
     sprintf_s(msg, msgLen, CoreDeviceDiscovery_PnpMessageformat, 
                 STRING_c_str(sHardwareId), STRING_c_str(sSymbolicLink));
 
-    PnpMessage_CreateMessage(&payload);
-    PnpMessage_SetMessage(payload, msg);
+    if (0 != PnpMessage_CreateMessage(&payload)) {
+        LogError("Failed to create a PNPMESSAGE for %s", hardwareIdA);
+        goto exit;
+    }
+
+    // The message frees msg when it is released
+    PnpMessage_SetMessageOwned(payload, msg);
+    msg = NULL;
 
     PnpMessage_AccessProperties(payload)->ChangeType = PNPMESSAGE_CHANGE_ARRIVAL;
 
@@ -198,9 +207,7 @@ CoreDevice_StartDiscovery(
     DWORD cmRet;
     CM_NOTIFY_FILTER cmFilter;
     HCMNOTIFICATION notifyHandle = NULL;
-    JSON_Value* jmsg;
-    JSON_Object* jobj;
-    char* adapterArgsJson = NULL;
+    const JSON_Object* jobj;
     JSON_Array* interfaceClasses = NULL;
 
     UNREFERENCED_PARAMETER(DeviceArgs);
@@ -216,10 +223,7 @@ CoreDevice_StartDiscovery(
         return -1;
     }
 
-    adapterArgsJson = PnpMemory_GetBuffer(AdapterArgs, NULL);
-
-    jmsg = json_parse_string(adapterArgsJson);
-    jobj = json_value_get_object(jmsg);
+    jobj = DiscoveryAdapter_GetAdapterParameters(AdapterArgs);
 
     interfaceClasses =  json_object_dotget_array(jobj, DEVICE_INTERFACE_CLASSES);
 
@@ -271,5 +275,6 @@ CoreDevice_StopDiscovery()
 DISCOVERY_ADAPTER CoreDeviceDiscovery = {
     .Identity = "core-device-discovery",
     .StartDiscovery = CoreDevice_StartDiscovery,
-    .StopDiscovery = CoreDevice_StopDiscovery
+    .StopDiscovery = CoreDevice_StopDiscovery,
+    .Flags = DISCOVERY_ADAPTER_FLAG_PARSED_PARAMETERS
 };
\ No newline at end of file
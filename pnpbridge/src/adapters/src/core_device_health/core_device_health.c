@@ -46,16 +46,6 @@ CoreDevice_OnDeviceNotification(
     return 0;
 }
 
-void
-CoreDevice_EventCallbackSent(
-    DIGITALTWIN_CLIENT_RESULT pnpSendEventStatus,
-    void* userContextCallback
-    )
-{
-    LogInfo("CoreDevice_EventCallbackSent called, result=%d, userContextCallback=%p",
-                pnpSendEventStatus, userContextCallback);
-}
-
 int
 CoreDevice_SendConnectionEventAsync(
     DIGITALTWIN_INTERFACE_CLIENT_HANDLE DigitalTwinInterface,
@@ -65,15 +55,15 @@ CoreDevice_SendConnectionEventAsync(
 {
     int result = 0;
     char msg[CONN_EVENT_SIZE] = { 0 };
-    DIGITALTWIN_CLIENT_RESULT dtResult;
+    int bridgeResult;
 
     sprintf_s(msg, CONN_EVENT_SIZE, CONN_FORMAT, EventName, EventData);
 
-    dtResult = DigitalTwin_InterfaceClient_SendTelemetryAsync(
-                        DigitalTwinInterface, EventName, (const char*)msg,
-                        CoreDevice_EventCallbackSent, NULL);
-    if (DIGITALTWIN_CLIENT_OK != dtResult) {
-        LogError("CoreDevice_SendEventAsync failed, result=%d\n", dtResult);
+    // Connection changes are events and must not be merged
+    bridgeResult = PnpBridge_SendTelemetry(DigitalTwinInterface, EventName,
+                        (const char*)msg, PNPBRIDGE_TELEMETRY_FLAG_NONE);
+    if (0 != bridgeResult) {
+        LogError("CoreDevice_SendEventAsync failed, result=%d\n", bridgeResult);
         result = -1;
     }
 
@@ -9,6 +9,14 @@
 static bool ModbusPnP_ContinueReadTasks = false;
 static CONDITION_VARIABLE StopPolling;
 
+// Connection of the bridge to the hub. The polling tasks poll less often while
+// the hub doesn't keep up and skip the readings that would be lost while it is
+// unreachable.
+static volatile PNPBRIDGE_CONNECTION_STATE ModbusPnp_ConnectionState = PNPBRIDGE_CONNECTION_STATE_CONNECTED;
+
+#define MODBUS_THROTTLED_POLLING_FACTOR 2
+#define MODBUS_DISCONNECTED_POLLING_FACTOR 4
+
 #pragma region Commands
 
 static void ModbusPnp_SetCommandResponse(DIGITALTWIN_CLIENT_COMMAND_RESPONSE* pnpClientCommandResponseContext, const char* responseData, int status)
@@ -54,7 +62,7 @@ const ModbusCommand* ModbusPnp_LookupCommand(SINGLYLINKEDLIST_HANDLE interfaceDe
 	const ModbusCommand* command = NULL;
 	while (commandItemHandle != NULL) {
 		command = singlylinkedlist_item_get_value(commandItemHandle);
-		if (strcmp(command->Name, commandName) == 0) {
+		if (strcmp(command->Definition->Name, commandName) == 0) {
 			return command;
 		}
 		commandItemHandle = singlylinkedlist_get_next_item(commandItemHandle);
@@ -119,7 +127,7 @@ const ModbusProperty* ModbusPnp_LookupProperty(SINGLYLINKEDLIST_HANDLE interface
 	const ModbusProperty* property;
 	while (propertyItemHandle != NULL) {
 		property = singlylinkedlist_item_get_value(propertyItemHandle);
-		if (strcmp(property->Name, propertyName) == 0) {
+		if (strcmp(property->Definition->Name, propertyName) == 0) {
 			return property;
 		}
 		propertyItemHandle = singlylinkedlist_get_next_item(propertyItemHandle);
@@ -189,10 +197,23 @@ int ModbusPnP_ReportReadOnlyProperty(DIGITALTWIN_INTERFACE_CLIENT_HANDLE pnpInte
 	return result;
 }
 
+static DWORD ModbusPnp_GetPollingInterval(int defaultFrequency, PNPBRIDGE_CONNECTION_STATE state)
+{
+	switch (state)
+	{
+	case PNPBRIDGE_CONNECTION_STATE_THROTTLED:
+		return (DWORD)defaultFrequency * MODBUS_THROTTLED_POLLING_FACTOR;
+	case PNPBRIDGE_CONNECTION_STATE_DISCONNECTED:
+		return (DWORD)defaultFrequency * MODBUS_DISCONNECTED_POLLING_FACTOR;
+	default:
+		return (DWORD)defaultFrequency;
+	}
+}
+
 int ModbusPnp_PollingSingleProperty(CapabilityContext *context)
 {
 	ModbusProperty* property = context->capability;
-	LogInfo("Start polling task for property \"%s\".", property->Name);
+	LogInfo("Start polling task for property \"%s\".", property->Definition->Name);
 	byte resultedData[MODBUS_RESPONSE_MAX_LENGTH];
 	memset(resultedData, 0x00, MODBUS_RESPONSE_MAX_LENGTH);
 
@@ -201,17 +222,22 @@ int ModbusPnp_PollingSingleProperty(CapabilityContext *context)
 	
 	while (ModbusPnP_ContinueReadTasks)
 	{
-		int resultLen = ModbusPnp_ReadCapability(context, Property, resultedData);
-		if (resultLen > 0) {
-			ModbusPnP_ReportReadOnlyProperty(PnpAdapterInterface_GetPnpInterfaceClient(property->InterfaceClient), (char*)property->Name, (char*)resultedData);
+		PNPBRIDGE_CONNECTION_STATE state = ModbusPnp_ConnectionState;
+
+		// Reported properties aren't spooled, so the register isn't read while the hub is unreachable
+		if (PNPBRIDGE_CONNECTION_STATE_DISCONNECTED != state) {
+			int resultLen = ModbusPnp_ReadCapability(context, Property, resultedData);
+			if (resultLen > 0) {
+				ModbusPnP_ReportReadOnlyProperty(PnpAdapterInterface_GetPnpInterfaceClient(property->InterfaceClient), (char*)property->Definition->Name, (char*)resultedData);
+			}
 		}
 
-		SleepConditionVariableSRW(&StopPolling, &lock, property->DefaultFrequency, CONDITION_VARIABLE_LOCKMODE_SHARED);
+		SleepConditionVariableSRW(&StopPolling, &lock, ModbusPnp_GetPollingInterval(property->Definition->DefaultFrequency, state), CONDITION_VARIABLE_LOCKMODE_SHARED);
 	}
 
 	ReleaseSRWLockShared(&lock);
 
-	LogInfo("Stopped polling task for property \"%s\".", property->Name);
+	LogInfo("Stopped polling task for property \"%s\".", property->Definition->Name);
 	free(context);
 	ThreadAPI_Exit(THREADAPI_OK);
 	return 0;
@@ -221,23 +247,20 @@ int ModbusPnp_PollingSingleProperty(CapabilityContext *context)
 
 #pragma region SendTelemetry
 
-void ModbusPnp_ReportTelemetryCallback(DIGITALTWIN_CLIENT_RESULT pnpSendEventStatus, void* userContextCallback)
-{
-	LogInfo("ModbusPnp_ReportTelemetryCallback called, result=%d, userContextCallback=%p", pnpSendEventStatus, userContextCallback);
-}
-
 int ModbusPnp_ReportTelemetry(DIGITALTWIN_INTERFACE_CLIENT_HANDLE pnpInterface, char* eventName, char* data)
 {
 	int result;
-    DIGITALTWIN_CLIENT_RESULT pnpClientResult;
+	int bridgeResult;
 
 	if (pnpInterface == NULL) {
 		return 0;
 	}
 
-	if ((pnpClientResult = DigitalTwin_InterfaceClient_SendTelemetryAsync(pnpInterface, eventName, (const char*)data, ModbusPnp_ReportTelemetryCallback, NULL)) != DIGITALTWIN_CLIENT_OK)
+	// Polled register values are samples: a newer reading of the same
+	// telemetry supersedes one that hasn't been sent yet
+	if ((bridgeResult = PnpBridge_SendTelemetry(pnpInterface, eventName, (const char*)data, PNPBRIDGE_TELEMETRY_FLAG_SAMPLE)) != 0)
 	{
-		LogError("PnP_InterfaceClient_SendTelemetryAsync failed, result=%d\n", pnpClientResult);
+		LogError("PnpBridge_SendTelemetry failed, result=%d\n", bridgeResult);
         result = -1;// __FAILURE__;
 	}
 	else
@@ -251,24 +274,29 @@ int ModbusPnp_ReportTelemetry(DIGITALTWIN_INTERFACE_CLIENT_HANDLE pnpInterface,
 int ModbusPnp_PollingSingleTelemetry(CapabilityContext *context)
 {
 	ModbusTelemetry* telemetry = context->capability;
-	LogInfo("Start polling task for telemetry \"%s\".", telemetry->Name);
+	LogInfo("Start polling task for telemetry \"%s\".", telemetry->Definition->Name);
 	byte resultedData[MODBUS_RESPONSE_MAX_LENGTH];
 
 	SRWLOCK lock;
 	AcquireSRWLockShared(&lock);
 	while (ModbusPnP_ContinueReadTasks)
 	{
-		memset(resultedData, 0x00, MODBUS_RESPONSE_MAX_LENGTH);
-		int resultLen = ModbusPnp_ReadCapability(context, Telemetry, resultedData);
-		if (resultLen > 0) {
-			ModbusPnp_ReportTelemetry(PnpAdapterInterface_GetPnpInterfaceClient(telemetry->InterfaceClient), (char*)telemetry->Name, (char*)resultedData);
+		PNPBRIDGE_CONNECTION_STATE state = ModbusPnp_ConnectionState;
+
+		// While the hub is unreachable the readings are only kept if the bridge spools them
+		if (PNPBRIDGE_CONNECTION_STATE_DISCONNECTED != state || PnpBridge_IsTelemetrySpooled()) {
+			memset(resultedData, 0x00, MODBUS_RESPONSE_MAX_LENGTH);
+			int resultLen = ModbusPnp_ReadCapability(context, Telemetry, resultedData);
+			if (resultLen > 0) {
+				ModbusPnp_ReportTelemetry(PnpAdapterInterface_GetPnpInterfaceClient(telemetry->InterfaceClient), (char*)telemetry->Definition->Name, (char*)resultedData);
+			}
 		}
 
-		SleepConditionVariableSRW(&StopPolling, &lock, telemetry->DefaultFrequency, CONDITION_VARIABLE_LOCKMODE_SHARED);
+		SleepConditionVariableSRW(&StopPolling, &lock, ModbusPnp_GetPollingInterval(telemetry->Definition->DefaultFrequency, state), CONDITION_VARIABLE_LOCKMODE_SHARED);
 	}
 	ReleaseSRWLockShared(&lock);
 
-	LogInfo("Stopped polling task for telemetry \"%s\".", telemetry->Name);
+	LogInfo("Stopped polling task for telemetry \"%s\".", telemetry->Definition->Name);
 	free(context);
 	ThreadAPI_Exit(THREADAPI_OK);
 	return 0;
@@ -282,6 +310,16 @@ void StopPollingTasks()
 	WakeAllConditionVariable(&StopPolling);;
 }
 
+void ModbusPnp_SetConnectionState(PNPBRIDGE_CONNECTION_STATE state)
+{
+	ModbusPnp_ConnectionState = state;
+
+	// The polling tasks that were slowed down or paused poll right away
+	if (PNPBRIDGE_CONNECTION_STATE_CONNECTED == state) {
+		WakeAllConditionVariable(&StopPolling);
+	}
+}
+
 int ModbusPnp_StartPollingAllTelemetryProperty(void* context)
 {
 	PMODBUS_DEVICE_CONTEXT deviceContext = (PMODBUS_DEVICE_CONTEXT)context;
@@ -330,7 +368,7 @@ int ModbusPnp_StartPollingAllTelemetryProperty(void* context)
 
 		if (ThreadAPI_Create(&(deviceContext->PollingTasks[i]), ModbusPnp_PollingSingleTelemetry, (void*)pollingPayload) != THREADAPI_OK)
 		{
-			LogError("Failed to create worker thread for telemetry \"%s\", 0x%x", telemetry->Name, GetLastError());
+			LogError("Failed to create worker thread for telemetry \"%s\", 0x%x", telemetry->Definition->Name, GetLastError());
 		}
 	}
 
@@ -354,7 +392,7 @@ int ModbusPnp_StartPollingAllTelemetryProperty(void* context)
 
 		if (ThreadAPI_Create(&(deviceContext->PollingTasks[telemetryCount + i]), ModbusPnp_PollingSingleProperty, (void*)pollingPayload) != THREADAPI_OK)
 		{
-			LogError("Failed to create worker thread for proerty \"%s\", 0x%x", property->Name, GetLastError());
+			LogError("Failed to create worker thread for proerty \"%s\", 0x%x", property->Definition->Name, GetLastError());
 		}
 	}
 
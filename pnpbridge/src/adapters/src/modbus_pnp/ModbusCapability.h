@@ -9,6 +9,7 @@ extern "C"
 #include <cfgmgr32.h>
 #include <ctype.h>
 #include <digitaltwin_interface_client.h>
+#include <pnpbridge.h>
 
 #include "ModbusConnection/ModbusConnectionHelper.h"
 
@@ -18,14 +19,21 @@ typedef enum ModbusAccessType
 	READ_WRITE = 2
 } ModbusAccessType;
 
-typedef struct ModbusTelemetry {
+// A capability parsed from an interfaceConfig. Devices configured with the
+// same interfaceConfig share its definitions, which aren't modified once parsed.
+typedef struct ModbusCapabilityDefinition {
 	const char*  Name;
 	const char*  StartAddress;
 	UINT16 Length;
 	ModbusDataType  DataType;
 	double ConversionCoefficient;
-	MODBUS_READ_REQUEST  ReadRequest;
 	int    DefaultFrequency;
+	ModbusAccessType Access;
+} ModbusCapabilityDefinition;
+
+typedef struct ModbusTelemetry {
+	const ModbusCapabilityDefinition* Definition;
+	MODBUS_READ_REQUEST  ReadRequest;
     DIGITALTWIN_INTERFACE_CLIENT_HANDLE InterfaceClient;
 	CapabilityType Type;
 } ModbusTelemetry, *PModbusTelemetry;
@@ -33,26 +41,16 @@ typedef struct ModbusTelemetry {
 typedef void(*MODBUS_TELEMETRY_POLLING_TASK)(ModbusTelemetry* userContextCallback);
 
 typedef struct ModbusProperty {
-	const char*  Name;
-	const char*  StartAddress;
-	UINT16 Length;
-	ModbusDataType  DataType;
-	double ConversionCoefficient;
+	const ModbusCapabilityDefinition* Definition;
 	MODBUS_READ_REQUEST  ReadRequest;
 	MODBUS_WRITE_1_REG_REQUEST WriteRequest;
     DIGITALTWIN_INTERFACE_CLIENT_HANDLE InterfaceClient;
-	int    DefaultFrequency;
-	ModbusAccessType Access;
 	CapabilityType Type;
 	//ModbusDevice HostDevice;
 } ModbusProperty, *PModbusProperty;
 
 typedef struct ModbusCommand {
-	const char*  Name;
-	const char*  StartAddress;
-	UINT16 Length;
-	ModbusDataType  DataType;
-	double ConversionCoefficient;
+	const ModbusCapabilityDefinition* Definition;
 	MODBUS_WRITE_1_REG_REQUEST WriteRequest;
     DIGITALTWIN_INTERFACE_CLIENT_HANDLE InterfaceClient;
 	CapabilityType Type;
@@ -69,6 +67,9 @@ typedef struct CapabilityContext {
 int ModbusPnp_StartPollingAllTelemetryProperty(void* context);
 void StopPollingTasks();
 
+// Applies the connection state of the bridge to the polling tasks of all the devices
+void ModbusPnp_SetConnectionState(PNPBRIDGE_CONNECTION_STATE state);
+
 void ModbusPnp_CommandHandler(const DIGITALTWIN_CLIENT_COMMAND_REQUEST* dtClientCommandContext, 
         DIGITALTWIN_CLIENT_COMMAND_RESPONSE* dtClientCommandResponseContext, void* userContextCallback);
 
@@ -76,25 +76,25 @@ int ProcessModbusResponse(MODBUS_CONNECTION_TYPE connectionType, CapabilityType
 	case Telemetry:
 	{
 		ModbusTelemetry* telemetry = (ModbusTelemetry*)capability;
-		dataType = telemetry->DataType;
-		dataLength = telemetry->Length;
-		conversionCoefficient = telemetry->ConversionCoefficient;
+		dataType = telemetry->Definition->DataType;
+		dataLength = telemetry->Definition->Length;
+		conversionCoefficient = telemetry->Definition->ConversionCoefficient;
 		break;
 	}
 	case Property:
 	{
 		ModbusProperty* property = (ModbusProperty*)capability;
-		dataType = property->DataType;
-		dataLength = property->Length;
-		conversionCoefficient = property->ConversionCoefficient;
+		dataType = property->Definition->DataType;
+		dataLength = property->Definition->Length;
+		conversionCoefficient = property->Definition->ConversionCoefficient;
 		break;
 	}
 	case Command:
 	{
 		ModbusCommand* command = (ModbusCommand*)capability;
-		dataType = command->DataType;
-		dataLength = command->Length;
-		conversionCoefficient = command->ConversionCoefficient;
+		dataType = command->Definition->DataType;
+		dataLength = command->Definition->Length;
+		conversionCoefficient = command->Definition->ConversionCoefficient;
 		break;
 	}
 	}
@@ -363,7 +363,7 @@ int ModbusPnp_ReadCapability(CapabilityContext* capabilityContext, CapabilityTyp
 		case Telemetry:
 		{
 			ModbusTelemetry* telemetry = (ModbusTelemetry*) (capabilityContext->capability);
-			capabilityName = telemetry->Name;
+			capabilityName = telemetry->Definition->Name;
 
 			switch (capabilityContext->connectionType)
 			{
@@ -383,7 +383,7 @@ int ModbusPnp_ReadCapability(CapabilityContext* capabilityContext, CapabilityTyp
 		case Property:
 		{
 			ModbusProperty* property = (ModbusProperty*) (capabilityContext->capability);
-			capabilityName = property->Name;
+			capabilityName = property->Definition->Name;
 			switch (capabilityContext->connectionType)
 			{
 				case TCP:
@@ -468,7 +468,7 @@ int ModbusPnp_WriteToCapability(CapabilityContext* capabilityContext, Capability
 		case Command:
 		{
 			ModbusCommand* command = (ModbusCommand*)(capabilityContext->capability);
-			capabilityName = command->Name;
+			capabilityName = command->Definition->Name;
 			if (0 != ModbusPnp_SetWriteRequest(capabilityContext->connectionType, Command, command, requestStr))
 			{
 				LogError("Failed to create write request for command \"%s\": 0x%x ", capabilityName, GetLastError());
@@ -493,7 +493,7 @@ int ModbusPnp_WriteToCapability(CapabilityContext* capabilityContext, Capability
 		case Property:
 		{
 			ModbusProperty* property = (ModbusProperty*)(capabilityContext->capability);
-			capabilityName = property->Name;
+			capabilityName = property->Definition->Name;
 			if (0 != ModbusPnp_SetWriteRequest(capabilityContext->connectionType, Property, property, requestStr))
 			{
 				LogError("Failed to create write request for writable property \"%s\": 0x%x ", capabilityName, GetLastError());
@@ -58,17 +58,17 @@ int ModbusRtu_SetReadRequest(CapabilityType capabilityType, void* capability, by
 		{
 			ModbusTelemetry* telemetry = (ModbusTelemetry*)capability;
 
-			if (!ModbusConnectionHelper_GetFunctionCode(telemetry->StartAddress, true, &(telemetry->ReadRequest.RtuRequest.Payload.FunctionCode), &modbusAddress))
+			if (!ModbusConnectionHelper_GetFunctionCode(telemetry->Definition->StartAddress, true, &(telemetry->ReadRequest.RtuRequest.Payload.FunctionCode), &modbusAddress))
 			{
-				LogError("Failed to get Modbus function code for telemetry \"%s\".", telemetry->Name);
+				LogError("Failed to get Modbus function code for telemetry \"%s\".", telemetry->Definition->Name);
 				return -1;
 			}
 
 			telemetry->ReadRequest.RtuRequest.UnitID = unitId;
 			telemetry->ReadRequest.RtuRequest.Payload.StartAddr_Hi = (modbusAddress >> 8) & 0xff;
 			telemetry->ReadRequest.RtuRequest.Payload.StartAddr_Lo = modbusAddress & 0xff;
-			telemetry->ReadRequest.RtuRequest.Payload.ReadLen_Hi = (telemetry->Length >> 8) & 0xff;
-			telemetry->ReadRequest.RtuRequest.Payload.ReadLen_Lo = telemetry->Length & 0xff;
+			telemetry->ReadRequest.RtuRequest.Payload.ReadLen_Hi = (telemetry->Definition->Length >> 8) & 0xff;
+			telemetry->ReadRequest.RtuRequest.Payload.ReadLen_Lo = telemetry->Definition->Length & 0xff;
 			telemetry->ReadRequest.RtuRequest.CRC = GetCRC(telemetry->ReadRequest.RtuArr, RTU_REQUEST_SIZE - 2);
 
 			break;
@@ -76,17 +76,17 @@ int ModbusRtu_SetReadRequest(CapabilityType capabilityType, void* capability, by
 		case Property:
 		{
 			ModbusProperty* property = (ModbusProperty*)capability;
-			if (!ModbusConnectionHelper_GetFunctionCode(property->StartAddress, true, &(property->ReadRequest.RtuRequest.Payload.FunctionCode), &modbusAddress))
+			if (!ModbusConnectionHelper_GetFunctionCode(property->Definition->StartAddress, true, &(property->ReadRequest.RtuRequest.Payload.FunctionCode), &modbusAddress))
 			{
-				LogError("Failed to get Modbus function code for property \"%s\".", property->Name);
+				LogError("Failed to get Modbus function code for property \"%s\".", property->Definition->Name);
 				return -1;
 			}
 
 			property->ReadRequest.RtuRequest.UnitID = unitId;
 			property->ReadRequest.RtuRequest.Payload.StartAddr_Hi = (modbusAddress >> 8) & 0xff;
 			property->ReadRequest.RtuRequest.Payload.StartAddr_Lo = modbusAddress & 0xff;
-			property->ReadRequest.RtuRequest.Payload.ReadLen_Hi = (property->Length >> 8) & 0xff;
-			property->ReadRequest.RtuRequest.Payload.ReadLen_Lo = property->Length & 0xff;
+			property->ReadRequest.RtuRequest.Payload.ReadLen_Hi = (property->Definition->Length >> 8) & 0xff;
+			property->ReadRequest.RtuRequest.Payload.ReadLen_Lo = property->Definition->Length & 0xff;
 			property->ReadRequest.RtuRequest.CRC = GetCRC(property->ReadRequest.RtuArr, RTU_REQUEST_SIZE - 2);
 			break;
 		}
@@ -110,15 +110,15 @@ int ModbusRtu_SetWriteRequest(CapabilityType capabilityType, void* capability, c
 			ModbusCommand* command = (ModbusCommand*)capability;
 
 
-			if (!ModbusConnectionHelper_GetFunctionCode(command->StartAddress, false, &(command->WriteRequest.RtuRequest.Payload.FunctionCode), &modbusAddress))
+			if (!ModbusConnectionHelper_GetFunctionCode(command->Definition->StartAddress, false, &(command->WriteRequest.RtuRequest.Payload.FunctionCode), &modbusAddress))
 			{
-				LogError("Failed to get Modbus function code for command \"%s\".", command->Name);
+				LogError("Failed to get Modbus function code for command \"%s\".", command->Definition->Name);
 				return -1;
 			}
 
-			if (!ModbusConnectionHelper_ConvertValueStrToUInt16(command->DataType, command->WriteRequest.RtuRequest.Payload.FunctionCode, valueStr, &binaryData))
+			if (!ModbusConnectionHelper_ConvertValueStrToUInt16(command->Definition->DataType, command->WriteRequest.RtuRequest.Payload.FunctionCode, valueStr, &binaryData))
 			{
-				LogError("Failed to convert data \"%s\" to byte array command \"%s\".", valueStr, command->Name);
+				LogError("Failed to convert data \"%s\" to byte array command \"%s\".", valueStr, command->Definition->Name);
 				return -1;
 			}
 
@@ -133,15 +133,15 @@ int ModbusRtu_SetWriteRequest(CapabilityType capabilityType, void* capability, c
 		case Property:
 		{
 			ModbusProperty* property = (ModbusProperty*)capability;
-			if (!ModbusConnectionHelper_GetFunctionCode(property->StartAddress, false, &(property->WriteRequest.RtuRequest.Payload.FunctionCode), &modbusAddress))
+			if (!ModbusConnectionHelper_GetFunctionCode(property->Definition->StartAddress, false, &(property->WriteRequest.RtuRequest.Payload.FunctionCode), &modbusAddress))
 			{
-				LogError("Failed to get Modbus function code for property \"%s\".", property->Name);
+				LogError("Failed to get Modbus function code for property \"%s\".", property->Definition->Name);
 				return -1;
 			}
 
-			if (!ModbusConnectionHelper_ConvertValueStrToUInt16(property->DataType, property->WriteRequest.RtuRequest.Payload.FunctionCode, valueStr, &binaryData))
+			if (!ModbusConnectionHelper_ConvertValueStrToUInt16(property->Definition->DataType, property->WriteRequest.RtuRequest.Payload.FunctionCode, valueStr, &binaryData))
 			{
-				LogError("Failed to convert data \"%s\" to byte array command \"%s\".", valueStr, property->Name);
+				LogError("Failed to convert data \"%s\" to byte array command \"%s\".", valueStr, property->Definition->Name);
 				return -1;
 			}
 
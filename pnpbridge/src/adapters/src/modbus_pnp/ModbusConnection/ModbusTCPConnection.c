@@ -44,9 +44,9 @@ int ModbusTcp_SetReadRequest(CapabilityType capabilityType, void* capability, by
 			ModbusTelemetry* telemetry = (ModbusTelemetry*)capability;
 			UINT16 modbusAddress = 0;
 
-			if (!ModbusConnectionHelper_GetFunctionCode(telemetry->StartAddress, true, &(telemetry->ReadRequest.TcpRequest.Payload.FunctionCode), &modbusAddress))
+			if (!ModbusConnectionHelper_GetFunctionCode(telemetry->Definition->StartAddress, true, &(telemetry->ReadRequest.TcpRequest.Payload.FunctionCode), &modbusAddress))
 			{
-				LogError("Failed to get Modbus function code for telemetry \"%s\".", telemetry->Name);
+				LogError("Failed to get Modbus function code for telemetry \"%s\".", telemetry->Definition->Name);
 				return -1;
 			}
 
@@ -58,17 +58,17 @@ int ModbusTcp_SetReadRequest(CapabilityType capabilityType, void* capability, by
 
 			telemetry->ReadRequest.TcpRequest.Payload.StartAddr_Hi = (modbusAddress >> 8) & 0xff;
 			telemetry->ReadRequest.TcpRequest.Payload.StartAddr_Lo = modbusAddress & 0xff;
-			telemetry->ReadRequest.TcpRequest.Payload.ReadLen_Hi = (telemetry->Length >> 8) & 0xff;
-			telemetry->ReadRequest.TcpRequest.Payload.ReadLen_Lo = telemetry->Length & 0xff;
+			telemetry->ReadRequest.TcpRequest.Payload.ReadLen_Hi = (telemetry->Definition->Length >> 8) & 0xff;
+			telemetry->ReadRequest.TcpRequest.Payload.ReadLen_Lo = telemetry->Definition->Length & 0xff;
 			break;
 		}
 		case Property:
 		{
 			ModbusProperty* property = (ModbusProperty*)capability;
 			UINT16 modbusAddress = 0;
-			if (!ModbusConnectionHelper_GetFunctionCode(property->StartAddress, true, &(property->ReadRequest.TcpRequest.Payload.FunctionCode), &modbusAddress))
+			if (!ModbusConnectionHelper_GetFunctionCode(property->Definition->StartAddress, true, &(property->ReadRequest.TcpRequest.Payload.FunctionCode), &modbusAddress))
 			{
-				LogError("Failed to get Modbus function code for property \"%s\".", property->Name);
+				LogError("Failed to get Modbus function code for property \"%s\".", property->Definition->Name);
 				return -1;
 			}
 
@@ -80,8 +80,8 @@ int ModbusTcp_SetReadRequest(CapabilityType capabilityType, void* capability, by
 
 			property->ReadRequest.TcpRequest.Payload.StartAddr_Hi = (modbusAddress >> 8) & 0xff;
 			property->ReadRequest.TcpRequest.Payload.StartAddr_Lo = modbusAddress & 0xff;
-			property->ReadRequest.TcpRequest.Payload.ReadLen_Hi = (property->Length >> 8) & 0xff;
-			property->ReadRequest.TcpRequest.Payload.ReadLen_Lo = property->Length & 0xff;
+			property->ReadRequest.TcpRequest.Payload.ReadLen_Hi = (property->Definition->Length >> 8) & 0xff;
+			property->ReadRequest.TcpRequest.Payload.ReadLen_Lo = property->Definition->Length & 0xff;
 			break;
 		}
 		default:
@@ -103,15 +103,15 @@ int ModbusTcp_SetWriteRequest(CapabilityType capabilityType, void* capability, c
 			ModbusCommand* command = (ModbusCommand*)capability;
 			UINT16 modbusAddress = 0;
 
-			if (!ModbusConnectionHelper_GetFunctionCode(command->StartAddress, false, &(command->WriteRequest.TcpRequest.Payload.FunctionCode), &modbusAddress))
+			if (!ModbusConnectionHelper_GetFunctionCode(command->Definition->StartAddress, false, &(command->WriteRequest.TcpRequest.Payload.FunctionCode), &modbusAddress))
 			{
-				LogError("Failed to get Modbus function code for command \"%s\".", command->Name);
+				LogError("Failed to get Modbus function code for command \"%s\".", command->Definition->Name);
 				return -1;
 			}
 
-			if (!ModbusConnectionHelper_ConvertValueStrToUInt16(command->DataType, command->WriteRequest.TcpRequest.Payload.FunctionCode, valueStr, &binaryData))
+			if (!ModbusConnectionHelper_ConvertValueStrToUInt16(command->Definition->DataType, command->WriteRequest.TcpRequest.Payload.FunctionCode, valueStr, &binaryData))
 			{
-				LogError("Failed to convert data \"%s\" to byte array command \"%s\".", valueStr, command->Name);
+				LogError("Failed to convert data \"%s\" to byte array command \"%s\".", valueStr, command->Definition->Name);
 				return -1;
 			}
 
@@ -131,15 +131,15 @@ int ModbusTcp_SetWriteRequest(CapabilityType capabilityType, void* capability, c
 		{
 			ModbusProperty* property = (ModbusProperty*)capability;
 			UINT16 modbusAddress = 0;
-			if (!ModbusConnectionHelper_GetFunctionCode(property->StartAddress, false, &(property->WriteRequest.TcpRequest.Payload.FunctionCode), &modbusAddress))
+			if (!ModbusConnectionHelper_GetFunctionCode(property->Definition->StartAddress, false, &(property->WriteRequest.TcpRequest.Payload.FunctionCode), &modbusAddress))
 			{
-				LogError("Failed to get Modbus function code for property \"%s\".", property->Name);
+				LogError("Failed to get Modbus function code for property \"%s\".", property->Definition->Name);
 				return -1;
 			}
 
-			if (!ModbusConnectionHelper_ConvertValueStrToUInt16(property->DataType, property->WriteRequest.TcpRequest.Payload.FunctionCode, valueStr, &binaryData))
+			if (!ModbusConnectionHelper_ConvertValueStrToUInt16(property->Definition->DataType, property->WriteRequest.TcpRequest.Payload.FunctionCode, valueStr, &binaryData))
 			{
-				LogError("Failed to convert data \"%s\" to byte array command \"%s\".", valueStr, property->Name);
+				LogError("Failed to convert data \"%s\" to byte array command \"%s\".", valueStr, property->Definition->Name);
 				return -1;
 			}
 
@@ -61,165 +61,294 @@ ModbusDataType ToModbusDataTypeEnum(const char* dataType)
 	return INVALID;
 }
 
-int ModbusPnp_ParseInterfaceConfig(MODBUS_DEVICE_CONTEXT *deviceContext, JSON_Object* configObj)
+// Interface definitions in use, shared by the devices configured with them
+static SINGLYLINKEDLIST_HANDLE ModbusInterfaceDefinitions = NULL;
+static LOCK_HANDLE ModbusInterfaceDefinitionsLock = NULL;
+
+static const char* ModbusPnp_GetCapabilityTypeName(CapabilityType capabilityType)
 {
-	ModbusDeviceConfig* deviceConfig = deviceContext->DeviceConfig;
-	SINGLYLINKEDLIST_HANDLE interfaceDefinitions = deviceContext->InterfaceDefinitions;
-	const char* interfaceId = NULL;
+	switch (capabilityType)
+	{
+		case Telemetry:
+			return "telemetry";
+		case Property:
+			return "property";
+		default:
+			return "command";
+	}
+}
 
-	//Get interface ID
-	interfaceId = (const char*)json_object_dotget_string(configObj, "interfaceId");
-	if (NULL == interfaceId) {
-		LogError("interfaceId parameter is missing in configuration");
+int ModbusPnp_ParseCapabilityDefinition(CapabilityType capabilityType, const char* name, JSON_Object* capabilityArgs, ModbusCapabilityDefinition* definition)
+{
+	const char* typeName = ModbusPnp_GetCapabilityTypeName(capabilityType);
+
+	if (NULL == capabilityArgs)
+	{
+		LogError("ERROR: %s \"%s\" definition is empty.", typeName, name);
 		return -1;
 	}
 
-	// inline interface
-	ModbusInterfaceConfig* interfaceConfig = calloc(1, sizeof(ModbusInterfaceConfig));
-	interfaceConfig->Events = singlylinkedlist_create();
-	interfaceConfig->Properties = singlylinkedlist_create();
-	interfaceConfig->Commands = singlylinkedlist_create();
-	interfaceConfig->Id = interfaceId;
+	definition->Name = name;
 
-	JSON_Object* telemetryList = json_object_dotget_object(configObj, "telemetry");
-	for (size_t i = 0; i < json_object_get_count(telemetryList); i++)
+	definition->StartAddress = json_object_dotget_string(capabilityArgs, "startAddress");
+	if (NULL == definition->StartAddress)
 	{
-		const char* name = json_object_get_name(telemetryList, i);
-		JSON_Object* telemetryArgs = json_object_dotget_object(telemetryList, name);
+		LogError("\"startAddress\" of %s \"%s\" is invalid.", typeName, name);
+		return -1;
+	}
 
-		if (NULL == telemetryArgs)
-		{
-			LogError("ERROR: Telemetry \"%s\" definition is empty.", name);
-			return -1;
-		}
+	definition->Length = (byte)json_object_dotget_number(capabilityArgs, "length");
+	if (0 == definition->Length)
+	{
+		LogError("\"length\" of %s \"%s\" is invalid.", typeName, name);
+		return -1;
+	}
 
-		ModbusTelemetry* telemetry = calloc(1, sizeof(ModbusTelemetry));
-		if (NULL == telemetry)
+	const char* dataTypeStr = (const char*)json_object_dotget_string(capabilityArgs, "dataType");
+	if (NULL == dataTypeStr)
+	{
+		LogError("\"dataType\" of %s \"%s\" is invalid.", typeName, name);
+		return -1;
+	}
+	definition->DataType = ToModbusDataTypeEnum(dataTypeStr);
+	if (definition->DataType == INVALID)
+	{
+		LogError("\"dataType\" of %s \"%s\" is invalid.", typeName, name);
+		return -1;
+	}
+
+	// Commands aren't polled
+	if (Command != capabilityType)
+	{
+		definition->DefaultFrequency = (int)json_object_dotget_number(capabilityArgs, "defaultFrequency");
+		if (0 == definition->DefaultFrequency)
 		{
-			LogError("Failed to allocation memory for telemetry configuration: \"%s\": 0x%x ", name, GetLastError());
+			LogError("\"defaultFrequency\" of %s \"%s\" is invalid.", typeName, name);
 			return -1;
 		}
+	}
 
-		telemetry->Name = name;
+	definition->ConversionCoefficient = json_object_dotget_number(capabilityArgs, "conversionCoefficient");
+	if (0 == definition->ConversionCoefficient)
+	{
+		LogError("\"conversionCoefficient\" of %s \"%s\" is invalid.", typeName, name);
+		return -1;
+	}
 
-		telemetry->StartAddress = json_object_dotget_string(telemetryArgs, "startAddress");
-		if (0 == telemetry->StartAddress)
-		{
-			LogError("\"startAddress\" of telemetry \"%s\" is in valid: 0x%x ", name, GetLastError());
-			return -1;
-		}
-		telemetry->Length = (byte)json_object_dotget_number(telemetryArgs, "length");
-		if (0 == telemetry->Length)
+	if (Property == capabilityType)
+	{
+		definition->Access = (int)json_object_dotget_number(capabilityArgs, "access");
+		if (0 == definition->Access)
 		{
-			LogError("\"length\" of telemetry \"%s\" is in valid: 0x%x ", name, GetLastError());
+			LogError("\"access\" of %s \"%s\" is invalid.", typeName, name);
 			return -1;
 		}
+	}
 
-		const char* dataTypeStr = (const char*)json_object_dotget_string(telemetryArgs, "dataType");
-		if (NULL == dataTypeStr)
-		{
-			LogError("\"dataType\" of telemetry \"%s\" is in valid: 0x%x ", name, GetLastError());
-			return -1;
-		}
-		telemetry->DataType = ToModbusDataTypeEnum(dataTypeStr);
-		if (telemetry->DataType == INVALID)
-		{
-			LogError("\"dataType\" of telemetry \"%s\" is in valid.", name);
-			return -1;
-		}
+	return 0;
+}
 
-		telemetry->DefaultFrequency = (int)json_object_dotget_number(telemetryArgs, "defaultFrequency");
-		if (0 == telemetry->DefaultFrequency)
-		{
-			LogError("\"defaultFrequency\" of telemetry \"%s\" is in valid: 0x%x ", name, GetLastError());
-			return -1;
-		}
+int ModbusPnp_ParseCapabilityDefinitions(CapabilityType capabilityType, JSON_Object* capabilityList, ModbusCapabilityDefinition** definitions, int* definitionCount)
+{
+	int count = (int)json_object_get_count(capabilityList);
 
-		telemetry->ConversionCoefficient = json_object_dotget_number(telemetryArgs, "conversionCoefficient");
-		if (0 == telemetry->ConversionCoefficient)
-		{
-			LogError("\"conversionCoefficient\" of telemetry \"%s\" is in valid: 0x%x ", name, GetLastError());
-			return -1;
-		}
+	*definitions = NULL;
+	*definitionCount = 0;
+	if (0 == count)
+	{
+		return 0;
+	}
 
-		if (0 != ModbusPnp_SetReadRequest(deviceConfig, Telemetry, telemetry))
+	*definitions = calloc(count, sizeof(ModbusCapabilityDefinition));
+	if (NULL == *definitions)
+	{
+		LogError("Failed to allocate memory for %d %s definition(s).", count, ModbusPnp_GetCapabilityTypeName(capabilityType));
+		return -1;
+	}
+	*definitionCount = count;
+
+	for (int i = 0; i < count; i++)
+	{
+		const char* name = json_object_get_name(capabilityList, i);
+		JSON_Object* capabilityArgs = json_object_dotget_object(capabilityList, name);
+
+		if (0 != ModbusPnp_ParseCapabilityDefinition(capabilityType, name, capabilityArgs, &(*definitions)[i]))
 		{
-			LogError("Failed to create read request for telemetry \"%s\": 0x%x ", name, GetLastError());
 			return -1;
 		}
+	}
 
-		singlylinkedlist_add(interfaceConfig->Events, telemetry);
+	return 0;
+}
+
+void ModbusPnp_FreeInterfaceDefinition(ModbusInterfaceDefinition* definition)
+{
+	free(definition->Telemetry);
+	free(definition->Properties);
+	free(definition->Commands);
+	free(definition);
+}
+
+ModbusInterfaceDefinition* ModbusPnp_CreateInterfaceDefinition(JSON_Object* configObj)
+{
+	//Get interface ID
+	const char* interfaceId = (const char*)json_object_dotget_string(configObj, "interfaceId");
+	if (NULL == interfaceId) {
+		LogError("interfaceId parameter is missing in configuration");
+		return NULL;
+	}
+
+	ModbusInterfaceDefinition* definition = calloc(1, sizeof(ModbusInterfaceDefinition));
+	if (NULL == definition) {
+		LogError("Failed to allocate memory for interface \"%s\".", interfaceId);
+		return NULL;
 	}
 
-	JSON_Object* propertyList = json_object_dotget_object(configObj, "properties");
-	for (size_t i = 0; i < json_object_get_count(propertyList); i++)
+	// The names and addresses point into the interfaceConfig, which is part of
+	// the bridge configuration and outlives the adapter
+	definition->Id = interfaceId;
+	definition->Source = json_object_get_wrapping_value(configObj);
+	definition->RefCount = 1;
+
+	if (0 != ModbusPnp_ParseCapabilityDefinitions(Telemetry, json_object_dotget_object(configObj, "telemetry"),
+			&definition->Telemetry, &definition->TelemetryCount) ||
+		0 != ModbusPnp_ParseCapabilityDefinitions(Property, json_object_dotget_object(configObj, "properties"),
+			&definition->Properties, &definition->PropertyCount) ||
+		0 != ModbusPnp_ParseCapabilityDefinitions(Command, json_object_dotget_object(configObj, "commands"),
+			&definition->Commands, &definition->CommandCount))
 	{
-		const char* name = json_object_get_name(propertyList, i);
-		JSON_Object* propertyArgs = json_object_dotget_object(propertyList, name);
+		ModbusPnp_FreeInterfaceDefinition(definition);
+		return NULL;
+	}
 
-		if (NULL == propertyArgs)
-		{
-			LogError("ERROR: Property \"%s\" definition is empty.", name);
-			return -1;
-		}
+	return definition;
+}
 
-		ModbusProperty* property = calloc(1, sizeof(ModbusProperty));
-		if (NULL == property)
-		{
-			LogError("Failed to allocation memory for property configuration: \"%s\": 0x%x", name, GetLastError());
-			return -1;
-		}
+// Returns the definition of an interfaceConfig, parsing it only if no other
+// device uses an equal one
+ModbusInterfaceDefinition* ModbusPnp_AcquireInterfaceDefinition(JSON_Object* configObj)
+{
+	const JSON_Value* source = json_object_get_wrapping_value(configObj);
+	const char* interfaceId = (const char*)json_object_dotget_string(configObj, "interfaceId");
+	ModbusInterfaceDefinition* definition = NULL;
 
-		property->Name = name;
+	Lock(ModbusInterfaceDefinitionsLock);
 
-		property->StartAddress = json_object_dotget_string(propertyArgs, "startAddress");
-		if (0 == property->StartAddress)
-		{
-			LogError("\"startAddress\" of property \"%s\" is in valid: 0x%x", name, GetLastError());
-			return -1;
+	LIST_ITEM_HANDLE definitionItem = singlylinkedlist_get_head_item(ModbusInterfaceDefinitions);
+	while (NULL != interfaceId && NULL != definitionItem) {
+		ModbusInterfaceDefinition* candidate = (ModbusInterfaceDefinition*)singlylinkedlist_item_get_value(definitionItem);
+
+		// Only the definitions of the same interface are compared in full
+		if (0 == strcmp(candidate->Id, interfaceId) && json_value_equals(candidate->Source, source)) {
+			candidate->RefCount++;
+			definition = candidate;
+			break;
 		}
+		definitionItem = singlylinkedlist_get_next_item(definitionItem);
+	}
 
-		property->Length = (byte)json_object_dotget_number(propertyArgs, "length");
-		if (0 == property->Length)
-		{
-			LogError("\"length\" of property \"%s\" is in valid: 0x%x ", name, GetLastError());
-			return -1;
+	if (NULL == definition) {
+		definition = ModbusPnp_CreateInterfaceDefinition(configObj);
+		if (NULL != definition && NULL == singlylinkedlist_add(ModbusInterfaceDefinitions, definition)) {
+			ModbusPnp_FreeInterfaceDefinition(definition);
+			definition = NULL;
 		}
+	}
 
-		const char* dataTypeStr = (const char*)json_object_dotget_string(propertyArgs, "dataType");
-		if (NULL == dataTypeStr)
-		{
-			LogError("\"dataType\" of property \"%s\" is in valid: 0x%x ", name, GetLastError());
-			return -1;
+	Unlock(ModbusInterfaceDefinitionsLock);
+
+	return definition;
+}
+
+static bool ModbusPnp_IsInterfaceDefinition(LIST_ITEM_HANDLE item, const void* definition)
+{
+	return singlylinkedlist_item_get_value(item) == definition;
+}
+
+void ModbusPnp_ReleaseInterfaceDefinition(ModbusInterfaceDefinition* definition)
+{
+	Lock(ModbusInterfaceDefinitionsLock);
+
+	if (0 == --definition->RefCount) {
+		LIST_ITEM_HANDLE definitionItem = singlylinkedlist_find(ModbusInterfaceDefinitions, ModbusPnp_IsInterfaceDefinition, definition);
+		if (NULL != definitionItem) {
+			singlylinkedlist_remove(ModbusInterfaceDefinitions, definitionItem);
 		}
-		property->DataType = ToModbusDataTypeEnum(dataTypeStr);
-		if (property->DataType == INVALID)
+		ModbusPnp_FreeInterfaceDefinition(definition);
+	}
+
+	Unlock(ModbusInterfaceDefinitionsLock);
+}
+
+int ModbusPnp_ParseInterfaceConfig(MODBUS_DEVICE_CONTEXT *deviceContext, JSON_Object* configObj)
+{
+	ModbusDeviceConfig* deviceConfig = deviceContext->DeviceConfig;
+	SINGLYLINKEDLIST_HANDLE interfaceDefinitions = deviceContext->InterfaceDefinitions;
+
+	ModbusInterfaceDefinition* definition = ModbusPnp_AcquireInterfaceDefinition(configObj);
+	if (NULL == definition) {
+		return -1;
+	}
+
+	// inline interface
+	ModbusInterfaceConfig* interfaceConfig = calloc(1, sizeof(ModbusInterfaceConfig));
+	if (NULL == interfaceConfig) {
+		LogError("Failed to allocate memory for interface \"%s\".", definition->Id);
+		ModbusPnp_ReleaseInterfaceDefinition(definition);
+		return -1;
+	}
+	interfaceConfig->Id = definition->Id;
+	interfaceConfig->Definition = definition;
+
+	// From here on interfaceConfig owns the definition reference, and every
+	// failure releases both through ModbusPnp_FreeInterfaceConfig
+	interfaceConfig->Events = singlylinkedlist_create();
+	interfaceConfig->Properties = singlylinkedlist_create();
+	interfaceConfig->Commands = singlylinkedlist_create();
+	if (NULL == interfaceConfig->Events || NULL == interfaceConfig->Properties || NULL == interfaceConfig->Commands) {
+		LogError("Failed to allocate the capability lists of interface \"%s\".", definition->Id);
+		goto cleanup;
+	}
+
+	// The definitions are shared, the requests hold the unit id of this device
+	for (int i = 0; i < definition->TelemetryCount; i++)
+	{
+		const char* name = definition->Telemetry[i].Name;
+		ModbusTelemetry* telemetry = calloc(1, sizeof(ModbusTelemetry));
+		if (NULL == telemetry)
 		{
-			LogError("\"dataType\" of telemetry \"%s\" is in valid.", name);
-			return -1;
+			LogError("Failed to allocation memory for telemetry configuration: \"%s\": 0x%x ", name, GetLastError());
+			goto cleanup;
 		}
 
-		property->DefaultFrequency = (int)json_object_dotget_number(propertyArgs, "defaultFrequency");
-		if (0 == property->DefaultFrequency)
+		telemetry->Definition = &definition->Telemetry[i];
+
+		if (0 != ModbusPnp_SetReadRequest(deviceConfig, Telemetry, telemetry))
 		{
-			LogError("\"defaultFrequency\" of property \"%s\" is in valid: 0x%x ", name, GetLastError());
-			return -1;
+			LogError("Failed to create read request for telemetry \"%s\": 0x%x ", name, GetLastError());
+			free(telemetry);
+			goto cleanup;
 		}
 
-		property->ConversionCoefficient = json_object_dotget_number(propertyArgs, "conversionCoefficient");
-		if (0 == property->ConversionCoefficient)
+		if (NULL == singlylinkedlist_add(interfaceConfig->Events, telemetry))
 		{
-			LogError("\"conversionCoefficient\" of property \"%s\" is in valid: 0x%x ", name, GetLastError());
-			return -1;
+			free(telemetry);
+			goto cleanup;
 		}
+	}
 
-		property->Access = (int)json_object_dotget_number(propertyArgs, "access");
-		if (0 == property->Access)
+	for (int i = 0; i < definition->PropertyCount; i++)
+	{
+		const char* name = definition->Properties[i].Name;
+		ModbusProperty* property = calloc(1, sizeof(ModbusProperty));
+		if (NULL == property)
 		{
-			LogError("\"conversionCoefficient\" of property \"%s\" is in valid: 0x%x ", name, GetLastError());
-			return -1;
+			LogError("Failed to allocation memory for property configuration: \"%s\": 0x%x", name, GetLastError());
+			goto cleanup;
 		}
 
+		property->Definition = &definition->Properties[i];
+
 		switch (deviceConfig->ConnectionType)
 		{
 			case TCP:
@@ -235,67 +364,28 @@ int ModbusPnp_ParseInterfaceConfig(MODBUS_DEVICE_CONTEXT *deviceContext, JSON_Ob
 		if (0 != ModbusPnp_SetReadRequest(deviceConfig, Property, property))
 		{
 			LogError("Failed to create read request for property \"%s\": 0x%x ", name, GetLastError());
-			return -1;
+			free(property);
+			goto cleanup;
 		}
 
-		singlylinkedlist_add(interfaceConfig->Properties, property);
-	}
-
-	JSON_Object* commandList = json_object_dotget_object(configObj, "commands");
-	for (size_t i = 0; i < json_object_get_count(commandList); i++)
-	{
-		const char* name = json_object_get_name(commandList, i);
-		JSON_Object* commandArgs = json_object_dotget_object(commandList, name);
-
-		if (NULL == commandArgs)
+		if (NULL == singlylinkedlist_add(interfaceConfig->Properties, property))
 		{
-			LogError("ERROR: Command \"%s\" definition is empty.", name);
-			return -1;
+			free(property);
+			goto cleanup;
 		}
+	}
 
+	for (int i = 0; i < definition->CommandCount; i++)
+	{
+		const char* name = definition->Commands[i].Name;
 		ModbusCommand* command = calloc(1, sizeof(ModbusCommand));
-
 		if (NULL == command)
 		{
 			LogError("Failed to allocation memory for command configuration: \"%s\": 0x%x ", name, GetLastError());
-			return -1;
-		}
-
-		command->Name = name;
-
-		command->StartAddress = json_object_dotget_string(commandArgs, "startAddress");
-		if (0 == command->StartAddress)
-		{
-			LogError("\"startAddress\" of command \"%s\" is in valid: 0x%x ", name, GetLastError());
-			return -1;
-		}
-
-		command->Length = (byte)json_object_dotget_number(commandArgs, "length");
-		if (0 == command->Length)
-		{
-			LogError("\"length\" of command \"%s\" is in valid: 0x%x ", name, GetLastError());
-			return -1;
-		}
-
-		const char* dataTypeStr = (const char*)json_object_dotget_string(commandArgs, "dataType");
-		if (NULL == dataTypeStr)
-		{
-			LogError("\"dataType\" of command \"%s\" is in valid: 0x%x ", name, GetLastError());
-			return -1;
-		}
-		command->DataType = ToModbusDataTypeEnum(dataTypeStr);
-		if (command->DataType == INVALID)
-		{
-			LogError("\"dataType\" of telemetry \"%s\" is in valid.", name);
-			return -1;
+			goto cleanup;
 		}
 
-		command->ConversionCoefficient = json_object_dotget_number(commandArgs, "conversionCoefficient");
-		if (0 == command->ConversionCoefficient)
-		{
-			LogError("\"conversionCoefficient\" of command \"%s\" is in valid: 0x%x ", name, GetLastError());
-			return -1;
-		}
+		command->Definition = &definition->Commands[i];
 
 		switch (deviceConfig->ConnectionType)
 		{
@@ -310,13 +400,24 @@ int ModbusPnp_ParseInterfaceConfig(MODBUS_DEVICE_CONTEXT *deviceContext, JSON_Ob
 
 		}
 
-		singlylinkedlist_add(interfaceConfig->Commands, command);
+		if (NULL == singlylinkedlist_add(interfaceConfig->Commands, command))
+		{
+			free(command);
+			goto cleanup;
+		}
 	}
 
-
-	singlylinkedlist_add(interfaceDefinitions, interfaceConfig);
+	if (NULL == singlylinkedlist_add(interfaceDefinitions, interfaceConfig))
+	{
+		LogError("Failed to add interface \"%s\" to the device.", definition->Id);
+		goto cleanup;
+	}
 
 	return 0;
+
+cleanup:
+	ModbusPnp_FreeInterfaceConfig(interfaceConfig);
+	return -1;
 }
 
 int ModbusPnp_ParseRtuSettings(ModbusDeviceConfig* deviceConfig, JSON_Object* configObj)
@@ -601,10 +702,15 @@ int ModbusPnp_OpenDeviceWorker(void* context)
         PNPMESSAGE payload = NULL;
         PNPMESSAGE_PROPERTIES* pnpMsgProps = NULL;
 
-        PnpMessage_CreateMessage(&payload);
-
-        PnpMessage_SetMessage(payload, json_serialize_to_string(json_object_get_wrapping_value(jsonObject)));
-        PnpMessage_SetInterfaceId(payload, def->Id);
+        char* message = json_serialize_to_string(json_object_get_wrapping_value(jsonObject));
+        if (NULL == message ||
+            0 != PnpMessage_CreateMessageWithPayload(&payload, message, def->Id, NULL)) {
+            LogError("Failed to create the PNPMESSAGE for interface %s", def->Id);
+            json_free_serialized_string(message);
+            interfaceItem = singlylinkedlist_get_next_item(interfaceItem);
+            continue;
+        }
+        json_free_serialized_string(message);
 
         pnpMsgProps = PnpMessage_AccessProperties(payload);
         pnpMsgProps->Context = deviceContext;
@@ -678,29 +784,16 @@ cleanup:
 
 #pragma region PnpDiscovery
 
-int 
-ModbusPnp_StartDiscovery(
-    _In_ PNPMEMORY DeviceArgs,
-    _In_ PNPMEMORY AdapterArgs
-    )
+int ModbusPnp_StartDevice(const JSON_Object* args)
 {
-	if (DeviceArgs == NULL) {
-		LogInfo("ModbusPnp_StartDiscovery: No device discovery parameters found in configuration.");
-		return 0;
-	}
-	
-	UNREFERENCED_PARAMETER(AdapterArgs);
-
-    LogInfo("Starting modbus discovery adapter");
-
 	// Parse Modbus DeviceConfig
 	ModbusDeviceConfig* deviceConfig = calloc(1, sizeof(ModbusDeviceConfig));
+	if (NULL == deviceConfig) {
+		LogError("Failed to allocate memory for the Modbus device configuration.");
+		return -1;
+	}
 	deviceConfig->ConnectionType = UNKOWN;
 
-    PDEVICE_ADAPTER_PARMAETERS deviceParams = (PDEVICE_ADAPTER_PARMAETERS) PnpMemory_GetBuffer(DeviceArgs, NULL);
-
-	JSON_Value* jvalue = json_parse_string(deviceParams->AdapterParameters[0]);
-	JSON_Object* args = json_value_get_object(jvalue);
 	JSON_Object* deviceConfigObj = json_object_dotget_object(args, "deviceConfig");
 
 	//BYTE unitId = (BYTE)json_object_dotget_number(deviceConfigObj, "unitId");
@@ -709,24 +802,51 @@ ModbusPnp_StartDiscovery(
 	JSON_Object* rtuArgs = json_object_dotget_object(deviceConfigObj, "rtu");
 	if (NULL != rtuArgs && ModbusPnp_ParseRtuSettings(deviceConfig, rtuArgs) != 0) {
 		LogError("Failed to parse RTU connection settings.");
+		free(deviceConfig);
 		return -1;
 	}
 
 	JSON_Object* tcpArgs = json_object_dotget_object(deviceConfigObj, "tcp");
 	if (NULL != tcpArgs && ModbusPnP_ParseTcpSettings(deviceConfig, tcpArgs) != 0) {
 		LogError("Failed to parse TCP connection settings.");
+		free(deviceConfig);
 		return -1;
 	}
 
 	if (UNKOWN == deviceConfig->ConnectionType)	{
 		LogError("Missing Modbus connection settings.");
+		free(deviceConfig);
 		return -1;
 	}
 
 	JSON_Object* interfaceConfigObj = json_object_dotget_object(args, "interfaceConfig");
 
 	LogInfo("Opening device %s", deviceConfig->ConnectionConfig.RtuConfig.Port);
-	ModbusPnp_OpenDevice(deviceConfig, interfaceConfigObj);
+	return ModbusPnp_OpenDevice(deviceConfig, interfaceConfigObj);
+}
+
+int 
+ModbusPnp_StartDiscovery(
+    _In_ PNPMEMORY DeviceArgs,
+    _In_ PNPMEMORY AdapterArgs
+    )
+{
+	if (DeviceArgs == NULL) {
+		LogInfo("ModbusPnp_StartDiscovery: No device discovery parameters found in configuration.");
+		return 0;
+	}
+	
+	UNREFERENCED_PARAMETER(AdapterArgs);
+
+    LogInfo("Starting modbus discovery adapter");
+
+	// A device that fails to start doesn't keep the others from starting
+	const JSON_Object* args;
+	for (int i = 0; NULL != (args = DiscoveryAdapter_GetDeviceParameters(DeviceArgs, i)); i++) {
+		if (0 != ModbusPnp_StartDevice(args)) {
+			LogError("Failed to start Modbus device (%d).", i);
+		}
+	}
 
 	return 0;
 }
@@ -778,6 +898,18 @@ void ModbusPnp_FreePropertyList(SINGLYLINKEDLIST_HANDLE propertyList) {
 	}
 }
 
+// Frees the requests of an interface and drops its definition reference
+void ModbusPnp_FreeInterfaceConfig(ModbusInterfaceConfig* interfaceConfig) {
+	ModbusPnp_FreeTelemetryList(interfaceConfig->Events);
+	ModbusPnp_FreeCommandList(interfaceConfig->Commands);
+	ModbusPnp_FreePropertyList(interfaceConfig->Properties);
+	singlylinkedlist_destroy(interfaceConfig->Events);
+	singlylinkedlist_destroy(interfaceConfig->Commands);
+	singlylinkedlist_destroy(interfaceConfig->Properties);
+	ModbusPnp_ReleaseInterfaceDefinition(interfaceConfig->Definition);
+	free(interfaceConfig);
+}
+
 void ModbusPnP_CleanupPollingTasks(PMODBUS_DEVICE_CONTEXT deviceContext)
 {
 	if (NULL != deviceContext->PollingTasks)
@@ -813,6 +945,17 @@ ModbusPnp_StartPnpInterface(
     return 0;
 }
 
+int
+ModbusPnp_ConnectionStateChanged(
+    _In_ PNPADAPTER_INTERFACE_HANDLE PnpInterface,
+    _In_ PNPBRIDGE_CONNECTION_STATE State
+    )
+{
+    AZURE_UNREFERENCED_PARAMETER(PnpInterface);
+    ModbusPnp_SetConnectionState(State);
+    return 0;
+}
+
 int ModbusPnp_ReleasePnpInterface(PNPADAPTER_INTERFACE_HANDLE pnpInterface) {
 	PMODBUS_DEVICE_CONTEXT deviceContext = PnpAdapterInterface_GetContext(pnpInterface);
 
@@ -834,11 +977,7 @@ int ModbusPnp_ReleasePnpInterface(PNPADAPTER_INTERFACE_HANDLE pnpInterface) {
 		LIST_ITEM_HANDLE interfaceItem = singlylinkedlist_get_head_item(deviceContext->InterfaceDefinitions);
 		while (interfaceItem != NULL) {
 			ModbusInterfaceConfig* def = (ModbusInterfaceConfig*)singlylinkedlist_item_get_value(interfaceItem);
-			ModbusPnp_FreeTelemetryList(def->Events);
-			ModbusPnp_FreeCommandList(def->Commands);
-			ModbusPnp_FreePropertyList(def->Properties);
-
-			free(def);
+			ModbusPnp_FreeInterfaceConfig(def);
 			interfaceItem = singlylinkedlist_get_next_item(interfaceItem);
 		}
 		singlylinkedlist_destroy(deviceContext->InterfaceDefinitions);
@@ -902,7 +1041,7 @@ ModbusPnp_CreatePnpInterface(
 
 				const ModbusProperty* property = singlylinkedlist_item_get_value(propertyItemHandle);
 
-				if (READ_WRITE == property->Access)
+				if (READ_WRITE == property->Definition->Access)
 				{
 					readWritePropertyCount++;
 					singlylinkedlist_add(readWritePropertyList, property);
@@ -938,7 +1077,7 @@ ModbusPnp_CreatePnpInterface(
 
 					const ModbusProperty* property = singlylinkedlist_item_get_value(propertyItemHandle);
 
-					propertyNames[i] = (char*) property->Name;
+					propertyNames[i] = (char*) property->Definition->Name;
 					propertyUpdateTable[i] = ModbusPnp_PropertyHandler;
 				}
 
@@ -982,7 +1121,7 @@ ModbusPnp_CreatePnpInterface(
 
 					if (NULL != commandItemHandle) {
 						const ModbusCommand* command = singlylinkedlist_item_get_value(commandItemHandle);
-						commandNames[i] = (char*) command->Name;
+						commandNames[i] = (char*) command->Definition->Name;
 						commandUpdateTable[i] = ModbusPnp_CommandHandler;
 					}
 				}
@@ -1027,6 +1166,7 @@ ModbusPnp_CreatePnpInterface(
             interfaceParams.InterfaceId = (char*)interfaceId;
 			interfaceParams.ReleaseInterface = ModbusPnp_ReleasePnpInterface;
             interfaceParams.StartInterface = ModbusPnp_StartPnpInterface;
+            interfaceParams.ConnectionStateChanged = ModbusPnp_ConnectionStateChanged;
 
 			result = PnpAdapterInterface_Create(&interfaceParams, &pnpAdapterInterface);
 			if (result < 0) {
@@ -1151,11 +1291,40 @@ exit:
 
 int ModbusPnp_Initialize(const char* adapterArgs) {
 	UNREFERENCED_PARAMETER(adapterArgs);
+
+	ModbusInterfaceDefinitions = singlylinkedlist_create();
+	if (NULL == ModbusInterfaceDefinitions) {
+		return -1;
+	}
+
+	ModbusInterfaceDefinitionsLock = Lock_Init();
+	if (NULL == ModbusInterfaceDefinitionsLock) {
+		singlylinkedlist_destroy(ModbusInterfaceDefinitions);
+		ModbusInterfaceDefinitions = NULL;
+		return -1;
+	}
+
 	return 0;
 }
 
 int 
 ModbusPnp_Shutdown() {
+	// Interfaces of devices that were never published still hold their definitions
+	if (NULL != ModbusInterfaceDefinitions) {
+		LIST_ITEM_HANDLE definitionItem = singlylinkedlist_get_head_item(ModbusInterfaceDefinitions);
+		while (NULL != definitionItem) {
+			ModbusPnp_FreeInterfaceDefinition((ModbusInterfaceDefinition*)singlylinkedlist_item_get_value(definitionItem));
+			definitionItem = singlylinkedlist_get_next_item(definitionItem);
+		}
+		singlylinkedlist_destroy(ModbusInterfaceDefinitions);
+		ModbusInterfaceDefinitions = NULL;
+	}
+
+	if (NULL != ModbusInterfaceDefinitionsLock) {
+		Lock_Deinit(ModbusInterfaceDefinitionsLock);
+		ModbusInterfaceDefinitionsLock = NULL;
+	}
+
 	return 0;
 }
 
@@ -1164,7 +1333,8 @@ ModbusPnp_Shutdown() {
 DISCOVERY_ADAPTER ModbusPnpDeviceDiscovery = {
 	.Identity = "modbus-pnp-discovery",
 	.StartDiscovery = ModbusPnp_StartDiscovery,
-	.StopDiscovery = ModbusPnp_StopDiscovery
+	.StopDiscovery = ModbusPnp_StopDiscovery,
+	.Flags = DISCOVERY_ADAPTER_FLAG_PARSED_PARAMETERS
 };
 
 PNP_ADAPTER ModbusPnpInterface = {
@@ -16,6 +16,7 @@ extern "C"
 #include <ctype.h>
 
 #include "ModbusEnum.h"
+#include "ModbusCapability.h"
 
 	typedef struct _MODBUS_RTU_CONFIG
 	{
@@ -45,10 +46,26 @@ extern "C"
 		MODBUS_CONNECTION_CONFIG ConnectionConfig;
 	} ModbusDeviceConfig, *PModbusDeviceConfig;
 
+	// Capabilities parsed from an interfaceConfig. Devices whose interfaceConfig is
+	// equal, such as the devices expanded from one template, share a definition.
+	typedef struct ModbusInterfaceDefinition
+	{
+		const char* Id;
+		const JSON_Value* Source;
+		int RefCount;
+		int TelemetryCount;
+		ModbusCapabilityDefinition* Telemetry;
+		int PropertyCount;
+		ModbusCapabilityDefinition* Properties;
+		int CommandCount;
+		ModbusCapabilityDefinition* Commands;
+	} ModbusInterfaceDefinition;
+
 	typedef struct ModbusInterfaceConfig
 	{
 		const char* Id;
 		int Index;
+		ModbusInterfaceDefinition* Definition;
 		SINGLYLINKEDLIST_HANDLE Events;
 		SINGLYLINKEDLIST_HANDLE Properties;
 		SINGLYLINKEDLIST_HANDLE Commands;
@@ -70,6 +87,8 @@ extern "C"
 
 	int ModbusPnp_GetListCount(SINGLYLINKEDLIST_HANDLE list);
 
+	void ModbusPnp_FreeInterfaceConfig(ModbusInterfaceConfig* interfaceConfig);
+
     // TODO: Fix this missing reference
     #ifndef AZURE_UNREFERENCED_PARAMETER
     #define AZURE_UNREFERENCED_PARAMETER(param)   (void)(param)
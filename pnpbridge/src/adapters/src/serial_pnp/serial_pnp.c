@@ -39,6 +39,9 @@ typedef uint16_t UINT16;
 
 #include "serial_pnp.h"
 
+// Connection of the bridge to the hub, see SerialPnp_ConnectionStateChanged
+static volatile PNPBRIDGE_CONNECTION_STATE SerialPnp_ConnectionState = PNPBRIDGE_CONNECTION_STATE_CONNECTED;
+
 int SerialPnp_UartReceiver(void* context)
 {
     int result = 0;
@@ -264,6 +267,14 @@ void SerialPnp_UnsolicitedPacket(PSERIAL_DEVICE_CONTEXT device, byte* packet, DW
     // Got an event
     if (SERIALPNP_PACKET_TYPE_EVENT_NOTIFICATION == packet[SERIALPNP_PACKET_PACKET_TYPE_OFFSET])
     {
+        // While the hub is unreachable the event is only kept if the bridge
+        // spools it. Otherwise it isn't converted, but the packet has still
+        // been read so that the device isn't held up.
+        if (PNPBRIDGE_CONNECTION_STATE_DISCONNECTED == SerialPnp_ConnectionState && !PnpBridge_IsTelemetrySpooled())
+        {
+            return;
+        }
+
         byte rxInterfaceId = packet[SERIALPNP_PACKET_INTERFACE_NUMBER_OFFSET];
         byte rxNameLength = packet[SERIALPNP_PACKET_NAME_LENGTH_OFFSET];
         DWORD rxDataSize = length - rxNameLength - SERIALPNP_PACKET_NAME_OFFSET;
@@ -866,10 +877,15 @@ int SerialPnp_OpenDeviceWorker(void* context)
         PNPMESSAGE payload = NULL;
         PNPMESSAGE_PROPERTIES* props = NULL;
 
-        PnpMessage_CreateMessage(&payload);
-
-        PnpMessage_SetMessage(payload, json_serialize_to_string(json_object_get_wrapping_value(jsonObject)));
-        PnpMessage_SetInterfaceId(payload, def->Id);
+        char* message = json_serialize_to_string(json_object_get_wrapping_value(jsonObject));
+        if (NULL == message ||
+            0 != PnpMessage_CreateMessageWithPayload(&payload, message, def->Id, NULL)) {
+            LogError("Failed to create the PNPMESSAGE for interface %s", def->Id);
+            json_free_serialized_string(message);
+            interfaceItem = singlylinkedlist_get_next_item(interfaceItem);
+            continue;
+        }
+        json_free_serialized_string(message);
         
         props = PnpMessage_AccessProperties(payload);
         props->Context = deviceContext; 
@@ -1290,8 +1306,7 @@ SerialPnp_StartDiscovery(
     const char* useComDevInterfaceStr;
     const char* baudRateParam;
     bool useComDeviceInterface = false;
-    JSON_Value* jvalue = json_parse_string(((PDEVICE_ADAPTER_PARMAETERS)(((PPNPBRIDGE_MEMORY_TAG)deviceArgs)->memory))->AdapterParameters[0]);
-    JSON_Object* args = json_value_get_object(jvalue);
+    const JSON_Object* args = DiscoveryAdapter_GetDeviceParameters(deviceArgs, 0);
 
     useComDevInterfaceStr = (const char*)json_object_dotget_string(args, "use_com_device_interface");
     if ((NULL != useComDevInterfaceStr) && (0 == strcmp(useComDevInterfaceStr, "true")))
@@ -1350,24 +1365,20 @@ int SerialPnp_StopDiscovery()
     return 0;
 }
 
-void SerialPnp_SendEventCallback(DIGITALTWIN_CLIENT_RESULT pnpSendEventStatus, void* userContextCallback)
-{
-    LogInfo("SerialDataSendEventCallback called, result=%d, userContextCallback=%p", pnpSendEventStatus, userContextCallback);
-}
-
 int SerialPnp_SendEventAsync(DIGITALTWIN_INTERFACE_CLIENT_HANDLE pnpInterface, char* eventName, char* data)
 {
     int result;
-    DIGITALTWIN_CLIENT_RESULT pnpClientResult;
+    int bridgeResult;
 
     if (pnpInterface == NULL)
     {
         return 0;
     }
 
-    if ((pnpClientResult = DigitalTwin_InterfaceClient_SendTelemetryAsync(pnpInterface, eventName, (const char*)data, SerialPnp_SendEventCallback, NULL)) != DIGITALTWIN_CLIENT_OK)
+    // Events are sent through the bridge telemetry queue and are never merged
+    if ((bridgeResult = PnpBridge_SendTelemetry(pnpInterface, eventName, (const char*)data, PNPBRIDGE_TELEMETRY_FLAG_NONE)) != 0)
     {
-        LogError("PnP_InterfaceClient_SendEventAsync failed, result=%d\n", pnpClientResult);
+        LogError("PnpBridge_SendTelemetry failed, result=%d\n", bridgeResult);
         result = -1; // __FAILURE__;
     }
     else
@@ -1486,6 +1497,26 @@ SerialPnp_StartPnpInterface(
     return 0;
 }
 
+// The devices push their events, so there is nothing to slow down while the
+// bridge is throttled. Events are dropped while it is disconnected.
+int
+SerialPnp_ConnectionStateChanged(
+    _In_ PNPADAPTER_INTERFACE_HANDLE PnpInterface,
+    _In_ PNPBRIDGE_CONNECTION_STATE State
+    )
+{
+    AZURE_UNREFERENCED_PARAMETER(PnpInterface);
+
+    if (State != SerialPnp_ConnectionState &&
+        PNPBRIDGE_CONNECTION_STATE_DISCONNECTED == State && !PnpBridge_IsTelemetrySpooled())
+    {
+        LogInfo("Serial events are dropped until the bridge is connected again");
+    }
+
+    SerialPnp_ConnectionState = State;
+    return 0;
+}
+
 int SerialPnp_CreatePnpInterface(PNPADAPTER_CONTEXT AdapterHandle, PNPMESSAGE msg) 
 {
     PNPMESSAGE_PROPERTIES* pnpMsgProps = NULL;
@@ -1547,6 +1578,7 @@ int SerialPnp_CreatePnpInterface(PNPADAPTER_CONTEXT AdapterHandle, PNPMESSAGE ms
             interfaceParams.InterfaceId = (char*)interfaceId;
             interfaceParams.ReleaseInterface = SerialPnp_ReleasePnpInterface;
             interfaceParams.StartInterface = SerialPnp_StartPnpInterface;
+            interfaceParams.ConnectionStateChanged = SerialPnp_ConnectionStateChanged;
 
             result = PnpAdapterInterface_Create(&interfaceParams, &pnpAdapterInterface);
             if (result < 0)
@@ -1718,7 +1750,8 @@ int SerialPnp_Shutdown()
 DISCOVERY_ADAPTER SerialPnpDiscovery = {
     .Identity = "serial-pnp-discovery",
     .StartDiscovery = SerialPnp_StartDiscovery,
-    .StopDiscovery = SerialPnp_StopDiscovery
+    .StopDiscovery = SerialPnp_StopDiscovery,
+    .Flags = DISCOVERY_ADAPTER_FLAG_PARSED_PARAMETERS
 };
 
 PNP_ADAPTER SerialPnpInterface = {
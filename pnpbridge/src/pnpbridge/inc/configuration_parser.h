@@ -11,6 +11,8 @@ extern "C"
 #include "azure_macro_utils/macro_utils.h"
 #include "umock_c/umock_c_prod.h"
 
+#include "pnpbridge_memory.h"
+
 // AUTH mechanisms for connecting to IOT device
 typedef enum AUTH_TYPE {
     AUTH_TYPE_TPM,
@@ -48,6 +50,9 @@ typedef struct _DPS_PARAMETERS {
     const char* IdScope;
     const char* DeviceId;
     const char* DcmModelId;
+
+    // File the hub assignment is cached in, NULL to register with DPS on every start
+    const char* AssignmentCachePath;
 } DPS_PARAMETERS;
 
 // Transport used to connect with IoTHub Device/Module
@@ -73,15 +78,133 @@ typedef struct _CONNECTION_PARAMETERS {
     const char* DeviceCapabilityModelUri;
 } CONNECTION_PARAMETERS, *PCONNECTION_PARAMETERS;
 
+// What a bounded queue does with an item that arrives while it is full
+typedef enum PNPBRIDGE_QUEUE_OVERFLOW_POLICY {
+    // Block the producer until the queue has room
+    PNPBRIDGE_QUEUE_OVERFLOW_BLOCK,
+
+    // Drop the oldest queued item to make room
+    PNPBRIDGE_QUEUE_OVERFLOW_DROP_OLDEST,
+
+    // Drop the item that arrived
+    PNPBRIDGE_QUEUE_OVERFLOW_DROP_NEWEST
+} PNPBRIDGE_QUEUE_OVERFLOW_POLICY;
+
+typedef struct _PNPBRIDGE_QUEUE_LIMITS {
+    // Maximum number of queued items. 0 means the queue is unbounded.
+    unsigned int Capacity;
+    PNPBRIDGE_QUEUE_OVERFLOW_POLICY OverflowPolicy;
+} PNPBRIDGE_QUEUE_LIMITS, *PPNPBRIDGE_QUEUE_LIMITS;
+
+// Lookup index over the configured devices. See configuration_parser.c
+typedef struct _CONFIGURATION_DEVICE_INDEX *PCONFIGURATION_DEVICE_INDEX;
+
+// Strings the compiled configuration points to. Each distinct string is
+// stored once. See configuration_parser.c
+typedef struct _CONFIGURATION_STRINGS *PCONFIGURATION_STRINGS;
+
+typedef struct _PNPBRIDGE_MATCH_PARAMETER {
+    const char* Name;
+
+    // NULL if the configured value isn't a string, which never matches
+    const char* Value;
+} PNPBRIDGE_MATCH_PARAMETER, *PPNPBRIDGE_MATCH_PARAMETER;
+
+// A device in the config, compiled so that matching a PNPMESSAGE doesn't read
+// the config document. The strings are interned in the configuration.
+typedef struct _PNPBRIDGE_DEVICE_CONFIG {
+    // NULL for a self describing device
+    const char* InterfaceId;
+    const char* ComponentName;
+    bool SelfDescribing;
+
+    // Identity of the device's pnp adapter and its key in the pnp adapter
+    // manager. The key is -1 until PnpAdapterManager_Create resolves it.
+    const char* PnpAdapterIdentity;
+    int PnpAdapterKey;
+
+    // Identity of the device's discovery adapter, NULL if it has none
+    const char* DiscoveryAdapterIdentity;
+
+    // match_filters.match_parameters sorted by name
+    bool ExactMatch;
+    PPNPBRIDGE_MATCH_PARAMETER MatchParameters;
+    int MatchParameterCount;
+
+    // discovery_parameters handed to the discovery adapter. It is a copy owned
+    // by the device, so it outlives the config document.
+    JSON_Value* DiscoveryParameters;
+} PNPBRIDGE_DEVICE_CONFIG, *PPNPBRIDGE_DEVICE_CONFIG;
+
+// An entry of pnp_adapters.parameters or discovery_adapters.parameters
+typedef struct _PNPBRIDGE_ADAPTER_CONFIG {
+    const char* Identity;
+
+    // Copy of the entry owned by the configuration
+    JSON_Value* Parameters;
+} PNPBRIDGE_ADAPTER_CONFIG, *PPNPBRIDGE_ADAPTER_CONFIG;
+
 typedef struct PNPBRIDGE_CONFIGURATION {
-    // PnpBridge config document
-    JSON_Value* JsonConfig;
+    // Configured devices in config order
+    PPNPBRIDGE_DEVICE_CONFIG Devices;
+    int DeviceCount;
+
+    // Adapter parameters in config order
+    PPNPBRIDGE_ADAPTER_CONFIG PnpAdapters;
+    int PnpAdapterCount;
+    PPNPBRIDGE_ADAPTER_CONFIG DiscoveryAdapters;
+    int DiscoveryAdapterCount;
+
+    PCONFIGURATION_STRINGS Strings;
+
+    // Index used by Configuration_IsDeviceConfigured to find the device
+    // matching a PNPMESSAGE. It is built by PnpBridgeConfig_RetrieveConfiguration.
+    PCONFIGURATION_DEVICE_INDEX DeviceIndex;
 
     // Connection parameters for the device/module
     PCONNECTION_PARAMETERS ConnParams;
 
     bool TraceOn;
 
+    // Arrival coalescing window used by the PNPMESSAGE worker
+    unsigned int CoalescingWindowMs;
+    unsigned int CoalescingMaxDelayMs;
+
+    // Time the telemetry worker waits for newer samples before sending
+    unsigned int TelemetryMergeWindowMs;
+
+    // Limits of the PNPMESSAGE ingress queue and the telemetry egress queue
+    PNPBRIDGE_QUEUE_LIMITS MessageQueueLimits;
+    PNPBRIDGE_QUEUE_LIMITS TelemetryQueueLimits;
+
+    // Interval at which the bridge logs its metrics. 0 only logs them at exit.
+    unsigned int MetricsIntervalMs;
+
+    // Number of threads that run the adapters' createPnpInterface and
+    // startPnpInterface callbacks, and how long each callback may take
+    // before the bridge stops waiting for it. 0 workers runs the callbacks
+    // on the PNPMESSAGE worker and 0 ms waits for them forever.
+    unsigned int AdapterWorkers;
+    unsigned int AdapterCallbackTimeoutMs;
+
+    // Budget of the memory held for devices, disabled by default
+    PNPMEMORY_BUDGET MemoryBudget;
+
+    // File the published devices are journaled to, NULL if they aren't
+    const char* JournalPath;
+    unsigned int JournalSizeBytes;
+
+    // Segment files the telemetry that can't be sent is spooled to, NULL if
+    // it isn't, and the rate at which it is replayed once the hub is back
+    const char* SpoolPath;
+    unsigned int SpoolSizeBytes;
+    unsigned int SpoolSegmentBytes;
+    unsigned int SpoolReplayRatePerSec;
+
+    // Set if changes to the devices in the config file are applied while the
+    // bridge is running
+    bool WatchConfig;
+
     // Set of flags that indicate which features are available
     // The idea is that features could be conditionally compiled
     // and this value should be set accordingly. During runtime,
@@ -101,6 +224,47 @@ typedef struct PNPBRIDGE_CONFIGURATION {
 */
 PNPBRIDGE_RESULT PnpBridgeConfig_GetJsonValueFromConfigFile(const char* Filename, JSON_Value** Config);
 
+// Size and hash of the config file a config snapshot was compiled from
+typedef struct _PNPBRIDGE_CONFIG_SNAPSHOT_KEY {
+    uint32_t Size;
+    uint64_t Hash;
+} PNPBRIDGE_CONFIG_SNAPSHOT_KEY, *PPNPBRIDGE_CONFIG_SNAPSHOT_KEY;
+
+/**
+* @brief    PnpBridgeConfig_GetJsonValueFromSnapshot reads a PnpBridge JSON config file
+*           from the snapshot compiled next to it, without parsing any JSON.
+*
+* @remarks  If there is no snapshot or it was compiled from an older config file, the
+*           config file is parsed and FromSnapshot is false. The caller should then
+*           call PnpBridgeConfig_SaveSnapshot once the config has been validated.
+*
+* @param    ConfigPath          Full path to JSON config file.
+*
+* @param    Config              JSON_Value representing the root of the config file
+*
+* @param    Key                 Key of the config file to save its snapshot with
+*
+* @param    FromSnapshot        Set if Config was rebuilt from the snapshot
+*
+* @returns  PNPBRIDGE_OK on success and other PNPBRIDGE_RESULT values on failure.
+*/
+PNPBRIDGE_RESULT PnpBridgeConfig_GetJsonValueFromSnapshot(const char* ConfigPath, JSON_Value** Config, PPNPBRIDGE_CONFIG_SNAPSHOT_KEY Key, bool* FromSnapshot);
+
+/**
+* @brief    PnpBridgeConfig_SaveSnapshot compiles a validated config into the snapshot
+*           read by PnpBridgeConfig_GetJsonValueFromSnapshot.
+*
+* @param    ConfigPath          Full path to JSON config file. The snapshot is saved
+*                               to this path with a ".snapshot" suffix.
+*
+* @param    Key                 Key returned by PnpBridgeConfig_GetJsonValueFromSnapshot
+*
+* @param    Config              JSON_Value representing the root of the config file
+*
+* @returns  PNPBRIDGE_OK on success and other PNPBRIDGE_RESULT values on failure.
+*/
+PNPBRIDGE_RESULT PnpBridgeConfig_SaveSnapshot(const char* ConfigPath, const PNPBRIDGE_CONFIG_SNAPSHOT_KEY* Key, JSON_Value* Config);
+
 /**
 * @brief    PnpBridgeConfig_GetJsonValueFromString reads a PnpBridge JSON config from string.
 *
@@ -124,6 +288,9 @@ PCONNECTION_PARAMETERS PnpBridgeConfig_GetConnectionDetails(JSON_Object* Connect
 * @brief    PnpBridgeConfig_RetrieveConfiguration retrieves and verifies the format 
 *           of the PnpBridge configuration file. It also checks for mandatory fields.
 *
+* @remarks  The configuration doesn't point into ConfigJson, which can be freed
+*           once this returns.
+*
 * @param    config   JSON value of the config file from parson
 *
 * @returns  PNPBRIDGE_OK on success and other PNPBRIDGE_RESULT values on failure.
@@ -135,6 +302,113 @@ PnpBridgeConfig_RetrieveConfiguration,
     PNPBRIDGE_CONFIGURATION*, BridgeConfig
     );
 
+/**
+* @brief    PnpBridgeConfig_ReleaseConfiguration releases the resources allocated by
+*           PnpBridgeConfig_RetrieveConfiguration.
+*
+* @param    BridgeConfig    Configuration filled by PnpBridgeConfig_RetrieveConfiguration
+*/
+MOCKABLE_FUNCTION(,
+void,
+PnpBridgeConfig_ReleaseConfiguration,
+    PNPBRIDGE_CONFIGURATION*, BridgeConfig
+    );
+
+/**
+* @brief    Configuration_ExpandDeviceTemplates copies the named device templates into
+*           the devices that use them. A device keeps the values it sets and takes the
+*           rest from its template. Objects set by both are merged the same way, so a
+*           device can override a single discovery parameter.
+*
+* @remarks  The template reference is removed from the expanded devices, so a config
+*           is only expanded once.
+*
+* @param    Config   JSON value of the config file from parson
+*
+* @returns  PNPBRIDGE_OK on success and PNPBRIDGE_INVALID_ARGS if a device uses a
+*           template that isn't defined.
+*/
+MOCKABLE_FUNCTION(,
+PNPBRIDGE_RESULT,
+Configuration_ExpandDeviceTemplates,
+    JSON_Value*, Config
+    );
+
+/**
+* @brief    Configuration_CompileDevices compiles the devices and the adapter parameters
+*           in the config into BridgeConfig. They are released by
+*           PnpBridgeConfig_ReleaseConfiguration.
+*
+* @param    Config          JSON value of the config file from parson
+*
+* @param    BridgeConfig    Configuration whose Devices, PnpAdapters, DiscoveryAdapters
+*                           and Strings are filled
+*
+* @returns  PNPBRIDGE_OK on success and other PNPBRIDGE_RESULT values on failure.
+*/
+MOCKABLE_FUNCTION(,
+PNPBRIDGE_RESULT,
+Configuration_CompileDevices,
+    JSON_Value*, Config,
+    PNPBRIDGE_CONFIGURATION*, BridgeConfig
+    );
+
+/**
+* @brief    Configuration_CreateDeviceIndex builds the lookup index over the compiled
+*           devices. Devices whose match parameters are compared for equality
+*           and self describing devices are hashed. Devices using the "exact" match
+*           type, which matches on a substring of the reported value, are kept in
+*           a fallback list that is scanned in config order.
+*
+* @param    Devices         Devices compiled by Configuration_CompileDevices
+*
+* @param    DeviceCount     Number of devices
+*
+* @param    DeviceIndex     Index that should be released with Configuration_DestroyDeviceIndex
+*
+* @returns  PNPBRIDGE_OK on success and other PNPBRIDGE_RESULT values on failure.
+*/
+MOCKABLE_FUNCTION(,
+PNPBRIDGE_RESULT,
+Configuration_CreateDeviceIndex,
+    PPNPBRIDGE_DEVICE_CONFIG, Devices,
+    int, DeviceCount,
+    PCONFIGURATION_DEVICE_INDEX*, DeviceIndex
+    );
+
+/**
+* @brief    Configuration_DiffDevices finds the devices of a reloaded config that are
+*           unchanged from the running config. A device is unchanged if all of its
+*           compiled fields, including its discovery parameters, are the same. Its
+*           position in the config doesn't matter.
+*
+* @param    Old             Running configuration
+*
+* @param    New             Reloaded configuration
+*
+* @param    NewToOld        Array of New->DeviceCount entries that is set to the index of
+*                           the same device in Old, or -1 if the device is new or changed
+*
+* @param    ChangeCount     Number of devices that were added or removed. A changed
+*                           device counts as both.
+*
+* @returns  PNPBRIDGE_OK on success and other PNPBRIDGE_RESULT values on failure.
+*/
+MOCKABLE_FUNCTION(,
+PNPBRIDGE_RESULT,
+Configuration_DiffDevices,
+    PNPBRIDGE_CONFIGURATION*, Old,
+    PNPBRIDGE_CONFIGURATION*, New,
+    int*, NewToOld,
+    int*, ChangeCount
+    );
+
+MOCKABLE_FUNCTION(,
+void,
+Configuration_DestroyDeviceIndex,
+    PCONFIGURATION_DEVICE_INDEX, DeviceIndex
+    );
+
 MOCKABLE_FUNCTION(, 
 JSON_Object*, 
 Configuration_GetMatchParametersForDevice,
@@ -156,13 +430,13 @@ Configuration_GetPnpParametersForDevice,
 MOCKABLE_FUNCTION(, 
 JSON_Object*,
 Configuration_GetPnpParameters,
-    JSON_Value*, config, const char*, identity
+    PNPBRIDGE_CONFIGURATION*, config, const char*, identity
     );
 
 MOCKABLE_FUNCTION(, 
 JSON_Object*,
 Configuration_GetDiscoveryParameters,
-    JSON_Value*, config, const char, *identity
+    PNPBRIDGE_CONFIGURATION*, config, const char*, identity
     );
 
 MOCKABLE_FUNCTION(,
@@ -170,10 +444,23 @@ JSON_Array*,
 Configuration_GetConfiguredDevices, JSON_Value*, config
     );
 
+/**
+* @brief    Configuration_IsDeviceConfigured finds the first device in the config that
+*           matches a PNPMESSAGE reported by a discovery adapter. The device index is
+*           used when BridgeConfig has one, otherwise the device list is scanned.
+*
+* @param    BridgeConfig    PnpBridge configuration
+*
+* @param    Message         JSON object of the PNPMESSAGE
+*
+* @param    Device          Matching device in BridgeConfig->Devices
+*
+* @returns  PNPBRIDGE_OK if a device matched and PNPBRIDGE_INVALID_ARGS otherwise.
+*/
 MOCKABLE_FUNCTION(, 
 PNPBRIDGE_RESULT,
 Configuration_IsDeviceConfigured,
-    JSON_Value*, config, JSON_Object*, Message, JSON_Object**, Device
+    PNPBRIDGE_CONFIGURATION*, BridgeConfig, JSON_Object*, Message, PPNPBRIDGE_DEVICE_CONFIG*, Device
     );
 
 #ifdef __cplusplus
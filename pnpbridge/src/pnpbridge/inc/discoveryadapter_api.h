@@ -16,6 +16,8 @@ TODOC: PROVIDE DETAILS OF PNPMESSAGE
 #include "azure_macro_utils/macro_utils.h"
 #include "umock_c/umock_c_prod.h"
 
+#include "parson.h"
+
 #ifdef __cplusplus
 extern "C"
 {
@@ -25,8 +27,13 @@ typedef struct _DEVICE_ADAPTER_PARMAETERS {
     // Number of devices containing adapter parameters for a given adapter
     int Count;
 
+    // Array of the device adapter parameters of size equal to Count, as parsed
+    // from the bridge configuration. Use DiscoveryAdapter_GetDeviceParameters.
+    const JSON_Object** Parameters;
+
     // Array of serialized json device adapter 
-    // parameters of size equal to Count
+    // parameters of size equal to Count. They are NULL for adapters
+    // that set DISCOVERY_ADAPTER_FLAG_PARSED_PARAMETERS.
     char* AdapterParameters[1];
 } DEVICE_ADAPTER_PARMAETERS, *PDEVICE_ADAPTER_PARMAETERS;
 
@@ -54,9 +61,10 @@ typedef int
 
 * @param    DeviceChangeCallback           PnpBridge callback method to be called when an adapter discovers device.
 *
-* @param    deviceArgs                     Json string PNPMEMORY containing list of devices arguments provided in config.
+* @param    deviceArgs                     DEVICE_ADAPTER_PARMAETERS PNPMEMORY containing list of devices arguments provided in config.
 *
-* @param    adapterArgs                    Json string PNPMEMORY containing adapter arguments provided in config.
+* @param    adapterArgs                    Json string PNPMEMORY containing adapter arguments provided in config. For adapters
+*                                          that set DISCOVERY_ADAPTER_FLAG_PARSED_PARAMETERS, use DiscoveryAdapter_GetAdapterParameters.
 *
 * @returns  integer greater than zero on success and other values on failure.
 */
@@ -88,12 +96,56 @@ DiscoveryAdapter_ReportDevice,
     _In_ PNPMESSAGE, Message
     );
 
+/**
+* @brief    DiscoveryAdapter_GetDeviceParameters returns the discovery parameters of a device
+*
+* @remarks  The object is part of the bridge configuration and must not be modified. It stays
+valid until the adapter's StopDiscovery returns.
+
+* @param    DeviceArgs          deviceArgs PNPMEMORY passed to StartDiscovery.
+*
+* @param    Index               Index of the device, less than DEVICE_ADAPTER_PARMAETERS.Count.
+*
+* @returns  The parsed discovery parameters or NULL if Index is out of range.
+*/
+const JSON_Object*
+DiscoveryAdapter_GetDeviceParameters(
+    _In_ PNPMEMORY DeviceArgs,
+    _In_ int Index
+    );
+
+/**
+* @brief    DiscoveryAdapter_GetAdapterParameters returns the discovery adapter parameters
+*
+* @remarks  Only for adapters that set DISCOVERY_ADAPTER_FLAG_PARSED_PARAMETERS. The object has
+the same lifetime as the ones returned by DiscoveryAdapter_GetDeviceParameters.
+
+* @param    AdapterArgs         adapterArgs PNPMEMORY passed to StartDiscovery.
+*
+* @returns  The parsed adapter parameters or NULL if AdapterArgs is NULL.
+*/
+const JSON_Object*
+DiscoveryAdapter_GetAdapterParameters(
+    _In_ PNPMEMORY AdapterArgs
+    );
+
+// Flags of a discovery adapter
+
+// The adapter reads its parameters with DiscoveryAdapter_GetDeviceParameters
+// and DiscoveryAdapter_GetAdapterParameters, so the bridge doesn't serialize
+// them to json strings
+#define DISCOVERY_ADAPTER_FLAG_PARSED_PARAMETERS 0x1
+
 typedef struct _DISCOVERY_ADAPTER {
     const char* Identity;
 
     DISCOVERYADAPTER_START_DISCOVER StartDiscovery;
 
     DISCOVERYADAPTER_STOP_DISCOVERY StopDiscovery;
+
+    // DISCOVERY_ADAPTER_FLAG_* values. Adapters that leave it 0 receive
+    // their parameters as json strings.
+    unsigned int Flags;
 } DISCOVERY_ADAPTER, *PDISCOVERY_ADAPTER;
 
 #ifdef __cplusplus
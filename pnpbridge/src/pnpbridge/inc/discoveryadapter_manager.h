@@ -9,7 +9,12 @@ extern "C"
 #endif
 
 typedef struct _DISCOVERY_MANAGER {
-    MAP_HANDLE DiscoveryAdapterMap;
+    // Identities of the started adapters and their DISCOVERY_ADAPTER_MANIFEST index
+    PNPBRIDGE_IDENTITY_TABLE DiscoveryAdapterTable;
+
+    // Adapters stopped by DiscoveryAdapterManager_StopChangedAdapters, indexed
+    // like DISCOVERY_ADAPTER_MANIFEST
+    bool* RestartPending;
 
     // List of thread handles for startdiscovery
    // SINGLYLINKEDLIST_HANDLE startDiscoveryThreadHandles;
@@ -27,6 +32,28 @@ PNPBRIDGE_RESULT DiscoveryAdapterManager_Create(PDISCOVERY_MANAGER* DiscoveryMan
 */
 PNPBRIDGE_RESULT DiscoveryAdapterManager_Start(PDISCOVERY_MANAGER DiscoveryManager, PNPBRIDGE_CONFIGURATION* Config);
 
+/**
+* @brief    DiscoveryAdapterManager_StopChangedAdapters stops the discovery adapters whose
+*           devices or adapter parameters differ between the running and a reloaded config.
+*
+* @remarks  An adapter is handed all of its devices when it is started, so it is restarted
+*           as a whole. Adapters whose devices are unchanged keep running.
+*
+* @param    Old         Running configuration
+*
+* @param    New         Reloaded configuration
+*
+* @param    NewToOld    Device mapping computed by Configuration_DiffDevices
+*
+* @returns  The number of adapters to start with DiscoveryAdapterManager_StartChangedAdapters,
+*           or -1 on failure.
+*/
+int DiscoveryAdapterManager_StopChangedAdapters(PDISCOVERY_MANAGER DiscoveryManager, PNPBRIDGE_CONFIGURATION* Old, PNPBRIDGE_CONFIGURATION* New, const int* NewToOld);
+
+// Starts the adapters stopped by DiscoveryAdapterManager_StopChangedAdapters with
+// the devices of Config
+PNPBRIDGE_RESULT DiscoveryAdapterManager_StartChangedAdapters(PDISCOVERY_MANAGER DiscoveryManager, PNPBRIDGE_CONFIGURATION* Config);
+
 //PNPBRIDGE_RESULT DiscoveryAdapterManager_PublishAlwaysInterfaces(PDISCOVERY_MANAGER discoveryManager, JSON_Value* config);
 
 void DiscoveryAdapterManager_Release(PDISCOVERY_MANAGER discoveryManager);
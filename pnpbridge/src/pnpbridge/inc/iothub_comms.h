@@ -21,6 +21,16 @@ IotComms_RegisterPnPInterfaces(
 
 PNPBRIDGE_RESULT IotComms_InitializeIotHandle(MX_IOT_HANDLE_TAG* iotHandle, bool traceOn, PCONNECTION_PARAMETERS connectionParams);
 
+// Returns true if the device client is connected to the hub and the interfaces
+// are registered, so that telemetry can be sent
+bool IotComms_IsConnected(MX_IOT_HANDLE_TAG* IotHandle);
+
+// Waits up to TimeoutMs for IotComms_IsConnected to no longer return Connected.
+// Returns right away if it already doesn't. The wait can end early when the
+// connection status is reported again, so the result may still be Connected.
+// A change wakes a single waiter, the bridge's connection monitor.
+bool IotComms_WaitForConnectionChange(MX_IOT_HANDLE_TAG* IotHandle, bool Connected, unsigned int TimeoutMs);
+
 #ifdef __cplusplus
 }
 #endif
\ No newline at end of file
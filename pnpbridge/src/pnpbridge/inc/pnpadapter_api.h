@@ -70,6 +70,40 @@ typedef int(*PNPADAPTER_DEVICE_ARRIVED)(PNPADAPTER_INTERFACE_HANDLE pnpInterface
 
 typedef int(*PNPADAPTER_INTERFACE_START)(PNPADAPTER_INTERFACE_HANDLE pnpInterface);
 
+// Connection of the bridge to the IoT hub, as seen by the pnp adapters
+typedef enum PNPBRIDGE_CONNECTION_STATE {
+    // Telemetry and reported properties are sent to the hub. Interfaces are
+    // only started once the bridge is connected, so this is their initial state.
+    PNPBRIDGE_CONNECTION_STATE_CONNECTED,
+
+    // The bridge is connected but the hub doesn't keep up with the telemetry:
+    // the telemetry queue is half full or the telemetry spool is being replayed.
+    // Adapters should poll less often.
+    PNPBRIDGE_CONNECTION_STATE_THROTTLED,
+
+    // The hub is unreachable. Reported properties fail and telemetry is only
+    // kept if PnpBridge_IsTelemetrySpooled. Adapters should pause the work
+    // whose result would be lost.
+    PNPBRIDGE_CONNECTION_STATE_DISCONNECTED
+} PNPBRIDGE_CONNECTION_STATE;
+
+/**
+* @brief    PNPADAPTER_INTERFACE_CONNECTION_STATE_CHANGED callback is invoked when the connection
+*           of the bridge to the IoT hub changes.
+*
+* @remarks  It is invoked with the adapter's interface list locked, so it shouldn't block or
+*           call back into the bridge. It can be invoked more than once with the same state,
+*           and before StartInterface has returned.
+*
+* @param    pnpInterface    Handle to pnp adapter interface
+*
+* @param    state           New connection state
+*
+* @returns  integer greater than zero on success and other values on failure.
+*/
+typedef int(*PNPADAPTER_INTERFACE_CONNECTION_STATE_CHANGED)(PNPADAPTER_INTERFACE_HANDLE pnpInterface,
+                                                             PNPBRIDGE_CONNECTION_STATE state);
+
 /**
    PnpAdapterInterface Methods
 **/
@@ -87,6 +121,10 @@ typedef struct _PNPADPATER_INTERFACE_PARAMS {
     // Invoked when the PnpBridge is tearing down and cleaning up all published interfaces
 	PNPADAPTER_INTERFACE_RELEASE ReleaseInterface;
 
+    // Invoked once this interface has been started when the connection of the
+    // bridge to the hub changes. Optional.
+    PNPADAPTER_INTERFACE_CONNECTION_STATE_CHANGED ConnectionStateChanged;
+
     DIGITALTWIN_INTERFACE_CLIENT_HANDLE DigitalTwinInterface;
 
     PNPADAPTER_CONTEXT PnpAdapterContext;
@@ -187,6 +225,15 @@ PnpAdapterInterface_GetContext,
     PNPADAPTER_INTERFACE_HANDLE, pnpAdapterInterface
     );
 
+/*
+    The interfaces of this adapter are journaled once published. When the
+    bridge restarts it creates them from the journaled message, with
+    ChangeType PNPBRIDGE_INTERFACE_CHANGE_PERSIST and no discovery Context,
+    before the device is discovered again. DeviceArrived is then invoked
+    with the discovered message.
+*/
+#define PNPADAPTER_FLAG_JOURNAL_REPLAY 0x1
+
 /*
 	PnpAdapter Binding info
 */
@@ -202,6 +249,9 @@ typedef struct _PNP_ADAPTER {
 	//PNPADAPTER_RELEASE_PNP_INTERFACE releaseInterface;
 
 	PNPADAPTER_PNP_INTERFACE_SHUTDOWN shutdown;
+
+    // PNPADAPTER_FLAG_* values
+    unsigned int flags;
 } PNP_ADAPTER, *PPNP_ADAPTER;
 
 #ifdef __cplusplus
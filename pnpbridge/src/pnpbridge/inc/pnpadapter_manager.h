@@ -17,18 +17,39 @@ typedef struct _PNP_ADAPTER_TAG {
 
     // Lock to protect pnpInterfaceList modification
     LOCK_HANDLE InterfaceListLock;
+
+    // Adapter manager that owns this adapter
+    struct _PNP_ADAPTER_MANAGER* adapterMgr;
 } PNP_ADAPTER_TAG, *PPNP_ADAPTER_TAG;
 
 // Structure uses to share context between adapter manager and adapter interface
 typedef struct _PNP_ADAPTER_CONTEXT_TAG {
     PPNP_ADAPTER_TAG adapter;
-    JSON_Object* deviceConfig;
+    PPNPBRIDGE_DEVICE_CONFIG deviceConfig;
+
+    // Component name of the device the interfaces are created for. It is
+    // owned by the PNPMESSAGE and only valid during createPnpInterface.
+    const char* componentName;
 } PNP_ADAPTER_CONTEXT_TAG, *PPNP_ADAPTER_CONTEXT_TAG;
 
 // Structure used for an instance of Pnp Adapter Manager
 typedef struct _PNP_ADAPTER_MANAGER {
-    MAP_HANDLE pnpAdapterMap;
+    // Identities of the initialized adapters and their PNP_ADAPTER_MANIFEST index
+    PNPBRIDGE_IDENTITY_TABLE pnpAdapterTable;
     PPNP_ADAPTER_TAG* pnpAdapters;
+
+    // Interface ids and component names of the interfaces created under all
+    // the adapters. They are kept up to date by PnpAdapterManager_AddInterface
+    // and PnpAdapterManager_RemoveInterface and can be read without taking
+    // the adapters' InterfaceListLock.
+    PNPBRIDGE_STRING_SET_HANDLE publishedInterfaceIds;
+    PNPBRIDGE_STRING_SET_HANDLE publishedComponentNames;
+
+    // Connection state last broadcast by PnpAdapterManager_NotifyConnectionState.
+    // Interfaces started after the broadcast are told once they are started.
+    // Written and read with the interlocked primitives, since the broadcast
+    // and the interface start run on different threads.
+    volatile PNPBRIDGE_CONNECTION_STATE connectionState;
 } PNP_ADAPTER_MANAGER, *PPNP_ADAPTER_MANAGER;
 
 typedef enum {
@@ -43,25 +64,37 @@ typedef struct _PNPADAPTER_INTERFACE_TAG {
     int key;
     PublishMode publishMode;
     char* interfaceId;
+    char* componentName;
     DIGITALTWIN_INTERFACE_CLIENT_HANDLE pnpInterfaceClient;
     PNPADPATER_INTERFACE_PARAMS params;
     PNPADAPTER_CONTEXT adapterContext;
     LIST_ITEM_HANDLE adapterEntry;
+
+    // Set once StartInterface has been invoked after the first publish.
+    // Republishing for newly arrived devices does not restart this interface.
+    bool interfaceStarted;
+
+    // Set once the interface has been included in a publish. Only published
+    // interfaces are started. Protected by the adapter's InterfaceListLock.
+    bool interfacePublished;
 } PNPADAPTER_INTERFACE_TAG, *PPNPADAPTER_INTERFACE_TAG;
 
 /**
 * @brief    PnpAdapterManager_Create creates the Azure Pnp Interface adapter manager.
 *
 * @remarks  PnpAdapterManager_Create initializes all the available Pnp Interface adapters by calling their
-            initialize method, if implemented. The Pnp Interface adapter is added to a PnpAdapterMap,
+            initialize method, if implemented. The Pnp Interface adapter is added to the pnpAdapterTable,
             whose key will be the PnpAdapters identity. This identity will be used to find the PnpAdapter
             based on the discovery extension change message.
 
 * @param    adapter           Pointer to get back an initialized PPNP_ADAPTER_MANAGER.
 *
+* @param    config            PnpBridge configuration. The PnpAdapterKey of each configured
+*                             device is set to the key of its adapter.
+*
 * @returns  PNPBRIDGE_OK on success and other PNPBRIDGE_RESULT values on failure.
 */
-PNPBRIDGE_RESULT PnpAdapterManager_Create(PPNP_ADAPTER_MANAGER* adapter, JSON_Value* config);
+PNPBRIDGE_RESULT PnpAdapterManager_Create(PPNP_ADAPTER_MANAGER* adapter, PNPBRIDGE_CONFIGURATION* config);
 
 /**
 * @brief    PnpAdapterManager_Release uninitializes the PnpAdapter resources.
@@ -74,12 +107,71 @@ PNPBRIDGE_RESULT PnpAdapterManager_Create(PPNP_ADAPTER_MANAGER* adapter, JSON_Va
 */
 void PnpAdapterManager_Release(PPNP_ADAPTER_MANAGER adapter);
 
-PNPBRIDGE_RESULT PnpAdapterManager_SupportsIdentity(PPNP_ADAPTER_MANAGER adapterMgr, JSON_Object* Message, bool* supported, int* key);
-PNPBRIDGE_RESULT PnpAdapterManager_CreatePnpInterface(PPNP_ADAPTER_MANAGER adapterMgr, MX_IOT_HANDLE_TAG* IotHandle, int key, JSON_Object* deviceConfig, PNPMESSAGE DeviceChangeMessage);
+// Sets the PnpAdapterKey of each configured device to the key of its adapter
+void PnpAdapterManager_ResolveDevices(PPNP_ADAPTER_MANAGER adapterMgr, PNPBRIDGE_CONFIGURATION* config);
+
+/**
+* @brief    PnpAdapterManager_RemapDevices moves the interfaces created for the devices
+*           of a running config to a reloaded config.
+*
+* @remarks  The interfaces of the devices that are unchanged now point to the device in
+*           NewDevices and the interfaces of the removed devices are released. The
+*           released DigitalTwin interfaces are no longer valid and must not be used
+*           by the telemetry queue.
+*
+* @param    OldDevices          Devices of the running config
+*
+* @param    OldToNew            Index of each device of OldDevices in NewDevices, or -1
+*                               if the device was removed or changed
+*
+* @param    ReleasedInterfaces  DigitalTwin interfaces of the released interfaces, to be
+*                               freed by the caller
+*
+* @returns  PNPBRIDGE_OK on success and other PNPBRIDGE_RESULT values on failure.
+*/
+PNPBRIDGE_RESULT
+PnpAdapterManager_RemapDevices(
+    PPNP_ADAPTER_MANAGER AdapterMgr,
+    PPNPBRIDGE_DEVICE_CONFIG OldDevices,
+    int OldDeviceCount,
+    PPNPBRIDGE_DEVICE_CONFIG NewDevices,
+    const int* OldToNew,
+    DIGITALTWIN_INTERFACE_CLIENT_HANDLE** ReleasedInterfaces,
+    int* ReleasedCount
+    );
+
+PNPBRIDGE_RESULT PnpAdapterManager_CreatePnpInterface(PPNP_ADAPTER_MANAGER adapterMgr, MX_IOT_HANDLE_TAG* IotHandle, int key, PPNPBRIDGE_DEVICE_CONFIG deviceConfig, PNPMESSAGE DeviceChangeMessage);
+
+// Returns the adapter at key, or NULL if it wasn't initialized
+PPNP_ADAPTER PnpAdapterManager_GetAdapter(PPNP_ADAPTER_MANAGER adapterMgr, int key);
+
+// Returns the key of the adapter with this identity, or -1
+int PnpAdapterManager_FindIdentity(PPNP_ADAPTER_MANAGER adapterMgr, const char* identity);
+
+// Invokes the DeviceArrived callback of the interface published for interfaceId.
+// Returns PNPBRIDGE_FAILED if there is no such interface.
+PNPBRIDGE_RESULT PnpAdapterManager_DeviceArrived(PPNP_ADAPTER_MANAGER adapterMgr, const char* interfaceId, PNPMESSAGE DeviceChangeMessage);
 
 PNPBRIDGE_RESULT PnpAdapterManager_GetAllInterfaces(PPNP_ADAPTER_MANAGER adapterMgr, DIGITALTWIN_INTERFACE_CLIENT_HANDLE** interfaces, int* count);
+
+// Returns the interface created with InterfaceClient, or NULL if it has been released
+PPNPADAPTER_INTERFACE_TAG PnpAdapterManager_FindInterface(PPNP_ADAPTER_MANAGER AdapterMgr, DIGITALTWIN_INTERFACE_CLIENT_HANDLE InterfaceClient);
+
+// Returns the DigitalTwin interface of the published interface with InterfaceId
+// and ComponentName, or NULL if there is none. ComponentName may be NULL.
+DIGITALTWIN_INTERFACE_CLIENT_HANDLE PnpAdapterManager_FindInterfaceClient(PPNP_ADAPTER_MANAGER AdapterMgr, const char* InterfaceId, const char* ComponentName);
+
 bool PnpAdapterManager_IsInterfaceIdPublished(PPNP_ADAPTER_MANAGER adapterMgr, const char* interfaceId);
-void PnpAdapterManager_InvokeStartInterface(PPNP_ADAPTER_MANAGER adapterMgr);
+bool PnpAdapterManager_IsComponentNamePublished(PPNP_ADAPTER_MANAGER adapterMgr, const char* componentName);
+void PnpAdapterManager_InvokeStartInterface(PPNP_ADAPTER_MANAGER adapterMgr, PNPBRIDGE_WORK_POOL_HANDLE workPool, unsigned int timeoutMs);
+
+// Invokes the ConnectionStateChanged callback of the started interfaces
+void PnpAdapterManager_NotifyConnectionState(PPNP_ADAPTER_MANAGER adapterMgr, PNPBRIDGE_CONNECTION_STATE state);
+
+// Marks an interface id and component name as published while the interface
+// is being created, so that duplicates reported in the meantime are dropped
+PNPBRIDGE_RESULT PnpAdapterManager_ReserveInterface(PPNP_ADAPTER_MANAGER adapterMgr, const char* interfaceId, const char* componentName);
+void PnpAdapterManager_UnreserveInterface(PPNP_ADAPTER_MANAGER adapterMgr, const char* interfaceId, const char* componentName);
 void PnpAdapterManager_ReleaseAdapter(PPNP_ADAPTER_TAG adapterTag);
 
 void PnpAdapterManager_AddInterface(PPNP_ADAPTER_TAG adapter, PNPADAPTER_INTERFACE_HANDLE pnpAdapterInterface);
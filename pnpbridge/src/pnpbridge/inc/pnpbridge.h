@@ -40,10 +40,41 @@ IotHandle_GetPnpDeviceClient,
     _In_ MX_IOT_HANDLE, IotHandle
     );
 
-MOCKABLE_FUNCTION(, int, PnpBridge_Main);
+// Runs the bridge with the config file at ConfigPath, or config.json in the
+// working directory if it is NULL. With UseConfigSnapshot the config is
+// loaded from a compiled snapshot, which is saved next to the config file
+// and compiled again whenever the config file changes.
+MOCKABLE_FUNCTION(, int, PnpBridge_Main,
+    const char*, ConfigPath,
+    bool, UseConfigSnapshot
+    );
 
 MOCKABLE_FUNCTION(, void, PnpBridge_Stop);
 
+// Telemetry flags for PnpBridge_SendTelemetry
+
+// Reading that must be delivered, e.g. an event
+#define PNPBRIDGE_TELEMETRY_FLAG_NONE 0x0
+
+// Periodic reading of a value. It is dropped if a newer reading of the same
+// telemetry on the same interface is queued before it is sent.
+#define PNPBRIDGE_TELEMETRY_FLAG_SAMPLE 0x1
+
+// Queues telemetry to be sent by the bridge on behalf of a pnp adapter.
+// TelemetryName and TelemetryData are copied. Returns 0 on success.
+MOCKABLE_FUNCTION(,
+int,
+PnpBridge_SendTelemetry,
+    DIGITALTWIN_INTERFACE_CLIENT_HANDLE, digitalTwinInterface,
+    const char*, telemetryName,
+    const char*, telemetryData,
+    unsigned int, flags
+    );
+
+// Returns true if telemetry queued while the bridge is disconnected from the
+// hub is kept in the telemetry spool and sent once it reconnects
+MOCKABLE_FUNCTION(, bool, PnpBridge_IsTelemetrySpooled);
+
 MOCKABLE_FUNCTION(,
 int,
 PnpBridge_UploadToBlobAsync,
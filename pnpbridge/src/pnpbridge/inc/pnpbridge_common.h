@@ -34,6 +34,7 @@ extern "C"
 #include "azure_c_shared_utility/strings_types.h"
 #include "azure_c_shared_utility/strings.h"
 #include "azure_c_shared_utility/lock.h"
+#include "azure_c_shared_utility/tickcounter.h"
 
 #include <iothub.h>
 #include <iothub_device_client.h>
@@ -47,6 +48,14 @@ extern "C"
 #include "parson.h"
 
 #include <assert.h>
+#include <time.h>
+
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <signal.h>
+#endif
 
 #define DIGITALTWIN_MODULE_CLIENT_HANDLE void*
 
@@ -64,21 +73,112 @@ extern "C"
     PNPBRIDGE_INVALID_ARGS, \
     PNPBRIDGE_CONFIG_READ_FAILED, \
     PNPBRIDGE_DUPLICATE_ENTRY, \
-    PNPBRIDGE_FAILED
+    PNPBRIDGE_FAILED, \
+    PNPBRIDGE_TIMED_OUT
 
 MU_DEFINE_ENUM(PNPBRIDGE_RESULT, PNPBRIDGE_RESULT_VALUES);
 
 #define PNPBRIDGE_SUCCESS(Result) (Result == PNPBRIDGE_OK)
+
+// Interlocked primitives used by the lock-free structures in the bridge
+#ifdef WIN32
+#define PNPBRIDGE_INTERLOCKED_INCREMENT(Target) InterlockedIncrement((volatile LONG*)(Target))
+#define PNPBRIDGE_INTERLOCKED_DECREMENT(Target) InterlockedDecrement((volatile LONG*)(Target))
+#define PNPBRIDGE_INTERLOCKED_ADD(Target, Value) InterlockedExchangeAdd((volatile LONG*)(Target), (Value))
+#define PNPBRIDGE_INTERLOCKED_READ(Target) InterlockedCompareExchange((volatile LONG*)(Target), 0, 0)
+#define PNPBRIDGE_INTERLOCKED_WRITE(Target, Value) (void)InterlockedExchange((volatile LONG*)(Target), (LONG)(Value))
+#define PNPBRIDGE_INTERLOCKED_COMPARE_EXCHANGE(Target, Value, Comparand) InterlockedCompareExchange((volatile LONG*)(Target), (Value), (Comparand))
+#define PNPBRIDGE_INTERLOCKED_EXCHANGE_POINTER(Target, Value) InterlockedExchangePointer((PVOID volatile*)(Target), (PVOID)(Value))
+#define PNPBRIDGE_INTERLOCKED_READ_POINTER(Target) InterlockedCompareExchangePointer((PVOID volatile*)(Target), NULL, NULL)
+#define PNPBRIDGE_INTERLOCKED_WRITE_POINTER(Target, Value) (void)InterlockedExchangePointer((PVOID volatile*)(Target), (PVOID)(Value))
+#else
+#define PNPBRIDGE_INTERLOCKED_INCREMENT(Target) __atomic_add_fetch((Target), 1, __ATOMIC_SEQ_CST)
+#define PNPBRIDGE_INTERLOCKED_DECREMENT(Target) __atomic_sub_fetch((Target), 1, __ATOMIC_SEQ_CST)
+#define PNPBRIDGE_INTERLOCKED_ADD(Target, Value) __atomic_add_fetch((Target), (Value), __ATOMIC_SEQ_CST)
+#define PNPBRIDGE_INTERLOCKED_READ(Target) __atomic_load_n((Target), __ATOMIC_SEQ_CST)
+#define PNPBRIDGE_INTERLOCKED_WRITE(Target, Value) __atomic_store_n((Target), (Value), __ATOMIC_SEQ_CST)
+#define PNPBRIDGE_INTERLOCKED_COMPARE_EXCHANGE(Target, Value, Comparand) __sync_val_compare_and_swap((Target), (Comparand), (Value))
+#define PNPBRIDGE_INTERLOCKED_EXCHANGE_POINTER(Target, Value) __atomic_exchange_n((Target), (Value), __ATOMIC_SEQ_CST)
+#define PNPBRIDGE_INTERLOCKED_READ_POINTER(Target) __atomic_load_n((Target), __ATOMIC_ACQUIRE)
+#define PNPBRIDGE_INTERLOCKED_WRITE_POINTER(Target, Value) __atomic_store_n((Target), (Value), __ATOMIC_RELEASE)
+#endif
 #include "configuration_parser.h"
 
-MAP_RESULT Map_Add_Index(MAP_HANDLE handle, const char* key, int value);
+// Table mapping adapter identities to their index in an adapter manifest. It is
+// sorted by identity and built at startup, so that looking up the adapter
+// for a device doesn't allocate. Identities are not copied and point into the
+// manifest.
+typedef struct _PNPBRIDGE_IDENTITY_ENTRY {
+    const char* Identity;
+    int Index;
+} PNPBRIDGE_IDENTITY_ENTRY, *PPNPBRIDGE_IDENTITY_ENTRY;
+
+typedef struct _PNPBRIDGE_IDENTITY_TABLE {
+    PPNPBRIDGE_IDENTITY_ENTRY Entries;
+    int Count;
+    int Capacity;
+} PNPBRIDGE_IDENTITY_TABLE, *PPNPBRIDGE_IDENTITY_TABLE;
+
+PNPBRIDGE_RESULT PnpIdentityTable_Create(PPNPBRIDGE_IDENTITY_TABLE Table, int Capacity);
+
+void PnpIdentityTable_Destroy(PPNPBRIDGE_IDENTITY_TABLE Table);
+
+// Returns PNPBRIDGE_DUPLICATE_ENTRY if the identity is already in the table
+PNPBRIDGE_RESULT PnpIdentityTable_Add(PPNPBRIDGE_IDENTITY_TABLE Table, const char* Identity, int Index);
+
+// Returns the manifest index of the identity or -1 if it isn't in the table
+int PnpIdentityTable_Find(PPNPBRIDGE_IDENTITY_TABLE Table, const char* Identity);
+
+void PnpIdentityTable_Remove(PPNPBRIDGE_IDENTITY_TABLE Table, const char* Identity);
 
-int Map_GetIndexValueFromKey(MAP_HANDLE handle, const char* key);
+// Seed for PnpBridge_HashString. Pass the result back in to hash several strings.
+#define PNPBRIDGE_HASH_INITIAL_VALUE 2166136261u
+
+unsigned int PnpBridge_HashString(unsigned int hash, const char* str);
+
+// Thread safe set of strings. See utility.c
+typedef struct _PNPBRIDGE_STRING_SET* PNPBRIDGE_STRING_SET_HANDLE;
+
+PNPBRIDGE_RESULT PnpStringSet_Create(PNPBRIDGE_STRING_SET_HANDLE* Set);
+
+void PnpStringSet_Destroy(PNPBRIDGE_STRING_SET_HANDLE Set);
+
+PNPBRIDGE_RESULT PnpStringSet_Add(PNPBRIDGE_STRING_SET_HANDLE Set, const char* String);
+
+void PnpStringSet_Remove(PNPBRIDGE_STRING_SET_HANDLE Set, const char* String);
+
+bool PnpStringSet_Contains(PNPBRIDGE_STRING_SET_HANDLE Set, const char* String);
 
 #include <pnpbridge.h>
 
 #define PNP_CONFIG_BRIDGE_PARAMETERS "pnp_bridge_parameters"
 #define PNP_CONFIG_TRACE_ON "trace_on"
+#define PNP_CONFIG_COALESCING_WINDOW_MS "coalescing_window_ms"
+#define PNP_CONFIG_COALESCING_MAX_DELAY_MS "coalescing_max_delay_ms"
+#define PNP_CONFIG_TELEMETRY_MERGE_WINDOW_MS "telemetry_merge_window_ms"
+#define PNP_CONFIG_MESSAGE_QUEUE "message_queue"
+#define PNP_CONFIG_TELEMETRY_QUEUE "telemetry_queue"
+#define PNP_CONFIG_QUEUE_CAPACITY "capacity"
+#define PNP_CONFIG_QUEUE_OVERFLOW_POLICY "overflow_policy"
+#define PNP_CONFIG_QUEUE_OVERFLOW_BLOCK "block"
+#define PNP_CONFIG_QUEUE_OVERFLOW_DROP_OLDEST "drop_oldest"
+#define PNP_CONFIG_QUEUE_OVERFLOW_DROP_NEWEST "drop_newest"
+#define PNP_CONFIG_METRICS_INTERVAL_MS "metrics_interval_ms"
+#define PNP_CONFIG_ADAPTER_WORKERS "adapter_workers"
+#define PNP_CONFIG_ADAPTER_CALLBACK_TIMEOUT_MS "adapter_callback_timeout_ms"
+#define PNP_CONFIG_MEMORY_BUDGET "memory_budget"
+#define PNP_CONFIG_MEMORY_BUDGET_LIMIT_BYTES "limit_bytes"
+#define PNP_CONFIG_MEMORY_BUDGET_SHED_SAMPLES_PERCENT "shed_samples_percent"
+#define PNP_CONFIG_MEMORY_BUDGET_REFUSE_ARRIVALS_PERCENT "refuse_arrivals_percent"
+#define PNP_CONFIG_DEVICE_JOURNAL "device_journal"
+#define PNP_CONFIG_DEVICE_JOURNAL_PATH "path"
+#define PNP_CONFIG_DEVICE_JOURNAL_SIZE_BYTES "size_bytes"
+#define PNP_CONFIG_WATCH_CONFIG "watch_config"
+#define PNP_CONFIG_TELEMETRY_SPOOL "telemetry_spool"
+#define PNP_CONFIG_TELEMETRY_SPOOL_PATH "path"
+#define PNP_CONFIG_TELEMETRY_SPOOL_SIZE_BYTES "size_bytes"
+#define PNP_CONFIG_TELEMETRY_SPOOL_SEGMENT_BYTES "segment_bytes"
+#define PNP_CONFIG_TELEMETRY_SPOOL_REPLAY_RATE "replay_rate_per_sec"
 #define PNP_CONFIG_CONNECTION_PARAMETERS "connection_parameters"
 
 #define PNP_CONFIG_CONNECTION_TYPE "connection_type"
@@ -93,6 +193,7 @@ int Map_GetIndexValueFromKey(MAP_HANDLE handle, const char* key);
 #define PNP_CONFIG_CONNECTION_DPS_GLOBAL_PROV_URI "global_prov_uri"
 #define PNP_CONFIG_CONNECTION_DPS_ID_SCOPE "id_scope" 
 #define PNP_CONFIG_CONNECTION_DPS_DEVICE_ID "device_id"
+#define PNP_CONFIG_CONNECTION_DPS_ASSIGNMENT_CACHE_PATH "assignment_cache_path"
 #define PNP_CONFIG_CONNECTION_DEVICE_CAPS_MODEL_URI "device_capability_model_uri"
 
 #define PNP_CONFIG_CONNECTION_AUTH_PARAMETERS "auth_parameters"
@@ -102,6 +203,8 @@ int Map_GetIndexValueFromKey(MAP_HANDLE handle, const char* key);
 #define PNP_CONFIG_CONNECTION_AUTH_TYPE_DEVICE_SYMM_KEY "symmetric_key"
 
 #define PNP_CONFIG_DEVICES "devices"
+#define PNP_CONFIG_DEVICE_TEMPLATES "device_templates"
+#define PNP_CONFIG_TEMPLATE "template"
 #define PNP_CONFIG_IDENTITY "identity"
 #define PNP_CONFIG_INTERFACE_ID "interface_id"
 #define PNP_CONFIG_COMPONENT_NAME "component_name"
@@ -123,6 +226,31 @@ int Map_GetIndexValueFromKey(MAP_HANDLE handle, const char* key);
 
 #define PNPBRIDGE_MAX_PATH 2048
 
+// Default queue capacities used when pnp_bridge_parameters doesn't set them
+// Config file read by PnpBridge_Main when no path is given
+#define PNPBRIDGE_DEFAULT_CONFIG_PATH "config.json"
+
+#define PNPBRIDGE_DEFAULT_MESSAGE_QUEUE_CAPACITY 1024
+#define PNPBRIDGE_DEFAULT_TELEMETRY_QUEUE_CAPACITY 4096
+
+#define PNPBRIDGE_DEFAULT_ADAPTER_WORKERS 4
+#define PNPBRIDGE_DEFAULT_ADAPTER_CALLBACK_TIMEOUT_MS 30000
+
+#define PNPBRIDGE_DEFAULT_SHED_SAMPLES_PERCENT 75
+#define PNPBRIDGE_DEFAULT_REFUSE_ARRIVALS_PERCENT 90
+
+#define PNPBRIDGE_DEFAULT_JOURNAL_SIZE_BYTES 65536
+
+// Time the config file has to stay unchanged before it is reloaded, so that
+// an editor saving it in several writes triggers a single reload
+#define PNPBRIDGE_CONFIG_RELOAD_SETTLE_MS 500
+#define PNPBRIDGE_JOURNAL_MIN_SIZE_BYTES 4096
+
+#define PNPBRIDGE_DEFAULT_SPOOL_SIZE_BYTES 16777216
+#define PNPBRIDGE_DEFAULT_SPOOL_SEGMENT_BYTES 1048576
+#define PNPBRIDGE_DEFAULT_SPOOL_REPLAY_RATE_PER_SEC 50
+#define PNPBRIDGE_SPOOL_MIN_SEGMENT_BYTES 4096
+
 // Mode agnostic iot and pnp handle
 typedef struct _MX_IOT_HANDLE_TAG {
     union {
@@ -147,6 +275,43 @@ typedef struct _MX_IOT_HANDLE_TAG {
     bool IsModule;
     bool DeviceClientInitialized;
     bool DigitalTwinClientInitialized;
+
+    // Set once interfaces have been registered over the DigitalTwin client.
+    // It is written under ConnectionLock by the thread that registers the
+    // interfaces, which reads it without the lock.
+    bool InterfacesRegistered;
+
+    // Connection status reported by the device client. ConnectionCondition
+    // is posted when the status changes, an interface registration completes
+    // or InterfacesRegistered changes. The connection monitor waits on
+    // MonitorCondition instead, which is posted for the same changes other
+    // than the registration completing, so that a post cannot wake it in
+    // place of the thread registering the interfaces.
+    // Like the device client, they live until the process exits.
+    LOCK_HANDLE ConnectionLock;
+    COND_HANDLE ConnectionCondition;
+    COND_HANDLE MonitorCondition;
+    IOTHUB_CLIENT_CONNECTION_STATUS ConnectionStatus;
+    IOTHUB_CLIENT_CONNECTION_STATUS_REASON ConnectionReason;
+
+    // Set while the device client connects to a hub read from the DPS
+    // assignment cache, until interfaces are registered with it
+    bool UsingCachedAssignment;
+
+    // Set when that hub rejected the device
+    bool AssignmentRejected;
+
+    // Device clients created, each of which opened a connection to the hub
+    volatile long Connects;
+
+    // Registrations with DPS
+    volatile long Provisionings;
+
+    // Successful interface registrations and how long the last and the
+    // slowest of them took
+    volatile long Registrations;
+    volatile long LastRegistrationMs;
+    volatile long MaxRegistrationMs;
 } MX_IOT_HANDLE_TAG;
 
 typedef struct _PNPBRIDGE_CHANGE_PAYLOAD {
@@ -156,18 +321,178 @@ typedef struct _PNPBRIDGE_CHANGE_PAYLOAD {
     PNPMEMORY Self;
     DLIST_ENTRY Entry;
     PNPMESSAGE_PROPERTIES Properties;
+
+    // Result of matching Message against the config. It is filled in the first
+    // time the message is processed so that reprocessing it doesn't parse the
+    // message or walk the configured devices again. The interface id and
+    // component name are cached in InterfaceId and Properties.ComponentName.
+    struct {
+        bool Valid;
+        PPNPBRIDGE_DEVICE_CONFIG DeviceConfig;
+        int AdapterIndex;
+    } Match;
+
+    // Set once the published message has been handed to the device journal
+    bool Journaled;
 } PNPBRIDGE_CHANGE_PAYLOAD, *PPNPBRIDGE_CHANGE_PAYLOAD;
 
+// Journal of the PNPMESSAGEs whose interfaces were published, kept in a memory
+// mapped file so that the bridge can publish them at once when it restarts.
+// See pnpjournal.c
+typedef struct _PNPBRIDGE_JOURNAL* PNPBRIDGE_JOURNAL_HANDLE;
+
+// A device without a component name has a NULL ComponentName
+typedef struct _PNPBRIDGE_JOURNAL_ENTRY {
+    const char* AdapterIdentity;
+    const char* InterfaceId;
+    const char* ComponentName;
+    const char* Message;
+} PNPBRIDGE_JOURNAL_ENTRY, *PPNPBRIDGE_JOURNAL_ENTRY;
+
+typedef void (*PNPBRIDGE_JOURNAL_CALLBACK)(void* Context, const PNPBRIDGE_JOURNAL_ENTRY* Entry);
+
+// Opens or creates the journal file and drops the devices that weren't
+// discovered in the last few runs of the bridge
+PNPBRIDGE_RESULT PnpJournal_Open(const char* Path, unsigned int SizeBytes, PNPBRIDGE_JOURNAL_HANDLE* Journal);
+
+void PnpJournal_Close(PNPBRIDGE_JOURNAL_HANDLE Journal);
+
+// Calls Callback for every device journaled before the journal was opened.
+// The entry's strings are valid until the journal is closed. Returns the
+// number of devices replayed.
+int PnpJournal_Replay(PNPBRIDGE_JOURNAL_HANDLE Journal, PNPBRIDGE_JOURNAL_CALLBACK Callback, void* Context);
+
+// Adds or replaces the entry of Entry->InterfaceId. Returns
+// PNPBRIDGE_INSUFFICIENT_MEMORY if the journal file is full.
+PNPBRIDGE_RESULT PnpJournal_Record(PNPBRIDGE_JOURNAL_HANDLE Journal, const PNPBRIDGE_JOURNAL_ENTRY* Entry);
+
+// Records that the device of InterfaceId was discovered. Returns true the
+// first time this is called for a device that was replayed.
+bool PnpJournal_Confirm(PNPBRIDGE_JOURNAL_HANDLE Journal, const char* InterfaceId);
+
+// Telemetry that couldn't be sent to the hub, kept in a ring of memory mapped
+// segment files until it is replayed. See pnpspool.c
+typedef struct _PNPBRIDGE_SPOOL* PNPBRIDGE_SPOOL_HANDLE;
+
+// A reading without a component name has a NULL ComponentName. Time is when
+// the reading was spooled.
+typedef struct _PNPBRIDGE_SPOOL_ENTRY {
+    const char* InterfaceId;
+    const char* ComponentName;
+    const char* TelemetryName;
+    const char* TelemetryData;
+    unsigned int Flags;
+    time_t Time;
+} PNPBRIDGE_SPOOL_ENTRY, *PPNPBRIDGE_SPOOL_ENTRY;
+
+typedef struct _PNPBRIDGE_SPOOL_STATISTICS {
+    // Readings and bytes that haven't been replayed, out of CapacityBytes
+    long Depth;
+    long long Bytes;
+    long long CapacityBytes;
+
+    // Time the oldest reading that hasn't been replayed was spooled, 0 if
+    // the spool is empty
+    time_t OldestTime;
+
+    // Readings dropped to make room for newer ones or because they were corrupt
+    long Dropped;
+} PNPBRIDGE_SPOOL_STATISTICS, *PPNPBRIDGE_SPOOL_STATISTICS;
+
+// Opens or creates the SizeBytes / SegmentBytes segment files <Path>.0,
+// <Path>.1 and so on. The readings spooled by an earlier run are kept.
+PNPBRIDGE_RESULT PnpSpool_Open(const char* Path, unsigned int SizeBytes, unsigned int SegmentBytes, PNPBRIDGE_SPOOL_HANDLE* Spool);
+
+void PnpSpool_Close(PNPBRIDGE_SPOOL_HANDLE Spool);
+
+// Adds a reading after the others. The oldest segment is dropped when every
+// segment is full. Returns PNPBRIDGE_INVALID_ARGS if the reading is larger
+// than a segment.
+PNPBRIDGE_RESULT PnpSpool_Append(PNPBRIDGE_SPOOL_HANDLE Spool, const PNPBRIDGE_SPOOL_ENTRY* Entry);
+
+// Reads the oldest reading without removing it. Returns false if the spool is
+// empty. The entry's strings are valid until the next PnpSpool_Pop or
+// PnpSpool_Append.
+bool PnpSpool_Peek(PNPBRIDGE_SPOOL_HANDLE Spool, PPNPBRIDGE_SPOOL_ENTRY Entry);
+
+// Removes the reading returned by PnpSpool_Peek
+void PnpSpool_Pop(PNPBRIDGE_SPOOL_HANDLE Spool);
+
+long PnpSpool_GetDepth(PNPBRIDGE_SPOOL_HANDLE Spool);
+
+void PnpSpool_GetStatistics(PNPBRIDGE_SPOOL_HANDLE Spool, PPNPBRIDGE_SPOOL_STATISTICS Statistics);
+
+// Occupancy counters of a bounded queue, reported in the bridge metrics
+typedef struct _PNPBRIDGE_QUEUE_STATISTICS {
+    long Capacity;
+    long Depth;
+
+    // Largest depth the queue has reached
+    long HighWaterMark;
+
+    // Items dropped by the overflow policy
+    long Dropped;
+
+    // Number of times a producer had to wait for room
+    long Blocked;
+} PNPBRIDGE_QUEUE_STATISTICS, *PPNPBRIDGE_QUEUE_STATISTICS;
+
+// Bounded pool of threads that runs the adapter callbacks which may block,
+// so that a slow device doesn't hold up the others. See pnpworkpool.c
+typedef struct _PNPBRIDGE_WORK_POOL* PNPBRIDGE_WORK_POOL_HANDLE;
+typedef struct _PNPBRIDGE_WORK_ITEM* PNPBRIDGE_WORK_ITEM_HANDLE;
+
+typedef int (*PNPBRIDGE_WORK_CALLBACK)(void* Context);
+
+// Called once for an item that timed out. Ran is false if the callback never
+// started, otherwise Result is what the callback returned.
+typedef void (*PNPBRIDGE_WORK_LATE_CALLBACK)(void* Context, bool Ran, int Result);
+
+PNPBRIDGE_RESULT PnpWorkPool_Create(int WorkerCount, PNPBRIDGE_WORK_POOL_HANDLE* Pool);
+
+// Waits for the running callbacks to return
+void PnpWorkPool_Release(PNPBRIDGE_WORK_POOL_HANDLE Pool);
+
+PNPBRIDGE_RESULT
+PnpWorkPool_Submit(
+    PNPBRIDGE_WORK_POOL_HANDLE Pool,
+    PNPBRIDGE_WORK_CALLBACK Callback,
+    PNPBRIDGE_WORK_LATE_CALLBACK LateCallback,
+    void* Context,
+    PNPBRIDGE_WORK_ITEM_HANDLE* Item
+    );
+
+// Waits for Item to complete and frees it. A callback that doesn't return within
+// TimeoutMs of starting is abandoned and PNPBRIDGE_TIMED_OUT is returned. Its
+// LateCallback then owns Context. A TimeoutMs of 0 waits forever.
+PNPBRIDGE_RESULT
+PnpWorkPool_Wait(
+    PNPBRIDGE_WORK_POOL_HANDLE Pool,
+    PNPBRIDGE_WORK_ITEM_HANDLE Item,
+    unsigned int TimeoutMs,
+    int* Result
+    );
+
 typedef struct _MESSAGE_QUEUE {
-    DLIST_ENTRY IngressQueue;
+    // Lock-free multi-producer/single-consumer ingress queue of PNPMESSAGEs,
+    // linked through PNPBRIDGE_CHANGE_PAYLOAD.Entry.Flink. Producers swap
+    // IngressHead and then link the previous head to the new entry. Only the
+    // worker reads from IngressTail. IngressStub keeps the list non-empty so
+    // that producers never have to touch IngressTail.
+    PDLIST_ENTRY volatile IngressHead;
 
-    DLIST_ENTRY PublishQueue;
+    PDLIST_ENTRY IngressTail;
+
+    DLIST_ENTRY IngressStub;
 
-    LOCK_HANDLE QueueLock;
+    // Messages whose interfaces have been created. Only accessed by the worker.
+    DLIST_ENTRY PublishQueue;
 
     volatile int PublishCount;
 
-    volatile int InCount;
+    // Number of messages in the ingress queue. A producer signals the worker
+    // only when it moves this count from 0 to 1.
+    volatile long InCount;
 
     THREAD_HANDLE Worker;
 
@@ -176,12 +501,71 @@ typedef struct _MESSAGE_QUEUE {
     COND_HANDLE WaitCondition;
 
     bool TearDown;
+
+    // After an arrival the worker waits for CoalescingWindowMs of quiet
+    // before processing, but never longer than CoalescingMaxDelayMs after
+    // the first arrival. A window of 0 disables coalescing.
+    unsigned int CoalescingWindowMs;
+
+    unsigned int CoalescingMaxDelayMs;
+
+    TICK_COUNTER_HANDLE TickCounter;
+
+    // Capacity of the ingress queue, 0 if it is unbounded. Producers reserve
+    // a slot in Depth before they push a message and the worker releases it
+    // after the message is popped.
+    long Capacity;
+
+    PNPBRIDGE_QUEUE_OVERFLOW_POLICY OverflowPolicy;
+
+    volatile long Depth;
+
+    // Producers waiting on SpaceCondition for the worker to free a slot
+    volatile long WaitingProducers;
+
+    COND_HANDLE SpaceCondition;
+
+    // With PNPBRIDGE_QUEUE_OVERFLOW_DROP_OLDEST producers pop from the ingress
+    // queue too. PopLock keeps them and the worker from popping at the same time.
+    LOCK_HANDLE PopLock;
+
+    volatile long HighWaterMark;
+
+    volatile long Dropped;
+
+    volatile long Blocked;
+
+    // Runs the adapters' createPnpInterface callbacks, NULL if they run on
+    // the worker. A callback that doesn't complete within CallbackTimeoutMs
+    // is left running and its message is handed back through LateCreates.
+    PNPBRIDGE_WORK_POOL_HANDLE WorkPool;
+
+    unsigned int CallbackTimeoutMs;
+
+    // Protected by WaitConditionLock
+    DLIST_ENTRY LateCreates;
+
+    int LateCount;
+
+    // Call posted by PnpMessageQueue_RunOnWorker, run by the worker between
+    // two cycles. The worker clears PendingCall when it takes the call and
+    // posts CallCondition once it has returned. Protected by WaitConditionLock.
+    PNPBRIDGE_WORK_CALLBACK PendingCall;
+
+    void* PendingCallContext;
+
+    bool CallRunning;
+
+    int PendingCallResult;
+
+    COND_HANDLE CallCondition;
 } MESSAGE_QUEUE, *PMESSAGE_QUEUE;
 
 
 // PnpMessage Queue APIs
 PNPBRIDGE_RESULT 
 PnpMessageQueue_Create(
+    PNPBRIDGE_CONFIGURATION* BridgeConfig,
     PMESSAGE_QUEUE* PnpMessageQueue
     );
 
@@ -196,6 +580,20 @@ PnpMessageQueue_Worker(
     void* threadArgument
     );
 
+// Runs Callback on the worker before it processes the next messages and waits
+// for it to return. Callback may change the state that only the worker
+// accesses, like the PublishQueue. Returns PNPBRIDGE_FAILED if the queue is
+// torn down before Callback runs.
+PNPBRIDGE_RESULT
+PnpMessageQueue_RunOnWorker(
+    PMESSAGE_QUEUE Queue,
+    PNPBRIDGE_WORK_CALLBACK Callback,
+    void* Context,
+    int* Result
+    );
+
+// Takes a reference on PnpMessage if it is queued. Returns PNPBRIDGE_FAILED
+// if the queue is full and the message was dropped or the queue is torn down.
 PNPBRIDGE_RESULT 
 PnpMesssageQueue_Add(
     PMESSAGE_QUEUE Queue,
@@ -208,21 +606,195 @@ PnpMesssageQueue_Remove(
     PNPMESSAGE* PnpMessage
     );
 
+void
+PnpMessageQueue_GetStatistics(
+    PMESSAGE_QUEUE Queue,
+    PPNPBRIDGE_QUEUE_STATISTICS Statistics
+    );
+
 PNPBRIDGE_RESULT
 PnpMesssageQueue_AddToPublishQ(
     PMESSAGE_QUEUE Queue,
     PNPMESSAGE PnpMessage
 );
 
-int PnpBridge_ProcessPnpMessage(PNPMESSAGE PnpMessage);
+typedef struct _TELEMETRY_QUEUE_STATISTICS {
+    PNPBRIDGE_QUEUE_STATISTICS Queue;
+
+    long Enqueued;
+    long Sent;
+    long SendFailures;
+
+    // Samples dropped because a newer sample of the same telemetry was
+    // queued within the merge window
+    long Merged;
+
+    // Readings dropped to keep within the memory budget
+    long Shed;
+
+    // Time between PnpBridge_SendTelemetry and the hand off to the SDK
+    tickcounter_ms_t TotalLatencyMs;
+    tickcounter_ms_t MaxLatencyMs;
+
+    // Readings written to the spool while the hub was unreachable, replayed
+    // from it, and dropped from it because their interface was gone
+    long Spooled;
+    long Replayed;
+    long ReplayDropped;
+
+    // Occupancy of the spool, left zeroed if it isn't configured
+    PNPBRIDGE_SPOOL_STATISTICS Spool;
+} TELEMETRY_QUEUE_STATISTICS, *PTELEMETRY_QUEUE_STATISTICS;
+
+// Lets the telemetry queue tell whether readings can be sent and name the
+// interfaces of the readings it spools. The identity strings are valid as long
+// as the interface, which isn't released while the worker is sending.
+typedef struct _TELEMETRY_QUEUE_CALLBACKS {
+    void* Context;
+
+    // Returns true if the hub is connected and the interfaces are registered
+    bool (*IsConnected)(void* Context);
+
+    // Returns false if Interface has been released
+    bool (*GetIdentity)(void* Context, DIGITALTWIN_INTERFACE_CLIENT_HANDLE Interface,
+                        const char** InterfaceId, const char** ComponentName);
+
+    // Returns the published interface of InterfaceId and ComponentName, or NULL
+    DIGITALTWIN_INTERFACE_CLIENT_HANDLE (*FindInterface)(void* Context, const char* InterfaceId, const char* ComponentName);
+} TELEMETRY_QUEUE_CALLBACKS, *PTELEMETRY_QUEUE_CALLBACKS;
+
+// Telemetry egress queue shared by all the pnp adapters. A single worker
+// sends the readings queued by PnpBridge_SendTelemetry.
+typedef struct _TELEMETRY_QUEUE {
+    // PNPBRIDGE_TELEMETRY entries in the order they were queued
+    DLIST_ENTRY Queue;
+
+    int Count;
+
+    LOCK_HANDLE Lock;
+
+    COND_HANDLE WaitCondition;
+
+    THREAD_HANDLE Worker;
+
+    bool TearDown;
+
+    // Once a reading is queued the worker waits MergeWindowMs before sending
+    // so that superseded samples can be merged. 0 sends readings right away.
+    unsigned int MergeWindowMs;
+
+    TICK_COUNTER_HANDLE TickCounter;
+
+    // Capacity of Queue, 0 if it is unbounded
+    PNPBRIDGE_QUEUE_LIMITS Limits;
 
+    // Producers blocked by PNPBRIDGE_QUEUE_OVERFLOW_BLOCK wait on SpaceCondition
+    COND_HANDLE SpaceCondition;
+
+    int WaitingProducers;
+
+    // Set while the worker sends a batch outside of Lock. It posts
+    // IdleCondition once the batch has been handed to the SDK.
+    bool Sending;
+
+    COND_HANDLE IdleCondition;
+
+    // Set by PnpTelemetryQueue_Suspend. The worker doesn't send anything
+    // until the queue is resumed.
+    bool Suspended;
+
+    // Readings that can't be sent while the hub is unreachable are written
+    // to Spool, NULL if it isn't configured. Only the worker appends to it
+    // and replays it, at most ReplayRatePerSec readings a second so that the
+    // backlog doesn't hold up live readings. ReplayTime is when the replay
+    // credit was last counted.
+    PNPBRIDGE_SPOOL_HANDLE Spool;
+    TELEMETRY_QUEUE_CALLBACKS Callbacks;
+    unsigned int ReplayRatePerSec;
+    tickcounter_ms_t ReplayTime;
+
+    TELEMETRY_QUEUE_STATISTICS Statistics;
+} TELEMETRY_QUEUE, *PTELEMETRY_QUEUE;
+
+// Telemetry Queue APIs
+PNPBRIDGE_RESULT
+PnpTelemetryQueue_Create(
+    PNPBRIDGE_CONFIGURATION* BridgeConfig,
+    const TELEMETRY_QUEUE_CALLBACKS* Callbacks,
+    PTELEMETRY_QUEUE* TelemetryQueue
+    );
+
+// Stops accepting telemetry and waits for the worker to send what is queued
+void
+PnpTelemetryQueue_Stop(
+    PTELEMETRY_QUEUE Queue
+    );
+
+void
+PnpTelemetryQueue_Release(
+    PTELEMETRY_QUEUE Queue
+    );
+
+// Thread entry callback
 int
-DiscoveryAdapter_PublishInterfaces(
-    void
+PnpTelemetryQueue_Worker(
+    void* ThreadArgument
     );
 
+// Waits for the batch being sent and holds the queued readings until
+// PnpTelemetryQueue_Resume, so that interfaces can be destroyed while the
+// bridge keeps running. Readings that don't fit in the queue while it is
+// suspended are dropped rather than block their adapter.
+void
+PnpTelemetryQueue_Suspend(
+    PTELEMETRY_QUEUE Queue
+    );
+
+// Drops the queued readings of the destroyed interfaces and resumes sending
+void
+PnpTelemetryQueue_Resume(
+    PTELEMETRY_QUEUE Queue,
+    const DIGITALTWIN_INTERFACE_CLIENT_HANDLE* DestroyedInterfaces,
+    int DestroyedCount
+    );
+
+// Returns PNPBRIDGE_FAILED if the queue is full and the reading was dropped or
+// the queue is being stopped
+PNPBRIDGE_RESULT
+PnpTelemetryQueue_Add(
+    PTELEMETRY_QUEUE Queue,
+    DIGITALTWIN_INTERFACE_CLIENT_HANDLE DigitalTwinInterface,
+    const char* TelemetryName,
+    const char* TelemetryData,
+    unsigned int Flags
+    );
+
+void
+PnpTelemetryQueue_GetStatistics(
+    PTELEMETRY_QUEUE Queue,
+    PTELEMETRY_QUEUE_STATISTICS Statistics
+    );
+
+// Sets the component name of a PNPMESSAGE
 int
-PnpBridge_ReinitPnpAdapters(
+PnpMessage_SetComponentName(
+    PNPMESSAGE Message,
+    const char* ComponentName
+    );
+
+// Matches a PNPMESSAGE against the config and reserves its interface id and
+// component name. Returns PNPBRIDGE_OK if an interface should be created for it.
+int PnpBridge_ProcessPnpMessage(PNPMESSAGE PnpMessage);
+
+// Creates the interface for a PNPMESSAGE accepted by PnpBridge_ProcessPnpMessage.
+// May be called from any thread.
+int PnpBridge_CreatePnpInterface(PNPMESSAGE PnpMessage);
+
+// Releases the reservation of a PNPMESSAGE whose interface won't be created
+void PnpBridge_CancelPnpMessage(PNPMESSAGE PnpMessage);
+
+int
+DiscoveryAdapter_PublishInterfaces(
     void
     );
 
@@ -4,6 +4,9 @@
 #ifndef PNPBRIDGE_OBJECT_H
 #define PNPBRIDGE_OBJECT_H
 
+#include <stddef.h>
+#include <stdbool.h>
+
 #ifdef __cplusplus
 extern "C"
 {
@@ -21,6 +24,8 @@ extern "C"
     typedef struct _PNPBRIDGE_MEMORY_TAG {
         volatile long count;
         int size;
+        // Slab size class the block was carved from, or -1 for a heap block
+        int sizeClass;
         void* memory;
         PNPMEMORY_ATTRIBUTES params;
     } PNPBRIDGE_MEMORY_TAG, *PPNPBRIDGE_MEMORY_TAG;
@@ -33,8 +38,125 @@ extern "C"
 
     void* PnpMemory_GetBuffer(PNPMEMORY memory, int* size);
 
+    // What the bridge refuses as the memory it holds for devices nears the
+    // budget. Each level includes the ones before it.
+    typedef enum _PNPMEMORY_SHEDDING_LEVEL {
+        PNPMEMORY_SHED_NONE,
+        // Telemetry sent with PNPBRIDGE_TELEMETRY_FLAG_SAMPLE is dropped
+        PNPMEMORY_SHED_SAMPLES,
+        // Device arrivals reported by the discovery adapters are dropped
+        PNPMEMORY_SHED_ARRIVALS
+    } PNPMEMORY_SHEDDING_LEVEL;
+
+    // Budget of the bytes held in PNPMEMORY blocks and queued telemetry. A
+    // LimitBytes of 0 disables it. Shedding starts once usage reaches the
+    // given percentages of LimitBytes and stops when it falls 5% below them.
+    // Allocations that would exceed LimitBytes fail.
+    typedef struct _PNPMEMORY_BUDGET {
+        long LimitBytes;
+        int ShedSamplesPercent;
+        int RefuseArrivalsPercent;
+    } PNPMEMORY_BUDGET, *PPNPMEMORY_BUDGET;
+
+    // NULL disables the budget. Usage is counted whether a budget is set or not.
+    void PnpMemory_SetBudget(const PNPMEMORY_BUDGET* budget);
+
+    // Charges bytes to the budget. Returns false, and charges nothing, if
+    // that would exceed it.
+    bool PnpMemory_ChargeBudget(long bytes);
+
+    void PnpMemory_ReleaseBudget(long bytes);
+
+    PNPMEMORY_SHEDDING_LEVEL PnpMemory_GetSheddingLevel();
+
+    const char* PnpMemory_GetSheddingLevelName(PNPMEMORY_SHEDDING_LEVEL level);
+
+    // Counters of the PNPMEMORY slab pools. A hit is an allocation served from
+    // a pool and a miss one that went to the heap. ResidentBytes is the size
+    // of all the pooled blocks, in use or cached, that are allocated from the
+    // heap. Building with PNPBRIDGE_MEMORY_USE_MALLOC disables the pools and
+    // counts every allocation as a miss.
+    // BudgetUsedBytes is what is charged to the memory budget and Refused the
+    // number of PnpMemory_Create calls that failed because of the budget.
+    typedef struct _PNPMEMORY_STATISTICS {
+        long Hits;
+        long Misses;
+        long ResidentBytes;
+        long BudgetLimitBytes;
+        long BudgetUsedBytes;
+        long BudgetPeakBytes;
+        long Refused;
+        PNPMEMORY_SHEDDING_LEVEL SheddingLevel;
+    } PNPMEMORY_STATISTICS, *PPNPMEMORY_STATISTICS;
+
+    void PnpMemory_GetStatistics(PPNPMEMORY_STATISTICS statistics);
+
+    // Subsystems the heap use of the bridge is accounted to. A build with
+    // PNPBRIDGE_MEMORY_ACCOUNTING compiles every bridge and adapter source
+    // with PNPMEMORY_TAG_FOR_THIS set to its subsystem, which routes its
+    // malloc, calloc, realloc and free through the accounting layer below.
+    // A block allocated by such a source must also be freed by one.
+    // PNPMEMORY_TAG_SDK is not tracked per allocation; it is the rest of
+    // the process heap, which is mostly the IoT SDK.
+    typedef enum _PNPMEMORY_TAG {
+        PNPMEMORY_TAG_BRIDGE,
+        PNPMEMORY_TAG_MESSAGE_QUEUE,
+        // The PNPMEMORY blocks, pools and thread caches, whichever subsystem
+        // they are created for
+        PNPMEMORY_TAG_PNPMEMORY,
+        PNPMEMORY_TAG_CONFIG,
+        PNPMEMORY_TAG_SERIAL_ADAPTER,
+        PNPMEMORY_TAG_MODBUS_ADAPTER,
+        PNPMEMORY_TAG_ADAPTER,
+        PNPMEMORY_TAG_SDK,
+        PNPMEMORY_TAG_COUNT
+    } PNPMEMORY_TAG;
+
+    // CurrentBytes and PeakBytes count requested sizes. Allocations and
+    // Frees are totals since start; AllocationRate is the number of
+    // allocations per second since the previous PnpMemory_LogTagStatistics.
+    typedef struct _PNPMEMORY_TAG_STATISTICS {
+        long CurrentBytes;
+        long PeakBytes;
+        long Allocations;
+        long Frees;
+        long AllocationRate;
+    } PNPMEMORY_TAG_STATISTICS, *PPNPMEMORY_TAG_STATISTICS;
+
+    const char* PnpMemory_GetTagName(PNPMEMORY_TAG tag);
+
+    // Returns a non zero value if the build does not account heap use
+    int PnpMemory_GetTagStatistics(PNPMEMORY_TAG tag, PPNPMEMORY_TAG_STATISTICS statistics);
+
+    // Logs a line per tag, prefixed with reason. Updates AllocationRate.
+    void PnpMemory_LogTagStatistics(const char* reason);
+
+    void* PnpMemory_TaggedMalloc(PNPMEMORY_TAG tag, size_t size);
+
+    void* PnpMemory_TaggedCalloc(PNPMEMORY_TAG tag, size_t count, size_t size);
+
+    void* PnpMemory_TaggedRealloc(PNPMEMORY_TAG tag, void* ptr, size_t size);
+
+    // Frees blocks of any tag, and blocks that were not allocated through
+    // the accounting layer at all, like the ones returned by the SDK.
+    void PnpMemory_TaggedFree(void* ptr);
+
 #ifdef __cplusplus
 }
 #endif
 
+#if defined(PNPBRIDGE_MEMORY_ACCOUNTING) && defined(PNPMEMORY_TAG_FOR_THIS) && !defined(__cplusplus)
+// stdlib.h goes first so that later includes of it don't see the macros
+#include <stdlib.h>
+
+#undef malloc
+#undef calloc
+#undef realloc
+#undef free
+#define malloc(size) PnpMemory_TaggedMalloc(PNPMEMORY_TAG_FOR_THIS, size)
+#define calloc(count, size) PnpMemory_TaggedCalloc(PNPMEMORY_TAG_FOR_THIS, count, size)
+#define realloc(ptr, size) PnpMemory_TaggedRealloc(PNPMEMORY_TAG_FOR_THIS, ptr, size)
+#define free(ptr) PnpMemory_TaggedFree(ptr)
+#endif
+
 #endif /* PNPBRIDGE_OBJECT_H */
\ No newline at end of file
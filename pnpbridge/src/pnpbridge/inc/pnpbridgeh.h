@@ -25,16 +25,58 @@ typedef struct _PNP_BRIDGE {
 
     PMESSAGE_QUEUE MessageQueue;
 
+    // Telemetry sent by the pnp adapters
+    PTELEMETRY_QUEUE TelemetryQueue;
+
     PNPBRIDGE_CONFIGURATION Configuration;
 
     COND_HANDLE ExitCondition;
 
     LOCK_HANDLE ExitLock;
+
+    // Published devices that are replayed at startup, NULL if not configured
+    PNPBRIDGE_JOURNAL_HANDLE Journal;
+
+    // Device arrivals refused while over the memory budget
+    volatile long RefusedArrivals;
+
+    // Config file the bridge was started with. It points to the argument of
+    // PnpBridge_Main.
+    const char* ConfigPath;
+    bool UseConfigSnapshot;
+
+    // Set when the config file has changed. The main thread then reloads it.
+    // Protected by ExitLock.
+    bool ReloadPending;
+
+    // Configurations replaced by a reload. Interfaces and adapters may still
+    // point into them, so they are released with the bridge.
+    SINGLYLINKEDLIST_HANDLE RetiredConfigurations;
+
+    // Broadcasts the connection state to the pnp adapters once the initial
+    // interfaces are published
+    THREAD_HANDLE ConnectionMonitor;
+    volatile bool ConnectionMonitorStop;
+
+#ifndef WIN32
+    // Logs the metrics every time the process receives SIGUSR1
+    pthread_t MetricsSignalThread;
+    bool MetricsSignalThreadStarted;
+    volatile bool MetricsSignalStop;
+
+    // Watches the directory of the config file with inotify
+    pthread_t ConfigWatchThread;
+    bool ConfigWatchThreadStarted;
+    int ConfigWatchFd;
+    int ConfigWatchDescriptor;
+#endif
 } PNP_BRIDGE, *PPNP_BRIDGE;
 
 
 void PnpBridge_Release(PPNP_BRIDGE pnpBridge);
 
+void PnpBridge_LogMetrics(PPNP_BRIDGE pnpBridge);
+
 #ifdef __cplusplus
 }
 #endif
\ No newline at end of file
@@ -41,12 +41,30 @@ PnpMessage_CreateMessage(
     _Out_ PNPMESSAGE* Message
     );
 
+// Creates a PNPMESSAGE holding copies of Payload and, if they are given,
+// InterfaceId and the component name in a single allocation
+int
+PnpMessage_CreateMessageWithPayload(
+    _Out_ PNPMESSAGE* Message,
+    _In_ const char* Payload,
+    _In_opt_ const char* InterfaceId,
+    _In_opt_ const char* ComponentName
+    );
+
 int 
 PnpMessage_SetMessage(
     _In_ PNPMESSAGE Message,
     const char* Payload
     );
 
+// Sets the payload without copying it. The message takes ownership of
+// Payload, which must have been allocated with malloc, and frees it.
+int
+PnpMessage_SetMessageOwned(
+    _In_ PNPMESSAGE Message,
+    _In_ char* Payload
+    );
+
 const char*
 PnpMessage_GetMessage(
     _In_ PNPMESSAGE Message
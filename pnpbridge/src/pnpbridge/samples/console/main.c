@@ -1,3 +1,4 @@
+#include <string.h>
 #include <pnpbridge.h>
 #include "azure_c_shared_utility/xlogging.h"
 
@@ -25,8 +26,28 @@ void CtrlHandler(int s) {
 }
 #endif
 
-int main()
+void Usage(const char* program) {
+    LogError("Usage: %s [--config-snapshot] [config file]", program);
+}
+
+int main(int argc, char* argv[])
 {
+    const char* configPath = NULL;
+    bool useConfigSnapshot = false;
+
+    for (int i = 1; i < argc; i++) {
+        if (0 == strcmp(argv[i], "--config-snapshot")) {
+            useConfigSnapshot = true;
+        }
+        else if ('-' != argv[i][0] && NULL == configPath) {
+            configPath = argv[i];
+        }
+        else {
+            Usage(argv[0]);
+            return 1;
+        }
+    }
+
     LogInfo("\n -- Press Ctrl+C to stop PnpBridge\n");
 
 #ifdef WIN32
@@ -40,7 +61,7 @@ int main()
     sigaction(SIGINT, &sigIntHandler, NULL);
 #endif
 
-    PnpBridge_Main();
+    PnpBridge_Main(configPath, useConfigSnapshot);
 
     return 0;
 }
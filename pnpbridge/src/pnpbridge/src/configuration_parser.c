@@ -1,10 +1,180 @@
 // Copyright (c) Microsoft. All rights reserved.
 // Licensed under the MIT license. See LICENSE file in the project root for full license information.
 
+#include <limits.h>
+
 #include "pnpbridge_common.h"
 
 char *getcwd(char *buf, size_t size);
 
+// Strings of the compiled configuration. Devices that share an adapter
+// identity or a match parameter name point to the same copy, so they can be
+// compared by address.
+#define CONFIGURATION_STRINGS_MIN_CAPACITY 64
+
+typedef struct _CONFIGURATION_STRINGS {
+    // Open addressing hash table with linear probing, at most half full
+    char** Strings;
+    unsigned int* Hashes;
+    unsigned int Capacity;
+    unsigned int Count;
+} CONFIGURATION_STRINGS;
+
+static PNPBRIDGE_RESULT Configuration_CreateStrings(PCONFIGURATION_STRINGS* Strings)
+{
+    PCONFIGURATION_STRINGS strings = calloc(1, sizeof(CONFIGURATION_STRINGS));
+    if (NULL == strings) {
+        return PNPBRIDGE_INSUFFICIENT_MEMORY;
+    }
+
+    strings->Capacity = CONFIGURATION_STRINGS_MIN_CAPACITY;
+    strings->Strings = calloc(strings->Capacity, sizeof(char*));
+    strings->Hashes = calloc(strings->Capacity, sizeof(unsigned int));
+    if (NULL == strings->Strings || NULL == strings->Hashes) {
+        free(strings->Strings);
+        free(strings->Hashes);
+        free(strings);
+        return PNPBRIDGE_INSUFFICIENT_MEMORY;
+    }
+
+    *Strings = strings;
+    return PNPBRIDGE_OK;
+}
+
+static void Configuration_DestroyStrings(PCONFIGURATION_STRINGS Strings)
+{
+    if (NULL == Strings) {
+        return;
+    }
+
+    for (unsigned int i = 0; i < Strings->Capacity; i++) {
+        free(Strings->Strings[i]);
+    }
+
+    free(Strings->Strings);
+    free(Strings->Hashes);
+    free(Strings);
+}
+
+static PNPBRIDGE_RESULT Configuration_GrowStrings(PCONFIGURATION_STRINGS Strings)
+{
+    const unsigned int capacity = Strings->Capacity << 1;
+    char** strs = calloc(capacity, sizeof(char*));
+    unsigned int* hashes = calloc(capacity, sizeof(unsigned int));
+    if (NULL == strs || NULL == hashes) {
+        free(strs);
+        free(hashes);
+        return PNPBRIDGE_INSUFFICIENT_MEMORY;
+    }
+
+    for (unsigned int i = 0; i < Strings->Capacity; i++) {
+        if (NULL == Strings->Strings[i]) {
+            continue;
+        }
+
+        unsigned int slot = Strings->Hashes[i] & (capacity - 1);
+        while (NULL != strs[slot]) {
+            slot = (slot + 1) & (capacity - 1);
+        }
+
+        strs[slot] = Strings->Strings[i];
+        hashes[slot] = Strings->Hashes[i];
+    }
+
+    free(Strings->Strings);
+    free(Strings->Hashes);
+    Strings->Strings = strs;
+    Strings->Hashes = hashes;
+    Strings->Capacity = capacity;
+
+    return PNPBRIDGE_OK;
+}
+
+// Sets Interned to the copy of String held by Strings. A NULL String is
+// interned as NULL.
+static PNPBRIDGE_RESULT Configuration_InternString(PCONFIGURATION_STRINGS Strings, const char* String, const char** Interned)
+{
+    *Interned = NULL;
+    if (NULL == String) {
+        return PNPBRIDGE_OK;
+    }
+
+    if (2 * (Strings->Count + 1) > Strings->Capacity && PNPBRIDGE_OK != Configuration_GrowStrings(Strings)) {
+        LogError("Failed to grow the configuration strings");
+        return PNPBRIDGE_INSUFFICIENT_MEMORY;
+    }
+
+    const unsigned int hash = PnpBridge_HashString(PNPBRIDGE_HASH_INITIAL_VALUE, String);
+    unsigned int slot = hash & (Strings->Capacity - 1);
+    while (NULL != Strings->Strings[slot]) {
+        if (Strings->Hashes[slot] == hash && 0 == strcmp(Strings->Strings[slot], String)) {
+            *Interned = Strings->Strings[slot];
+            return PNPBRIDGE_OK;
+        }
+        slot = (slot + 1) & (Strings->Capacity - 1);
+    }
+
+    const size_t size = strlen(String) + 1;
+    Strings->Strings[slot] = malloc(size);
+    if (NULL == Strings->Strings[slot]) {
+        LogError("Failed to copy a configuration string");
+        return PNPBRIDGE_INSUFFICIENT_MEMORY;
+    }
+
+    memcpy(Strings->Strings[slot], String, size);
+
+    Strings->Hashes[slot] = hash;
+    Strings->Count++;
+    *Interned = Strings->Strings[slot];
+
+    return PNPBRIDGE_OK;
+}
+
+// Replaces the strings of the connection parameters, which point into the
+// config document, with interned copies
+static PNPBRIDGE_RESULT Configuration_InternConnectionDetails(PCONFIGURATION_STRINGS Strings, PCONNECTION_PARAMETERS ConnParams)
+{
+    PNPBRIDGE_RESULT result = Configuration_InternString(Strings, ConnParams->DeviceCapabilityModelUri, &ConnParams->DeviceCapabilityModelUri);
+
+    if (PNPBRIDGE_OK == result && CONNECTION_TYPE_CONNECTION_STRING == ConnParams->ConnectionType) {
+        result = Configuration_InternString(Strings, ConnParams->u1.ConnectionString, &ConnParams->u1.ConnectionString);
+    }
+
+    if (PNPBRIDGE_OK == result && CONNECTION_TYPE_DPS == ConnParams->ConnectionType) {
+        DPS_PARAMETERS* dpsParams = &ConnParams->u1.Dps;
+        result = Configuration_InternString(Strings, dpsParams->GlobalProvUri, &dpsParams->GlobalProvUri);
+        if (PNPBRIDGE_OK == result) {
+            result = Configuration_InternString(Strings, dpsParams->IdScope, &dpsParams->IdScope);
+        }
+        if (PNPBRIDGE_OK == result) {
+            result = Configuration_InternString(Strings, dpsParams->DeviceId, &dpsParams->DeviceId);
+        }
+        if (PNPBRIDGE_OK == result && NULL != dpsParams->AssignmentCachePath) {
+            result = Configuration_InternString(Strings, dpsParams->AssignmentCachePath, &dpsParams->AssignmentCachePath);
+        }
+        dpsParams->DcmModelId = ConnParams->DeviceCapabilityModelUri;
+    }
+
+    if (PNPBRIDGE_OK == result && AUTH_TYPE_SYMMETRIC_KEY == ConnParams->AuthParameters.AuthType) {
+        result = Configuration_InternString(Strings, ConnParams->AuthParameters.u1.DeviceKey, &ConnParams->AuthParameters.u1.DeviceKey);
+    }
+
+    return result;
+}
+
+static void Configuration_FreeAdapters(PPNPBRIDGE_ADAPTER_CONFIG Adapters, int AdapterCount)
+{
+    if (NULL == Adapters) {
+        return;
+    }
+
+    for (int i = 0; i < AdapterCount; i++) {
+        json_value_free(Adapters[i].Parameters);
+    }
+
+    free(Adapters);
+}
+
 PCONNECTION_PARAMETERS PnpBridgeConfig_GetConnectionDetails(JSON_Object* ConnectionParams)
 {
     PCONNECTION_PARAMETERS connParams = NULL;
@@ -98,6 +268,9 @@ PCONNECTION_PARAMETERS PnpBridgeConfig_GetConnectionDetails(JSON_Object* Connect
                     LEAVE;
                 }
 
+                // Optional
+                dpsParams->AssignmentCachePath = json_object_get_string(dpsSettings, PNP_CONFIG_CONNECTION_DPS_ASSIGNMENT_CACHE_PATH);
+
                 dpsParams->DcmModelId = connParams->DeviceCapabilityModelUri;
             }
         }
@@ -195,10 +368,58 @@ PNPBRIDGE_RESULT PnpBridgeConfig_GetJsonValueFromConfigFile(const char *filename
     return PNPBRIDGE_OK;
 }
 
+// Reads the capacity and overflow policy of a queue from pnp_bridge_parameters.
+// Missing values keep the defaults passed in Limits.
+PNPBRIDGE_RESULT
+PnpBridgeConfig_GetQueueLimits(
+    _In_ JSON_Object* PnpBridgeParameters,
+    _In_ const char* QueueName,
+    _Inout_ PPNPBRIDGE_QUEUE_LIMITS Limits
+    )
+{
+    JSON_Object* queue = json_object_get_object(PnpBridgeParameters, QueueName);
+    if (NULL == queue) {
+        return PNPBRIDGE_OK;
+    }
+
+    if (json_object_has_value(queue, PNP_CONFIG_QUEUE_CAPACITY)) {
+        double capacity = json_object_get_number(queue, PNP_CONFIG_QUEUE_CAPACITY);
+        if (capacity < 0) {
+            LogError("%s.%s can't be negative", QueueName, PNP_CONFIG_QUEUE_CAPACITY);
+            return PNPBRIDGE_INVALID_ARGS;
+        }
+
+        Limits->Capacity = (unsigned int)capacity;
+    }
+
+    const char* policy = json_object_get_string(queue, PNP_CONFIG_QUEUE_OVERFLOW_POLICY);
+    if (NULL != policy) {
+        if (0 == strcmp(policy, PNP_CONFIG_QUEUE_OVERFLOW_BLOCK)) {
+            Limits->OverflowPolicy = PNPBRIDGE_QUEUE_OVERFLOW_BLOCK;
+        }
+        else if (0 == strcmp(policy, PNP_CONFIG_QUEUE_OVERFLOW_DROP_OLDEST)) {
+            Limits->OverflowPolicy = PNPBRIDGE_QUEUE_OVERFLOW_DROP_OLDEST;
+        }
+        else if (0 == strcmp(policy, PNP_CONFIG_QUEUE_OVERFLOW_DROP_NEWEST)) {
+            Limits->OverflowPolicy = PNPBRIDGE_QUEUE_OVERFLOW_DROP_NEWEST;
+        }
+        else {
+            LogError("%s.%s %s is not supported", QueueName, PNP_CONFIG_QUEUE_OVERFLOW_POLICY, policy);
+            return PNPBRIDGE_INVALID_ARGS;
+        }
+    }
+
+    LogInfo("%s holds %u item(s), policy %d", QueueName, Limits->Capacity, Limits->OverflowPolicy);
+
+    return PNPBRIDGE_OK;
+}
+
 PNPBRIDGE_RESULT PnpBridgeConfig_RetrieveConfiguration(JSON_Value* JsonConfig, PNPBRIDGE_CONFIGURATION* BridgeConfig)
 {
     PNPBRIDGE_RESULT result = PNPBRIDGE_OK;
     PCONNECTION_PARAMETERS connParams = NULL;
+    const char* journalPath = NULL;
+    const char* spoolPath = NULL;
 
     // Check for mandatory parameters
     TRY {
@@ -230,6 +451,238 @@ PNPBRIDGE_RESULT PnpBridgeConfig_RetrieveConfiguration(JSON_Value* JsonConfig, P
         BridgeConfig->TraceOn = (1 == traceOnBool);
         LogInfo("Tracing is %s", BridgeConfig->TraceOn ? "enabled" : "disabled");
 
+        // Read the arrival coalescing window. Devices reported within the window
+        // are created and published in a single pass.
+        {
+            double window = json_object_get_number(pnpBridgeParameters, PNP_CONFIG_COALESCING_WINDOW_MS);
+            double maxDelay = json_object_get_number(pnpBridgeParameters, PNP_CONFIG_COALESCING_MAX_DELAY_MS);
+            if (window < 0 || maxDelay < 0) {
+                LogError("%s and %s can't be negative", PNP_CONFIG_COALESCING_WINDOW_MS, PNP_CONFIG_COALESCING_MAX_DELAY_MS);
+                result = PNPBRIDGE_INVALID_ARGS;
+                LEAVE;
+            }
+
+            BridgeConfig->CoalescingWindowMs = (unsigned int)window;
+            BridgeConfig->CoalescingMaxDelayMs = (unsigned int)maxDelay;
+            if (BridgeConfig->CoalescingMaxDelayMs < BridgeConfig->CoalescingWindowMs) {
+                BridgeConfig->CoalescingMaxDelayMs = BridgeConfig->CoalescingWindowMs;
+            }
+
+            LogInfo("Arrival coalescing window is %u ms, capped at %u ms",
+                    BridgeConfig->CoalescingWindowMs, BridgeConfig->CoalescingMaxDelayMs);
+        }
+
+        // Read the telemetry merge window. Samples of the same telemetry queued
+        // within the window are merged and only the latest one is sent.
+        {
+            double mergeWindow = json_object_get_number(pnpBridgeParameters, PNP_CONFIG_TELEMETRY_MERGE_WINDOW_MS);
+            if (mergeWindow < 0) {
+                LogError("%s can't be negative", PNP_CONFIG_TELEMETRY_MERGE_WINDOW_MS);
+                result = PNPBRIDGE_INVALID_ARGS;
+                LEAVE;
+            }
+
+            BridgeConfig->TelemetryMergeWindowMs = (unsigned int)mergeWindow;
+            LogInfo("Telemetry merge window is %u ms", BridgeConfig->TelemetryMergeWindowMs);
+        }
+
+        // Read the queue limits. A device that keeps reporting itself fills the
+        // PNPMESSAGE queue with duplicates, so new arrivals are dropped. Telemetry
+        // keeps the latest readings.
+        {
+            BridgeConfig->MessageQueueLimits.Capacity = PNPBRIDGE_DEFAULT_MESSAGE_QUEUE_CAPACITY;
+            BridgeConfig->MessageQueueLimits.OverflowPolicy = PNPBRIDGE_QUEUE_OVERFLOW_DROP_NEWEST;
+            result = PnpBridgeConfig_GetQueueLimits(pnpBridgeParameters, PNP_CONFIG_MESSAGE_QUEUE, &BridgeConfig->MessageQueueLimits);
+            if (PNPBRIDGE_OK != result) {
+                LEAVE;
+            }
+
+            BridgeConfig->TelemetryQueueLimits.Capacity = PNPBRIDGE_DEFAULT_TELEMETRY_QUEUE_CAPACITY;
+            BridgeConfig->TelemetryQueueLimits.OverflowPolicy = PNPBRIDGE_QUEUE_OVERFLOW_DROP_OLDEST;
+            result = PnpBridgeConfig_GetQueueLimits(pnpBridgeParameters, PNP_CONFIG_TELEMETRY_QUEUE, &BridgeConfig->TelemetryQueueLimits);
+            if (PNPBRIDGE_OK != result) {
+                LEAVE;
+            }
+        }
+
+        {
+            double metricsInterval = json_object_get_number(pnpBridgeParameters, PNP_CONFIG_METRICS_INTERVAL_MS);
+            if (metricsInterval < 0) {
+                LogError("%s can't be negative", PNP_CONFIG_METRICS_INTERVAL_MS);
+                result = PNPBRIDGE_INVALID_ARGS;
+                LEAVE;
+            }
+
+            BridgeConfig->MetricsIntervalMs = (unsigned int)metricsInterval;
+        }
+
+        // Read the adapter work pool settings. A device that hangs in its
+        // adapter callback must not hold up the publish of the others.
+        {
+            double workers = PNPBRIDGE_DEFAULT_ADAPTER_WORKERS;
+            double timeout = PNPBRIDGE_DEFAULT_ADAPTER_CALLBACK_TIMEOUT_MS;
+
+            if (json_object_has_value(pnpBridgeParameters, PNP_CONFIG_ADAPTER_WORKERS)) {
+                workers = json_object_get_number(pnpBridgeParameters, PNP_CONFIG_ADAPTER_WORKERS);
+            }
+
+            if (json_object_has_value(pnpBridgeParameters, PNP_CONFIG_ADAPTER_CALLBACK_TIMEOUT_MS)) {
+                timeout = json_object_get_number(pnpBridgeParameters, PNP_CONFIG_ADAPTER_CALLBACK_TIMEOUT_MS);
+            }
+
+            if (workers < 0 || timeout < 0) {
+                LogError("%s and %s can't be negative", PNP_CONFIG_ADAPTER_WORKERS, PNP_CONFIG_ADAPTER_CALLBACK_TIMEOUT_MS);
+                result = PNPBRIDGE_INVALID_ARGS;
+                LEAVE;
+            }
+
+            BridgeConfig->AdapterWorkers = (unsigned int)workers;
+            BridgeConfig->AdapterCallbackTimeoutMs = (unsigned int)timeout;
+            LogInfo("Adapter callbacks run on %u worker(s) with a timeout of %u ms",
+                    BridgeConfig->AdapterWorkers, BridgeConfig->AdapterCallbackTimeoutMs);
+        }
+
+        // Read the memory budget. As usage nears the limit the bridge sheds
+        // sampled telemetry and then device arrivals.
+        {
+            JSON_Object* budget = json_object_get_object(pnpBridgeParameters, PNP_CONFIG_MEMORY_BUDGET);
+            double limit = 0;
+            double shedSamples = PNPBRIDGE_DEFAULT_SHED_SAMPLES_PERCENT;
+            double refuseArrivals = PNPBRIDGE_DEFAULT_REFUSE_ARRIVALS_PERCENT;
+
+            if (NULL != budget) {
+                limit = json_object_get_number(budget, PNP_CONFIG_MEMORY_BUDGET_LIMIT_BYTES);
+
+                if (json_object_has_value(budget, PNP_CONFIG_MEMORY_BUDGET_SHED_SAMPLES_PERCENT)) {
+                    shedSamples = json_object_get_number(budget, PNP_CONFIG_MEMORY_BUDGET_SHED_SAMPLES_PERCENT);
+                }
+
+                if (json_object_has_value(budget, PNP_CONFIG_MEMORY_BUDGET_REFUSE_ARRIVALS_PERCENT)) {
+                    refuseArrivals = json_object_get_number(budget, PNP_CONFIG_MEMORY_BUDGET_REFUSE_ARRIVALS_PERCENT);
+                }
+            }
+
+            if (limit < 0 || limit > LONG_MAX) {
+                LogError("%s.%s must be between 0 and %ld", PNP_CONFIG_MEMORY_BUDGET, PNP_CONFIG_MEMORY_BUDGET_LIMIT_BYTES, LONG_MAX);
+                result = PNPBRIDGE_INVALID_ARGS;
+                LEAVE;
+            }
+
+            if (shedSamples <= 0 || refuseArrivals < shedSamples || refuseArrivals > 100) {
+                LogError("%s.%s and %s must be ascending percentages", PNP_CONFIG_MEMORY_BUDGET,
+                         PNP_CONFIG_MEMORY_BUDGET_SHED_SAMPLES_PERCENT, PNP_CONFIG_MEMORY_BUDGET_REFUSE_ARRIVALS_PERCENT);
+                result = PNPBRIDGE_INVALID_ARGS;
+                LEAVE;
+            }
+
+            BridgeConfig->MemoryBudget.LimitBytes = (long)limit;
+            BridgeConfig->MemoryBudget.ShedSamplesPercent = (int)shedSamples;
+            BridgeConfig->MemoryBudget.RefuseArrivalsPercent = (int)refuseArrivals;
+            if (BridgeConfig->MemoryBudget.LimitBytes > 0) {
+                LogInfo("Memory budget is %ld bytes, sampled telemetry is shed at %d%% and device arrivals at %d%%",
+                        BridgeConfig->MemoryBudget.LimitBytes, BridgeConfig->MemoryBudget.ShedSamplesPercent,
+                        BridgeConfig->MemoryBudget.RefuseArrivalsPercent);
+            }
+        }
+
+        // Read the device journal. The devices it holds are published when
+        // the bridge starts, before their discovery adapters report them.
+        {
+            JSON_Object* journal = json_object_get_object(pnpBridgeParameters, PNP_CONFIG_DEVICE_JOURNAL);
+            double size = PNPBRIDGE_DEFAULT_JOURNAL_SIZE_BYTES;
+
+            if (NULL != journal) {
+                journalPath = json_object_get_string(journal, PNP_CONFIG_DEVICE_JOURNAL_PATH);
+                if (NULL == journalPath) {
+                    LogError("%s.%s is missing", PNP_CONFIG_DEVICE_JOURNAL, PNP_CONFIG_DEVICE_JOURNAL_PATH);
+                    result = PNPBRIDGE_INVALID_ARGS;
+                    LEAVE;
+                }
+
+                if (json_object_has_value(journal, PNP_CONFIG_DEVICE_JOURNAL_SIZE_BYTES)) {
+                    size = json_object_get_number(journal, PNP_CONFIG_DEVICE_JOURNAL_SIZE_BYTES);
+                }
+            }
+
+            if (size < PNPBRIDGE_JOURNAL_MIN_SIZE_BYTES || size > UINT_MAX) {
+                LogError("%s.%s must be between %d and %u", PNP_CONFIG_DEVICE_JOURNAL, PNP_CONFIG_DEVICE_JOURNAL_SIZE_BYTES,
+                         PNPBRIDGE_JOURNAL_MIN_SIZE_BYTES, UINT_MAX);
+                result = PNPBRIDGE_INVALID_ARGS;
+                LEAVE;
+            }
+
+            BridgeConfig->JournalSizeBytes = (unsigned int)size;
+            if (NULL != journalPath) {
+                LogInfo("Published devices are journaled to %s (%u bytes)", journalPath, BridgeConfig->JournalSizeBytes);
+            }
+        }
+
+        // Read the telemetry spool. Telemetry that can't be sent while the hub
+        // is unreachable is kept in it and replayed once the hub is back.
+        {
+            JSON_Object* spool = json_object_get_object(pnpBridgeParameters, PNP_CONFIG_TELEMETRY_SPOOL);
+            double size = PNPBRIDGE_DEFAULT_SPOOL_SIZE_BYTES;
+            double segmentSize = PNPBRIDGE_DEFAULT_SPOOL_SEGMENT_BYTES;
+            double replayRate = PNPBRIDGE_DEFAULT_SPOOL_REPLAY_RATE_PER_SEC;
+
+            if (NULL != spool) {
+                spoolPath = json_object_get_string(spool, PNP_CONFIG_TELEMETRY_SPOOL_PATH);
+                if (NULL == spoolPath) {
+                    LogError("%s.%s is missing", PNP_CONFIG_TELEMETRY_SPOOL, PNP_CONFIG_TELEMETRY_SPOOL_PATH);
+                    result = PNPBRIDGE_INVALID_ARGS;
+                    LEAVE;
+                }
+
+                if (json_object_has_value(spool, PNP_CONFIG_TELEMETRY_SPOOL_SIZE_BYTES)) {
+                    size = json_object_get_number(spool, PNP_CONFIG_TELEMETRY_SPOOL_SIZE_BYTES);
+                }
+
+                if (json_object_has_value(spool, PNP_CONFIG_TELEMETRY_SPOOL_SEGMENT_BYTES)) {
+                    segmentSize = json_object_get_number(spool, PNP_CONFIG_TELEMETRY_SPOOL_SEGMENT_BYTES);
+                }
+
+                if (json_object_has_value(spool, PNP_CONFIG_TELEMETRY_SPOOL_REPLAY_RATE)) {
+                    replayRate = json_object_get_number(spool, PNP_CONFIG_TELEMETRY_SPOOL_REPLAY_RATE);
+                }
+            }
+
+            if (segmentSize < PNPBRIDGE_SPOOL_MIN_SEGMENT_BYTES || segmentSize > UINT_MAX) {
+                LogError("%s.%s must be between %d and %u", PNP_CONFIG_TELEMETRY_SPOOL, PNP_CONFIG_TELEMETRY_SPOOL_SEGMENT_BYTES,
+                         PNPBRIDGE_SPOOL_MIN_SEGMENT_BYTES, UINT_MAX);
+                result = PNPBRIDGE_INVALID_ARGS;
+                LEAVE;
+            }
+
+            if (size < 2 * segmentSize || size > UINT_MAX) {
+                LogError("%s.%s must hold at least two segments of %s and be at most %u", PNP_CONFIG_TELEMETRY_SPOOL,
+                         PNP_CONFIG_TELEMETRY_SPOOL_SIZE_BYTES, PNP_CONFIG_TELEMETRY_SPOOL_SEGMENT_BYTES, UINT_MAX);
+                result = PNPBRIDGE_INVALID_ARGS;
+                LEAVE;
+            }
+
+            if (replayRate < 1 || replayRate > INT_MAX) {
+                LogError("%s.%s must be between 1 and %d", PNP_CONFIG_TELEMETRY_SPOOL, PNP_CONFIG_TELEMETRY_SPOOL_REPLAY_RATE, INT_MAX);
+                result = PNPBRIDGE_INVALID_ARGS;
+                LEAVE;
+            }
+
+            BridgeConfig->SpoolSizeBytes = (unsigned int)size;
+            BridgeConfig->SpoolSegmentBytes = (unsigned int)segmentSize;
+            BridgeConfig->SpoolReplayRatePerSec = (unsigned int)replayRate;
+            if (NULL != spoolPath) {
+                LogInfo("Telemetry is spooled to %s (%u bytes in segments of %u) and replayed at %u readings/s",
+                        spoolPath, BridgeConfig->SpoolSizeBytes, BridgeConfig->SpoolSegmentBytes,
+                        BridgeConfig->SpoolReplayRatePerSec);
+            }
+        }
+
+        // Read the config watch option. Devices added, removed or changed in the
+        // config file are then applied without restarting the bridge.
+        {
+            int watchConfig = json_object_get_boolean(pnpBridgeParameters, PNP_CONFIG_WATCH_CONFIG);
+            BridgeConfig->WatchConfig = (1 == watchConfig);
+        }
+
         // TODO: Check for connection pcoarameters
         {
             JSON_Object* connectionParameters = json_object_get_object(pnpBridgeParameters, PNP_CONFIG_CONNECTION_PARAMETERS);
@@ -244,6 +697,14 @@ PNPBRIDGE_RESULT PnpBridgeConfig_RetrieveConfiguration(JSON_Value* JsonConfig, P
                 result = PNPBRIDGE_INVALID_ARGS;
                 LEAVE;
             }
+
+            BridgeConfig->ConnParams = connParams;
+        }
+
+        // Devices are validated once their templates have been expanded
+        result = Configuration_ExpandDeviceTemplates(JsonConfig);
+        if (PNPBRIDGE_OK != result) {
+            LEAVE;
         }
 
         // Check for Device list
@@ -317,22 +778,90 @@ PNPBRIDGE_RESULT PnpBridgeConfig_RetrieveConfiguration(JSON_Value* JsonConfig, P
             result = PNPBRIDGE_INVALID_ARGS;
             LEAVE;
         }
-        
-        // Assign output values
-        BridgeConfig->JsonConfig = JsonConfig;
-        BridgeConfig->ConnParams = connParams;
 
+        // Compile the devices and adapter parameters, and copy the strings
+        // that are used after startup, so the config document can be freed
+        result = Configuration_CompileDevices(JsonConfig, BridgeConfig);
+        if (PNPBRIDGE_OK != result) {
+            LogError("Failed to compile the configured devices");
+            LEAVE;
+        }
+
+        result = Configuration_InternString(BridgeConfig->Strings, journalPath, &BridgeConfig->JournalPath);
+        if (PNPBRIDGE_OK != result) {
+            LEAVE;
+        }
+
+        result = Configuration_InternString(BridgeConfig->Strings, spoolPath, &BridgeConfig->SpoolPath);
+        if (PNPBRIDGE_OK != result) {
+            LEAVE;
+        }
+
+        result = Configuration_InternConnectionDetails(BridgeConfig->Strings, connParams);
+        if (PNPBRIDGE_OK != result) {
+            LEAVE;
+        }
+
+        // Index the devices so that matching a PNPMESSAGE doesn't have to
+        // compare it against every device in the config
+        result = Configuration_CreateDeviceIndex(BridgeConfig->Devices, BridgeConfig->DeviceCount, &BridgeConfig->DeviceIndex);
+        if (PNPBRIDGE_OK != result) {
+            LogError("Failed to index the configured devices");
+            LEAVE;
+        }
     } FINALLY {
+        // Everything retrieved so far, connParams included, is in BridgeConfig
         if (!PNPBRIDGE_SUCCESS(result)) {
-            if (connParams) {
-                free(connParams);
-            }
+            PnpBridgeConfig_ReleaseConfiguration(BridgeConfig);
         }
     }
 
     return result;
 }
 
+void PnpBridgeConfig_ReleaseConfiguration(PNPBRIDGE_CONFIGURATION* BridgeConfig)
+{
+    if (NULL == BridgeConfig) {
+        return;
+    }
+
+    if (NULL != BridgeConfig->DeviceIndex) {
+        Configuration_DestroyDeviceIndex(BridgeConfig->DeviceIndex);
+        BridgeConfig->DeviceIndex = NULL;
+    }
+
+    if (NULL != BridgeConfig->Devices) {
+        for (int i = 0; i < BridgeConfig->DeviceCount; i++) {
+            free(BridgeConfig->Devices[i].MatchParameters);
+            if (NULL != BridgeConfig->Devices[i].DiscoveryParameters) {
+                json_value_free(BridgeConfig->Devices[i].DiscoveryParameters);
+            }
+        }
+        free(BridgeConfig->Devices);
+        BridgeConfig->Devices = NULL;
+        BridgeConfig->DeviceCount = 0;
+    }
+
+    Configuration_FreeAdapters(BridgeConfig->PnpAdapters, BridgeConfig->PnpAdapterCount);
+    BridgeConfig->PnpAdapters = NULL;
+    BridgeConfig->PnpAdapterCount = 0;
+
+    Configuration_FreeAdapters(BridgeConfig->DiscoveryAdapters, BridgeConfig->DiscoveryAdapterCount);
+    BridgeConfig->DiscoveryAdapters = NULL;
+    BridgeConfig->DiscoveryAdapterCount = 0;
+
+    if (NULL != BridgeConfig->ConnParams) {
+        free(BridgeConfig->ConnParams);
+        BridgeConfig->ConnParams = NULL;
+    }
+
+    // The strings go last, everything above points to them
+    BridgeConfig->JournalPath = NULL;
+    BridgeConfig->SpoolPath = NULL;
+    Configuration_DestroyStrings(BridgeConfig->Strings);
+    BridgeConfig->Strings = NULL;
+}
+
 PNPBRIDGE_RESULT PnpBridgeConfig_GetJsonValueFromString(const char *configString, JSON_Value** config)
 {
     if (NULL == configString || NULL == config) {
@@ -390,117 +919,738 @@ Configuration_GetDiscoveryParametersForDevice(
     return discoveryParams;
 }
 
-JSON_Object* Configuration_GetAdapterParameters(JSON_Value* config, const char* identity, const char* adapterType) {
-    JSON_Object* jsonObject = json_value_get_object(config);
-    JSON_Object *adapter = json_object_dotget_object(jsonObject, adapterType);
-    if (NULL == adapter) {
-        return NULL;
-    }
-
-    JSON_Array* params = json_object_dotget_array(adapter, PNP_CONFIG_PARAMETERS);
-    if (NULL == params) {
-        return NULL;
-    }
+// Copies the values of Template that Device doesn't set into Device
+static PNPBRIDGE_RESULT
+Configuration_MergeTemplate(
+    JSON_Object* Device,
+    const JSON_Object* Template
+    )
+{
+    for (size_t i = 0; i < json_object_get_count(Template); i++) {
+        const char* name = json_object_get_name(Template, i);
+        JSON_Value* templateValue = json_object_get_value_at(Template, i);
+        JSON_Value* deviceValue = json_object_get_value(Device, name);
+
+        if (NULL == deviceValue) {
+            JSON_Value* copy = json_value_deep_copy(templateValue);
+            if (NULL == copy) {
+                return PNPBRIDGE_INSUFFICIENT_MEMORY;
+            }
 
-    for (int j = 0; j < (int)json_array_get_count(params); j++) {
-        JSON_Object *param = json_array_get_object(params, j);
-        const char* id = json_object_dotget_string(param, PNP_CONFIG_IDENTITY);
-        if (NULL != id) {
-            if (strcmp(id, identity) == 0) {
-                return param;
+            if (JSONSuccess != json_object_set_value(Device, name, copy)) {
+                json_value_free(copy);
+                return PNPBRIDGE_INSUFFICIENT_MEMORY;
+            }
+        }
+        else if (JSONObject == json_value_get_type(deviceValue) &&
+                 JSONObject == json_value_get_type(templateValue)) {
+            PNPBRIDGE_RESULT result = Configuration_MergeTemplate(json_value_get_object(deviceValue),
+                                                                 json_value_get_object(templateValue));
+            if (PNPBRIDGE_OK != result) {
+                return result;
             }
         }
     }
 
-    return NULL;
+    return PNPBRIDGE_OK;
 }
 
-JSON_Object* Configuration_GetPnpParameters(JSON_Value* config, const char* identity) {
-    return Configuration_GetAdapterParameters(config, identity, PNP_CONFIG_PNP_ADAPTERS);
-}
+PNPBRIDGE_RESULT Configuration_ExpandDeviceTemplates(JSON_Value* Config)
+{
+    JSON_Object* jsonObject = json_value_get_object(Config);
+    JSON_Object* templates = json_object_get_object(jsonObject, PNP_CONFIG_DEVICE_TEMPLATES);
+    JSON_Array* devices = Configuration_GetConfiguredDevices(Config);
+    int expandedCount = 0;
+
+    for (int i = 0; i < (int)json_array_get_count(devices); i++) {
+        JSON_Object* device = json_array_get_object(devices, i);
+        const char* templateName = json_object_get_string(device, PNP_CONFIG_TEMPLATE);
+        if (NULL == templateName) {
+            continue;
+        }
 
-JSON_Object* Configuration_GetDiscoveryParameters(JSON_Value* config, const char* identity) {
-    return Configuration_GetAdapterParameters(config, identity, PNP_CONFIG_DISCOVERY_ADAPTERS);
-}
+        JSON_Object* deviceTemplate = json_object_get_object(templates, templateName);
+        if (NULL == deviceTemplate) {
+            LogError("Device (%d) uses %s %s, which isn't in %s", i, PNP_CONFIG_TEMPLATE, templateName, PNP_CONFIG_DEVICE_TEMPLATES);
+            return PNPBRIDGE_INVALID_ARGS;
+        }
 
-PNPBRIDGE_RESULT Configuration_IsDeviceConfigured(JSON_Value* config, JSON_Object* message, JSON_Object** device) {
-    JSON_Array *devices = Configuration_GetConfiguredDevices(config);
-    JSON_Object* discMatchParams;
-    char* pnpAdapterIdentity = NULL;
-    PNPBRIDGE_RESULT result = PNPBRIDGE_OK;
+        PNPBRIDGE_RESULT result = Configuration_MergeTemplate(device, deviceTemplate);
+        if (PNPBRIDGE_OK != result) {
+            LogError("Failed to expand %s %s into device (%d)", PNP_CONFIG_TEMPLATE, templateName, i);
+            return result;
+        }
+
+        // A config snapshot holds the expanded devices, which aren't expanded again
+        json_object_remove(device, PNP_CONFIG_TEMPLATE);
+        expandedCount++;
+    }
+
+    if (expandedCount > 0) {
+        LogInfo("Expanded %d device(s) from %d template(s)", expandedCount, (int)json_object_get_count(templates));
+    }
+
+    return PNPBRIDGE_OK;
+}
+
+static PNPBRIDGE_RESULT
+Configuration_CompileAdapters(
+    PCONFIGURATION_STRINGS Strings,
+    JSON_Value* Config,
+    const char* AdapterType,
+    PPNPBRIDGE_ADAPTER_CONFIG* Adapters,
+    int* AdapterCount
+    )
+{
+    JSON_Object* jsonObject = json_value_get_object(Config);
+    JSON_Object* adapter = json_object_dotget_object(jsonObject, AdapterType);
+    JSON_Array* params = json_object_dotget_array(adapter, PNP_CONFIG_PARAMETERS);
+    const int paramCount = (int)json_array_get_count(params);
+    PPNPBRIDGE_ADAPTER_CONFIG adapters = NULL;
+    int count = 0;
+
+    if (0 == paramCount) {
+        return PNPBRIDGE_OK;
+    }
+
+    adapters = calloc(paramCount, sizeof(PNPBRIDGE_ADAPTER_CONFIG));
+    if (NULL == adapters) {
+        return PNPBRIDGE_INSUFFICIENT_MEMORY;
+    }
 
-    *device = NULL;
+    for (int j = 0; j < paramCount; j++) {
+        JSON_Object* param = json_array_get_object(params, j);
+        const char* id = json_object_dotget_string(param, PNP_CONFIG_IDENTITY);
+        if (NULL == id) {
+            continue;
+        }
+
+        PPNPBRIDGE_ADAPTER_CONFIG entry = &adapters[count];
+        if (PNPBRIDGE_OK != Configuration_InternString(Strings, id, &entry->Identity) ||
+            NULL == (entry->Parameters = json_value_deep_copy(json_object_get_wrapping_value(param)))) {
+            LogError("Failed to copy the %s parameters of %s", AdapterType, id);
+            Configuration_FreeAdapters(adapters, count);
+            return PNPBRIDGE_INSUFFICIENT_MEMORY;
+        }
+        count++;
+    }
+
+    *Adapters = adapters;
+    *AdapterCount = count;
+
+    return PNPBRIDGE_OK;
+}
 
+static int Configuration_CompareMatchParameters(const void* parameter1, const void* parameter2)
+{
+    return strcmp(((const PNPBRIDGE_MATCH_PARAMETER*)parameter1)->Name, ((const PNPBRIDGE_MATCH_PARAMETER*)parameter2)->Name);
+}
+
+static PNPBRIDGE_RESULT
+Configuration_CompileDevice(
+    PCONFIGURATION_STRINGS Strings,
+    JSON_Object* Device,
+    PPNPBRIDGE_DEVICE_CONFIG Compiled
+    )
+{
+    PNPBRIDGE_RESULT result;
+    JSON_Object* discoveryParams = Configuration_GetDiscoveryParametersForDevice(Device);
+    JSON_Object* matchCriteria = json_object_dotget_object(Device, PNP_CONFIG_MATCH_FILTERS);
+    JSON_Object* matchParameters = json_object_dotget_object(matchCriteria, PNP_CONFIG_MATCH_PARAMETERS);
+    const char* matchType = json_object_get_string(matchCriteria, PNP_CONFIG_MATCH_TYPE);
+    const char* selfDescribing = json_object_get_string(Device, PNP_CONFIG_SELF_DESCRIBING);
+    const int matchParameterCount = (int)json_object_get_count(matchParameters);
+
+    Compiled->PnpAdapterKey = -1;
+    Compiled->SelfDescribing = (NULL != selfDescribing) && (0 == strcmp(selfDescribing, PNP_CONFIG_TRUE));
+    Compiled->ExactMatch = (NULL != matchType) && (0 == strcmp(matchType, PNP_CONFIG_MATCH_TYPE_EXACT));
+
+    result = Configuration_InternString(Strings, json_object_get_string(Device, PNP_CONFIG_INTERFACE_ID), &Compiled->InterfaceId);
+    if (PNPBRIDGE_OK == result) {
+        result = Configuration_InternString(Strings, json_object_get_string(Device, PNP_CONFIG_COMPONENT_NAME), &Compiled->ComponentName);
+    }
+    if (PNPBRIDGE_OK == result) {
+        result = Configuration_InternString(Strings, json_object_get_string(Configuration_GetPnpParametersForDevice(Device), PNP_CONFIG_IDENTITY),
+                                            &Compiled->PnpAdapterIdentity);
+    }
+    if (PNPBRIDGE_OK == result) {
+        result = Configuration_InternString(Strings, json_object_get_string(discoveryParams, PNP_CONFIG_IDENTITY),
+                                            &Compiled->DiscoveryAdapterIdentity);
+    }
+    if (PNPBRIDGE_OK != result) {
+        return result;
+    }
+
+    if (NULL != discoveryParams) {
+        Compiled->DiscoveryParameters = json_value_deep_copy(json_object_get_wrapping_value(discoveryParams));
+        if (NULL == Compiled->DiscoveryParameters) {
+            LogError("Failed to copy the discovery parameters of a device");
+            return PNPBRIDGE_INSUFFICIENT_MEMORY;
+        }
+    }
+
+    if (matchParameterCount > 0) {
+        Compiled->MatchParameters = calloc(matchParameterCount, sizeof(PNPBRIDGE_MATCH_PARAMETER));
+        if (NULL == Compiled->MatchParameters) {
+            return PNPBRIDGE_INSUFFICIENT_MEMORY;
+        }
+
+        for (int j = 0; j < matchParameterCount; j++) {
+            const char* name = json_object_get_name(matchParameters, j);
+            result = Configuration_InternString(Strings, name, &Compiled->MatchParameters[j].Name);
+            if (PNPBRIDGE_OK == result) {
+                result = Configuration_InternString(Strings, json_object_get_string(matchParameters, name), &Compiled->MatchParameters[j].Value);
+            }
+            if (PNPBRIDGE_OK != result) {
+                return result;
+            }
+        }
+
+        // Every match parameter has to match, so their order doesn't matter.
+        // Sorted parameters hash the same way as the device index schemas.
+        qsort(Compiled->MatchParameters, matchParameterCount, sizeof(PNPBRIDGE_MATCH_PARAMETER), Configuration_CompareMatchParameters);
+        Compiled->MatchParameterCount = matchParameterCount;
+    }
+
+    return PNPBRIDGE_OK;
+}
+
+PNPBRIDGE_RESULT Configuration_CompileDevices(JSON_Value* Config, PNPBRIDGE_CONFIGURATION* BridgeConfig)
+{
+    PNPBRIDGE_RESULT result = PNPBRIDGE_OK;
+
+    // A partially compiled config is released by PnpBridgeConfig_ReleaseConfiguration
     TRY {
-        discMatchParams = json_object_get_object(message, PNP_CONFIG_MATCH_PARAMETERS);
-        for (int i = 0; i < (int)json_array_get_count(devices); i++) {
-            bool foundMatch = false;
-            JSON_Object* dev = json_array_get_object(devices, i);
-            JSON_Object* pnpParams = Configuration_GetPnpParametersForDevice(dev);
-            if (NULL == pnpParams) {
-                continue;
+        if (NULL == Config || NULL == BridgeConfig) {
+            LogError("Configuration_CompileDevices: Invalid parameters");
+            result = PNPBRIDGE_INVALID_ARGS;
+            LEAVE;
+        }
+
+        result = Configuration_CreateStrings(&BridgeConfig->Strings);
+        if (PNPBRIDGE_OK != result) {
+            LEAVE;
+        }
+
+        JSON_Array* devices = Configuration_GetConfiguredDevices(Config);
+        const int deviceCount = (int)json_array_get_count(devices);
+        if (deviceCount > 0) {
+            BridgeConfig->Devices = calloc(deviceCount, sizeof(PNPBRIDGE_DEVICE_CONFIG));
+            if (NULL == BridgeConfig->Devices) {
+                result = PNPBRIDGE_INSUFFICIENT_MEMORY;
+                LEAVE;
+            }
+            BridgeConfig->DeviceCount = deviceCount;
+        }
+
+        for (int i = 0; i < deviceCount; i++) {
+            result = Configuration_CompileDevice(BridgeConfig->Strings, json_array_get_object(devices, i), &BridgeConfig->Devices[i]);
+            if (PNPBRIDGE_OK != result) {
+                LEAVE;
             }
+        }
+
+        result = Configuration_CompileAdapters(BridgeConfig->Strings, Config, PNP_CONFIG_PNP_ADAPTERS,
+                                               &BridgeConfig->PnpAdapters, &BridgeConfig->PnpAdapterCount);
+        if (PNPBRIDGE_OK != result) {
+            LEAVE;
+        }
 
-            JSON_Object* matchCriteria = json_object_dotget_object(dev, PNP_CONFIG_MATCH_FILTERS);
-          
-            const char* matchType = json_object_get_string(matchCriteria, PNP_CONFIG_MATCH_TYPE);
-            const char* currPnpAdapterId = json_object_get_string(pnpParams, PNP_CONFIG_IDENTITY);
-            bool exactMatch = strcmp(matchType, PNP_CONFIG_MATCH_TYPE_EXACT) == 0;
+        result = Configuration_CompileAdapters(BridgeConfig->Strings, Config, PNP_CONFIG_DISCOVERY_ADAPTERS,
+                                               &BridgeConfig->DiscoveryAdapters, &BridgeConfig->DiscoveryAdapterCount);
+        if (PNPBRIDGE_OK != result) {
+            LEAVE;
+        }
 
-            if (NULL != discMatchParams) {
-                JSON_Object* matchParameters = json_object_dotget_object(matchCriteria, PNP_CONFIG_MATCH_PARAMETERS);
-                const size_t matchParameterCount = json_object_get_count(matchParameters);
-                for (int j = 0; j < (int)matchParameterCount; j++) {
-                    const char* name = json_object_get_name(matchParameters, j);
-                    const char* value1 = json_object_get_string(matchParameters, name);
+        LogInfo("Compiled %d configured devices and %d adapter parameters, %u distinct strings", BridgeConfig->DeviceCount,
+                BridgeConfig->PnpAdapterCount + BridgeConfig->DiscoveryAdapterCount, BridgeConfig->Strings->Count);
+    } FINALLY {
+    }
 
-                    if (!json_object_dothas_value(discMatchParams, name)) {
-                        break;
-                    }
+    return result;
+}
 
-                    const char* value2 = json_object_get_string(discMatchParams, name);
-                    bool match;
-                    if (exactMatch) {
-                        match = 0 != strstr(value2, value1);
-                    }
-                    else {
-                        match = 0 == strcmp(value2, value1);
-                    }
-                    if (false == match) {
-                        foundMatch = false;
-                        break;
-                    }
-                    else {
-                        foundMatch = true;
-                    }
+static JSON_Object* Configuration_GetAdapterParameters(PPNPBRIDGE_ADAPTER_CONFIG adapters, int adapterCount, const char* identity) {
+    if (NULL == identity) {
+        return NULL;
+    }
+
+    for (int j = 0; j < adapterCount; j++) {
+        if (0 == strcmp(adapters[j].Identity, identity)) {
+            return json_value_get_object(adapters[j].Parameters);
+        }
+    }
+
+    return NULL;
+}
+
+JSON_Object* Configuration_GetPnpParameters(PNPBRIDGE_CONFIGURATION* config, const char* identity) {
+    return Configuration_GetAdapterParameters(config->PnpAdapters, config->PnpAdapterCount, identity);
+}
+
+JSON_Object* Configuration_GetDiscoveryParameters(PNPBRIDGE_CONFIGURATION* config, const char* identity) {
+    return Configuration_GetAdapterParameters(config->DiscoveryAdapters, config->DiscoveryAdapterCount, identity);
+}
+
+static bool Configuration_IsSameString(const char* String1, const char* String2)
+{
+    if (NULL == String1 || NULL == String2) {
+        return String1 == String2;
+    }
+
+    return 0 == strcmp(String1, String2);
+}
+
+static bool Configuration_IsSameDevice(PPNPBRIDGE_DEVICE_CONFIG Device1, PPNPBRIDGE_DEVICE_CONFIG Device2)
+{
+    if (Device1->SelfDescribing != Device2->SelfDescribing ||
+        Device1->ExactMatch != Device2->ExactMatch ||
+        Device1->MatchParameterCount != Device2->MatchParameterCount ||
+        !Configuration_IsSameString(Device1->InterfaceId, Device2->InterfaceId) ||
+        !Configuration_IsSameString(Device1->ComponentName, Device2->ComponentName) ||
+        !Configuration_IsSameString(Device1->PnpAdapterIdentity, Device2->PnpAdapterIdentity) ||
+        !Configuration_IsSameString(Device1->DiscoveryAdapterIdentity, Device2->DiscoveryAdapterIdentity)) {
+        return false;
+    }
+
+    // Match parameters are sorted by name
+    for (int i = 0; i < Device1->MatchParameterCount; i++) {
+        if (!Configuration_IsSameString(Device1->MatchParameters[i].Name, Device2->MatchParameters[i].Name) ||
+            !Configuration_IsSameString(Device1->MatchParameters[i].Value, Device2->MatchParameters[i].Value)) {
+            return false;
+        }
+    }
+
+    if (NULL == Device1->DiscoveryParameters || NULL == Device2->DiscoveryParameters) {
+        return Device1->DiscoveryParameters == Device2->DiscoveryParameters;
+    }
+
+    return 1 == json_value_equals(Device1->DiscoveryParameters, Device2->DiscoveryParameters);
+}
+
+PNPBRIDGE_RESULT Configuration_DiffDevices(PNPBRIDGE_CONFIGURATION* Old, PNPBRIDGE_CONFIGURATION* New, int* NewToOld, int* ChangeCount)
+{
+    bool* matched = NULL;
+    int unchanged = 0;
+
+    if (NULL == Old || NULL == New || (NULL == NewToOld && New->DeviceCount > 0) || NULL == ChangeCount) {
+        LogError("Configuration_DiffDevices: Invalid parameters");
+        return PNPBRIDGE_INVALID_ARGS;
+    }
+
+    // Each device of the running config is the same as one reloaded device at most
+    matched = calloc(Old->DeviceCount > 0 ? Old->DeviceCount : 1, sizeof(bool));
+    if (NULL == matched) {
+        return PNPBRIDGE_INSUFFICIENT_MEMORY;
+    }
+
+    for (int i = 0; i < New->DeviceCount; i++) {
+        NewToOld[i] = -1;
+
+        // Most devices keep their position in the config, so it is checked first
+        if (i < Old->DeviceCount && !matched[i] && Configuration_IsSameDevice(&Old->Devices[i], &New->Devices[i])) {
+            NewToOld[i] = i;
+        }
+        else {
+            for (int j = 0; j < Old->DeviceCount; j++) {
+                if (!matched[j] && Configuration_IsSameDevice(&Old->Devices[j], &New->Devices[i])) {
+                    NewToOld[i] = j;
+                    break;
                 }
             }
-            else {
-                char* selfDescribing = (char*)json_object_get_string(dev, PNP_CONFIG_SELF_DESCRIBING);
-                if (NULL != selfDescribing && 0 == strcmp(selfDescribing, PNP_CONFIG_TRUE)) {
-                    JSON_Object* discAdapterParams = Configuration_GetDiscoveryParametersForDevice(dev);
-                    const char* discAdapterId = json_object_get_string(discAdapterParams, PNP_CONFIG_IDENTITY);
-                    const char* messageId = json_object_get_string(message, PNP_CONFIG_IDENTITY);
-                    if (NULL != discAdapterId && NULL != messageId && 0 == strcmp(discAdapterId, messageId)) {
-                        foundMatch = true;
-                    }
-                }
+        }
+
+        if (NewToOld[i] >= 0) {
+            matched[NewToOld[i]] = true;
+            unchanged++;
+        }
+    }
+
+    *ChangeCount = (Old->DeviceCount - unchanged) + (New->DeviceCount - unchanged);
+
+    free(matched);
+
+    return PNPBRIDGE_OK;
+}
+
+// A PNPMESSAGE reported by a discovery adapter is matched against the configured
+// devices in one of two ways:
+//
+// 1. A message with match_parameters matches a device when every match parameter
+//    of the device is reported with the same value. The "exact" match type only
+//    requires the configured value to be contained in the reported value, which
+//    is how a hardware id prefix matches the full hardware id.
+// 2. A message without match_parameters matches a self describing device whose
+//    discovery adapter identity is the identity of the message.
+//
+// The device index hashes equality matches on the sorted name/value tuple of
+// their match parameters and self describing devices on their discovery adapter
+// identity. Devices configured with the same parameter names share a schema so
+// that a lookup hashes the message once per schema rather than once per device.
+// "exact" devices can't be hashed and are kept in a fallback list. As with the
+// linear scan, the first matching device in the config wins.
+
+// Schema of the entries keyed on the discovery adapter identity
+#define CONFIGURATION_SCHEMA_IDENTITY -1
+
+// Minimum number of buckets in the device index
+#define CONFIGURATION_INDEX_MIN_BUCKETS 16
+
+typedef struct _CONFIGURATION_MATCH_SCHEMA {
+    // Sorted match parameters of the first device with the schema. Only their
+    // interned names belong to the schema.
+    PPNPBRIDGE_MATCH_PARAMETER Parameters;
+    int ParameterCount;
+} CONFIGURATION_MATCH_SCHEMA, *PCONFIGURATION_MATCH_SCHEMA;
+
+typedef struct _CONFIGURATION_INDEX_ENTRY {
+    unsigned int Hash;
+    int Schema;
+
+    // Index of the device in the config. -1 marks an empty bucket.
+    int DeviceIndex;
+} CONFIGURATION_INDEX_ENTRY, *PCONFIGURATION_INDEX_ENTRY;
+
+typedef struct _CONFIGURATION_DEVICE_INDEX {
+    PPNPBRIDGE_DEVICE_CONFIG Devices;
+
+    // Open addressing hash table with linear probing. Entries are never removed
+    // and are inserted in config order, so the first entry that matches along
+    // a probe sequence is the first matching device in the config.
+    PCONFIGURATION_INDEX_ENTRY Buckets;
+    unsigned int BucketCount;
+
+    PCONFIGURATION_MATCH_SCHEMA Schemas;
+    int SchemaCount;
+
+    // Devices matched on a substring of the reported value, in config order
+    int* FallbackDevices;
+    int FallbackCount;
+} CONFIGURATION_DEVICE_INDEX;
+
+static bool Configuration_MatchParameters(PPNPBRIDGE_DEVICE_CONFIG device, JSON_Object* discMatchParams)
+{
+    if (0 == device->MatchParameterCount) {
+        return false;
+    }
+
+    for (int j = 0; j < device->MatchParameterCount; j++) {
+        const char* value1 = device->MatchParameters[j].Value;
+        const char* value2 = json_object_get_string(discMatchParams, device->MatchParameters[j].Name);
+        if (NULL == value1 || NULL == value2) {
+            return false;
+        }
+
+        bool match;
+        if (device->ExactMatch) {
+            match = NULL != strstr(value2, value1);
+        }
+        else {
+            match = 0 == strcmp(value2, value1);
+        }
+
+        if (!match) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static bool Configuration_HashMatchParameters(PCONFIGURATION_MATCH_SCHEMA schema, JSON_Object* parameters, unsigned int* hash)
+{
+    *hash = PNPBRIDGE_HASH_INITIAL_VALUE;
+    for (int i = 0; i < schema->ParameterCount; i++) {
+        const char* value = json_object_get_string(parameters, schema->Parameters[i].Name);
+        if (NULL == value) {
+            return false;
+        }
+
+        *hash = PnpBridge_HashString(*hash, schema->Parameters[i].Name);
+        *hash = PnpBridge_HashString(*hash, value);
+    }
+
+    return true;
+}
+
+static bool Configuration_HashDeviceParameters(PPNPBRIDGE_DEVICE_CONFIG device, unsigned int* hash)
+{
+    *hash = PNPBRIDGE_HASH_INITIAL_VALUE;
+    for (int i = 0; i < device->MatchParameterCount; i++) {
+        if (NULL == device->MatchParameters[i].Value) {
+            return false;
+        }
+
+        *hash = PnpBridge_HashString(*hash, device->MatchParameters[i].Name);
+        *hash = PnpBridge_HashString(*hash, device->MatchParameters[i].Value);
+    }
+
+    return true;
+}
+
+static bool Configuration_MatchSchemaParameters(PCONFIGURATION_MATCH_SCHEMA schema, PPNPBRIDGE_DEVICE_CONFIG device, JSON_Object* discMatchParams)
+{
+    for (int i = 0; i < schema->ParameterCount; i++) {
+        const char* value1 = device->MatchParameters[i].Value;
+        const char* value2 = json_object_get_string(discMatchParams, schema->Parameters[i].Name);
+        if (NULL == value1 || NULL == value2 || 0 != strcmp(value1, value2)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// The names are interned, so the schemas are compared by address
+static int Configuration_FindSchema(PCONFIGURATION_DEVICE_INDEX index, PPNPBRIDGE_DEVICE_CONFIG device)
+{
+    for (int i = 0; i < index->SchemaCount; i++) {
+        PCONFIGURATION_MATCH_SCHEMA schema = &index->Schemas[i];
+        if (schema->ParameterCount != device->MatchParameterCount) {
+            continue;
+        }
+
+        int j = 0;
+        while (j < schema->ParameterCount && schema->Parameters[j].Name == device->MatchParameters[j].Name) {
+            j++;
+        }
+
+        if (j == schema->ParameterCount) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+static void Configuration_InsertIndexEntry(PCONFIGURATION_DEVICE_INDEX index, unsigned int hash, int schema, int deviceIndex)
+{
+    const unsigned int mask = index->BucketCount - 1;
+    unsigned int bucket = hash & mask;
+
+    while (index->Buckets[bucket].DeviceIndex >= 0) {
+        bucket = (bucket + 1) & mask;
+    }
+
+    index->Buckets[bucket].Hash = hash;
+    index->Buckets[bucket].Schema = schema;
+    index->Buckets[bucket].DeviceIndex = deviceIndex;
+}
+
+static int Configuration_LookupIndexEntry(PCONFIGURATION_DEVICE_INDEX index, unsigned int hash, int schema, JSON_Object* discMatchParams, const char* identity)
+{
+    const unsigned int mask = index->BucketCount - 1;
+
+    for (unsigned int bucket = hash & mask; index->Buckets[bucket].DeviceIndex >= 0; bucket = (bucket + 1) & mask) {
+        PCONFIGURATION_INDEX_ENTRY entry = &index->Buckets[bucket];
+        if (entry->Hash != hash || entry->Schema != schema) {
+            continue;
+        }
+
+        PPNPBRIDGE_DEVICE_CONFIG dev = &index->Devices[entry->DeviceIndex];
+        bool match;
+        if (CONFIGURATION_SCHEMA_IDENTITY == schema) {
+            match = 0 == strcmp(dev->DiscoveryAdapterIdentity, identity);
+        }
+        else {
+            match = Configuration_MatchSchemaParameters(&index->Schemas[schema], dev, discMatchParams);
+        }
+
+        if (match) {
+            return entry->DeviceIndex;
+        }
+    }
+
+    return -1;
+}
+
+PNPBRIDGE_RESULT Configuration_CreateDeviceIndex(PPNPBRIDGE_DEVICE_CONFIG Devices, int DeviceCount, PCONFIGURATION_DEVICE_INDEX* DeviceIndex)
+{
+    PNPBRIDGE_RESULT result = PNPBRIDGE_OK;
+    PCONFIGURATION_DEVICE_INDEX index = NULL;
+
+    TRY {
+        if ((NULL == Devices && DeviceCount > 0) || NULL == DeviceIndex) {
+            LogError("Configuration_CreateDeviceIndex: Invalid parameters");
+            result = PNPBRIDGE_INVALID_ARGS;
+            LEAVE;
+        }
+
+        *DeviceIndex = NULL;
+
+        index = calloc(1, sizeof(CONFIGURATION_DEVICE_INDEX));
+        if (NULL == index) {
+            result = PNPBRIDGE_INSUFFICIENT_MEMORY;
+            LEAVE;
+        }
+
+        index->Devices = Devices;
+
+        // A device has at most 2 entries. Keep the table at most half full.
+        index->BucketCount = CONFIGURATION_INDEX_MIN_BUCKETS;
+        while (index->BucketCount < 4 * (unsigned int)DeviceCount) {
+            index->BucketCount <<= 1;
+        }
+
+        index->Buckets = malloc(index->BucketCount * sizeof(CONFIGURATION_INDEX_ENTRY));
+        index->Schemas = calloc(DeviceCount + 1, sizeof(CONFIGURATION_MATCH_SCHEMA));
+        index->FallbackDevices = malloc((DeviceCount + 1) * sizeof(int));
+        if (NULL == index->Buckets || NULL == index->Schemas || NULL == index->FallbackDevices) {
+            result = PNPBRIDGE_INSUFFICIENT_MEMORY;
+            LEAVE;
+        }
+
+        for (unsigned int i = 0; i < index->BucketCount; i++) {
+            index->Buckets[i].DeviceIndex = -1;
+        }
+
+        for (int i = 0; i < DeviceCount; i++) {
+            PPNPBRIDGE_DEVICE_CONFIG dev = &Devices[i];
+            if (NULL == dev->PnpAdapterIdentity) {
+                continue;
             }
 
-            if (foundMatch) {
-                pnpAdapterIdentity = (char*)currPnpAdapterId;
-                *device = dev;
-                result = PNPBRIDGE_OK;
-                LEAVE;
+            if (dev->SelfDescribing && NULL != dev->DiscoveryAdapterIdentity) {
+                Configuration_InsertIndexEntry(index, PnpBridge_HashString(PNPBRIDGE_HASH_INITIAL_VALUE, dev->DiscoveryAdapterIdentity),
+                                               CONFIGURATION_SCHEMA_IDENTITY, i);
+            }
+
+            if (0 == dev->MatchParameterCount) {
+                continue;
+            }
+
+            if (dev->ExactMatch) {
+                index->FallbackDevices[index->FallbackCount++] = i;
+                continue;
+            }
+
+            int schema = Configuration_FindSchema(index, dev);
+            if (schema < 0) {
+                schema = index->SchemaCount++;
+                index->Schemas[schema].Parameters = dev->MatchParameters;
+                index->Schemas[schema].ParameterCount = dev->MatchParameterCount;
+            }
+
+            // A device with a non string match parameter never matches
+            unsigned int hash;
+            if (Configuration_HashDeviceParameters(dev, &hash)) {
+                Configuration_InsertIndexEntry(index, hash, schema, i);
             }
         }
+
+        LogInfo("Indexed %d configured devices: %d match schemas, %d devices matched on substrings",
+                DeviceCount, index->SchemaCount, index->FallbackCount);
+
+        *DeviceIndex = index;
     }
     FINALLY
     {
-        if (NULL == *device) {
-            result = PNPBRIDGE_INVALID_ARGS;
+        if (PNPBRIDGE_OK != result && NULL != index) {
+            Configuration_DestroyDeviceIndex(index);
         }
     }
 
     return result;
 }
+
+void Configuration_DestroyDeviceIndex(PCONFIGURATION_DEVICE_INDEX DeviceIndex)
+{
+    if (NULL == DeviceIndex) {
+        return;
+    }
+
+    free(DeviceIndex->Schemas);
+    free(DeviceIndex->Buckets);
+    free(DeviceIndex->FallbackDevices);
+    free(DeviceIndex);
+}
+
+static int Configuration_FindDeviceInIndex(PCONFIGURATION_DEVICE_INDEX index, JSON_Object* message)
+{
+    JSON_Object* discMatchParams = json_object_get_object(message, PNP_CONFIG_MATCH_PARAMETERS);
+    int found = -1;
+
+    if (NULL == discMatchParams) {
+        const char* messageId = json_object_get_string(message, PNP_CONFIG_IDENTITY);
+        if (NULL != messageId) {
+            found = Configuration_LookupIndexEntry(index, PnpBridge_HashString(PNPBRIDGE_HASH_INITIAL_VALUE, messageId),
+                                                   CONFIGURATION_SCHEMA_IDENTITY, NULL, messageId);
+        }
+
+        return found;
+    }
+
+    for (int i = 0; i < index->SchemaCount; i++) {
+        unsigned int hash;
+        if (!Configuration_HashMatchParameters(&index->Schemas[i], discMatchParams, &hash)) {
+            continue;
+        }
+
+        int candidate = Configuration_LookupIndexEntry(index, hash, i, discMatchParams, NULL);
+        if (candidate >= 0 && (found < 0 || candidate < found)) {
+            found = candidate;
+        }
+    }
+
+    // Substring matches only win if they come before the hashed match in the config
+    for (int i = 0; i < index->FallbackCount; i++) {
+        const int deviceIndex = index->FallbackDevices[i];
+        if (found >= 0 && deviceIndex > found) {
+            break;
+        }
+
+        if (Configuration_MatchParameters(&index->Devices[deviceIndex], discMatchParams)) {
+            found = deviceIndex;
+            break;
+        }
+    }
+
+    return found;
+}
+
+static int Configuration_FindDevice(PPNPBRIDGE_DEVICE_CONFIG devices, int deviceCount, JSON_Object* message)
+{
+    JSON_Object* discMatchParams = json_object_get_object(message, PNP_CONFIG_MATCH_PARAMETERS);
+    const char* messageId = json_object_get_string(message, PNP_CONFIG_IDENTITY);
+
+    for (int i = 0; i < deviceCount; i++) {
+        PPNPBRIDGE_DEVICE_CONFIG dev = &devices[i];
+        if (NULL == dev->PnpAdapterIdentity) {
+            continue;
+        }
+
+        if (NULL != discMatchParams) {
+            if (Configuration_MatchParameters(dev, discMatchParams)) {
+                return i;
+            }
+        }
+        else {
+            if (dev->SelfDescribing && NULL != dev->DiscoveryAdapterIdentity &&
+                NULL != messageId && 0 == strcmp(dev->DiscoveryAdapterIdentity, messageId)) {
+                return i;
+            }
+        }
+    }
+
+    return -1;
+}
+
+PNPBRIDGE_RESULT Configuration_IsDeviceConfigured(PNPBRIDGE_CONFIGURATION* BridgeConfig, JSON_Object* Message, PPNPBRIDGE_DEVICE_CONFIG* Device) {
+    int deviceIndex;
+
+    *Device = NULL;
+
+    if (NULL != BridgeConfig->DeviceIndex) {
+        deviceIndex = Configuration_FindDeviceInIndex(BridgeConfig->DeviceIndex, Message);
+    }
+    else {
+        deviceIndex = Configuration_FindDevice(BridgeConfig->Devices, BridgeConfig->DeviceCount, Message);
+    }
+
+    if (deviceIndex < 0) {
+        return PNPBRIDGE_INVALID_ARGS;
+    }
+
+    *Device = &BridgeConfig->Devices[deviceIndex];
+    return PNPBRIDGE_OK;
+}
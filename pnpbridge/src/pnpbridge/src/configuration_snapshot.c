@@ -0,0 +1,692 @@
+// Copyright (c) Microsoft. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#include <errno.h>
+
+#include "pnpbridge_common.h"
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+// A config snapshot is the validated config tree compiled into a flat image
+// that is mapped and rebuilt without parsing any JSON. The header holds the
+// size and hash of the config file it was compiled from, so a snapshot of an
+// older config file is ignored and compiled again.
+//
+// The image holds the values in pre-order. Every value starts with its
+// PNPBRIDGE_CONFIG_SNAPSHOT_VALUE type:
+//   object   uint32 count, then count times a string name and a value
+//   array    uint32 count, then count values
+//   string   uint32 length, then length bytes and a NUL
+//   number   8 byte double
+//   true, false and null have no data
+// Multi-byte fields are in host byte order and are not aligned.
+#define PNPBRIDGE_CONFIG_SNAPSHOT_MAGIC 0x43504e50 // "PNPC"
+#define PNPBRIDGE_CONFIG_SNAPSHOT_VERSION 1
+#define PNPBRIDGE_CONFIG_SNAPSHOT_SUFFIX ".snapshot"
+#define PNPBRIDGE_CONFIG_SNAPSHOT_TEMP_SUFFIX ".tmp"
+
+// Bounds the recursion when a corrupt snapshot is rebuilt
+#define PNPBRIDGE_CONFIG_SNAPSHOT_MAX_DEPTH 64
+
+// Largest config file that is compiled
+#define PNPBRIDGE_CONFIG_SNAPSHOT_MAX_CONFIG_SIZE (64 * 1024 * 1024)
+
+typedef enum _PNPBRIDGE_CONFIG_SNAPSHOT_VALUE {
+    PNPBRIDGE_CONFIG_SNAPSHOT_NULL = 1,
+    PNPBRIDGE_CONFIG_SNAPSHOT_OBJECT,
+    PNPBRIDGE_CONFIG_SNAPSHOT_ARRAY,
+    PNPBRIDGE_CONFIG_SNAPSHOT_STRING,
+    PNPBRIDGE_CONFIG_SNAPSHOT_NUMBER,
+    PNPBRIDGE_CONFIG_SNAPSHOT_TRUE,
+    PNPBRIDGE_CONFIG_SNAPSHOT_FALSE
+} PNPBRIDGE_CONFIG_SNAPSHOT_VALUE;
+
+typedef struct _PNPBRIDGE_CONFIG_SNAPSHOT_HEADER {
+    uint32_t Magic;
+    uint32_t Version;
+    uint32_t ConfigSize;
+    uint32_t ImageSize;
+    uint64_t ConfigHash;
+} PNPBRIDGE_CONFIG_SNAPSHOT_HEADER, *PPNPBRIDGE_CONFIG_SNAPSHOT_HEADER;
+
+// Image being read. Offset is past Size once a read went out of bounds.
+typedef struct _PNPBRIDGE_CONFIG_SNAPSHOT_READER {
+    const unsigned char* Data;
+    uint32_t Size;
+    uint32_t Offset;
+} PNPBRIDGE_CONFIG_SNAPSHOT_READER, *PPNPBRIDGE_CONFIG_SNAPSHOT_READER;
+
+// Image being compiled. Failed is set if it couldn't grow.
+typedef struct _PNPBRIDGE_CONFIG_SNAPSHOT_WRITER {
+    unsigned char* Data;
+    size_t Size;
+    size_t Capacity;
+    bool Failed;
+} PNPBRIDGE_CONFIG_SNAPSHOT_WRITER, *PPNPBRIDGE_CONFIG_SNAPSHOT_WRITER;
+
+// 64 bit FNV-1a
+static uint64_t
+PnpConfigSnapshot_Hash(
+    _In_ const unsigned char* Data,
+    _In_ size_t Size
+    )
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    for (size_t i = 0; i < Size; i++) {
+        hash ^= Data[i];
+        hash *= 0x100000001b3ULL;
+    }
+
+    return hash;
+}
+
+static char*
+PnpConfigSnapshot_GetPath(
+    _In_ const char* ConfigPath,
+    _In_ const char* Suffix
+    )
+{
+    size_t size = strlen(ConfigPath) + strlen(PNPBRIDGE_CONFIG_SNAPSHOT_SUFFIX) + strlen(Suffix) + 1;
+    char* path = malloc(size);
+
+    if (NULL != path) {
+        strcpy_s(path, size, ConfigPath);
+        strcat_s(path, size, PNPBRIDGE_CONFIG_SNAPSHOT_SUFFIX);
+        strcat_s(path, size, Suffix);
+    }
+
+    return path;
+}
+
+// Reads the whole config file into a NUL terminated buffer
+static PNPBRIDGE_RESULT
+PnpConfigSnapshot_ReadConfigFile(
+    _In_ const char* ConfigPath,
+    _Out_ char** Contents,
+    _Out_ uint32_t* Size
+    )
+{
+    PNPBRIDGE_RESULT result = PNPBRIDGE_OK;
+    FILE* file = NULL;
+    char* contents = NULL;
+    long size = 0;
+
+    *Contents = NULL;
+
+    TRY {
+        file = fopen(ConfigPath, "rb");
+        if (NULL == file) {
+            LogError("Cannot open the config file %s", ConfigPath);
+            result = PNPBRIDGE_FILE_NOT_FOUND;
+            LEAVE;
+        }
+
+        if (0 != fseek(file, 0, SEEK_END) || (size = ftell(file)) < 0 || 0 != fseek(file, 0, SEEK_SET)) {
+            LogError("Failed to get the size of the config file %s", ConfigPath);
+            result = PNPBRIDGE_CONFIG_READ_FAILED;
+            LEAVE;
+        }
+
+        if (size > PNPBRIDGE_CONFIG_SNAPSHOT_MAX_CONFIG_SIZE) {
+            LogError("Config file %s is larger than %d bytes", ConfigPath, PNPBRIDGE_CONFIG_SNAPSHOT_MAX_CONFIG_SIZE);
+            result = PNPBRIDGE_CONFIG_READ_FAILED;
+            LEAVE;
+        }
+
+        contents = malloc((size_t)size + 1);
+        if (NULL == contents) {
+            result = PNPBRIDGE_INSUFFICIENT_MEMORY;
+            LEAVE;
+        }
+
+        if ((size_t)size != fread(contents, 1, (size_t)size, file)) {
+            LogError("Failed to read the config file %s", ConfigPath);
+            result = PNPBRIDGE_CONFIG_READ_FAILED;
+            LEAVE;
+        }
+        contents[size] = '\0';
+
+        *Contents = contents;
+        *Size = (uint32_t)size;
+    } FINALLY {
+        if (NULL != file) {
+            fclose(file);
+        }
+
+        if (PNPBRIDGE_OK != result) {
+            free(contents);
+        }
+    }
+
+    return result;
+}
+
+static bool
+PnpConfigSnapshot_Read(
+    _In_ PPNPBRIDGE_CONFIG_SNAPSHOT_READER Reader,
+    _Out_ void* Buffer,
+    _In_ uint32_t Size
+    )
+{
+    if (Reader->Offset > Reader->Size || Size > Reader->Size - Reader->Offset) {
+        Reader->Offset = UINT32_MAX;
+        return false;
+    }
+
+    memcpy(Buffer, Reader->Data + Reader->Offset, Size);
+    Reader->Offset += Size;
+
+    return true;
+}
+
+// Returns the string at the current offset, which points into the image
+static const char*
+PnpConfigSnapshot_ReadString(
+    _In_ PPNPBRIDGE_CONFIG_SNAPSHOT_READER Reader
+    )
+{
+    uint32_t length = 0;
+    const char* string;
+
+    if (!PnpConfigSnapshot_Read(Reader, &length, sizeof(length)) ||
+        length >= Reader->Size - Reader->Offset ||
+        '\0' != Reader->Data[Reader->Offset + length]) {
+        Reader->Offset = UINT32_MAX;
+        return NULL;
+    }
+
+    string = (const char*)(Reader->Data + Reader->Offset);
+    Reader->Offset += length + 1;
+
+    return string;
+}
+
+static JSON_Value*
+PnpConfigSnapshot_ReadValue(
+    _In_ PPNPBRIDGE_CONFIG_SNAPSHOT_READER Reader,
+    _In_ int Depth
+    )
+{
+    JSON_Value* value = NULL;
+    unsigned char type = 0;
+    uint32_t count = 0;
+
+    if (Depth > PNPBRIDGE_CONFIG_SNAPSHOT_MAX_DEPTH || !PnpConfigSnapshot_Read(Reader, &type, sizeof(type))) {
+        return NULL;
+    }
+
+    switch (type) {
+        case PNPBRIDGE_CONFIG_SNAPSHOT_OBJECT:
+            if (!PnpConfigSnapshot_Read(Reader, &count, sizeof(count))) {
+                break;
+            }
+
+            value = json_value_init_object();
+            for (uint32_t i = 0; NULL != value && i < count; i++) {
+                const char* name = PnpConfigSnapshot_ReadString(Reader);
+                JSON_Value* member = (NULL != name) ? PnpConfigSnapshot_ReadValue(Reader, Depth + 1) : NULL;
+
+                if (NULL == member || JSONSuccess != json_object_set_value(json_value_get_object(value), name, member)) {
+                    json_value_free(member);
+                    json_value_free(value);
+                    value = NULL;
+                }
+            }
+            break;
+
+        case PNPBRIDGE_CONFIG_SNAPSHOT_ARRAY:
+            if (!PnpConfigSnapshot_Read(Reader, &count, sizeof(count))) {
+                break;
+            }
+
+            value = json_value_init_array();
+            for (uint32_t i = 0; NULL != value && i < count; i++) {
+                JSON_Value* element = PnpConfigSnapshot_ReadValue(Reader, Depth + 1);
+
+                if (NULL == element || JSONSuccess != json_array_append_value(json_value_get_array(value), element)) {
+                    json_value_free(element);
+                    json_value_free(value);
+                    value = NULL;
+                }
+            }
+            break;
+
+        case PNPBRIDGE_CONFIG_SNAPSHOT_STRING:
+        {
+            const char* string = PnpConfigSnapshot_ReadString(Reader);
+            if (NULL != string) {
+                value = json_value_init_string(string);
+            }
+            break;
+        }
+
+        case PNPBRIDGE_CONFIG_SNAPSHOT_NUMBER:
+        {
+            double number = 0;
+            if (PnpConfigSnapshot_Read(Reader, &number, sizeof(number))) {
+                value = json_value_init_number(number);
+            }
+            break;
+        }
+
+        case PNPBRIDGE_CONFIG_SNAPSHOT_TRUE:
+        case PNPBRIDGE_CONFIG_SNAPSHOT_FALSE:
+            value = json_value_init_boolean(PNPBRIDGE_CONFIG_SNAPSHOT_TRUE == type);
+            break;
+
+        case PNPBRIDGE_CONFIG_SNAPSHOT_NULL:
+            value = json_value_init_null();
+            break;
+
+        default:
+            break;
+    }
+
+    return value;
+}
+
+static void
+PnpConfigSnapshot_Write(
+    _In_ PPNPBRIDGE_CONFIG_SNAPSHOT_WRITER Writer,
+    _In_ const void* Buffer,
+    _In_ size_t Size
+    )
+{
+    if (Writer->Failed) {
+        return;
+    }
+
+    if (Writer->Capacity - Writer->Size < Size) {
+        size_t capacity = (0 == Writer->Capacity) ? 4096 : Writer->Capacity;
+        unsigned char* data;
+
+        while (capacity - Writer->Size < Size) {
+            capacity *= 2;
+        }
+
+        data = realloc(Writer->Data, capacity);
+        if (NULL == data) {
+            Writer->Failed = true;
+            return;
+        }
+
+        Writer->Data = data;
+        Writer->Capacity = capacity;
+    }
+
+    memcpy(Writer->Data + Writer->Size, Buffer, Size);
+    Writer->Size += Size;
+}
+
+static void
+PnpConfigSnapshot_WriteString(
+    _In_ PPNPBRIDGE_CONFIG_SNAPSHOT_WRITER Writer,
+    _In_ const char* String
+    )
+{
+    uint32_t length = (uint32_t)strlen(String);
+
+    PnpConfigSnapshot_Write(Writer, &length, sizeof(length));
+    PnpConfigSnapshot_Write(Writer, String, (size_t)length + 1);
+}
+
+static void
+PnpConfigSnapshot_WriteValue(
+    _In_ PPNPBRIDGE_CONFIG_SNAPSHOT_WRITER Writer,
+    _In_ const JSON_Value* Value
+    )
+{
+    unsigned char type;
+
+    switch (json_value_get_type(Value)) {
+        case JSONObject:
+        {
+            JSON_Object* object = json_value_get_object(Value);
+            uint32_t count = (uint32_t)json_object_get_count(object);
+
+            type = PNPBRIDGE_CONFIG_SNAPSHOT_OBJECT;
+            PnpConfigSnapshot_Write(Writer, &type, sizeof(type));
+            PnpConfigSnapshot_Write(Writer, &count, sizeof(count));
+            for (uint32_t i = 0; i < count; i++) {
+                PnpConfigSnapshot_WriteString(Writer, json_object_get_name(object, i));
+                PnpConfigSnapshot_WriteValue(Writer, json_object_get_value_at(object, i));
+            }
+            break;
+        }
+
+        case JSONArray:
+        {
+            JSON_Array* array = json_value_get_array(Value);
+            uint32_t count = (uint32_t)json_array_get_count(array);
+
+            type = PNPBRIDGE_CONFIG_SNAPSHOT_ARRAY;
+            PnpConfigSnapshot_Write(Writer, &type, sizeof(type));
+            PnpConfigSnapshot_Write(Writer, &count, sizeof(count));
+            for (uint32_t i = 0; i < count; i++) {
+                PnpConfigSnapshot_WriteValue(Writer, json_array_get_value(array, i));
+            }
+            break;
+        }
+
+        case JSONString:
+            type = PNPBRIDGE_CONFIG_SNAPSHOT_STRING;
+            PnpConfigSnapshot_Write(Writer, &type, sizeof(type));
+            PnpConfigSnapshot_WriteString(Writer, json_value_get_string(Value));
+            break;
+
+        case JSONNumber:
+        {
+            double number = json_value_get_number(Value);
+
+            type = PNPBRIDGE_CONFIG_SNAPSHOT_NUMBER;
+            PnpConfigSnapshot_Write(Writer, &type, sizeof(type));
+            PnpConfigSnapshot_Write(Writer, &number, sizeof(number));
+            break;
+        }
+
+        case JSONBoolean:
+            type = json_value_get_boolean(Value) ? PNPBRIDGE_CONFIG_SNAPSHOT_TRUE : PNPBRIDGE_CONFIG_SNAPSHOT_FALSE;
+            PnpConfigSnapshot_Write(Writer, &type, sizeof(type));
+            break;
+
+        default:
+            type = PNPBRIDGE_CONFIG_SNAPSHOT_NULL;
+            PnpConfigSnapshot_Write(Writer, &type, sizeof(type));
+            break;
+    }
+}
+
+// Rebuilds the config tree from the snapshot if it was compiled from a config
+// file of this size and hash
+static PNPBRIDGE_RESULT
+PnpConfigSnapshot_Load(
+    _In_ const unsigned char* Snapshot,
+    _In_ size_t SnapshotSize,
+    _In_ const PNPBRIDGE_CONFIG_SNAPSHOT_KEY* Key,
+    _Out_ JSON_Value** Config
+    )
+{
+    PNPBRIDGE_CONFIG_SNAPSHOT_HEADER header;
+    PNPBRIDGE_CONFIG_SNAPSHOT_READER reader = { 0 };
+
+    *Config = NULL;
+
+    if (SnapshotSize < sizeof(header)) {
+        return PNPBRIDGE_CONFIG_READ_FAILED;
+    }
+
+    memcpy(&header, Snapshot, sizeof(header));
+    if (PNPBRIDGE_CONFIG_SNAPSHOT_MAGIC != header.Magic ||
+        PNPBRIDGE_CONFIG_SNAPSHOT_VERSION != header.Version ||
+        header.ImageSize != SnapshotSize - sizeof(header)) {
+        LogError("Config snapshot is not valid");
+        return PNPBRIDGE_CONFIG_READ_FAILED;
+    }
+
+    if (Key->Size != header.ConfigSize || Key->Hash != header.ConfigHash) {
+        LogInfo("Config file has changed since its snapshot was compiled");
+        return PNPBRIDGE_CONFIG_READ_FAILED;
+    }
+
+    reader.Data = Snapshot + sizeof(header);
+    reader.Size = header.ImageSize;
+
+    *Config = PnpConfigSnapshot_ReadValue(&reader, 0);
+    if (NULL == *Config || reader.Offset != reader.Size || JSONObject != json_value_get_type(*Config)) {
+        LogError("Config snapshot is corrupt");
+        json_value_free(*Config);
+        *Config = NULL;
+        return PNPBRIDGE_CONFIG_READ_FAILED;
+    }
+
+    return PNPBRIDGE_OK;
+}
+
+#ifdef WIN32
+static PNPBRIDGE_RESULT
+PnpConfigSnapshot_MapAndLoad(
+    _In_ const char* SnapshotPath,
+    _In_ const PNPBRIDGE_CONFIG_SNAPSHOT_KEY* Key,
+    _Out_ JSON_Value** Config
+    )
+{
+    PNPBRIDGE_RESULT result = PNPBRIDGE_FILE_NOT_FOUND;
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = NULL;
+    const unsigned char* view = NULL;
+    LARGE_INTEGER size;
+
+    *Config = NULL;
+
+    TRY {
+        file = CreateFileA(SnapshotPath, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (INVALID_HANDLE_VALUE == file) {
+            LEAVE;
+        }
+
+        if (!GetFileSizeEx(file, &size) || 0 == size.QuadPart || size.QuadPart > UINT32_MAX) {
+            result = PNPBRIDGE_CONFIG_READ_FAILED;
+            LEAVE;
+        }
+
+        mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (NULL == mapping) {
+            result = PNPBRIDGE_CONFIG_READ_FAILED;
+            LEAVE;
+        }
+
+        view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+        if (NULL == view) {
+            result = PNPBRIDGE_CONFIG_READ_FAILED;
+            LEAVE;
+        }
+
+        result = PnpConfigSnapshot_Load(view, (size_t)size.QuadPart, Key, Config);
+    } FINALLY {
+        if (NULL != view) {
+            UnmapViewOfFile(view);
+        }
+
+        if (NULL != mapping) {
+            CloseHandle(mapping);
+        }
+
+        if (INVALID_HANDLE_VALUE != file) {
+            CloseHandle(file);
+        }
+    }
+
+    return result;
+}
+#else
+static PNPBRIDGE_RESULT
+PnpConfigSnapshot_MapAndLoad(
+    _In_ const char* SnapshotPath,
+    _In_ const PNPBRIDGE_CONFIG_SNAPSHOT_KEY* Key,
+    _Out_ JSON_Value** Config
+    )
+{
+    PNPBRIDGE_RESULT result = PNPBRIDGE_FILE_NOT_FOUND;
+    int file = -1;
+    void* view = MAP_FAILED;
+    struct stat info;
+
+    *Config = NULL;
+
+    TRY {
+        file = open(SnapshotPath, O_RDONLY);
+        if (file < 0) {
+            LEAVE;
+        }
+
+        if (0 != fstat(file, &info) || 0 == info.st_size || info.st_size > UINT32_MAX) {
+            result = PNPBRIDGE_CONFIG_READ_FAILED;
+            LEAVE;
+        }
+
+        view = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+        if (MAP_FAILED == view) {
+            LogError("Failed to map the config snapshot %s: %d", SnapshotPath, errno);
+            result = PNPBRIDGE_CONFIG_READ_FAILED;
+            LEAVE;
+        }
+
+        result = PnpConfigSnapshot_Load(view, (size_t)info.st_size, Key, Config);
+    } FINALLY {
+        if (MAP_FAILED != view) {
+            munmap(view, (size_t)info.st_size);
+        }
+
+        if (file >= 0) {
+            close(file);
+        }
+    }
+
+    return result;
+}
+#endif
+
+PNPBRIDGE_RESULT
+PnpBridgeConfig_GetJsonValueFromSnapshot(
+    _In_ const char* ConfigPath,
+    _Out_ JSON_Value** Config,
+    _Out_ PPNPBRIDGE_CONFIG_SNAPSHOT_KEY Key,
+    _Out_ bool* FromSnapshot
+    )
+{
+    PNPBRIDGE_RESULT result = PNPBRIDGE_OK;
+    char* contents = NULL;
+    char* snapshotPath = NULL;
+
+    if (NULL == ConfigPath || NULL == Config || NULL == Key || NULL == FromSnapshot) {
+        return PNPBRIDGE_INVALID_ARGS;
+    }
+
+    *Config = NULL;
+    *FromSnapshot = false;
+
+    TRY {
+        // The config file is read to check that the snapshot is current. This
+        // is much cheaper than parsing it.
+        result = PnpConfigSnapshot_ReadConfigFile(ConfigPath, &contents, &Key->Size);
+        if (PNPBRIDGE_OK != result) {
+            LEAVE;
+        }
+
+        Key->Hash = PnpConfigSnapshot_Hash((const unsigned char*)contents, Key->Size);
+
+        snapshotPath = PnpConfigSnapshot_GetPath(ConfigPath, "");
+        if (NULL == snapshotPath) {
+            result = PNPBRIDGE_INSUFFICIENT_MEMORY;
+            LEAVE;
+        }
+
+        if (PNPBRIDGE_OK == PnpConfigSnapshot_MapAndLoad(snapshotPath, Key, Config)) {
+            LogInfo("Loaded the config from its snapshot %s", snapshotPath);
+            *FromSnapshot = true;
+            LEAVE;
+        }
+
+        // Parse the contents that were hashed so that the snapshot compiled
+        // from them has the right key even if the file changes meanwhile
+        *Config = json_parse_string(contents);
+        if (NULL == *Config) {
+            LogError("Failed to parse the config file. Please validate the JSON file in a JSON vailidator");
+            result = PNPBRIDGE_CONFIG_READ_FAILED;
+            LEAVE;
+        }
+    } FINALLY {
+        free(contents);
+        free(snapshotPath);
+    }
+
+    return result;
+}
+
+PNPBRIDGE_RESULT
+PnpBridgeConfig_SaveSnapshot(
+    _In_ const char* ConfigPath,
+    _In_ const PNPBRIDGE_CONFIG_SNAPSHOT_KEY* Key,
+    _In_ JSON_Value* Config
+    )
+{
+    PNPBRIDGE_RESULT result = PNPBRIDGE_OK;
+    PNPBRIDGE_CONFIG_SNAPSHOT_WRITER writer = { 0 };
+    PNPBRIDGE_CONFIG_SNAPSHOT_HEADER header = { 0 };
+    char* snapshotPath = NULL;
+    char* tempPath = NULL;
+    FILE* file = NULL;
+
+    TRY {
+        snapshotPath = PnpConfigSnapshot_GetPath(ConfigPath, "");
+        tempPath = PnpConfigSnapshot_GetPath(ConfigPath, PNPBRIDGE_CONFIG_SNAPSHOT_TEMP_SUFFIX);
+        if (NULL == snapshotPath || NULL == tempPath) {
+            result = PNPBRIDGE_INSUFFICIENT_MEMORY;
+            LEAVE;
+        }
+
+        PnpConfigSnapshot_Write(&writer, &header, sizeof(header));
+        PnpConfigSnapshot_WriteValue(&writer, Config);
+        if (writer.Failed || writer.Size > UINT32_MAX) {
+            result = PNPBRIDGE_INSUFFICIENT_MEMORY;
+            LEAVE;
+        }
+
+        header.Magic = PNPBRIDGE_CONFIG_SNAPSHOT_MAGIC;
+        header.Version = PNPBRIDGE_CONFIG_SNAPSHOT_VERSION;
+        header.ConfigSize = Key->Size;
+        header.ConfigHash = Key->Hash;
+        header.ImageSize = (uint32_t)(writer.Size - sizeof(header));
+        memcpy(writer.Data, &header, sizeof(header));
+
+        // Write a temporary file and move it over the snapshot so that a
+        // partly written snapshot is never loaded
+        file = fopen(tempPath, "wb");
+        if (NULL == file) {
+            LogError("Failed to create the config snapshot %s", tempPath);
+            result = PNPBRIDGE_FILE_NOT_FOUND;
+            LEAVE;
+        }
+
+        if (writer.Size != fwrite(writer.Data, 1, writer.Size, file) || 0 != fflush(file)) {
+            LogError("Failed to write the config snapshot %s", tempPath);
+            result = PNPBRIDGE_FAILED;
+            LEAVE;
+        }
+
+        fclose(file);
+        file = NULL;
+
+#ifdef WIN32
+        if (!MoveFileExA(tempPath, snapshotPath, MOVEFILE_REPLACE_EXISTING)) {
+#else
+        if (0 != rename(tempPath, snapshotPath)) {
+#endif
+            LogError("Failed to replace the config snapshot %s", snapshotPath);
+            result = PNPBRIDGE_FAILED;
+            LEAVE;
+        }
+
+        LogInfo("Compiled the config into the snapshot %s (%u bytes)", snapshotPath, (unsigned int)writer.Size);
+    } FINALLY {
+        if (NULL != file) {
+            fclose(file);
+        }
+
+        if (PNPBRIDGE_OK != result && NULL != tempPath) {
+            remove(tempPath);
+        }
+
+        free(writer.Data);
+        free(snapshotPath);
+        free(tempPath);
+    }
+
+    return result;
+}
@@ -10,19 +10,13 @@ extern const int DiscoveryAdapterCount;
 
 void DiscoveryAdapterChangeHandler(PNPMESSAGE DeviceChangePayload);
 
-PNPBRIDGE_RESULT DiscoveryAdapterManager_ValidateDiscoveryAdapter(PDISCOVERY_ADAPTER  discAdapter, MAP_HANDLE discAdapterMap) {
-    bool containsKey = false;
+PNPBRIDGE_RESULT DiscoveryAdapterManager_ValidateDiscoveryAdapter(PDISCOVERY_ADAPTER  discAdapter, PPNPBRIDGE_IDENTITY_TABLE discAdapterTable) {
     if (NULL == discAdapter->Identity) {
         LogError("DiscoveryAdapter's Identity field is not initialized");
         return PNPBRIDGE_INVALID_ARGS;
     }
 
-    if (MAP_OK != Map_ContainsKey(discAdapterMap, discAdapter->Identity, &containsKey)) {
-        LogError("Map_ContainsKey failed");
-        return PNPBRIDGE_FAILED;
-    }
-
-    if (containsKey) {
+    if (PnpIdentityTable_Find(discAdapterTable, discAdapter->Identity) >= 0) {
         LogError("Found duplicate discovery adapter identity %s", discAdapter->Identity);
         return PNPBRIDGE_DUPLICATE_ENTRY;
     }
@@ -43,15 +37,24 @@ PNPBRIDGE_RESULT DiscoveryAdapterManager_Create(PDISCOVERY_MANAGER* discoveryMan
         return PNPBRIDGE_INVALID_ARGS;
     }
 
-    discoveryMgr = malloc(sizeof(DISCOVERY_MANAGER));
+    discoveryMgr = calloc(1, sizeof(DISCOVERY_MANAGER));
     if (NULL == discoveryMgr) {
         LogError("Failed to allocate memory for discoveryManager");
         return PNPBRIDGE_INSUFFICIENT_MEMORY;
     }
 
-    discoveryMgr->DiscoveryAdapterMap = Map_Create(NULL);
-    if (NULL == discoveryMgr->DiscoveryAdapterMap) {
-        return PNPBRIDGE_FAILED;
+    if (PNPBRIDGE_OK != PnpIdentityTable_Create(&discoveryMgr->DiscoveryAdapterTable, DiscoveryAdapterCount)) {
+        LogError("Failed to allocate the discovery adapter table");
+        free(discoveryMgr);
+        return PNPBRIDGE_INSUFFICIENT_MEMORY;
+    }
+
+    discoveryMgr->RestartPending = calloc(DiscoveryAdapterCount > 0 ? DiscoveryAdapterCount : 1, sizeof(bool));
+    if (NULL == discoveryMgr->RestartPending) {
+        LogError("Failed to allocate the discovery adapter restart flags");
+        PnpIdentityTable_Destroy(&discoveryMgr->DiscoveryAdapterTable);
+        free(discoveryMgr);
+        return PNPBRIDGE_INSUFFICIENT_MEMORY;
     }
 
     *discoveryManager = discoveryMgr;
@@ -75,9 +78,12 @@ DiscoveryManager_StartDiscoveryAdapter(
     PNPMEMORY deviceParamsMemory = NULL;
     char** deviceParams = NULL;
 
+    // Adapters that read the parsed parameters get them without a json round trip
+    bool serialize = (0 == (discoveryInterface->Flags & DISCOVERY_ADAPTER_FLAG_PARSED_PARAMETERS));
+
     TRY {
         result = DiscoveryAdapterManager_ValidateDiscoveryAdapter(discoveryInterface, 
-                    discoveryManager->DiscoveryAdapterMap);
+                    &discoveryManager->DiscoveryAdapterTable);
         if (PNPBRIDGE_OK != result) {
             LogError("Parson failed to serialize adapterParams");
             LEAVE;
@@ -85,7 +91,7 @@ DiscoveryManager_StartDiscoveryAdapter(
 
         // Serialize device discovery adapter parameters 
         if (NULL != DeviceAdapterParamsList && DeviceAdapterParamsCount > 0) {
-            deviceParams = malloc(sizeof(char*) * DeviceAdapterParamsCount);
+            deviceParams = calloc(DeviceAdapterParamsCount, sizeof(char*));
             if (NULL == deviceParams) {
                 LogError("Failed to allocate memory for deviceParams");
                 result = PNPBRIDGE_INSUFFICIENT_MEMORY;
@@ -96,31 +102,48 @@ DiscoveryManager_StartDiscoveryAdapter(
             int x = 0;
             int stringSize = 0;
             while (NULL != handle) {
-                JSON_Object* deviceAdpaterParam = (JSON_Object*)singlylinkedlist_item_get_value(handle);
-                deviceParams[x] = json_serialize_to_string(json_object_get_wrapping_value(deviceAdpaterParam));
-                if (NULL == deviceParams[x]) {
-                    LogError("Failed to serialize deviceAdpaterParam");
-                    result = PNPBRIDGE_INSUFFICIENT_MEMORY;
-                    LEAVE;
+                if (serialize) {
+                    JSON_Object* deviceAdpaterParam = (JSON_Object*)singlylinkedlist_item_get_value(handle);
+                    deviceParams[x] = json_serialize_to_string(json_object_get_wrapping_value(deviceAdpaterParam));
+                    if (NULL == deviceParams[x]) {
+                        LogError("Failed to serialize deviceAdpaterParam");
+                        result = PNPBRIDGE_INSUFFICIENT_MEMORY;
+                        LEAVE;
+                    }
+
+                    stringSize += (int)strlen(deviceParams[x]) + 1;
                 }
-                
-                stringSize += (int)strlen(deviceParams[x]) + 1;
 
                 handle = singlylinkedlist_get_next_item(handle);
                 x++;
             }
 
-            // Create PNPMEMORY for the deviceParamString
+            // Create PNPMEMORY for the parsed parameters followed by the serialized ones
             PDEVICE_ADAPTER_PARMAETERS deviceAdapterParams;
-            PnpMemory_Create(PNPMEMORY_NO_OBJECT_PARAMS, sizeof(DEVICE_ADAPTER_PARMAETERS) + sizeof(char*) * x +  sizeof(char) *  stringSize, &deviceParamsMemory);\
+            if (0 != PnpMemory_Create(PNPMEMORY_NO_OBJECT_PARAMS, sizeof(DEVICE_ADAPTER_PARMAETERS) + sizeof(char*) * x +
+                                      sizeof(JSON_Object*) * x + sizeof(char) * stringSize, &deviceParamsMemory)) {
+                LogError("Failed to allocate the device adapter parameters");
+                result = PNPBRIDGE_INSUFFICIENT_MEMORY;
+                LEAVE;
+            }
 
             deviceAdapterParams = (PDEVICE_ADAPTER_PARMAETERS) PnpMemory_GetBuffer(deviceParamsMemory, NULL);
 
             deviceAdapterParams->Count = x;
+            deviceAdapterParams->Parameters = (const JSON_Object**)(&deviceAdapterParams->AdapterParameters + x);
 
             // Copy serialized device adapter parameters to PNPMEMORY
-            char* offset = (char*)(&deviceAdapterParams->AdapterParameters + x);
+            char* offset = (char*)(deviceAdapterParams->Parameters + x);
+            handle = singlylinkedlist_get_head_item(DeviceAdapterParamsList);
             for (int i = 0; i < DeviceAdapterParamsCount; i++) {
+                deviceAdapterParams->Parameters[i] = (const JSON_Object*)singlylinkedlist_item_get_value(handle);
+                handle = singlylinkedlist_get_next_item(handle);
+
+                if (!serialize) {
+                    deviceAdapterParams->AdapterParameters[i] = NULL;
+                    continue;
+                }
+
                 deviceAdapterParams->AdapterParameters[i] = offset;
                 int size = (int) strlen(deviceParams[i]) + 1;
                 strcpy_s(deviceAdapterParams->AdapterParameters[i], size, deviceParams[i]);
@@ -129,7 +152,17 @@ DiscoveryManager_StartDiscoveryAdapter(
             }
         }
 
-        if (adapterParams) {
+        if (adapterParams && !serialize) {
+            // Pass the parsed adapter parameters
+            if (0 != PnpMemory_Create(PNPMEMORY_NO_OBJECT_PARAMS, sizeof(JSON_Object*), &adapterParamsMemory)) {
+                LogError("Failed to allocate the adapter parameters");
+                result = PNPBRIDGE_INSUFFICIENT_MEMORY;
+                LEAVE;
+            }
+
+            *(const JSON_Object**)PnpMemory_GetBuffer(adapterParamsMemory, NULL) = adapterParams;
+        }
+        else if (adapterParams) {
             // Serialize the adapter parameters
             adapterParamString = json_serialize_to_string(json_object_get_wrapping_value(adapterParams));
             if (NULL == adapterParamString) {
@@ -140,7 +173,12 @@ DiscoveryManager_StartDiscoveryAdapter(
 
             // Create PNPMEMORY for the adapterParamString
             int length = (int)(strlen(adapterParamString) + 1);
-            PnpMemory_Create(PNPMEMORY_NO_OBJECT_PARAMS, sizeof(char) *  length, &adapterParamsMemory);
+            if (0 != PnpMemory_Create(PNPMEMORY_NO_OBJECT_PARAMS, sizeof(char) *  length, &adapterParamsMemory)) {
+                LogError("Failed to allocate the adapter parameters");
+                result = PNPBRIDGE_INSUFFICIENT_MEMORY;
+                LEAVE;
+            }
+
             strcpy_s(PnpMemory_GetBuffer(adapterParamsMemory, NULL), length, adapterParamString);
         }
 
@@ -152,7 +190,7 @@ DiscoveryManager_StartDiscoveryAdapter(
             LEAVE;
         }
 
-        Map_Add_Index(discoveryManager->DiscoveryAdapterMap, discoveryInterface->Identity, key);
+        PnpIdentityTable_Add(&discoveryManager->DiscoveryAdapterTable, discoveryInterface->Identity, key);
 
     } FINALLY{
         if (adapterParamString) {
@@ -169,7 +207,9 @@ DiscoveryManager_StartDiscoveryAdapter(
 
         if (deviceParams) {
             for (int i = 0; i < DeviceAdapterParamsCount; i++) {
-                json_free_serialized_string(deviceParams[i]);
+                if (NULL != deviceParams[i]) {
+                    json_free_serialized_string(deviceParams[i]);
+                }
             }
             free(deviceParams);
         }
@@ -178,6 +218,38 @@ DiscoveryManager_StartDiscoveryAdapter(
     return PNPBRIDGE_OK;
 }
 
+const JSON_Object*
+DiscoveryAdapter_GetDeviceParameters(
+    _In_ PNPMEMORY DeviceArgs,
+    _In_ int Index
+    )
+{
+    PDEVICE_ADAPTER_PARMAETERS deviceParams;
+
+    if (NULL == DeviceArgs) {
+        return NULL;
+    }
+
+    deviceParams = (PDEVICE_ADAPTER_PARMAETERS)PnpMemory_GetBuffer(DeviceArgs, NULL);
+    if (Index < 0 || Index >= deviceParams->Count) {
+        return NULL;
+    }
+
+    return deviceParams->Parameters[Index];
+}
+
+const JSON_Object*
+DiscoveryAdapter_GetAdapterParameters(
+    _In_ PNPMEMORY AdapterArgs
+    )
+{
+    if (NULL == AdapterArgs) {
+        return NULL;
+    }
+
+    return *(const JSON_Object**)PnpMemory_GetBuffer(AdapterArgs, NULL);
+}
+
 //PNPBRIDGE_RESULT DiscoveryAdapterManager_PublishAlwaysInterfaces(PDISCOVERY_MANAGER discoveryManager, JSON_Value* config) {
 //    AZURE_UNREFERENCED_PARAMETER(discoveryManager);
 //    JSON_Array *devices = Configuration_GetConfiguredDevices(config);
@@ -207,50 +279,59 @@ DiscoveryManager_StartDiscoveryAdapter(
 //    return 0;
 //}
 
+// Starts the discovery adapter at Index with its configured devices
+static PNPBRIDGE_RESULT
+DiscoveryAdapterManager_StartAdapter(
+    PDISCOVERY_MANAGER DiscoveryManager,
+    PNPBRIDGE_CONFIGURATION* Config,
+    int Index
+    )
+{
+    PNPBRIDGE_RESULT result = PNPBRIDGE_OK;
+    PDISCOVERY_ADAPTER  discoveryInterface = DISCOVERY_ADAPTER_MANIFEST[Index];
+    SINGLYLINKEDLIST_HANDLE deviceParamsList = NULL;
+    int deviceParamsCount = 0;
+
+    // Create device parameter list
+    deviceParamsList = singlylinkedlist_create();
+    if (NULL == deviceParamsList) {
+        LogError("Failed to allocate the device parameters of discovery adapter %s", discoveryInterface->Identity);
+        return PNPBRIDGE_INSUFFICIENT_MEMORY;
+    }
+
+    for (int j = 0; j < Config->DeviceCount; j++) {
+        PPNPBRIDGE_DEVICE_CONFIG device = &Config->Devices[j];
+
+        // Check if the discovery adapter identity matches
+        if (NULL != device->DiscoveryAdapterIdentity &&
+            0 == strcmp(device->DiscoveryAdapterIdentity, discoveryInterface->Identity)) {
+            // Add it to the device parameter list
+            singlylinkedlist_add(deviceParamsList, json_value_get_object(device->DiscoveryParameters));
+            deviceParamsCount++;
+        }
+    }
+
+    JSON_Object* adapterParams = NULL;
+    adapterParams = Configuration_GetDiscoveryParameters(Config, discoveryInterface->Identity);
+
+    result = DiscoveryManager_StartDiscoveryAdapter(DiscoveryManager, discoveryInterface,
+                    deviceParamsList, deviceParamsCount, adapterParams, Index);
+
+    // The adapter was handed the parameters themselves, not the list
+    singlylinkedlist_destroy(deviceParamsList);
+
+    return result;
+}
+
 PNPBRIDGE_RESULT DiscoveryAdapterManager_Start(PDISCOVERY_MANAGER DiscoveryManager, PNPBRIDGE_CONFIGURATION * Config)
 {
     PNPBRIDGE_RESULT result = PNPBRIDGE_OK;
-    JSON_Array *devices = NULL;
-   
    
     TRY {
-        devices = Configuration_GetConfiguredDevices(Config->JsonConfig);
-        
         // For each discovery adapter, get the adapter parameters and device then
         // invoke the StartDiscovery
         for (int i = 0; i < DiscoveryAdapterCount; i++) {
-            PDISCOVERY_ADAPTER  discoveryInterface = DISCOVERY_ADAPTER_MANIFEST[i];
-            SINGLYLINKEDLIST_HANDLE deviceParamsList = NULL;
-            int deviceParamsCount = 0;
-
-            // Create device parameter list
-            deviceParamsList = singlylinkedlist_create();
-            if (NULL == deviceParamsList) {
-                // Report error
-            }
-
-            for (int j = 0; j < (int)json_array_get_count(devices); j++) {
-                JSON_Object *device = json_array_get_object(devices, j);
-
-                // Check if the discovery adapter identity matches
-                JSON_Object* params = Configuration_GetDiscoveryParametersForDevice(device);
-                if (NULL != params) {
-                    const char* discoveryIdentity = json_object_get_string(params, PNP_CONFIG_IDENTITY);
-                    if (NULL != discoveryIdentity) {
-                        if (0 == strcmp(discoveryIdentity, discoveryInterface->Identity)) {
-                            // Add it to the device parameter list
-                            singlylinkedlist_add(deviceParamsList, params);
-                            deviceParamsCount++;
-                        }
-                    }
-                }
-            }
-
-            JSON_Object* adapterParams = NULL;
-            adapterParams = Configuration_GetDiscoveryParameters(Config->JsonConfig, discoveryInterface->Identity);
-
-            result = DiscoveryManager_StartDiscoveryAdapter(DiscoveryManager, discoveryInterface, 
-                            deviceParamsList, deviceParamsCount, adapterParams, i);
+            result = DiscoveryAdapterManager_StartAdapter(DiscoveryManager, Config, i);
             if (PNPBRIDGE_OK != result) {
                 LEAVE;
             }
@@ -261,11 +342,120 @@ PNPBRIDGE_RESULT DiscoveryAdapterManager_Start(PDISCOVERY_MANAGER DiscoveryManag
     return result;
 }
 
-void DiscoveryAdapterManager_Release(PDISCOVERY_MANAGER discoveryManager) {
-    const char* const* keys;
-    const char* const* values;
-    size_t count;
+static bool
+DiscoveryAdapterManager_IsAdapterChanged(
+    const char* Identity,
+    PNPBRIDGE_CONFIGURATION* Old,
+    PNPBRIDGE_CONFIGURATION* New,
+    const int* NewToOld,
+    const bool* OldUnchanged
+    )
+{
+    JSON_Object* oldParams = Configuration_GetDiscoveryParameters(Old, Identity);
+    JSON_Object* newParams = Configuration_GetDiscoveryParameters(New, Identity);
+
+    if (NULL == oldParams || NULL == newParams) {
+        if (oldParams != newParams) {
+            return true;
+        }
+    }
+    else if (1 != json_value_equals(json_object_get_wrapping_value(oldParams), json_object_get_wrapping_value(newParams))) {
+        return true;
+    }
+
+    // An unchanged device has the same discovery adapter in both configs
+    for (int i = 0; i < New->DeviceCount; i++) {
+        if (NewToOld[i] < 0 && NULL != New->Devices[i].DiscoveryAdapterIdentity &&
+            0 == strcmp(New->Devices[i].DiscoveryAdapterIdentity, Identity)) {
+            return true;
+        }
+    }
+
+    for (int i = 0; i < Old->DeviceCount; i++) {
+        if (!OldUnchanged[i] && NULL != Old->Devices[i].DiscoveryAdapterIdentity &&
+            0 == strcmp(Old->Devices[i].DiscoveryAdapterIdentity, Identity)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+int
+DiscoveryAdapterManager_StopChangedAdapters(
+    PDISCOVERY_MANAGER DiscoveryManager,
+    PNPBRIDGE_CONFIGURATION* Old,
+    PNPBRIDGE_CONFIGURATION* New,
+    const int* NewToOld
+    )
+{
+    bool* oldUnchanged = NULL;
+    int changed = 0;
+
+    oldUnchanged = calloc(Old->DeviceCount > 0 ? Old->DeviceCount : 1, sizeof(bool));
+    if (NULL == oldUnchanged) {
+        LogError("Failed to allocate the discovery adapter diff");
+        return -1;
+    }
+
+    for (int i = 0; i < New->DeviceCount; i++) {
+        if (NewToOld[i] >= 0) {
+            oldUnchanged[NewToOld[i]] = true;
+        }
+    }
+
+    for (int i = 0; i < DiscoveryAdapterCount; i++) {
+        PDISCOVERY_ADAPTER adapter = DISCOVERY_ADAPTER_MANIFEST[i];
 
+        DiscoveryManager->RestartPending[i] = DiscoveryAdapterManager_IsAdapterChanged(adapter->Identity, Old, New,
+                                                                                       NewToOld, oldUnchanged);
+        if (!DiscoveryManager->RestartPending[i]) {
+            continue;
+        }
+
+        changed++;
+
+        // An adapter that failed to start is only started again
+        if (PnpIdentityTable_Find(&DiscoveryManager->DiscoveryAdapterTable, adapter->Identity) >= 0) {
+            LogInfo("Stopping discovery adapter %s, its devices or parameters changed", adapter->Identity);
+            adapter->StopDiscovery();
+            PnpIdentityTable_Remove(&DiscoveryManager->DiscoveryAdapterTable, adapter->Identity);
+        }
+    }
+
+    free(oldUnchanged);
+
+    return changed;
+}
+
+PNPBRIDGE_RESULT
+DiscoveryAdapterManager_StartChangedAdapters(
+    PDISCOVERY_MANAGER DiscoveryManager,
+    PNPBRIDGE_CONFIGURATION* Config
+    )
+{
+    PNPBRIDGE_RESULT result = PNPBRIDGE_OK;
+
+    for (int i = 0; i < DiscoveryAdapterCount; i++) {
+        if (!DiscoveryManager->RestartPending[i]) {
+            continue;
+        }
+
+        DiscoveryManager->RestartPending[i] = false;
+
+        LogInfo("Starting discovery adapter %s with the reloaded config", DISCOVERY_ADAPTER_MANIFEST[i]->Identity);
+
+        // The other adapters are started even if one of them fails
+        if (PNPBRIDGE_OK != DiscoveryAdapterManager_StartAdapter(DiscoveryManager, Config, i)) {
+            LogError("Failed to restart discovery adapter %s", DISCOVERY_ADAPTER_MANIFEST[i]->Identity);
+            result = PNPBRIDGE_FAILED;
+        }
+    }
+
+    return result;
+}
+
+void DiscoveryAdapterManager_Release(PDISCOVERY_MANAGER discoveryManager) {
     // Wait for all start discovery threads to join
    /* LIST_ITEM_HANDLE interfaceItem = singlylinkedlist_get_head_item(discoveryManager->startDiscoveryThreadHandles);
     while (interfaceItem != NULL) {
@@ -276,22 +466,15 @@ void DiscoveryAdapterManager_Release(PDISCOVERY_MANAGER discoveryManager) {
     }
     singlylinkedlist_destroy(discoveryManager->startDiscoveryThreadHandles);*/
 
-    // Call shutdown on all interfaces
-    if (Map_GetInternals(discoveryManager->DiscoveryAdapterMap, &keys, &values, &count) != MAP_OK)
-    {
-        LogError("Map_GetInternals failed to get all pnp adapters");
-    }
-    else
-    {
-        for (int i = 0; i < (int)count; i++)
-        {
-            int index = atoi(values[i]);
-            PDISCOVERY_ADAPTER  adapter = DISCOVERY_ADAPTER_MANIFEST[index];
-            adapter->StopDiscovery();
-        }
+    // Call shutdown on all started adapters
+    for (int i = 0; i < discoveryManager->DiscoveryAdapterTable.Count; i++) {
+        int index = discoveryManager->DiscoveryAdapterTable.Entries[i].Index;
+        PDISCOVERY_ADAPTER  adapter = DISCOVERY_ADAPTER_MANIFEST[index];
+        adapter->StopDiscovery();
     }
 
-    Map_Destroy(discoveryManager->DiscoveryAdapterMap);
+    PnpIdentityTable_Destroy(&discoveryManager->DiscoveryAdapterTable);
+    free(discoveryManager->RestartPending);
     free(discoveryManager);
 }
 
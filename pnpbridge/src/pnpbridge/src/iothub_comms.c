@@ -35,11 +35,44 @@ typedef enum APP_DPS_REGISTRATION_STATUS_TAG
     APP_DPS_REGISTRATION_FAILED
 } APP_DPS_REGISTRATION_STATUS;
 
-// Amount to sleep between querying state from DPS registration loop
-static const int pnpSampleDevice_dpsRegistrationPollSleep = 1000;
+// DPS registration is signaled by provisioningRegisterCallback through the
+// condition, which the caller waits on until the deadline
+typedef struct APP_DPS_REGISTRATION_CONTEXT_TAG
+{
+    LOCK_HANDLE Lock;
+    COND_HANDLE Condition;
+    APP_DPS_REGISTRATION_STATUS Status;
+} APP_DPS_REGISTRATION_CONTEXT;
+
+// Time DPS has to assign the device to a hub
+#define IOTCOMMS_DPS_REGISTRATION_TIMEOUT_MS 60000
+#endif // ENABLE_IOT_CENTRAL
 
-// Maximum amount of times we'll poll for DPS registration being ready.
-static const int pnpSampleDevice_dpsRegistrationMaxPolls = 60;
+// Time the hub has to acknowledge an interface registration
+#define IOTCOMMS_INTERFACE_REGISTRATION_TIMEOUT_MS 60000
+
+// Waits on Condition, with Lock held, until it is posted or Deadline passes.
+// Returns false once the deadline has passed.
+static bool
+IotComms_WaitUntil(
+    COND_HANDLE Condition,
+    LOCK_HANDLE Lock,
+    TICK_COUNTER_HANDLE TickCounter,
+    tickcounter_ms_t Deadline
+    )
+{
+    tickcounter_ms_t now = 0;
+
+    if (0 != tickcounter_get_current_ms(TickCounter, &now) || now >= Deadline) {
+        return false;
+    }
+
+    (void)Condition_Wait(Condition, Lock, (int)(Deadline - now));
+
+    return true;
+}
+
+#ifdef ENABLE_IOT_CENTRAL
 
 static const char* pnpSample_CustomProvisioningData = "{ \
                                                           \"__iot:interfaces\": \
@@ -53,9 +86,170 @@ static const char* pnpSample_CustomProvisioningData = "{ \
 char* pnpSample_provisioning_IoTHubUri;
 char* pnpSample_provisioning_DeviceId;
 
+// Fields of the DPS assignment cache
+#define IOTCOMMS_ASSIGNMENT_GLOBAL_PROV_URI "global_prov_uri"
+#define IOTCOMMS_ASSIGNMENT_ID_SCOPE "id_scope"
+#define IOTCOMMS_ASSIGNMENT_REGISTRATION_ID "registration_id"
+#define IOTCOMMS_ASSIGNMENT_IOTHUB_URI "iothub_uri"
+#define IOTCOMMS_ASSIGNMENT_DEVICE_ID "device_id"
+
+#define IOTCOMMS_ASSIGNMENT_TEMP_SUFFIX ".tmp"
+
+// Forgets the hub DPS assigned the device to, and deletes it from the cache
+static void IotComms_ForgetAssignment(PCONNECTION_PARAMETERS ConnectionParams)
+{
+    free(pnpSample_provisioning_IoTHubUri);
+    free(pnpSample_provisioning_DeviceId);
+    pnpSample_provisioning_IoTHubUri = NULL;
+    pnpSample_provisioning_DeviceId = NULL;
+
+    if (NULL != ConnectionParams->u1.Dps.AssignmentCachePath) {
+        remove(ConnectionParams->u1.Dps.AssignmentCachePath);
+    }
+}
+
+// Reads the hub assignment from the cache. An assignment that was made for
+// another DPS instance, scope or registration id is ignored.
+static bool IotComms_ReadAssignmentCache(PCONNECTION_PARAMETERS ConnectionParams)
+{
+    const DPS_PARAMETERS* dpsParams = &ConnectionParams->u1.Dps;
+    JSON_Value* cache = NULL;
+    bool found = false;
+
+    TRY {
+        // There is no cache until DPS has been contacted once
+        cache = json_parse_file(dpsParams->AssignmentCachePath);
+        if (NULL == cache) {
+            LEAVE;
+        }
+
+        JSON_Object* cacheObj = json_value_get_object(cache);
+        const char* globalProvUri = json_object_get_string(cacheObj, IOTCOMMS_ASSIGNMENT_GLOBAL_PROV_URI);
+        const char* idScope = json_object_get_string(cacheObj, IOTCOMMS_ASSIGNMENT_ID_SCOPE);
+        const char* registrationId = json_object_get_string(cacheObj, IOTCOMMS_ASSIGNMENT_REGISTRATION_ID);
+        const char* iothubUri = json_object_get_string(cacheObj, IOTCOMMS_ASSIGNMENT_IOTHUB_URI);
+        const char* deviceId = json_object_get_string(cacheObj, IOTCOMMS_ASSIGNMENT_DEVICE_ID);
+
+        if (NULL == globalProvUri || NULL == idScope || NULL == registrationId || NULL == iothubUri || NULL == deviceId ||
+            0 != strcmp(globalProvUri, dpsParams->GlobalProvUri) || 0 != strcmp(idScope, dpsParams->IdScope) ||
+            0 != strcmp(registrationId, dpsParams->DeviceId)) {
+            LogInfo("Ignoring the DPS assignment cache %s, it doesn't match the dps_parameters", dpsParams->AssignmentCachePath);
+            LEAVE;
+        }
+
+        free(pnpSample_provisioning_IoTHubUri);
+        free(pnpSample_provisioning_DeviceId);
+        pnpSample_provisioning_IoTHubUri = NULL;
+        pnpSample_provisioning_DeviceId = NULL;
+
+        if ((mallocAndStrcpy_s(&pnpSample_provisioning_IoTHubUri, iothubUri) != 0) ||
+            (mallocAndStrcpy_s(&pnpSample_provisioning_DeviceId, deviceId) != 0)) {
+            LogError("Unable to copy the cached provisioning information");
+            IotComms_ForgetAssignment(ConnectionParams);
+            LEAVE;
+        }
+
+        found = true;
+    } FINALLY {
+        if (NULL != cache) {
+            json_value_free(cache);
+        }
+    }
+
+    return found;
+}
+
+// Saves the hub assignment so that later starts connect to the hub directly
+static void IotComms_WriteAssignmentCache(PCONNECTION_PARAMETERS ConnectionParams)
+{
+    const DPS_PARAMETERS* dpsParams = &ConnectionParams->u1.Dps;
+    JSON_Value* cache = NULL;
+    char* tempPath = NULL;
+    bool tempCreated = false;
+
+    TRY {
+        cache = json_value_init_object();
+        tempPath = malloc(strlen(dpsParams->AssignmentCachePath) + sizeof(IOTCOMMS_ASSIGNMENT_TEMP_SUFFIX));
+        if (NULL == cache || NULL == tempPath) {
+            LogError("Failed to allocate the DPS assignment cache");
+            LEAVE;
+        }
+
+        JSON_Object* cacheObj = json_value_get_object(cache);
+        if (JSONSuccess != json_object_set_string(cacheObj, IOTCOMMS_ASSIGNMENT_GLOBAL_PROV_URI, dpsParams->GlobalProvUri) ||
+            JSONSuccess != json_object_set_string(cacheObj, IOTCOMMS_ASSIGNMENT_ID_SCOPE, dpsParams->IdScope) ||
+            JSONSuccess != json_object_set_string(cacheObj, IOTCOMMS_ASSIGNMENT_REGISTRATION_ID, dpsParams->DeviceId) ||
+            JSONSuccess != json_object_set_string(cacheObj, IOTCOMMS_ASSIGNMENT_IOTHUB_URI, pnpSample_provisioning_IoTHubUri) ||
+            JSONSuccess != json_object_set_string(cacheObj, IOTCOMMS_ASSIGNMENT_DEVICE_ID, pnpSample_provisioning_DeviceId)) {
+            LogError("Failed to build the DPS assignment cache");
+            LEAVE;
+        }
+
+        // Write a temporary file and move it over the cache so that a partly
+        // written cache is never read
+        strcpy(tempPath, dpsParams->AssignmentCachePath);
+        strcat(tempPath, IOTCOMMS_ASSIGNMENT_TEMP_SUFFIX);
+        tempCreated = true;
+        if (JSONSuccess != json_serialize_to_file(cache, tempPath)) {
+            LogError("Failed to write the DPS assignment cache %s", tempPath);
+            LEAVE;
+        }
+
+#ifdef WIN32
+        if (!MoveFileExA(tempPath, dpsParams->AssignmentCachePath, MOVEFILE_REPLACE_EXISTING)) {
+#else
+        if (0 != rename(tempPath, dpsParams->AssignmentCachePath)) {
+#endif
+            LogError("Failed to replace the DPS assignment cache %s", dpsParams->AssignmentCachePath);
+            LEAVE;
+        }
+
+        tempCreated = false;
+        LogInfo("Cached the DPS assignment in %s", dpsParams->AssignmentCachePath);
+    } FINALLY {
+        if (tempCreated) {
+            remove(tempPath);
+        }
+
+        if (NULL != cache) {
+            json_value_free(cache);
+        }
+
+        free(tempPath);
+    }
+}
+
+// The device authenticates with the assigned hub using the credentials it
+// registered with, which are set up here when DPS is skipped
+static bool IotComms_InitializeAssignedDeviceSecurity(PCONNECTION_PARAMETERS ConnectionParams)
+{
+    IOTHUB_SECURITY_TYPE secureDeviceTypeForIotHub;
+
+    if (AUTH_TYPE_SYMMETRIC_KEY == ConnectionParams->AuthParameters.AuthType) {
+        secureDeviceTypeForIotHub = IOTHUB_SECURITY_TYPE_SYMMETRIC_KEY;
+        if (prov_dev_set_symmetric_key_info(ConnectionParams->u1.Dps.DeviceId, ConnectionParams->AuthParameters.u1.DeviceKey) != 0) {
+            LogError("prov_dev_set_symmetric_key_info failed.");
+            return false;
+        }
+    }
+    else {
+        secureDeviceTypeForIotHub = IOTHUB_SECURITY_TYPE_X509;
+    }
+
+    if (iothub_security_init(secureDeviceTypeForIotHub) != 0) {
+        LogError("iothub_security_init failed");
+        return false;
+    }
+
+    return true;
+}
+
 static void provisioningRegisterCallback(PROV_DEVICE_RESULT register_result, const char* iothub_uri, const char* device_id, void* user_context)
 {
-    APP_DPS_REGISTRATION_STATUS* appDpsRegistrationStatus = (APP_DPS_REGISTRATION_STATUS*)user_context;
+    APP_DPS_REGISTRATION_CONTEXT* dpsContext = (APP_DPS_REGISTRATION_CONTEXT*)user_context;
+    APP_DPS_REGISTRATION_STATUS* appDpsRegistrationStatus = &dpsContext->Status;
+
+    Lock(dpsContext->Lock);
 
     if (register_result != PROV_DEVICE_RESULT_OK)
     {
@@ -64,6 +258,11 @@ static void provisioningRegisterCallback(PROV_DEVICE_RESULT register_result, con
     }
     else
     {
+        free(pnpSample_provisioning_IoTHubUri);
+        free(pnpSample_provisioning_DeviceId);
+        pnpSample_provisioning_IoTHubUri = NULL;
+        pnpSample_provisioning_DeviceId = NULL;
+
         if ((mallocAndStrcpy_s(&pnpSample_provisioning_IoTHubUri, iothub_uri) != 0) ||
             (mallocAndStrcpy_s(&pnpSample_provisioning_DeviceId, device_id) != 0))
         {
@@ -76,15 +275,49 @@ static void provisioningRegisterCallback(PROV_DEVICE_RESULT register_result, con
             *appDpsRegistrationStatus = APP_DPS_REGISTRATION_SUCCEEDED;
         }
     }
+
+    Condition_Post(dpsContext->Condition);
+    Unlock(dpsContext->Lock);
+}
+
+// Connects to the IoT hub that DPS assigned the device to. The assignment is
+// kept for the lifetime of the bridge, so a device client that has to be
+// recreated doesn't register with DPS again.
+static IOTHUB_DEVICE_HANDLE IotComms_InitializeIotHubFromAssignment(bool TraceOn)
+{
+    IOTHUB_DEVICE_HANDLE deviceHandle = NULL;
+    IOTHUB_CLIENT_RESULT iothubClientResult;
+
+    if ((deviceHandle = IoTHubDeviceClient_CreateFromDeviceAuth(pnpSample_provisioning_IoTHubUri, pnpSample_provisioning_DeviceId, MQTT_Protocol)) == NULL)
+    {
+        LogError("IoTHubDeviceClient_CreateFromDeviceAuth failed");
+    }
+    else if ((iothubClientResult = IoTHubDeviceClient_SetOption(deviceHandle, OPTION_LOG_TRACE, &TraceOn)) != IOTHUB_CLIENT_OK)
+    {
+        LogError("Failed to set option %s, error=%d", OPTION_LOG_TRACE, iothubClientResult);
+        IoTHubDeviceClient_Destroy(deviceHandle);
+        deviceHandle = NULL;
+    }
+    else
+    {
+        // Never log the complete connection string , as this contains information
+        // that could compromise security of the device.
+        LogInfo("***** Successfully created device device=<%s> via provisioning *****", pnpSample_provisioning_DeviceId);
+    }
+
+    return deviceHandle;
 }
 
-IOTHUB_DEVICE_HANDLE IotComms_InitializeIotHubViaProvisioning(bool TraceOn, PCONNECTION_PARAMETERS ConnectionParams)
+IOTHUB_DEVICE_HANDLE IotComms_InitializeIotHubViaProvisioning(MX_IOT_HANDLE_TAG* IotHandle, bool TraceOn, PCONNECTION_PARAMETERS ConnectionParams)
 {
     PROV_DEVICE_RESULT provDeviceResult;
     PROV_DEVICE_HANDLE provDeviceHandle = NULL;
     IOTHUB_DEVICE_HANDLE deviceHandle = NULL;
     char* customProvisioningData = NULL;
     APP_DPS_REGISTRATION_STATUS appDpsRegistrationStatus = APP_DPS_REGISTRATION_PENDING;
+    APP_DPS_REGISTRATION_CONTEXT dpsContext = { 0 };
+    TICK_COUNTER_HANDLE tickCounter = NULL;
+    tickcounter_ms_t deadline = 0;
 
     const char* globalProvUri = ConnectionParams->u1.Dps.GlobalProvUri;
     const char* idScope = ConnectionParams->u1.Dps.IdScope;
@@ -110,6 +343,15 @@ IOTHUB_DEVICE_HANDLE IotComms_InitializeIotHubViaProvisioning(bool TraceOn, PCON
             LEAVE;
         }
 
+        dpsContext.Status = APP_DPS_REGISTRATION_PENDING;
+        dpsContext.Lock = Lock_Init();
+        dpsContext.Condition = Condition_Init();
+        tickCounter = tickcounter_create();
+        if (NULL == dpsContext.Lock || NULL == dpsContext.Condition || NULL == tickCounter) {
+            LogError("Failed to allocate the DPS registration context");
+            LEAVE;
+        }
+
         size_t customProvDataLength = strlen(pnpSample_CustomProvisioningData) + strlen(dcmModelId) + 1;
         customProvisioningData = calloc(1, customProvDataLength * sizeof(char));
         if (NULL == customProvisioningData) {
@@ -140,17 +382,27 @@ IOTHUB_DEVICE_HANDLE IotComms_InitializeIotHubViaProvisioning(bool TraceOn, PCON
         {
             LogError("Failed setting provisioning data, error=%d", provDeviceResult);
         }
-        else if ((provDeviceResult = Prov_Device_Register_Device(provDeviceHandle, provisioningRegisterCallback, &appDpsRegistrationStatus, NULL, NULL)) != PROV_DEVICE_RESULT_OK)
+        else if ((provDeviceResult = Prov_Device_Register_Device(provDeviceHandle, provisioningRegisterCallback, &dpsContext, NULL, NULL)) != PROV_DEVICE_RESULT_OK)
         {
             LogError("Prov_Device_Register_Device failed, error=%d", provDeviceResult);
         }
         else
         {
-            for (int i = 0; (i < pnpSampleDevice_dpsRegistrationMaxPolls) && (appDpsRegistrationStatus == APP_DPS_REGISTRATION_PENDING); i++)
+            PNPBRIDGE_INTERLOCKED_INCREMENT(&IotHandle->Provisionings);
+
+            (void)tickcounter_get_current_ms(tickCounter, &deadline);
+            deadline += IOTCOMMS_DPS_REGISTRATION_TIMEOUT_MS;
+
+            Lock(dpsContext.Lock);
+            while (dpsContext.Status == APP_DPS_REGISTRATION_PENDING)
             {
-                ThreadAPI_Sleep(pnpSampleDevice_dpsRegistrationPollSleep);
-                //Prov_Device_LL_DoWork(provDeviceLLHandle);
+                if (!IotComms_WaitUntil(dpsContext.Condition, dpsContext.Lock, tickCounter, deadline))
+                {
+                    break;
+                }
             }
+            appDpsRegistrationStatus = dpsContext.Status;
+            Unlock(dpsContext.Lock);
 
             if (appDpsRegistrationStatus == APP_DPS_REGISTRATION_SUCCEEDED)
             {
@@ -169,27 +421,18 @@ IOTHUB_DEVICE_HANDLE IotComms_InitializeIotHubViaProvisioning(bool TraceOn, PCON
         if (appDpsRegistrationStatus == APP_DPS_REGISTRATION_SUCCEEDED)
         {
             // The initial provisioning stage has succeeded.  Now use this material to connect to IoTHub.
-            IOTHUB_CLIENT_RESULT iothubClientResult;
-
             if (iothub_security_init(secureDeviceTypeForIotHub) != 0)
             {
                 LogError("iothub_security_init failed");
             }
-            else if ((deviceHandle = IoTHubDeviceClient_CreateFromDeviceAuth(pnpSample_provisioning_IoTHubUri, pnpSample_provisioning_DeviceId, MQTT_Protocol)) == NULL)
-            {
-                LogError("IoTHubDeviceClient_CreateFromDeviceAuth failed");
-            }
-            else if ((iothubClientResult = IoTHubDeviceClient_SetOption(deviceHandle, OPTION_LOG_TRACE, &TraceOn)) != IOTHUB_CLIENT_OK)
+            else
             {
-                LogError("Failed to set option %s, error=%d", OPTION_LOG_TRACE, iothubClientResult);
-                IoTHubDeviceClient_Destroy(deviceHandle);
-                deviceHandle = NULL;
+                deviceHandle = IotComms_InitializeIotHubFromAssignment(TraceOn);
             }
-            else
+
+            if (NULL != deviceHandle && NULL != ConnectionParams->u1.Dps.AssignmentCachePath)
             {
-                // Never log the complete connection string , as this contains information
-                // that could compromise security of the device.
-                LogInfo("***** Successfully created device device=<%s> via provisioning *****", pnpSample_provisioning_DeviceId);
+                IotComms_WriteAssignmentCache(ConnectionParams);
             }
         }
 
@@ -199,10 +442,23 @@ IOTHUB_DEVICE_HANDLE IotComms_InitializeIotHubViaProvisioning(bool TraceOn, PCON
             free(customProvisioningData);
         }
 
+        // The callback can't run once the provisioning client is destroyed
         if (provDeviceHandle != NULL) {
             Prov_Device_Destroy(provDeviceHandle);
         }
 
+        if (NULL != dpsContext.Condition) {
+            Condition_Deinit(dpsContext.Condition);
+        }
+
+        if (NULL != dpsContext.Lock) {
+            Lock_Deinit(dpsContext.Lock);
+        }
+
+        if (NULL != tickCounter) {
+            tickcounter_destroy(tickCounter);
+        }
+
         if (deviceHandle == NULL) {
             IoTHub_Deinit();
         }
@@ -220,10 +476,13 @@ typedef enum APP_PNP_REGISTRATION_STATUS_TAG
     APP_PNP_REGISTRATION_FAILED
 } APP_PNP_REGISTRATION_STATUS;
 
+// The registration waits on the connection lock of the IoT handle, so that it
+// also wakes up when the hub rejects the device. A registration that is given
+// up while pending is freed by its callback.
 typedef struct PNP_REGISTRATION_CONTEXT {
-    COND_HANDLE Condition;
-    LOCK_HANDLE Lock;
+    MX_IOT_HANDLE_TAG* IotHandle;
     APP_PNP_REGISTRATION_STATUS RegistrationStatus;
+    bool Abandoned;
 } PNP_REGISTRATION_CONTEXT, *PPNP_REGISTRATION_CONTEXT;
 
 // appPnpInterfacesRegistered is invoked when the interfaces have been registered or failed.
@@ -234,15 +493,173 @@ IotComms_PnPInterfaceRegisteredCallback(
     )
 {
     PPNP_REGISTRATION_CONTEXT registrationContext = (PPNP_REGISTRATION_CONTEXT)userContextCallback;
+    MX_IOT_HANDLE_TAG* iotHandle = registrationContext->IotHandle;
+    bool abandoned;
+
+    Lock(iotHandle->ConnectionLock);
     registrationContext->RegistrationStatus = (pnpInterfaceStatus == DIGITALTWIN_CLIENT_OK) ? APP_PNP_REGISTRATION_SUCCEEDED : APP_PNP_REGISTRATION_FAILED;
-    Lock(registrationContext->Lock);
-    Condition_Post(registrationContext->Condition);
-    Unlock(registrationContext->Lock);
+    abandoned = registrationContext->Abandoned;
+    Condition_Post(iotHandle->ConnectionCondition);
+    Unlock(iotHandle->ConnectionLock);
+
+    if (abandoned) {
+        free(registrationContext);
+    }
 }
 
-// Invokes PnP_DeviceClient_RegisterInterfacesAsync, which indicates to Azure IoT which PnP interfaces this device supports.
-// The PnP Handle *is not valid* until this operation has completed (as indicated by the callback appPnpInterfacesRegistered being invoked).
-// In this sample, we block indefinitely but production code should include a timeout.
+// Wakes the threads waiting for a change of the connection state. Must be
+// called with ConnectionLock held.
+static void
+IotComms_PostConnectionChange(
+    MX_IOT_HANDLE_TAG* IotHandle
+    )
+{
+    Condition_Post(IotHandle->ConnectionCondition);
+    Condition_Post(IotHandle->MonitorCondition);
+}
+
+// Records the connection status of the device client. A hub that was read from
+// the DPS assignment cache and rejects the credentials of the device no longer
+// has the device assigned to it.
+static void
+IotComms_ConnectionStatusCallback(
+    IOTHUB_CLIENT_CONNECTION_STATUS Status,
+    IOTHUB_CLIENT_CONNECTION_STATUS_REASON Reason,
+    void* UserContext
+    )
+{
+    MX_IOT_HANDLE_TAG* iotHandle = (MX_IOT_HANDLE_TAG*)UserContext;
+
+    LogInfo("IoT Hub connection status %s, reason %s", MU_ENUM_TO_STRING(IOTHUB_CLIENT_CONNECTION_STATUS, Status),
+            MU_ENUM_TO_STRING(IOTHUB_CLIENT_CONNECTION_STATUS_REASON, Reason));
+
+    Lock(iotHandle->ConnectionLock);
+    iotHandle->ConnectionStatus = Status;
+    iotHandle->ConnectionReason = Reason;
+    if (iotHandle->UsingCachedAssignment && IOTHUB_CLIENT_CONNECTION_UNAUTHENTICATED == Status &&
+        (IOTHUB_CLIENT_CONNECTION_BAD_CREDENTIAL == Reason || IOTHUB_CLIENT_CONNECTION_DEVICE_DISABLED == Reason)) {
+        iotHandle->AssignmentRejected = true;
+    }
+    IotComms_PostConnectionChange(iotHandle);
+    Unlock(iotHandle->ConnectionLock);
+}
+
+// Invokes DigitalTwin_DeviceClient_RegisterInterfacesAsync and waits for the callback
+static PNPBRIDGE_RESULT
+IotComms_RegisterInterfacesOnClient(
+    MX_IOT_HANDLE_TAG* IotHandle,
+    const char* ModelRepoId,
+    DIGITALTWIN_INTERFACE_CLIENT_HANDLE* Interfaces,
+    int InterfaceCount,
+    DIGITALTWIN_CLIENT_RESULT* PnpResult
+    )
+{
+    PNPBRIDGE_RESULT result = PNPBRIDGE_OK;
+    PPNP_REGISTRATION_CONTEXT callbackContext = NULL;
+    TICK_COUNTER_HANDLE tickCounter = NULL;
+    tickcounter_ms_t deadline = 0;
+
+    *PnpResult = DIGITALTWIN_CLIENT_OK;
+
+    TRY {
+        if (IotHandle->IsModule) {
+            LogError("Module support is not present in public preview");
+            result = PNPBRIDGE_NOT_SUPPORTED;
+            LEAVE;
+        }
+
+        callbackContext = calloc(1, sizeof(PNP_REGISTRATION_CONTEXT));
+        tickCounter = tickcounter_create();
+        if (NULL == callbackContext || NULL == tickCounter || 0 != tickcounter_get_current_ms(tickCounter, &deadline)) {
+            result = PNPBRIDGE_INSUFFICIENT_MEMORY;
+            LEAVE;
+        }
+
+        deadline += IOTCOMMS_INTERFACE_REGISTRATION_TIMEOUT_MS;
+
+        callbackContext->IotHandle = IotHandle;
+        callbackContext->RegistrationStatus = APP_PNP_REGISTRATION_PENDING;
+
+        *PnpResult = DigitalTwin_DeviceClient_RegisterInterfacesAsync(
+                        IotHandle->u1.IotDevice.PnpDeviceClientHandle, ModelRepoId, Interfaces,
+                        InterfaceCount, IotComms_PnPInterfaceRegisteredCallback, callbackContext);
+        if (DIGITALTWIN_CLIENT_OK != *PnpResult) {
+            result = PNPBRIDGE_FAILED;
+            LEAVE;
+        }
+
+        Lock(IotHandle->ConnectionLock);
+        while (APP_PNP_REGISTRATION_PENDING == callbackContext->RegistrationStatus && !IotHandle->AssignmentRejected) {
+            if (!IotComms_WaitUntil(IotHandle->ConnectionCondition, IotHandle->ConnectionLock, tickCounter, deadline)) {
+                break;
+            }
+        }
+
+        if (APP_PNP_REGISTRATION_PENDING == callbackContext->RegistrationStatus && !IotHandle->AssignmentRejected) {
+            LogError("Timed out registering the PnP interfaces after %d ms", IOTCOMMS_INTERFACE_REGISTRATION_TIMEOUT_MS);
+            result = PNPBRIDGE_TIMED_OUT;
+        }
+        else if (APP_PNP_REGISTRATION_SUCCEEDED != callbackContext->RegistrationStatus) {
+            LogError("PnP has failed to register.\n");
+            result = PNPBRIDGE_FAILED;
+        }
+
+        if (APP_PNP_REGISTRATION_PENDING == callbackContext->RegistrationStatus) {
+            callbackContext->Abandoned = true;
+            callbackContext = NULL;
+        }
+
+        if (PNPBRIDGE_OK == result) {
+            IotHandle->InterfacesRegistered = true;
+            IotComms_PostConnectionChange(IotHandle);
+        }
+        Unlock(IotHandle->ConnectionLock);
+    } FINALLY {
+        free(callbackContext);
+
+        if (NULL != tickCounter) {
+            tickcounter_destroy(tickCounter);
+        }
+    }
+
+    return result;
+}
+
+// Creates whichever of the device client and the DigitalTwin client is missing
+static PNPBRIDGE_RESULT
+IotComms_EnsureDigitalTwinClient(
+    MX_IOT_HANDLE_TAG* IotHandle,
+    bool TraceOn,
+    PCONNECTION_PARAMETERS ConnectionParams
+    )
+{
+    PNPBRIDGE_RESULT result = PNPBRIDGE_OK;
+
+    if (!IotHandle->DeviceClientInitialized) {
+        result = IotComms_InitializeIotHandle(IotHandle, TraceOn, ConnectionParams);
+        if (PNPBRIDGE_OK != result) {
+            LogError("IotComms_InitializeIotHandle failed\n");
+            return result;
+        }
+    }
+
+    if (!IotHandle->DigitalTwinClientInitialized) {
+        result = IotComms_DigitalTwinClient_Initalize(IotHandle);
+    }
+
+    return result;
+}
+
+// Registers the interfaces of the bridge with Azure IoT. The PnP Handle *is not
+// valid* until this operation has completed (as indicated by the callback
+// IotComms_PnPInterfaceRegisteredCallback being invoked).
+//
+// The device client created at startup is wrapped in a DigitalTwin client on
+// the first publish, and later publishes register the full interface list
+// again over the same client, so the MQTT/TLS connection and the DPS
+// assignment are kept. A DigitalTwin client that refuses to register a second
+// time is rebuilt. Since it owns its device client, that reconnects to the
+// hub, but DPS isn't contacted again.
 int 
 IotComms_RegisterPnPInterfaces(
     MX_IOT_HANDLE_TAG* IotHandle,
@@ -254,50 +671,45 @@ IotComms_RegisterPnPInterfaces(
     )
 {
     PNPBRIDGE_RESULT result;
-    DIGITALTWIN_CLIENT_RESULT pnpResult;
-    PNP_REGISTRATION_CONTEXT callbackContext = { 0 };
-    callbackContext.RegistrationStatus = APP_PNP_REGISTRATION_PENDING;
-    callbackContext.Condition = Condition_Init();
-    callbackContext.Lock = Lock_Init();
-
-    // DigitalTwinClient doesn't support incremental publishing of PnP Interface
-    // Inorder to workaround this we will destroy the DigitalTwinClient and recreate it
-    IotComms_DigitalTwinClient_Destroy(IotHandle);
-    result = IotComms_InitializeIotHandle(IotHandle, traceOn, connectionParams);
-    if (PNPBRIDGE_OK != result) {
-        LogError("IotComms_InitializeIotHandle failed\n");
-        goto end;
-    }
-    IotComms_DigitalTwinClient_Initalize(IotHandle);
+    DIGITALTWIN_CLIENT_RESULT pnpResult = DIGITALTWIN_CLIENT_OK;
+    bool reregistering = IotHandle->InterfacesRegistered;
 
-    if (!IotHandle->IsModule) {
-        pnpResult = DigitalTwin_DeviceClient_RegisterInterfacesAsync(
-                        IotHandle->u1.IotDevice.PnpDeviceClientHandle, ModelRepoId, Interfaces,
-                        InterfaceCount, IotComms_PnPInterfaceRegisteredCallback, &callbackContext);
-    }
-    else {
-        LogError("Module support is not present in public preview");
-        pnpResult = PNPBRIDGE_NOT_SUPPORTED;
+    result = IotComms_EnsureDigitalTwinClient(IotHandle, traceOn, connectionParams);
+    if (PNPBRIDGE_OK == result) {
+        result = IotComms_RegisterInterfacesOnClient(IotHandle, ModelRepoId, Interfaces, InterfaceCount, &pnpResult);
     }
 
-    if (DIGITALTWIN_CLIENT_OK != pnpResult) {
-        result = PNPBRIDGE_FAILED;
-        goto end;
+    if (PNPBRIDGE_OK != result && reregistering && DIGITALTWIN_CLIENT_OK != pnpResult) {
+        LogInfo("The DigitalTwin client refused to register the interfaces again (%d), rebuilding it", pnpResult);
+
+        IotComms_DigitalTwinClient_Destroy(IotHandle);
+        result = IotComms_EnsureDigitalTwinClient(IotHandle, traceOn, connectionParams);
+        if (PNPBRIDGE_OK == result) {
+            result = IotComms_RegisterInterfacesOnClient(IotHandle, ModelRepoId, Interfaces, InterfaceCount, &pnpResult);
+        }
     }
 
-    Lock(callbackContext.Lock);
-    Condition_Wait(callbackContext.Condition, callbackContext.Lock, 0);
-    Unlock(callbackContext.Lock);
+    // The device is assigned to another hub now. It registers with DPS again
+    // and the new assignment replaces the cached one.
+    if (PNPBRIDGE_OK != result && IotHandle->AssignmentRejected) {
+        LogInfo("The IoT hub in the DPS assignment cache rejected the device, registering with DPS");
 
-    if (callbackContext.RegistrationStatus != APP_PNP_REGISTRATION_SUCCEEDED) {
-        LogError("PnP has failed to register.\n");
-        result = -1;
-    }
-    else {
-        result = 0;
+        IotComms_DigitalTwinClient_Destroy(IotHandle);
+        IotComms_ForgetAssignment(connectionParams);
+        IotHandle->UsingCachedAssignment = false;
+        IotHandle->AssignmentRejected = false;
+
+        result = IotComms_EnsureDigitalTwinClient(IotHandle, traceOn, connectionParams);
+        if (PNPBRIDGE_OK == result) {
+            result = IotComms_RegisterInterfacesOnClient(IotHandle, ModelRepoId, Interfaces, InterfaceCount, &pnpResult);
+        }
     }
 
-end:
+    if (PNPBRIDGE_OK == result) {
+        // The hub accepted the cached assignment
+        IotHandle->UsingCachedAssignment = false;
+        PNPBRIDGE_INTERLOCKED_INCREMENT(&IotHandle->Registrations);
+    }
 
     return result;
 }
@@ -330,7 +742,7 @@ IOTHUB_DEVICE_HANDLE IotComms_InitializeIotHubDeviceHandle(bool TraceOn, const c
 }
 
 
-IOTHUB_DEVICE_HANDLE IotComms_InitializeIotDevice(bool TraceOn, PCONNECTION_PARAMETERS ConnectionParams)
+IOTHUB_DEVICE_HANDLE IotComms_InitializeIotDevice(MX_IOT_HANDLE_TAG* IotHandle, bool TraceOn, PCONNECTION_PARAMETERS ConnectionParams)
 {
     if (ConnectionParams->ConnectionType == CONNECTION_TYPE_CONNECTION_STRING) {
         if (ConnectionParams->AuthParameters.AuthType == AUTH_TYPE_SYMMETRIC_KEY) {
@@ -365,7 +777,30 @@ IOTHUB_DEVICE_HANDLE IotComms_InitializeIotDevice(bool TraceOn, PCONNECTION_PARA
     else if (ConnectionParams->ConnectionType == CONNECTION_TYPE_DPS) {
         if ((AUTH_TYPE_SYMMETRIC_KEY == ConnectionParams->AuthParameters.AuthType) ||
             (AUTH_TYPE_X509 == ConnectionParams->AuthParameters.AuthType)) {
-            return IotComms_InitializeIotHubViaProvisioning(TraceOn, ConnectionParams);
+            // On the first connect, the hub DPS assigned the device to on an
+            // earlier start is used without contacting DPS
+            if (NULL == pnpSample_provisioning_IoTHubUri && NULL != ConnectionParams->u1.Dps.AssignmentCachePath &&
+                IotComms_ReadAssignmentCache(ConnectionParams)) {
+                if (IotComms_InitializeAssignedDeviceSecurity(ConnectionParams)) {
+                    LogInfo("Connecting to %s from the DPS assignment cache", pnpSample_provisioning_IoTHubUri);
+                    IotHandle->UsingCachedAssignment = true;
+                }
+                else {
+                    IotComms_ForgetAssignment(ConnectionParams);
+                }
+            }
+
+            if (NULL != pnpSample_provisioning_IoTHubUri && NULL != pnpSample_provisioning_DeviceId) {
+                IOTHUB_DEVICE_HANDLE handle = IotComms_InitializeIotHubFromAssignment(TraceOn);
+                if (NULL != handle || !IotHandle->UsingCachedAssignment) {
+                    return handle;
+                }
+
+                IotHandle->UsingCachedAssignment = false;
+                IotComms_ForgetAssignment(ConnectionParams);
+            }
+
+            return IotComms_InitializeIotHubViaProvisioning(IotHandle, TraceOn, ConnectionParams);
         }
         else {
             LogError("Auth type (%d) is not supported for DPS", ConnectionParams->AuthParameters.AuthType);
@@ -391,13 +826,20 @@ IotComms_InitializeIotDeviceHandle(
         IotHandle->IsModule = false;
        
         // Connect to Iot Hub Device
-        IotHandle->u1.IotDevice.deviceHandle = IotComms_InitializeIotDevice(TraceOn, ConnectionParams);
+        IotHandle->u1.IotDevice.deviceHandle = IotComms_InitializeIotDevice(IotHandle, TraceOn, ConnectionParams);
         if (NULL == IotHandle->u1.IotDevice.deviceHandle) {
             LogError("IotComms_InitializeIotDevice failed\n");
             result = PNPBRIDGE_FAILED;
             LEAVE;
         }
 
+        PNPBRIDGE_INTERLOCKED_INCREMENT(&IotHandle->Connects);
+
+        if (IOTHUB_CLIENT_OK != IoTHubDeviceClient_SetConnectionStatusCallback(IotHandle->u1.IotDevice.deviceHandle,
+                                                                               IotComms_ConnectionStatusCallback, IotHandle)) {
+            LogError("IoTHubDeviceClient_SetConnectionStatusCallback failed");
+        }
+
         // We have completed initializing the pnp client
         IotHandle->DeviceClientInitialized = true;
     } FINALLY {
@@ -432,25 +874,102 @@ IotComms_DigitalTwinClient_Initalize(
     return result;
 }
 
+// The DigitalTwin client owns the device client it was created from, so both
+// are destroyed and the connection to the hub is closed. A device client that
+// wasn't wrapped yet is destroyed on its own.
 void
 IotComms_DigitalTwinClient_Destroy(
     MX_IOT_HANDLE_TAG* IotHandle
     )
 {
-    if (NULL != IotHandle->u1.IotDevice.PnpDeviceClientHandle) {
-        if (!IotHandle->IsModule) {
-            DigitalTwin_DeviceClient_Destroy(IotHandle->u1.IotDevice.PnpDeviceClientHandle);
-        }
-        else {
+    if (IotHandle->IsModule) {
+        if (NULL != IotHandle->u1.IotModule.pnpModuleClientHandle) {
             LogError("Module support is not present in public preview");
         }
     }
+    else if (NULL != IotHandle->u1.IotDevice.PnpDeviceClientHandle) {
+        DigitalTwin_DeviceClient_Destroy(IotHandle->u1.IotDevice.PnpDeviceClientHandle);
+        IotHandle->u1.IotDevice.PnpDeviceClientHandle = NULL;
+        IotHandle->u1.IotDevice.deviceHandle = NULL;
+        IotHandle->DeviceClientInitialized = false;
+    }
+    else if (NULL != IotHandle->u1.IotDevice.deviceHandle) {
+        IoTHubDeviceClient_Destroy(IotHandle->u1.IotDevice.deviceHandle);
+        IotHandle->u1.IotDevice.deviceHandle = NULL;
+        IotHandle->DeviceClientInitialized = false;
+    }
 
     IotHandle->DigitalTwinClientInitialized = false;
+
+    Lock(IotHandle->ConnectionLock);
+    IotHandle->InterfacesRegistered = false;
+    IotComms_PostConnectionChange(IotHandle);
+    Unlock(IotHandle->ConnectionLock);
+}
+
+// Must be called with ConnectionLock held
+static bool
+IotComms_IsConnectedLocked(
+    MX_IOT_HANDLE_TAG* IotHandle
+    )
+{
+    return IotHandle->InterfacesRegistered && IOTHUB_CLIENT_CONNECTION_AUTHENTICATED == IotHandle->ConnectionStatus;
+}
+
+bool
+IotComms_IsConnected(
+    MX_IOT_HANDLE_TAG* IotHandle
+    )
+{
+    bool connected;
+
+    Lock(IotHandle->ConnectionLock);
+    connected = IotComms_IsConnectedLocked(IotHandle);
+    Unlock(IotHandle->ConnectionLock);
+
+    return connected;
+}
+
+bool
+IotComms_WaitForConnectionChange(
+    MX_IOT_HANDLE_TAG* IotHandle,
+    bool Connected,
+    unsigned int TimeoutMs
+    )
+{
+    bool connected;
+
+    Lock(IotHandle->ConnectionLock);
+    connected = IotComms_IsConnectedLocked(IotHandle);
+    if (connected == Connected) {
+        Condition_Wait(IotHandle->MonitorCondition, IotHandle->ConnectionLock, (int)TimeoutMs);
+        connected = IotComms_IsConnectedLocked(IotHandle);
+    }
+    Unlock(IotHandle->ConnectionLock);
+
+    return connected;
 }
 
 PNPBRIDGE_RESULT IotComms_InitializeIotHandle(MX_IOT_HANDLE_TAG* IotHandle, bool TraceOn, PCONNECTION_PARAMETERS ConnectionParams)
 {
+    if (NULL == IotHandle->ConnectionLock) {
+        IotHandle->ConnectionLock = Lock_Init();
+    }
+
+    if (NULL == IotHandle->ConnectionCondition) {
+        IotHandle->ConnectionCondition = Condition_Init();
+    }
+
+    if (NULL == IotHandle->MonitorCondition) {
+        IotHandle->MonitorCondition = Condition_Init();
+    }
+
+    if (NULL == IotHandle->ConnectionLock || NULL == IotHandle->ConnectionCondition ||
+        NULL == IotHandle->MonitorCondition) {
+        LogError("Failed to allocate the connection lock");
+        return PNPBRIDGE_INSUFFICIENT_MEMORY;
+    }
+
     if (ConnectionParams->ConnectionType == CONNECTION_TYPE_EDGE_MODULE) {
         return PNPBRIDGE_NOT_SUPPORTED;
     }
@@ -51,12 +51,21 @@ PnpAdapterInterface_Create(
         memcpy(&interface->params, params, sizeof(interface->params));
 
         // Copy adapter context
-        interface->adapterContext = calloc(1, sizeof(PPNP_ADAPTER_CONTEXT_TAG));
+        interface->adapterContext = calloc(1, sizeof(PNP_ADAPTER_CONTEXT_TAG));
         if (NULL == interface->adapterContext) {
             result = -1;
             LEAVE;
         }
-        memcpy(interface->adapterContext, adapterContext, sizeof(interface->adapterContext));
+        memcpy(interface->adapterContext, adapterContext, sizeof(PNP_ADAPTER_CONTEXT_TAG));
+
+        // The component name in the adapter context belongs to the PNPMESSAGE
+        if (NULL != adapterContext->componentName) {
+            if (0 != mallocAndStrcpy_s(&interface->componentName, adapterContext->componentName)) {
+                result = -1;
+                LEAVE;
+            }
+        }
+        ((PPNP_ADAPTER_CONTEXT_TAG)interface->adapterContext)->componentName = interface->componentName;
 
         // Add this interface to the list of interfaces under the adapter context
         PnpAdapterManager_AddInterface(adapterContext->adapter, interface);
@@ -84,10 +93,6 @@ PnpAdapterInterface_Destroy(
     }
 
     PPNPADAPTER_INTERFACE_TAG interface = (PPNPADAPTER_INTERFACE_TAG)pnpAdapterInterface;
-    if (NULL != interface->interfaceId) {
-        free(interface->interfaceId);
-    }
-
     if (NULL != interface->adapterContext) {
         PPNP_ADAPTER_CONTEXT_TAG adapterContext = (PPNP_ADAPTER_CONTEXT_TAG)interface->adapterContext;
         if (NULL != interface->adapterEntry) {
@@ -95,6 +100,14 @@ PnpAdapterInterface_Destroy(
         }
         free(interface->adapterContext);
     }
+
+    if (NULL != interface->interfaceId) {
+        free(interface->interfaceId);
+    }
+
+    if (NULL != interface->componentName) {
+        free(interface->componentName);
+    }
 }
 
 DIGITALTWIN_INTERFACE_CLIENT_HANDLE PnpAdapterInterface_GetPnpInterfaceClient(PNPADAPTER_INTERFACE_HANDLE pnpAdapterInterface) {
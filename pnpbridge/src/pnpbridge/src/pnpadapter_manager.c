@@ -12,17 +12,12 @@ extern const int PnpAdapterCount;
 #include "pnpadapter_manager.h"
 #endif
 
-PNPBRIDGE_RESULT PnpAdapterManager_ValidatePnpAdapter(PPNP_ADAPTER  pnpAdapter, MAP_HANDLE pnpAdapterMap) {
-    bool containsKey = false;
+PNPBRIDGE_RESULT PnpAdapterManager_ValidatePnpAdapter(PPNP_ADAPTER  pnpAdapter, PPNPBRIDGE_IDENTITY_TABLE pnpAdapterTable) {
     if (NULL == pnpAdapter->identity) {
         LogError("PnpAdapter's Identity filed is not initialized");
         return PNPBRIDGE_INVALID_ARGS;
     }
-    if (MAP_OK != Map_ContainsKey(pnpAdapterMap, pnpAdapter->identity, &containsKey)) {
-        LogError("Map_ContainsKey failed");
-        return PNPBRIDGE_FAILED;
-    }
-    if (containsKey) {
+    if (PnpIdentityTable_Find(pnpAdapterTable, pnpAdapter->identity) >= 0) {
         LogError("Found duplicate pnp adapter identity %s", pnpAdapter->identity);
         return PNPBRIDGE_DUPLICATE_ENTRY;
     }
@@ -34,7 +29,7 @@ PNPBRIDGE_RESULT PnpAdapterManager_ValidatePnpAdapter(PPNP_ADAPTER  pnpAdapter,
     return PNPBRIDGE_OK;
 }
 
-PNPBRIDGE_RESULT PnpAdapterManager_InitializeAdapter(PPNP_ADAPTER adapter, PPNP_ADAPTER_TAG* adapterTag) {
+PNPBRIDGE_RESULT PnpAdapterManager_InitializeAdapter(PPNP_ADAPTER_MANAGER adapterMgr, PPNP_ADAPTER adapter, PPNP_ADAPTER_TAG* adapterTag) {
     PNPBRIDGE_RESULT result = PNPBRIDGE_OK;
     PPNP_ADAPTER_TAG adapterT = NULL;
     TRY
@@ -46,6 +41,7 @@ PNPBRIDGE_RESULT PnpAdapterManager_InitializeAdapter(PPNP_ADAPTER adapter, PPNP_
         }
 
         adapterT->adapter = adapter;
+        adapterT->adapterMgr = adapterMgr;
         adapterT->InterfaceListLock = Lock_Init();
         adapterT->pnpInterfaceList = singlylinkedlist_create();
         if (NULL == adapterT->InterfaceListLock) {
@@ -94,7 +90,7 @@ void PnpAdapterManager_ReleaseAdapter(PPNP_ADAPTER_TAG adapterTag) {
     free(adapterTag);
 }
 
-PNPBRIDGE_RESULT PnpAdapterManager_Create(PPNP_ADAPTER_MANAGER* adapterMgr, JSON_Value* config) {
+PNPBRIDGE_RESULT PnpAdapterManager_Create(PPNP_ADAPTER_MANAGER* adapterMgr, PNPBRIDGE_CONFIGURATION* config) {
     PNPBRIDGE_RESULT result = PNPBRIDGE_OK;
     PPNP_ADAPTER_MANAGER adapter = NULL;
 
@@ -103,15 +99,24 @@ PNPBRIDGE_RESULT PnpAdapterManager_Create(PPNP_ADAPTER_MANAGER* adapterMgr, JSON
         goto exit;
     }
 
-    adapter = (PPNP_ADAPTER_MANAGER) malloc(sizeof(PNP_ADAPTER_MANAGER));
+    adapter = (PPNP_ADAPTER_MANAGER) calloc(1, sizeof(PNP_ADAPTER_MANAGER));
     if (NULL == adapter) {
         result = PNPBRIDGE_INSUFFICIENT_MEMORY;
         goto exit;
     }
 
-    adapter->pnpAdapterMap = Map_Create(NULL);
-    if (NULL == adapter->pnpAdapterMap) {
-        result = PNPBRIDGE_FAILED;
+    result = PnpStringSet_Create(&adapter->publishedInterfaceIds);
+    if (PNPBRIDGE_OK != result) {
+        goto exit;
+    }
+
+    result = PnpStringSet_Create(&adapter->publishedComponentNames);
+    if (PNPBRIDGE_OK != result) {
+        goto exit;
+    }
+
+    result = PnpIdentityTable_Create(&adapter->pnpAdapterTable, PnpAdapterCount);
+    if (PNPBRIDGE_OK != result) {
         goto exit;
     }
 
@@ -126,7 +131,7 @@ PNPBRIDGE_RESULT PnpAdapterManager_Create(PPNP_ADAPTER_MANAGER* adapterMgr, JSON
     for (int i = 0; i < PnpAdapterCount; i++) {
         PPNP_ADAPTER  pnpAdapter = PNP_ADAPTER_MANIFEST[i];
         
-        result = PnpAdapterManager_InitializeAdapter(pnpAdapter, &adapter->pnpAdapters[i]);
+        result = PnpAdapterManager_InitializeAdapter(adapter, pnpAdapter, &adapter->pnpAdapters[i]);
         if (!PNPBRIDGE_SUCCESS(result)) {
             LogError("Failed to initialize PnpAdapter %s", pnpAdapter->identity);
             continue;
@@ -138,7 +143,7 @@ PNPBRIDGE_RESULT PnpAdapterManager_Create(PPNP_ADAPTER_MANAGER* adapterMgr, JSON
         }
 
         // Validate Pnp Adapter Methods
-        result = PnpAdapterManager_ValidatePnpAdapter(pnpAdapter, adapter->pnpAdapterMap);
+        result = PnpAdapterManager_ValidatePnpAdapter(pnpAdapter, &adapter->pnpAdapterTable);
         if (PNPBRIDGE_OK != result) {
             LogError("PnpAdapter structure is not initialized properly");
             goto exit;
@@ -155,9 +160,14 @@ PNPBRIDGE_RESULT PnpAdapterManager_Create(PPNP_ADAPTER_MANAGER* adapterMgr, JSON
             continue;
         }
 
-        Map_Add_Index(adapter->pnpAdapterMap, pnpAdapter->identity, i);
+        result = PnpIdentityTable_Add(&adapter->pnpAdapterTable, pnpAdapter->identity, i);
+        if (PNPBRIDGE_OK != result) {
+            goto exit;
+        }
     }
 
+    PnpAdapterManager_ResolveDevices(adapter, config);
+
     *adapterMgr = adapter;
 
 exit:
@@ -170,29 +180,17 @@ exit:
 }
 
 void PnpAdapterManager_Release(PPNP_ADAPTER_MANAGER adapterMgr) {
-    const char* const* keys;
-    const char* const* values;
-    size_t count;
-
-    if (NULL != adapterMgr->pnpAdapterMap) {
-        // Call shutdown on all interfaces
-        if (Map_GetInternals(adapterMgr->pnpAdapterMap, &keys, &values, &count) != MAP_OK) {
-            LogError("Map_GetInternals failed to get all pnp adapters");
-        }
-        else
-        {
-            for (int i = 0; i < (int)count; i++) {
-                int index = atoi(values[i]);
-                PPNP_ADAPTER_TAG  adapterT = adapterMgr->pnpAdapters[index];
-                if (NULL != adapterT) {
-                    // Release all interfaces
-                    PnpAdapterManager_ReleaseAdapter(adapterT);
-
-                    PPNP_ADAPTER adapter = PNP_ADAPTER_MANIFEST[index];
-                    if (NULL != adapter->shutdown) {
-                        adapter->shutdown();
-                    }
-                }
+    // Call shutdown on all initialized adapters
+    for (int i = 0; i < adapterMgr->pnpAdapterTable.Count; i++) {
+        int index = adapterMgr->pnpAdapterTable.Entries[i].Index;
+        PPNP_ADAPTER_TAG  adapterT = adapterMgr->pnpAdapters[index];
+        if (NULL != adapterT) {
+            // Release all interfaces
+            PnpAdapterManager_ReleaseAdapter(adapterT);
+
+            PPNP_ADAPTER adapter = PNP_ADAPTER_MANIFEST[index];
+            if (NULL != adapter->shutdown) {
+                adapter->shutdown();
             }
         }
     }
@@ -201,31 +199,68 @@ void PnpAdapterManager_Release(PPNP_ADAPTER_MANAGER adapterMgr) {
         free(adapterMgr->pnpAdapters);
     }
 
-    Map_Destroy(adapterMgr->pnpAdapterMap);
+    PnpIdentityTable_Destroy(&adapterMgr->pnpAdapterTable);
+
+    PnpStringSet_Destroy(adapterMgr->publishedInterfaceIds);
+    PnpStringSet_Destroy(adapterMgr->publishedComponentNames);
     free(adapterMgr);
 }
 
-PNPBRIDGE_RESULT PnpAdapterManager_SupportsIdentity(PPNP_ADAPTER_MANAGER adapter, JSON_Object* Message, bool* supported, int* key) {
-    bool containsMessageKey = false;
-    JSON_Object* pnpParams = json_object_get_object(Message, PNP_CONFIG_PNP_PARAMETERS);
-    char* getIdentity = (char*) json_object_get_string(pnpParams, PNP_CONFIG_IDENTITY);
-    MAP_RESULT mapResult;
-
-    *supported = false;
+void PnpAdapterManager_ResolveDevices(PPNP_ADAPTER_MANAGER adapterMgr, PNPBRIDGE_CONFIGURATION* config) {
+    // Resolve the adapter of every configured device up front, so that a
+    // PNPMESSAGE is routed without looking its adapter up by identity
+    for (int i = 0; i < config->DeviceCount; i++) {
+        PPNPBRIDGE_DEVICE_CONFIG device = &config->Devices[i];
+        device->PnpAdapterKey = PnpIdentityTable_Find(&adapterMgr->pnpAdapterTable, device->PnpAdapterIdentity);
+        if (device->PnpAdapterKey < 0 && NULL != device->PnpAdapterIdentity) {
+            LogError("PnpAdapter %s of configured device %d is not present in AdapterManifest", device->PnpAdapterIdentity, i);
+        }
+    }
+}
 
-    mapResult = Map_ContainsKey(adapter->pnpAdapterMap, getIdentity, &containsMessageKey);
-    if (MAP_OK != mapResult || !containsMessageKey) {
-        LogError("PnpAdapter %s is not present in AdapterManifest", getIdentity);
-        return PNPBRIDGE_FAILED;
+PPNP_ADAPTER PnpAdapterManager_GetAdapter(PPNP_ADAPTER_MANAGER adapterMgr, int key) {
+    if (key < 0 || key >= PnpAdapterCount || NULL == adapterMgr->pnpAdapters[key]) {
+        return NULL;
     }
 
-    // Get the interface ID
-    int index = Map_GetIndexValueFromKey(adapter->pnpAdapterMap, getIdentity);
+    return adapterMgr->pnpAdapters[key]->adapter;
+}
+
+int PnpAdapterManager_FindIdentity(PPNP_ADAPTER_MANAGER adapterMgr, const char* identity) {
+    return PnpIdentityTable_Find(&adapterMgr->pnpAdapterTable, identity);
+}
 
-    *supported = true;
-    *key = index;
+/*
+    Hands a discovered device to the interface that was created for it
+    from the device journal before the device was discovered
+*/
+PNPBRIDGE_RESULT PnpAdapterManager_DeviceArrived(PPNP_ADAPTER_MANAGER adapterMgr, const char* interfaceId, PNPMESSAGE DeviceChangeMessage) {
+    bool found = false;
 
-    return PNPBRIDGE_OK;
+    for (int i = 0; i < PnpAdapterCount && !found; i++) {
+        PPNP_ADAPTER_TAG pnpAdapter = adapterMgr->pnpAdapters[i];
+        if (NULL == pnpAdapter) {
+            continue;
+        }
+
+        Lock(pnpAdapter->InterfaceListLock);
+        LIST_ITEM_HANDLE handle = singlylinkedlist_get_head_item(pnpAdapter->pnpInterfaceList);
+        while (NULL != handle) {
+            PPNPADAPTER_INTERFACE_TAG adapterInterface = (PPNPADAPTER_INTERFACE_TAG)singlylinkedlist_item_get_value(handle);
+            if (0 == strcmp(adapterInterface->interfaceId, interfaceId)) {
+                found = true;
+                if (NULL != adapterInterface->params.DeviceArrived &&
+                    adapterInterface->params.DeviceArrived(adapterInterface, DeviceChangeMessage) < 0) {
+                    LogError("DeviceArrived adapter callback failed for interface %s", interfaceId);
+                }
+                break;
+            }
+            handle = singlylinkedlist_get_next_item(handle);
+        }
+        Unlock(pnpAdapter->InterfaceListLock);
+    }
+
+    return found ? PNPBRIDGE_OK : PNPBRIDGE_FAILED;
 }
 
 /*
@@ -238,7 +273,7 @@ PnpAdapterManager_CreatePnpInterface(
     PPNP_ADAPTER_MANAGER AdapterMgr,
     MX_IOT_HANDLE_TAG* IotHandle,
     int key,
-    JSON_Object* deviceConfig,
+    PPNPBRIDGE_DEVICE_CONFIG deviceConfig,
     PNPMESSAGE DeviceChangeMessage
     ) 
 {
@@ -250,6 +285,7 @@ PnpAdapterManager_CreatePnpInterface(
 
     context.adapter = adapterT;
     context.deviceConfig = deviceConfig;
+    context.componentName = PnpMessage_AccessProperties(DeviceChangeMessage)->ComponentName;
 
     // Invoke interface binding method
     int ret = adapterT->adapter->createPnpInterface(&context, DeviceChangeMessage);
@@ -263,32 +299,41 @@ PnpAdapterManager_CreatePnpInterface(
 PNPBRIDGE_RESULT PnpAdapterManager_GetAllInterfaces(PPNP_ADAPTER_MANAGER adapterMgr, DIGITALTWIN_INTERFACE_CLIENT_HANDLE** interfaces , int* count) {
     int n = 0;
 
-    // Get the number of created interfaces
+    // Get the number of created interfaces. Interfaces can be added by the
+    // adapter callbacks running on the work pool, so the lists are walked
+    // under their lock and the second pass doesn't trust this count.
     for (int i = 0; i < PnpAdapterCount; i++) {
         PPNP_ADAPTER_TAG  pnpAdapter = adapterMgr->pnpAdapters[i];
         
         SINGLYLINKEDLIST_HANDLE pnpInterfaces = pnpAdapter->pnpInterfaceList;
+        Lock(pnpAdapter->InterfaceListLock);
         LIST_ITEM_HANDLE handle = singlylinkedlist_get_head_item(pnpInterfaces);
         while (NULL != handle) {
             handle = singlylinkedlist_get_next_item(handle);
             n++;
         }
+        Unlock(pnpAdapter->InterfaceListLock);
     }
 
     // create an array of interface handles
     DIGITALTWIN_INTERFACE_CLIENT_HANDLE* pnpClientHandles = NULL;
+    int x = 0;
     {
         pnpClientHandles = calloc(n, sizeof(DIGITALTWIN_INTERFACE_CLIENT_HANDLE));
-        int x = 0;
+        if (NULL == pnpClientHandles && n > 0) {
+            return PNPBRIDGE_INSUFFICIENT_MEMORY;
+        }
+
         for (int i = 0; i < PnpAdapterCount; i++) {
             PPNP_ADAPTER_TAG  pnpAdapter = adapterMgr->pnpAdapters[i];
 
             SINGLYLINKEDLIST_HANDLE pnpInterfaces = pnpAdapter->pnpInterfaceList;
             Lock(pnpAdapter->InterfaceListLock);
             LIST_ITEM_HANDLE handle = singlylinkedlist_get_head_item(pnpInterfaces);
-            while (NULL != handle) {
+            while (NULL != handle && x < n) {
                 PPNPADAPTER_INTERFACE_TAG adapterInterface = (DIGITALTWIN_INTERFACE_CLIENT_HANDLE) singlylinkedlist_item_get_value(handle);
                 pnpClientHandles[x] = PnpAdapterInterface_GetPnpInterfaceClient(adapterInterface);
+                adapterInterface->interfacePublished = true;
                 handle = singlylinkedlist_get_next_item(handle);
                 x++;
             }
@@ -296,68 +341,359 @@ PNPBRIDGE_RESULT PnpAdapterManager_GetAllInterfaces(PPNP_ADAPTER_MANAGER adapter
         }
     }
 
-    *count = n;
+    *count = x;
     *interfaces = pnpClientHandles;
 
     return 0;
 }
 
-void PnpAdapterManager_InvokeStartInterface(PPNP_ADAPTER_MANAGER adapterMgr) {
+static int
+PnpAdapterManager_StartInterfaceWork(
+    void* Context
+    )
+{
+    PPNPADAPTER_INTERFACE_TAG adapterInterface = (PPNPADAPTER_INTERFACE_TAG)Context;
+    return adapterInterface->params.StartInterface(adapterInterface);
+}
+
+static void
+PnpAdapterManager_StartInterfaceLate(
+    void* Context,
+    bool Ran,
+    int Result
+    )
+{
+    PPNPADAPTER_INTERFACE_TAG adapterInterface = (PPNPADAPTER_INTERFACE_TAG)Context;
+
+    if (!Ran) {
+        LogError("startInterface adapter callback for interface %s was not started in time",
+                    adapterInterface->interfaceId);
+    }
+    else {
+        LogError("startInterface adapter callback for interface %s completed late, %d",
+                    adapterInterface->interfaceId, Result);
+    }
+}
+
+void PnpAdapterManager_InvokeStartInterface(PPNP_ADAPTER_MANAGER adapterMgr, PNPBRIDGE_WORK_POOL_HANDLE workPool, unsigned int timeoutMs) {
     for (int i = 0; i < PnpAdapterCount; i++) {
         PPNP_ADAPTER_TAG  pnpAdapter = adapterMgr->pnpAdapters[i];
+        PPNPADAPTER_INTERFACE_TAG* toStart = NULL;
+        int n = 0;
 
+        // Collect the interfaces that were just published. Interfaces published
+        // in an earlier cycle are already running and the ones created since
+        // GetAllInterfaces are started after the next publish.
         SINGLYLINKEDLIST_HANDLE pnpInterfaces = pnpAdapter->pnpInterfaceList;
+        Lock(pnpAdapter->InterfaceListLock);
         LIST_ITEM_HANDLE handle = singlylinkedlist_get_head_item(pnpInterfaces);
         while (NULL != handle) {
+            n++;
+            handle = singlylinkedlist_get_next_item(handle);
+        }
+
+        toStart = calloc(n, sizeof(PPNPADAPTER_INTERFACE_TAG));
+        n = 0;
+
+        handle = singlylinkedlist_get_head_item(pnpInterfaces);
+        while (NULL != handle && NULL != toStart) {
             PPNPADAPTER_INTERFACE_TAG adapterInterface = (DIGITALTWIN_INTERFACE_CLIENT_HANDLE)singlylinkedlist_item_get_value(handle);
+            if (adapterInterface->interfacePublished && !adapterInterface->interfaceStarted) {
+                adapterInterface->interfaceStarted = true;
+                toStart[n++] = adapterInterface;
+            }
+            handle = singlylinkedlist_get_next_item(handle);
+        }
+        Unlock(pnpAdapter->InterfaceListLock);
+
+        if (NULL == toStart) {
+            continue;
+        }
+
+        // Start all of them at once on the work pool and then wait for each,
+        // so that one slow device only delays the others by its timeout
+        PNPBRIDGE_WORK_ITEM_HANDLE* work = NULL;
+        if (NULL != workPool) {
+            work = calloc(n, sizeof(PNPBRIDGE_WORK_ITEM_HANDLE));
+            for (int j = 0; j < n && NULL != work; j++) {
+                if (PNPBRIDGE_OK != PnpWorkPool_Submit(workPool, PnpAdapterManager_StartInterfaceWork,
+                                                       PnpAdapterManager_StartInterfaceLate, toStart[j], &work[j])) {
+                    work[j] = NULL;
+                }
+            }
+        }
+
+        for (int j = 0; j < n; j++) {
+            PPNPADAPTER_INTERFACE_TAG adapterInterface = toStart[j];
+            int res;
+
             // Invoke the startInterface callback
-            int res = adapterInterface->params.StartInterface(adapterInterface);
+            if (NULL != work && NULL != work[j]) {
+                if (PNPBRIDGE_OK != PnpWorkPool_Wait(workPool, work[j], timeoutMs, &res)) {
+                    LogError("startInterface adapter callback for interface %s timed out after %u ms",
+                                adapterInterface->interfaceId, timeoutMs);
+                    continue;
+                }
+            }
+            else {
+                res = adapterInterface->params.StartInterface(adapterInterface);
+            }
 
             // TODO: If failed then clear the interface
             if (res < 0) {
                 LogError("startInterface adapter callback failed for interface %s, %d",
                             adapterInterface->interfaceId, res);
                 // TODO: Mark for removal
+                continue;
             }
 
-            handle = singlylinkedlist_get_next_item(handle);
+            // The interface missed the broadcasts made before it was started. The
+            // state is read under the lock so that a later broadcast comes after it.
+            if (NULL != adapterInterface->params.ConnectionStateChanged) {
+                Lock(pnpAdapter->InterfaceListLock);
+                PNPBRIDGE_CONNECTION_STATE state = (PNPBRIDGE_CONNECTION_STATE)PNPBRIDGE_INTERLOCKED_READ(&adapterMgr->connectionState);
+                if (PNPBRIDGE_CONNECTION_STATE_CONNECTED != state &&
+                    adapterInterface->params.ConnectionStateChanged(adapterInterface, state) < 0) {
+                    LogError("ConnectionStateChanged adapter callback failed for interface %s", adapterInterface->interfaceId);
+                }
+                Unlock(pnpAdapter->InterfaceListLock);
+            }
         }
+
+        free(work);
+        free(toStart);
     }
 
     // TODO: If any interfaces removed then republish it
 }
 
-bool PnpAdapterManager_IsInterfaceIdPublished(PPNP_ADAPTER_MANAGER adapterMgr, const char* interfaceId) {
+void PnpAdapterManager_NotifyConnectionState(PPNP_ADAPTER_MANAGER adapterMgr, PNPBRIDGE_CONNECTION_STATE state) {
+    PNPBRIDGE_INTERLOCKED_WRITE(&adapterMgr->connectionState, state);
+
     for (int i = 0; i < PnpAdapterCount; i++) {
-        PPNP_ADAPTER_TAG  pnpAdapter = adapterMgr->pnpAdapters[i];
+        PPNP_ADAPTER_TAG pnpAdapter = adapterMgr->pnpAdapters[i];
+        if (NULL == pnpAdapter) {
+            continue;
+        }
 
-        SINGLYLINKEDLIST_HANDLE pnpInterfaces = pnpAdapter->pnpInterfaceList;
         Lock(pnpAdapter->InterfaceListLock);
-        LIST_ITEM_HANDLE handle = singlylinkedlist_get_head_item(pnpInterfaces);
+        LIST_ITEM_HANDLE handle = singlylinkedlist_get_head_item(pnpAdapter->pnpInterfaceList);
         while (NULL != handle) {
-            PPNPADAPTER_INTERFACE_TAG adapterInterface = (DIGITALTWIN_INTERFACE_CLIENT_HANDLE)singlylinkedlist_item_get_value(handle);
-            if (0 == strcmp(adapterInterface->interfaceId, interfaceId)) {
-                return true;
+            PPNPADAPTER_INTERFACE_TAG adapterInterface = (PPNPADAPTER_INTERFACE_TAG)singlylinkedlist_item_get_value(handle);
+            if (adapterInterface->interfaceStarted && NULL != adapterInterface->params.ConnectionStateChanged &&
+                adapterInterface->params.ConnectionStateChanged(adapterInterface, state) < 0) {
+                LogError("ConnectionStateChanged adapter callback failed for interface %s", adapterInterface->interfaceId);
+            }
+            handle = singlylinkedlist_get_next_item(handle);
+        }
+        Unlock(pnpAdapter->InterfaceListLock);
+    }
+}
+
+PNPBRIDGE_RESULT
+PnpAdapterManager_RemapDevices(
+    PPNP_ADAPTER_MANAGER AdapterMgr,
+    PPNPBRIDGE_DEVICE_CONFIG OldDevices,
+    int OldDeviceCount,
+    PPNPBRIDGE_DEVICE_CONFIG NewDevices,
+    const int* OldToNew,
+    DIGITALTWIN_INTERFACE_CLIENT_HANDLE** ReleasedInterfaces,
+    int* ReleasedCount
+    )
+{
+    PNPBRIDGE_RESULT result = PNPBRIDGE_OK;
+    PPNPADAPTER_INTERFACE_TAG* removed = NULL;
+    DIGITALTWIN_INTERFACE_CLIENT_HANDLE* released = NULL;
+    int n = 0;
+
+    *ReleasedInterfaces = NULL;
+    *ReleasedCount = 0;
+
+    for (int i = 0; i < PnpAdapterCount; i++) {
+        PPNP_ADAPTER_TAG pnpAdapter = AdapterMgr->pnpAdapters[i];
+        if (NULL == pnpAdapter) {
+            continue;
+        }
+
+        Lock(pnpAdapter->InterfaceListLock);
+
+        int count = 0;
+        LIST_ITEM_HANDLE handle = singlylinkedlist_get_head_item(pnpAdapter->pnpInterfaceList);
+        while (NULL != handle) {
+            count++;
+            handle = singlylinkedlist_get_next_item(handle);
+        }
+
+        PPNPADAPTER_INTERFACE_TAG* grown = realloc(removed, (n + count + 1) * sizeof(PPNPADAPTER_INTERFACE_TAG));
+        if (NULL != grown) {
+            removed = grown;
+        }
+        else {
+            LogError("Failed to allocate the interfaces of the removed devices. They won't be released.");
+            result = PNPBRIDGE_INSUFFICIENT_MEMORY;
+        }
+
+        handle = singlylinkedlist_get_head_item(pnpAdapter->pnpInterfaceList);
+        while (NULL != handle) {
+            PPNPADAPTER_INTERFACE_TAG adapterInterface = (PPNPADAPTER_INTERFACE_TAG)singlylinkedlist_item_get_value(handle);
+            PPNP_ADAPTER_CONTEXT_TAG context = (PPNP_ADAPTER_CONTEXT_TAG)adapterInterface->adapterContext;
+            handle = singlylinkedlist_get_next_item(handle);
+
+            // An interface whose create completed late may still point to a
+            // device of an earlier config. It is left alone.
+            if (context->deviceConfig < OldDevices || context->deviceConfig >= OldDevices + OldDeviceCount) {
+                continue;
+            }
+
+            int newIndex = OldToNew[context->deviceConfig - OldDevices];
+            if (newIndex >= 0) {
+                context->deviceConfig = &NewDevices[newIndex];
+            }
+            else if (NULL != grown) {
+                removed[n++] = adapterInterface;
+            }
+        }
+
+        Unlock(pnpAdapter->InterfaceListLock);
+    }
+
+    if (n > 0) {
+        released = calloc(n, sizeof(DIGITALTWIN_INTERFACE_CLIENT_HANDLE));
+        if (NULL == released) {
+            LogError("Failed to allocate the interfaces of the removed devices. They won't be released.");
+            free(removed);
+            return PNPBRIDGE_INSUFFICIENT_MEMORY;
+        }
+    }
+
+    // The adapters' ReleaseInterface callbacks may wait for the interface's
+    // threads, so they are invoked without holding the list lock
+    for (int i = 0; i < n; i++) {
+        PPNPADAPTER_INTERFACE_TAG adapterInterface = removed[i];
+        PPNP_ADAPTER_CONTEXT_TAG context = (PPNP_ADAPTER_CONTEXT_TAG)adapterInterface->adapterContext;
+
+        LogInfo("Releasing interface %s, its device was removed from the config", adapterInterface->interfaceId);
+
+        released[i] = PnpAdapterInterface_GetPnpInterfaceClient(adapterInterface);
+        PnpAdapterManager_RemoveInterface(context->adapter, adapterInterface);
+        adapterInterface->adapterEntry = NULL;
+        adapterInterface->params.ReleaseInterface(adapterInterface);
+    }
+
+    free(removed);
+
+    *ReleasedInterfaces = released;
+    *ReleasedCount = n;
+
+    return result;
+}
+
+PPNPADAPTER_INTERFACE_TAG
+PnpAdapterManager_FindInterface(
+    PPNP_ADAPTER_MANAGER AdapterMgr,
+    DIGITALTWIN_INTERFACE_CLIENT_HANDLE InterfaceClient
+    )
+{
+    PPNPADAPTER_INTERFACE_TAG found = NULL;
+
+    for (int i = 0; i < PnpAdapterCount && NULL == found; i++) {
+        PPNP_ADAPTER_TAG pnpAdapter = AdapterMgr->pnpAdapters[i];
+
+        Lock(pnpAdapter->InterfaceListLock);
+        LIST_ITEM_HANDLE handle = singlylinkedlist_get_head_item(pnpAdapter->pnpInterfaceList);
+        while (NULL != handle) {
+            PPNPADAPTER_INTERFACE_TAG adapterInterface = (PPNPADAPTER_INTERFACE_TAG) singlylinkedlist_item_get_value(handle);
+            if (adapterInterface->pnpInterfaceClient == InterfaceClient) {
+                found = adapterInterface;
+                break;
+            }
+            handle = singlylinkedlist_get_next_item(handle);
+        }
+        Unlock(pnpAdapter->InterfaceListLock);
+    }
+
+    return found;
+}
+
+DIGITALTWIN_INTERFACE_CLIENT_HANDLE
+PnpAdapterManager_FindInterfaceClient(
+    PPNP_ADAPTER_MANAGER AdapterMgr,
+    const char* InterfaceId,
+    const char* ComponentName
+    )
+{
+    DIGITALTWIN_INTERFACE_CLIENT_HANDLE found = NULL;
+
+    for (int i = 0; i < PnpAdapterCount && NULL == found; i++) {
+        PPNP_ADAPTER_TAG pnpAdapter = AdapterMgr->pnpAdapters[i];
+
+        Lock(pnpAdapter->InterfaceListLock);
+        LIST_ITEM_HANDLE handle = singlylinkedlist_get_head_item(pnpAdapter->pnpInterfaceList);
+        while (NULL != handle) {
+            PPNPADAPTER_INTERFACE_TAG adapterInterface = (PPNPADAPTER_INTERFACE_TAG) singlylinkedlist_item_get_value(handle);
+            if (adapterInterface->interfacePublished && 0 == strcmp(adapterInterface->interfaceId, InterfaceId) &&
+                (NULL == ComponentName ? NULL == adapterInterface->componentName :
+                 NULL != adapterInterface->componentName && 0 == strcmp(adapterInterface->componentName, ComponentName))) {
+                found = adapterInterface->pnpInterfaceClient;
+                break;
             }
             handle = singlylinkedlist_get_next_item(handle);
         }
         Unlock(pnpAdapter->InterfaceListLock);
     }
 
-    return false;
+    return found;
+}
+
+bool PnpAdapterManager_IsInterfaceIdPublished(PPNP_ADAPTER_MANAGER adapterMgr, const char* interfaceId) {
+    return PnpStringSet_Contains(adapterMgr->publishedInterfaceIds, interfaceId);
+}
+
+bool PnpAdapterManager_IsComponentNamePublished(PPNP_ADAPTER_MANAGER adapterMgr, const char* componentName) {
+    return PnpStringSet_Contains(adapterMgr->publishedComponentNames, componentName);
+}
+
+PNPBRIDGE_RESULT PnpAdapterManager_ReserveInterface(PPNP_ADAPTER_MANAGER adapterMgr, const char* interfaceId, const char* componentName) {
+    if (PNPBRIDGE_OK != PnpStringSet_Add(adapterMgr->publishedInterfaceIds, interfaceId)) {
+        return PNPBRIDGE_INSUFFICIENT_MEMORY;
+    }
+
+    if (NULL != componentName &&
+        PNPBRIDGE_OK != PnpStringSet_Add(adapterMgr->publishedComponentNames, componentName)) {
+        PnpStringSet_Remove(adapterMgr->publishedInterfaceIds, interfaceId);
+        return PNPBRIDGE_INSUFFICIENT_MEMORY;
+    }
+
+    return PNPBRIDGE_OK;
+}
+
+void PnpAdapterManager_UnreserveInterface(PPNP_ADAPTER_MANAGER adapterMgr, const char* interfaceId, const char* componentName) {
+    PnpStringSet_Remove(adapterMgr->publishedInterfaceIds, interfaceId);
+    if (NULL != componentName) {
+        PnpStringSet_Remove(adapterMgr->publishedComponentNames, componentName);
+    }
 }
 
 // TODO: Prevent duplicate interfaces
 void PnpAdapterManager_AddInterface(PPNP_ADAPTER_TAG adapter, PNPADAPTER_INTERFACE_HANDLE pnpAdapterInterface) {
     LIST_ITEM_HANDLE handle = NULL;
+    PPNPADAPTER_INTERFACE_TAG interface = (PPNPADAPTER_INTERFACE_TAG)pnpAdapterInterface;
     Lock(adapter->InterfaceListLock);
 
     handle = singlylinkedlist_add(adapter->pnpInterfaceList, pnpAdapterInterface);
     Unlock(adapter->InterfaceListLock);
 
     if (NULL != handle) {
-        PPNPADAPTER_INTERFACE_TAG interface = (PPNPADAPTER_INTERFACE_TAG)pnpAdapterInterface;
         interface->adapterEntry = handle;
+
+        if (PNPBRIDGE_OK != PnpStringSet_Add(adapter->adapterMgr->publishedInterfaceIds, interface->interfaceId)) {
+            LogError("Failed to record published interface %s", interface->interfaceId);
+        }
+
+        if (NULL != interface->componentName &&
+            PNPBRIDGE_OK != PnpStringSet_Add(adapter->adapterMgr->publishedComponentNames, interface->componentName)) {
+            LogError("Failed to record published component %s", interface->componentName);
+        }
     }
     // Handle failure case when singlylinkedlist_add returns NULL
 }
@@ -373,4 +709,9 @@ PnpAdapterManager_RemoveInterface(
     Lock(Adapter->InterfaceListLock);
     singlylinkedlist_remove(Adapter->pnpInterfaceList, interface->adapterEntry);
     Unlock(Adapter->InterfaceListLock);
+
+    PnpStringSet_Remove(Adapter->adapterMgr->publishedInterfaceIds, interface->interfaceId);
+    if (NULL != interface->componentName) {
+        PnpStringSet_Remove(Adapter->adapterMgr->publishedComponentNames, interface->componentName);
+    }
 }
@@ -11,6 +11,13 @@
 #include "pnpbridgeh.h"
 #include <iothub_client.h>
 
+#ifndef WIN32
+#include <errno.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
 //TODO:
 // 2. Try interface teardown for incremental publishing
 // 3. Update the adapters
@@ -22,14 +29,113 @@
 PPNP_BRIDGE g_PnpBridge = NULL;
 PNP_BRIDGE_STATE g_PnpBridgeState = PNP_BRIDGE_UNINITIALIZED;
 
+// Reads, validates and compiles the config file. The config snapshot is read
+// and saved if UseConfigSnapshot is set.
+static PNPBRIDGE_RESULT
+PnpBridge_LoadConfiguration(
+    const char* ConfigPath,
+    bool UseConfigSnapshot,
+    PNPBRIDGE_CONFIGURATION* Configuration
+    )
+{
+    PNPBRIDGE_RESULT result = PNPBRIDGE_OK;
+    JSON_Value* config = NULL;
+    PNPBRIDGE_CONFIG_SNAPSHOT_KEY snapshotKey = { 0 };
+    bool fromSnapshot = false;
+
+    // Get the JSON VALUE of configuration file
+    if (UseConfigSnapshot) {
+        result = PnpBridgeConfig_GetJsonValueFromSnapshot(ConfigPath, &config, &snapshotKey, &fromSnapshot);
+    }
+    else {
+        result = PnpBridgeConfig_GetJsonValueFromConfigFile(ConfigPath, &config);
+    }
+
+    if (PNPBRIDGE_OK != result) {
+        LogError("Failed to retrieve the bridge configuration from %s file.", ConfigPath);
+        return result;
+    }
+
+    // Check if config file has REQUIRED parameters
+    result = PnpBridgeConfig_RetrieveConfiguration(config, Configuration);
+    if (PNPBRIDGE_OK != result) {
+        LogError("Config file is invalid");
+    }
+    // Only a config that passed validation is compiled. The bridge runs
+    // without a snapshot if it can't be saved.
+    else if (UseConfigSnapshot && !fromSnapshot &&
+             PNPBRIDGE_OK != PnpBridgeConfig_SaveSnapshot(ConfigPath, &snapshotKey, config)) {
+        LogError("Failed to save the config snapshot. The config file will be parsed on the next start.");
+    }
+
+    // Nothing points into the config document once it has been compiled
+    json_value_free(config);
+
+    return result;
+}
+
+// Callbacks of the telemetry queue. They are invoked by its worker, which runs
+// until the pnp adapters are released.
+static bool
+PnpBridge_IsHubConnected(
+    void* Context
+    )
+{
+    PPNP_BRIDGE pnpBridge = (PPNP_BRIDGE)Context;
+
+    return IotComms_IsConnected(&pnpBridge->IotHandle);
+}
+
+static bool
+PnpBridge_GetInterfaceIdentity(
+    void* Context,
+    DIGITALTWIN_INTERFACE_CLIENT_HANDLE Interface,
+    const char** InterfaceId,
+    const char** ComponentName
+    )
+{
+    PPNP_BRIDGE pnpBridge = (PPNP_BRIDGE)Context;
+    PPNPADAPTER_INTERFACE_TAG adapterInterface = NULL;
+
+    if (NULL != pnpBridge->PnpMgr) {
+        adapterInterface = PnpAdapterManager_FindInterface(pnpBridge->PnpMgr, Interface);
+    }
+
+    if (NULL == adapterInterface) {
+        return false;
+    }
+
+    *InterfaceId = adapterInterface->interfaceId;
+    *ComponentName = adapterInterface->componentName;
+
+    return true;
+}
+
+static DIGITALTWIN_INTERFACE_CLIENT_HANDLE
+PnpBridge_FindInterfaceClient(
+    void* Context,
+    const char* InterfaceId,
+    const char* ComponentName
+    )
+{
+    PPNP_BRIDGE pnpBridge = (PPNP_BRIDGE)Context;
+
+    if (NULL == pnpBridge->PnpMgr) {
+        return NULL;
+    }
+
+    return PnpAdapterManager_FindInterfaceClient(pnpBridge->PnpMgr, InterfaceId, ComponentName);
+}
+
 PNPBRIDGE_RESULT 
 PnpBridge_Initialize(
-    PPNP_BRIDGE* PnpBridge
+    PPNP_BRIDGE* PnpBridge,
+    const char* ConfigPath,
+    bool UseConfigSnapshot
     ) 
 {
     PNPBRIDGE_RESULT result = PNPBRIDGE_OK;
     PPNP_BRIDGE pbridge = NULL;
-    JSON_Value* config = NULL;
     bool lockAcquired = false;
 
     TRY {
@@ -43,6 +149,9 @@ PnpBridge_Initialize(
             LEAVE;
         }
 
+        pbridge->ConfigPath = ConfigPath;
+        pbridge->UseConfigSnapshot = UseConfigSnapshot;
+
         pbridge->ExitCondition = Condition_Init();
         if (NULL == pbridge->ExitCondition) {
             LogError("Failed to init ExitCondition");
@@ -59,17 +168,15 @@ PnpBridge_Initialize(
         Lock(pbridge->ExitLock);
         lockAcquired = true;
 
-        // Get the JSON VALUE of configuration file
-        result = PnpBridgeConfig_GetJsonValueFromConfigFile("config.json", &config);
-        if (PNPBRIDGE_OK != result) {
-            LogError("Failed to retrieve the bridge configuration from config.json file.");
+        pbridge->RetiredConfigurations = singlylinkedlist_create();
+        if (NULL == pbridge->RetiredConfigurations) {
+            LogError("Failed to allocate the retired configuration list");
+            result = PNPBRIDGE_INSUFFICIENT_MEMORY;
             LEAVE;
         }
 
-        // Check if config file has REQUIRED parameters
-        result = PnpBridgeConfig_RetrieveConfiguration(config, &pbridge->Configuration);
+        result = PnpBridge_LoadConfiguration(ConfigPath, UseConfigSnapshot, &pbridge->Configuration);
         if (PNPBRIDGE_OK != result) {
-            LogError("Config file is invalid");
             LEAVE;
         }
 
@@ -83,7 +190,37 @@ PnpBridge_Initialize(
             }
         }
 
-        PnpMessageQueue_Create(&pbridge->MessageQueue);
+        // Enforce the memory budget before anything is queued
+        PnpMemory_SetBudget(&pbridge->Configuration.MemoryBudget);
+
+        result = PnpMessageQueue_Create(&pbridge->Configuration, &pbridge->MessageQueue);
+        if (PNPBRIDGE_OK != result) {
+            LogError("PnpMessageQueue_Create failed: %d", result);
+            LEAVE;
+        }
+
+        {
+            TELEMETRY_QUEUE_CALLBACKS callbacks = { 0 };
+
+            callbacks.Context = pbridge;
+            callbacks.IsConnected = PnpBridge_IsHubConnected;
+            callbacks.GetIdentity = PnpBridge_GetInterfaceIdentity;
+            callbacks.FindInterface = PnpBridge_FindInterfaceClient;
+            result = PnpTelemetryQueue_Create(&pbridge->Configuration, &callbacks, &pbridge->TelemetryQueue);
+        }
+        if (PNPBRIDGE_OK != result) {
+            LogError("PnpTelemetryQueue_Create failed: %d", result);
+            LEAVE;
+        }
+
+        // The bridge still works without its journal, it just waits for the
+        // discovery adapters before it publishes anything
+        if (NULL != pbridge->Configuration.JournalPath &&
+            PNPBRIDGE_OK != PnpJournal_Open(pbridge->Configuration.JournalPath, pbridge->Configuration.JournalSizeBytes, &pbridge->Journal)) {
+            LogError("Failed to open the device journal %s. Devices won't be published until they are discovered.",
+                     pbridge->Configuration.JournalPath);
+            pbridge->Journal = NULL;
+        }
 
         *PnpBridge = pbridge;
 
@@ -116,10 +253,13 @@ PnpBridge_Release(
 
     g_PnpBridgeState = PNP_BRIDGE_DESTROYED;
 
+    PnpBridge_LogMetrics(pnpBridge);
+
     // The order of resource release is important here
     // 1. First release discovery adapters so that no new PNPMESSAGE is sent
     // 2. Drain the message queue and release it
-    // 3. Release the pnp adapter resources
+    // 3. Send the queued telemetry while the interfaces still exist
+    // 4. Release the pnp adapter resources and then the telemetry queue
 
     // Stop Disovery Modules
     if (pnpBridge->DiscoveryMgr) {
@@ -133,12 +273,44 @@ PnpBridge_Release(
         pnpBridge->MessageQueue = NULL;
     }
 
+    // Nothing is journaled once the message queue worker has exited
+    if (pnpBridge->Journal) {
+        PnpJournal_Close(pnpBridge->Journal);
+        pnpBridge->Journal = NULL;
+    }
+
+    // Flush the telemetry queue. Adapters that report telemetry while they
+    // are being stopped are refused.
+    if (pnpBridge->TelemetryQueue) {
+        PnpTelemetryQueue_Stop(pnpBridge->TelemetryQueue);
+    }
+
     // Stop Pnp Modules
     if (pnpBridge->PnpMgr) {
         PnpAdapterManager_Release(pnpBridge->PnpMgr);
         pnpBridge->PnpMgr = NULL;
     }
 
+    if (pnpBridge->TelemetryQueue) {
+        PnpTelemetryQueue_Release(pnpBridge->TelemetryQueue);
+        pnpBridge->TelemetryQueue = NULL;
+    }
+
+    PnpMemory_SetBudget(NULL);
+
+    PnpBridgeConfig_ReleaseConfiguration(&pnpBridge->Configuration);
+
+    if (NULL != pnpBridge->RetiredConfigurations) {
+        LIST_ITEM_HANDLE handle = singlylinkedlist_get_head_item(pnpBridge->RetiredConfigurations);
+        while (NULL != handle) {
+            PNPBRIDGE_CONFIGURATION* retired = (PNPBRIDGE_CONFIGURATION*)singlylinkedlist_item_get_value(handle);
+            PnpBridgeConfig_ReleaseConfiguration(retired);
+            free(retired);
+            handle = singlylinkedlist_get_next_item(handle);
+        }
+        singlylinkedlist_destroy(pnpBridge->RetiredConfigurations);
+    }
+
     if (NULL != pnpBridge->ExitCondition) {
         Condition_Deinit(pnpBridge->ExitCondition);
     }
@@ -152,6 +324,38 @@ PnpBridge_Release(
     }
 }
 
+// Queues a journaled device as if its discovery adapter had reported it
+void
+PnpBridge_ReplayJournalEntry(
+    _In_ void* Context,
+    _In_ const PNPBRIDGE_JOURNAL_ENTRY* Entry
+    )
+{
+    PPNP_BRIDGE pnpBridge = (PPNP_BRIDGE)Context;
+    PNPMESSAGE message = NULL;
+
+    // The adapter may have been removed from the manifest or stopped journaling
+    PPNP_ADAPTER adapter = PnpAdapterManager_GetAdapter(pnpBridge->PnpMgr,
+                               PnpAdapterManager_FindIdentity(pnpBridge->PnpMgr, Entry->AdapterIdentity));
+    if (NULL == adapter || 0 == (adapter->flags & PNPADAPTER_FLAG_JOURNAL_REPLAY)) {
+        LogInfo("Not replaying journaled interface %s of adapter %s", Entry->InterfaceId, Entry->AdapterIdentity);
+        return;
+    }
+
+    if (0 != PnpMessage_CreateMessageWithPayload(&message, Entry->Message, Entry->InterfaceId, Entry->ComponentName)) {
+        LogError("Failed to create the PNPMESSAGE of journaled interface %s", Entry->InterfaceId);
+        return;
+    }
+
+    PnpMessage_AccessProperties(message)->ChangeType = PNPBRIDGE_INTERFACE_CHANGE_PERSIST;
+
+    if (PNPBRIDGE_OK != PnpMesssageQueue_Add(pnpBridge->MessageQueue, message)) {
+        LogError("Failed to queue journaled interface %s", Entry->InterfaceId);
+    }
+
+    PnpMessage_ReleaseReference(message);
+}
+
 int 
 PnpBridge_Worker(
     _In_ void* ThreadArgument
@@ -163,11 +367,12 @@ PnpBridge_Worker(
 
     PNPBRIDGE_RESULT result = PNPBRIDGE_OK;
 
-    // Publish persistent Pnp Interfaces
-    /* result = DiscoveryAdapterManager_PublishAlwaysInterfaces(pnpBridge->discoveryMgr, pnpBridge->Configuration.JsonConfig);
-    if (!PNPBRIDGE_SUCCESS(result)) {
-        goto exit;
-    }*/
+    // Publish the journaled interfaces of the last run before the discovery
+    // adapters report their devices again
+    if (NULL != pnpBridge->Journal) {
+        int replayed = PnpJournal_Replay(pnpBridge->Journal, PnpBridge_ReplayJournalEntry, pnpBridge);
+        LogInfo("Replayed %d journaled interface(s)", replayed);
+    }
 
     // Start Device Discovery
     result = DiscoveryAdapterManager_Start(pnpBridge->DiscoveryMgr, &pnpBridge->Configuration);
@@ -197,15 +402,15 @@ PnpBridge_ValidateDeviceChangePayload(
     return PNPBRIDGE_OK;
 }
 
-int 
-PnpBridge_ProcessPnpMessage(
-    PNPMESSAGE PnpMessage
+// Matches a PNPMESSAGE against the configured devices and caches the matched
+// device config, adapter index, interface id and component name in the payload
+PNPBRIDGE_RESULT
+PnpBridge_MatchPnpMessage(
+    _In_ PNPMESSAGE PnpMessage
     )
 {
     PPNP_BRIDGE pnpBridge = g_PnpBridge;
     PNPBRIDGE_RESULT result = PNPBRIDGE_OK;
-    bool containsFilter = false;
-    int key = 0;
     JSON_Value* jmsg = NULL;
     PPNPBRIDGE_CHANGE_PAYLOAD msg = NULL;
 
@@ -220,7 +425,7 @@ PnpBridge_ProcessPnpMessage(
         }
 
         JSON_Object* jobj;
-        JSON_Object* jdevice;
+        PPNPBRIDGE_DEVICE_CONFIG device;
 
         jmsg = json_parse_string(msg->Message);
         if (NULL == jmsg) {
@@ -236,81 +441,148 @@ PnpBridge_ProcessPnpMessage(
             LEAVE;
         }
 
-        if (PNPBRIDGE_OK != Configuration_IsDeviceConfigured(pnpBridge->Configuration.JsonConfig, jobj, &jdevice)) {
+        if (PNPBRIDGE_OK != Configuration_IsDeviceConfigured(&pnpBridge->Configuration, jobj, &device)) {
             LogInfo("Dropping the change notification reported by a discovery adapter");
             result = PNPBRIDGE_INVALID_ARGS;
             LEAVE;
         }
 
-        result = PnpAdapterManager_SupportsIdentity(pnpBridge->PnpMgr, jdevice, &containsFilter, &key);
-        if (PNPBRIDGE_OK != result) {
+        // The adapter was resolved when the adapter manager was created
+        if (device->PnpAdapterKey < 0) {
+            LogError("PnpAdapter %s is not present in AdapterManifest. Dropping device change callback", device->PnpAdapterIdentity);
             result = PNPBRIDGE_INVALID_ARGS;
             LEAVE;
         }
 
-        if (!containsFilter) {
-            LogError("Dropping device change callback");
-            result = PNPBRIDGE_INVALID_ARGS;
-            LEAVE;
-        }
-
-        // Create an Pnp interface
-        char* interfaceId = NULL;
-        char* componentName = NULL;
-        char* selfDescribing = (char*)json_object_get_string(jdevice, PNP_CONFIG_SELF_DESCRIBING);
-        if (NULL != selfDescribing && 0 == strcmp(selfDescribing, "true")) {
-            interfaceId = msg->InterfaceId;
-            if (NULL == interfaceId) {
+        if (device->SelfDescribing) {
+            if (NULL == msg->InterfaceId) {
                 LogError("Interface id is missing for self describing device");
                 result = PNPBRIDGE_INVALID_ARGS;
                 LEAVE;
             }
         }
         else {
-            interfaceId = (char*)json_object_get_string(jdevice, PNP_CONFIG_INTERFACE_ID);
-            if (NULL == interfaceId) {
+            if (NULL == device->InterfaceId) {
                 LogError(PNP_CONFIG_INTERFACE_ID " is missing in config for the device");
                 result = PNPBRIDGE_INVALID_ARGS;
                 LEAVE;
             }
 
-            componentName = (char*)json_object_get_string(jdevice, PNP_CONFIG_COMPONENT_NAME);
-            if (NULL == componentName) {
+            if (NULL == device->ComponentName) {
                 LogError(PNP_CONFIG_COMPONENT_NAME " is missing in config for the device");
                 result = PNPBRIDGE_INVALID_ARGS;
                 LEAVE;
             }
 
             // Add interfaceId to the message
-            PnpMessage_SetInterfaceId(PnpMessage, interfaceId);
+            if (0 != PnpMessage_SetInterfaceId(PnpMessage, device->InterfaceId)) {
+                result = PNPBRIDGE_INSUFFICIENT_MEMORY;
+                LEAVE;
+            }
 
             // Add the component name
-            mallocAndStrcpy_s(&PnpMessage_AccessProperties(PnpMessage)->ComponentName, componentName);
+            if (0 != PnpMessage_SetComponentName(PnpMessage, device->ComponentName)) {
+                result = PNPBRIDGE_INSUFFICIENT_MEMORY;
+                LEAVE;
+            }
         }
 
-        if (PnpAdapterManager_IsInterfaceIdPublished(pnpBridge->PnpMgr, interfaceId)) {
-            LogError("PnP Interface has already been published. Dropping the change notification. \n");
-            result = PNPBRIDGE_FAILED;
-            LEAVE;
+        msg->Match.DeviceConfig = device;
+        msg->Match.AdapterIndex = device->PnpAdapterKey;
+        msg->Match.Valid = true;
+    } FINALLY {
+        if (NULL != jmsg) {
+            json_value_free(jmsg);
         }
+    }
 
-        result = PnpAdapterManager_CreatePnpInterface(pnpBridge->PnpMgr, &pnpBridge->IotHandle, key, jdevice, PnpMessage);
-        if (!PNPBRIDGE_SUCCESS(result)) {
-            LEAVE;
+    return result;
+}
+
+int 
+PnpBridge_ProcessPnpMessage(
+    PNPMESSAGE PnpMessage
+    )
+{
+    PPNP_BRIDGE pnpBridge = g_PnpBridge;
+    PNPBRIDGE_RESULT result = PNPBRIDGE_OK;
+    PPNPBRIDGE_CHANGE_PAYLOAD msg = NULL;
+
+    msg = (PPNPBRIDGE_CHANGE_PAYLOAD) PnpMemory_GetBuffer(PnpMessage, NULL);
+
+    // Only parse and match the message the first time it is processed
+    if (!msg->Match.Valid) {
+        result = PnpBridge_MatchPnpMessage(PnpMessage);
+        if (PNPBRIDGE_OK != result) {
+            return result;
         }
+    }
 
-        //// Query all the pnp interface clients and publish them
-        //DiscoveryAdapter_PublishInterfaces();
+    PNPMESSAGE_CHANGE_TYPE changeType = msg->Properties.ChangeType;
+    if (PNPBRIDGE_INTERFACE_CHANGE_PERSIST == changeType) {
+        PPNP_ADAPTER adapter = PnpAdapterManager_GetAdapter(pnpBridge->PnpMgr, msg->Match.AdapterIndex);
+        if (NULL == adapter || 0 == (adapter->flags & PNPADAPTER_FLAG_JOURNAL_REPLAY)) {
+            LogError("Journaled interface %s now matches an adapter that doesn't replay it. Dropping it.", msg->InterfaceId);
+            return PNPBRIDGE_FAILED;
+        }
+    }
 
-    } FINALLY {
-        if (NULL != jmsg) {
-            json_value_free(jmsg);
+    if (PnpAdapterManager_IsInterfaceIdPublished(pnpBridge->PnpMgr, msg->InterfaceId)) {
+        // A device whose interface was replayed from the journal has been
+        // discovered. Hand it to the interface instead of dropping it.
+        if (PNPMESSAGE_CHANGE_ARRIVAL == changeType && NULL != pnpBridge->Journal &&
+            PnpJournal_Confirm(pnpBridge->Journal, msg->InterfaceId)) {
+            LogInfo("Journaled interface %s has been discovered", msg->InterfaceId);
+            PnpAdapterManager_DeviceArrived(pnpBridge->PnpMgr, msg->InterfaceId, PnpMessage);
+            return PNPBRIDGE_FAILED;
         }
+
+        LogError("PnP Interface has already been published. Dropping the change notification. \n");
+        return PNPBRIDGE_FAILED;
+    }
+
+    if (NULL != msg->Properties.ComponentName &&
+        PnpAdapterManager_IsComponentNamePublished(pnpBridge->PnpMgr, msg->Properties.ComponentName)) {
+        LogError("Component %s has already been published. Dropping the change notification.", msg->Properties.ComponentName);
+        return PNPBRIDGE_FAILED;
     }
 
+    // Hold the interface id and component name until the interface is created,
+    // so that a duplicate in the same batch is dropped while this one is
+    // still being created on the work pool
+    return PnpAdapterManager_ReserveInterface(pnpBridge->PnpMgr, msg->InterfaceId, msg->Properties.ComponentName);
+}
+
+int
+PnpBridge_CreatePnpInterface(
+    PNPMESSAGE PnpMessage
+    )
+{
+    PPNP_BRIDGE pnpBridge = g_PnpBridge;
+    PNPBRIDGE_RESULT result = PNPBRIDGE_OK;
+    PPNPBRIDGE_CHANGE_PAYLOAD msg = NULL;
+
+    msg = (PPNPBRIDGE_CHANGE_PAYLOAD) PnpMemory_GetBuffer(PnpMessage, NULL);
+
+    // Create an Pnp interface
+    result = PnpAdapterManager_CreatePnpInterface(pnpBridge->PnpMgr, &pnpBridge->IotHandle, msg->Match.AdapterIndex, msg->Match.DeviceConfig, PnpMessage);
+
+    // The interface, if it was created, now holds its own entries
+    PnpAdapterManager_UnreserveInterface(pnpBridge->PnpMgr, msg->InterfaceId, msg->Properties.ComponentName);
+
     return result;
 }
 
+void
+PnpBridge_CancelPnpMessage(
+    PNPMESSAGE PnpMessage
+    )
+{
+    PPNPBRIDGE_CHANGE_PAYLOAD msg = (PPNPBRIDGE_CHANGE_PAYLOAD) PnpMemory_GetBuffer(PnpMessage, NULL);
+
+    PnpAdapterManager_UnreserveInterface(g_PnpBridge->PnpMgr, msg->InterfaceId, msg->Properties.ComponentName);
+}
+
 int
 DiscoveryAdapter_PublishInterfaces() {
     // Query all the pnp interface clients and publish them
@@ -318,10 +590,15 @@ DiscoveryAdapter_PublishInterfaces() {
     int interfaceCount = 0;
     PNPBRIDGE_RESULT result;
     DIGITALTWIN_INTERFACE_CLIENT_HANDLE* interfaces = NULL;
+    tickcounter_ms_t publishStart = 0;
+    tickcounter_ms_t publishEnd = 0;
     PnpAdapterManager_GetAllInterfaces(pnpBridge->PnpMgr, &interfaces, &interfaceCount);
 
     LogInfo("Publishing %d Azure Pnp Interface(s)", interfaceCount);
 
+    // This runs on the message queue worker, which owns the tick counter
+    tickcounter_get_current_ms(pnpBridge->MessageQueue->TickCounter, &publishStart);
+
     result = IotComms_RegisterPnPInterfaces(&pnpBridge->IotHandle,
                                             pnpBridge->Configuration.ConnParams->DeviceCapabilityModelUri,
                                             interfaces,
@@ -333,34 +610,48 @@ DiscoveryAdapter_PublishInterfaces() {
         goto end;
     }
 
-    // Notify interfaces of successful publish
-    PnpAdapterManager_InvokeStartInterface(pnpBridge->PnpMgr);
+    tickcounter_get_current_ms(pnpBridge->MessageQueue->TickCounter, &publishEnd);
+    pnpBridge->IotHandle.LastRegistrationMs = (long)(publishEnd - publishStart);
+    if (pnpBridge->IotHandle.LastRegistrationMs > pnpBridge->IotHandle.MaxRegistrationMs) {
+        pnpBridge->IotHandle.MaxRegistrationMs = pnpBridge->IotHandle.LastRegistrationMs;
+    }
 
-end:
-    free(interfaces);
-    return result;
-}
+    // Journal the devices of the newly published interfaces. This runs on the
+    // message queue worker, which owns the PublishQueue.
+    if (NULL != pnpBridge->Journal) {
+        PDLIST_ENTRY entry = pnpBridge->MessageQueue->PublishQueue.Flink;
+        while (entry != &pnpBridge->MessageQueue->PublishQueue) {
+            PPNPBRIDGE_CHANGE_PAYLOAD msg = containingRecord(entry, PNPBRIDGE_CHANGE_PAYLOAD, Entry);
+            entry = entry->Flink;
 
-int
-PnpBridge_ReinitPnpAdapters()
-{
-    PPNP_BRIDGE pnpBridge = g_PnpBridge;
-    PNPBRIDGE_RESULT result = PNPBRIDGE_OK;
+            if (msg->Journaled) {
+                continue;
+            }
+            msg->Journaled = true;
 
-    if (pnpBridge->PnpMgr) {
-        PnpAdapterManager_Release(pnpBridge->PnpMgr);
-        pnpBridge->PnpMgr = NULL;
-    }
+            // Replayed devices are already in the journal
+            PPNP_ADAPTER adapter = PnpAdapterManager_GetAdapter(pnpBridge->PnpMgr, msg->Match.AdapterIndex);
+            if (PNPBRIDGE_INTERFACE_CHANGE_PERSIST == msg->Properties.ChangeType ||
+                NULL == adapter || 0 == (adapter->flags & PNPADAPTER_FLAG_JOURNAL_REPLAY)) {
+                continue;
+            }
 
-    // Load all the adapters in interface manifest that implement Azure IoT PnP Interface
-    // PnpBridge will call into corresponding adapter when a device is reported by 
-    // DiscoveryExtension
-    result = PnpAdapterManager_Create(&pnpBridge->PnpMgr, pnpBridge->Configuration.JsonConfig);
-    if (PNPBRIDGE_OK != result) {
-        LogError("PnpAdapterManager_Create failed: %d", result);
+            PNPBRIDGE_JOURNAL_ENTRY journalEntry = { 0 };
+            journalEntry.AdapterIdentity = adapter->identity;
+            journalEntry.InterfaceId = msg->InterfaceId;
+            journalEntry.ComponentName = msg->Properties.ComponentName;
+            journalEntry.Message = msg->Message;
+            PnpJournal_Record(pnpBridge->Journal, &journalEntry);
+        }
     }
 
-    return 0;
+    // Notify newly created interfaces of successful publish
+    PnpAdapterManager_InvokeStartInterface(pnpBridge->PnpMgr, pnpBridge->MessageQueue->WorkPool,
+                                           pnpBridge->MessageQueue->CallbackTimeoutMs);
+
+end:
+    free(interfaces);
+    return result;
 }
 
 int 
@@ -376,19 +667,586 @@ DiscoveryAdapter_ReportDevice(
 
     PMESSAGE_QUEUE queue = g_PnpBridge->MessageQueue;
 
-    // Add it to PnpMessagesList
-    PnpMesssageQueue_Add(queue, PnpMessage);
+    // Devices that arrive while the bridge is close to its memory budget are
+    // refused. Removals are still processed since they free memory.
+    if (PNPMESSAGE_CHANGE_ARRIVAL == PnpMessage_AccessProperties(PnpMessage)->ChangeType &&
+        PnpMemory_GetSheddingLevel() >= PNPMEMORY_SHED_ARRIVALS) {
+        PNPBRIDGE_INTERLOCKED_INCREMENT(&g_PnpBridge->RefusedArrivals);
+        LogError("PnpBridge is over its memory budget. Refusing the device arrival");
+        return -1;
+    }
+
+    // Add it to PnpMessagesList. This notifies the worker if it is idle.
+    if (PNPBRIDGE_OK != PnpMesssageQueue_Add(queue, PnpMessage)) {
+        return -1;
+    }
+
+    return 0;
+}
+
+// Logs the counters of the bridge queues
+void
+PnpBridge_LogMetrics(
+    _In_ PPNP_BRIDGE pnpBridge
+    )
+{
+    if (NULL != pnpBridge->MessageQueue) {
+        PNPBRIDGE_QUEUE_STATISTICS stats;
+        PnpMessageQueue_GetStatistics(pnpBridge->MessageQueue, &stats);
+        LogInfo("Metrics: message queue depth %ld/%ld, high water mark %ld, dropped %ld, blocked %ld",
+                stats.Depth, stats.Capacity, stats.HighWaterMark, stats.Dropped, stats.Blocked);
+    }
+
+    if (NULL != pnpBridge->TelemetryQueue) {
+        TELEMETRY_QUEUE_STATISTICS stats;
+        PnpTelemetryQueue_GetStatistics(pnpBridge->TelemetryQueue, &stats);
+        LogInfo("Metrics: telemetry queue depth %ld/%ld, high water mark %ld, dropped %ld, blocked %ld, "
+                "sent %ld, merged %ld, shed %ld, failed %ld, max latency %lu ms",
+                stats.Queue.Depth, stats.Queue.Capacity, stats.Queue.HighWaterMark, stats.Queue.Dropped,
+                stats.Queue.Blocked, stats.Sent, stats.Merged, stats.Shed, stats.SendFailures,
+                (unsigned long)stats.MaxLatencyMs);
+
+        if (0 != stats.Spool.CapacityBytes) {
+            long oldestAge = (0 != stats.Spool.OldestTime) ? (long)difftime(time(NULL), stats.Spool.OldestTime) : 0;
+
+            LogInfo("Metrics: telemetry spool depth %ld readings, %lld/%lld bytes, oldest %ld s, "
+                    "spooled %ld, replayed %ld, dropped %ld, replay dropped %ld",
+                    stats.Spool.Depth, stats.Spool.Bytes, stats.Spool.CapacityBytes, oldestAge,
+                    stats.Spooled, stats.Replayed, stats.Spool.Dropped, stats.ReplayDropped);
+        }
+    }
+
+    LogInfo("Metrics: hub connects %ld, DPS registrations %ld, interface registrations %ld, "
+            "last registration %ld ms, max %ld ms",
+            PNPBRIDGE_INTERLOCKED_READ(&pnpBridge->IotHandle.Connects),
+            PNPBRIDGE_INTERLOCKED_READ(&pnpBridge->IotHandle.Provisionings),
+            PNPBRIDGE_INTERLOCKED_READ(&pnpBridge->IotHandle.Registrations),
+            PNPBRIDGE_INTERLOCKED_READ(&pnpBridge->IotHandle.LastRegistrationMs),
+            PNPBRIDGE_INTERLOCKED_READ(&pnpBridge->IotHandle.MaxRegistrationMs));
+
+    {
+        PNPMEMORY_STATISTICS stats;
+        PnpMemory_GetStatistics(&stats);
+        LogInfo("Metrics: memory pool hits %ld, misses %ld, resident %ld bytes",
+                stats.Hits, stats.Misses, stats.ResidentBytes);
+        if (0 != stats.BudgetLimitBytes) {
+            LogInfo("Metrics: memory budget %ld/%ld bytes, peak %ld, shedding %s, refused allocations %ld, "
+                    "refused arrivals %ld",
+                    stats.BudgetUsedBytes, stats.BudgetLimitBytes, stats.BudgetPeakBytes,
+                    PnpMemory_GetSheddingLevelName(stats.SheddingLevel), stats.Refused,
+                    PNPBRIDGE_INTERLOCKED_READ(&pnpBridge->RefusedArrivals));
+        }
+    }
+
+    // Logs nothing unless the bridge is built with use_memory_accounting
+    PnpMemory_LogTagStatistics("Metrics");
+}
+
+// How often the connection monitor checks whether the telemetry backs up
+#define PNPBRIDGE_CONNECTION_MONITOR_POLL_MS 1000
+
+static const char*
+PnpBridge_ConnectionStateToString(
+    PNPBRIDGE_CONNECTION_STATE State
+    )
+{
+    switch (State) {
+    case PNPBRIDGE_CONNECTION_STATE_CONNECTED:
+        return "connected";
+    case PNPBRIDGE_CONNECTION_STATE_THROTTLED:
+        return "throttled";
+    default:
+        return "disconnected";
+    }
+}
+
+// The bridge is throttled while it is connected but the hub doesn't keep up
+// with the telemetry, which shows as a telemetry queue that is half full or
+// a spool that is still being replayed
+static PNPBRIDGE_CONNECTION_STATE
+PnpBridge_GetConnectionState(
+    PPNP_BRIDGE pnpBridge,
+    bool Connected
+    )
+{
+    TELEMETRY_QUEUE_STATISTICS stats;
+
+    if (!Connected) {
+        return PNPBRIDGE_CONNECTION_STATE_DISCONNECTED;
+    }
 
-    // Notify the worker
-    Lock(queue->WaitConditionLock);
-    Condition_Post(queue->WaitCondition);
-    Unlock(queue->WaitConditionLock);
+    PnpTelemetryQueue_GetStatistics(pnpBridge->TelemetryQueue, &stats);
+    if ((stats.Queue.Capacity > 0 && 2 * stats.Queue.Depth >= stats.Queue.Capacity) || stats.Spool.Depth > 0) {
+        return PNPBRIDGE_CONNECTION_STATE_THROTTLED;
+    }
+
+    return PNPBRIDGE_CONNECTION_STATE_CONNECTED;
+}
+
+// Broadcasts the connection state to the pnp adapters whenever it changes.
+// The state starts out connected, which is what the adapters assume.
+static int
+PnpBridge_ConnectionMonitor(
+    void* ThreadArgument
+    )
+{
+    PPNP_BRIDGE pnpBridge = (PPNP_BRIDGE)ThreadArgument;
+    PNPBRIDGE_CONNECTION_STATE state = PNPBRIDGE_CONNECTION_STATE_CONNECTED;
+    bool connected = true;
+
+    while (!pnpBridge->ConnectionMonitorStop) {
+        connected = IotComms_WaitForConnectionChange(&pnpBridge->IotHandle, connected, PNPBRIDGE_CONNECTION_MONITOR_POLL_MS);
+
+        PNPBRIDGE_CONNECTION_STATE newState = PnpBridge_GetConnectionState(pnpBridge, connected);
+        if (newState != state && !pnpBridge->ConnectionMonitorStop) {
+            LogInfo("Connection state changed from %s to %s", PnpBridge_ConnectionStateToString(state),
+                    PnpBridge_ConnectionStateToString(newState));
+            state = newState;
+            PnpAdapterManager_NotifyConnectionState(pnpBridge->PnpMgr, state);
+        }
+    }
 
     return 0;
 }
 
+static void
+PnpBridge_StartConnectionMonitor(
+    PPNP_BRIDGE pnpBridge
+    )
+{
+    pnpBridge->ConnectionMonitorStop = false;
+    if (THREADAPI_OK != ThreadAPI_Create(&pnpBridge->ConnectionMonitor, PnpBridge_ConnectionMonitor, pnpBridge)) {
+        LogError("Failed to create the connection monitor, the pnp adapters won't be told about connection changes");
+        pnpBridge->ConnectionMonitor = NULL;
+    }
+}
+
+// Must be called before the pnp adapters are released
+static void
+PnpBridge_StopConnectionMonitor(
+    PPNP_BRIDGE pnpBridge
+    )
+{
+    if (NULL != pnpBridge->ConnectionMonitor) {
+        pnpBridge->ConnectionMonitorStop = true;
+        ThreadAPI_Join(pnpBridge->ConnectionMonitor, NULL);
+        pnpBridge->ConnectionMonitor = NULL;
+    }
+}
+
+#ifndef WIN32
+static void*
+PnpBridge_MetricsSignalWorker(
+    void* ThreadArgument
+    )
+{
+    PPNP_BRIDGE pnpBridge = (PPNP_BRIDGE)ThreadArgument;
+    sigset_t signals;
+
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR1);
+
+    for (;;) {
+        int received = 0;
+        if (0 != sigwait(&signals, &received)) {
+            continue;
+        }
+
+        if (pnpBridge->MetricsSignalStop) {
+            break;
+        }
+
+        LogInfo("SIGUSR1 received, logging the metrics");
+        PnpBridge_LogMetrics(pnpBridge);
+    }
+
+    return NULL;
+}
+
+// SIGUSR1 is blocked in every bridge thread and taken with sigwait by a
+// dedicated thread, which is free to log unlike a signal handler. Must be
+// called before any bridge thread is created so they inherit the mask.
+static void
+PnpBridge_BlockMetricsSignal()
+{
+    sigset_t signals;
+
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR1);
+    if (0 != pthread_sigmask(SIG_BLOCK, &signals, NULL)) {
+        LogError("Failed to block SIGUSR1, the metrics can't be logged on demand");
+    }
+}
+
+static void
+PnpBridge_StartMetricsSignalThread(
+    PPNP_BRIDGE pnpBridge
+    )
+{
+    pnpBridge->MetricsSignalStop = false;
+    if (0 != pthread_create(&pnpBridge->MetricsSignalThread, NULL, PnpBridge_MetricsSignalWorker, pnpBridge)) {
+        LogError("Failed to create the SIGUSR1 metrics thread");
+        return;
+    }
+
+    pnpBridge->MetricsSignalThreadStarted = true;
+}
+
+static void
+PnpBridge_StopMetricsSignalThread(
+    PPNP_BRIDGE pnpBridge
+    )
+{
+    if (pnpBridge->MetricsSignalThreadStarted) {
+        pnpBridge->MetricsSignalStop = true;
+        pthread_kill(pnpBridge->MetricsSignalThread, SIGUSR1);
+        pthread_join(pnpBridge->MetricsSignalThread, NULL);
+        pnpBridge->MetricsSignalThreadStarted = false;
+    }
+}
+#endif
+
+// A reloaded configuration handed to the message queue worker
+typedef struct _PNPBRIDGE_RELOAD {
+    PPNP_BRIDGE Bridge;
+    PNPBRIDGE_CONFIGURATION* Configuration;
+
+    // Index of each reloaded device in the running config, or -1
+    const int* NewToOld;
+} PNPBRIDGE_RELOAD, *PPNPBRIDGE_RELOAD;
+
+// Exchanges the devices and the adapter parameters of two configurations.
+// The other settings of the running config are kept.
+static void
+PnpBridge_SwapDevices(
+    PNPBRIDGE_CONFIGURATION* Config1,
+    PNPBRIDGE_CONFIGURATION* Config2
+    )
+{
+    PNPBRIDGE_CONFIGURATION swap = *Config1;
+
+    Config1->Devices = Config2->Devices;
+    Config1->DeviceCount = Config2->DeviceCount;
+    Config1->PnpAdapters = Config2->PnpAdapters;
+    Config1->PnpAdapterCount = Config2->PnpAdapterCount;
+    Config1->DiscoveryAdapters = Config2->DiscoveryAdapters;
+    Config1->DiscoveryAdapterCount = Config2->DiscoveryAdapterCount;
+    Config1->Strings = Config2->Strings;
+    Config1->DeviceIndex = Config2->DeviceIndex;
+
+    Config2->Devices = swap.Devices;
+    Config2->DeviceCount = swap.DeviceCount;
+    Config2->PnpAdapters = swap.PnpAdapters;
+    Config2->PnpAdapterCount = swap.PnpAdapterCount;
+    Config2->DiscoveryAdapters = swap.DiscoveryAdapters;
+    Config2->DiscoveryAdapterCount = swap.DiscoveryAdapterCount;
+    Config2->Strings = swap.Strings;
+    Config2->DeviceIndex = swap.DeviceIndex;
+}
+
+// Runs on the message queue worker, which owns the PublishQueue and matches
+// the PNPMESSAGEs against the running config. Interfaces of unchanged devices
+// are moved to the reloaded config and the others are released, then the
+// reloaded devices replace the running ones.
+static int
+PnpBridge_ApplyConfiguration(
+    void* Context
+    )
+{
+    PPNPBRIDGE_RELOAD reload = (PPNPBRIDGE_RELOAD)Context;
+    PPNP_BRIDGE pnpBridge = reload->Bridge;
+    PNPBRIDGE_CONFIGURATION* running = &pnpBridge->Configuration;
+    PNPBRIDGE_CONFIGURATION* reloaded = reload->Configuration;
+    DIGITALTWIN_INTERFACE_CLIENT_HANDLE* released = NULL;
+    int releasedCount = 0;
+    int* oldToNew = NULL;
+
+    oldToNew = malloc((running->DeviceCount > 0 ? running->DeviceCount : 1) * sizeof(int));
+    if (NULL == oldToNew) {
+        LogError("Failed to allocate the device mapping of the reloaded config");
+        return PNPBRIDGE_INSUFFICIENT_MEMORY;
+    }
+
+    for (int i = 0; i < running->DeviceCount; i++) {
+        oldToNew[i] = -1;
+    }
+
+    for (int i = 0; i < reloaded->DeviceCount; i++) {
+        if (reload->NewToOld[i] >= 0) {
+            oldToNew[reload->NewToOld[i]] = i;
+        }
+    }
+
+    PnpAdapterManager_ResolveDevices(pnpBridge->PnpMgr, reloaded);
+
+    // The telemetry of the released interfaces is dropped before it is sent
+    PnpTelemetryQueue_Suspend(pnpBridge->TelemetryQueue);
+    if (PNPBRIDGE_OK != PnpAdapterManager_RemapDevices(pnpBridge->PnpMgr, running->Devices, running->DeviceCount,
+                                                       reloaded->Devices, oldToNew, &released, &releasedCount)) {
+        LogError("Failed to release the interfaces of the removed devices");
+    }
+    PnpTelemetryQueue_Resume(pnpBridge->TelemetryQueue, released, releasedCount);
+
+    // The messages of the published devices are moved along with their interfaces
+    PDLIST_ENTRY entry = pnpBridge->MessageQueue->PublishQueue.Flink;
+    while (entry != &pnpBridge->MessageQueue->PublishQueue) {
+        PPNPBRIDGE_CHANGE_PAYLOAD msg = containingRecord(entry, PNPBRIDGE_CHANGE_PAYLOAD, Entry);
+        PPNPBRIDGE_DEVICE_CONFIG device = msg->Match.DeviceConfig;
+        entry = entry->Flink;
+
+        if (device < running->Devices || device >= running->Devices + running->DeviceCount) {
+            continue;
+        }
+
+        int newIndex = oldToNew[device - running->Devices];
+        if (newIndex >= 0) {
+            msg->Match.DeviceConfig = &reloaded->Devices[newIndex];
+        }
+        else {
+            DList_RemoveEntryList(&msg->Entry);
+            pnpBridge->MessageQueue->PublishCount--;
+            PnpMessage_ReleaseReference(msg->Self);
+        }
+    }
+
+    PnpBridge_SwapDevices(running, reloaded);
+
+    // Re-register the remaining interfaces over the same IoT Hub connection
+    if (releasedCount > 0) {
+        DiscoveryAdapter_PublishInterfaces();
+    }
+
+    LogInfo("Applied the reloaded config, %d interface(s) released", releasedCount);
+
+    free(released);
+    free(oldToNew);
+
+    return PNPBRIDGE_OK;
+}
+
+// Reloads the config file and applies the devices that were added, removed or
+// changed. Only the discovery adapters of those devices are restarted and the
+// interfaces of the other devices keep running.
+static void
+PnpBridge_ReloadConfiguration(
+    PPNP_BRIDGE pnpBridge
+    )
+{
+    PNPBRIDGE_CONFIGURATION* reloaded = NULL;
+    int* newToOld = NULL;
+    int changeCount = 0;
+    int restartCount = 0;
+    bool retire = false;
+
+    TRY {
+        reloaded = calloc(1, sizeof(PNPBRIDGE_CONFIGURATION));
+        if (NULL == reloaded) {
+            LogError("Failed to allocate the reloaded config");
+            LEAVE;
+        }
+
+        if (PNPBRIDGE_OK != PnpBridge_LoadConfiguration(pnpBridge->ConfigPath, pnpBridge->UseConfigSnapshot, reloaded)) {
+            LogError("The bridge keeps running with the devices of the current config");
+            LEAVE;
+        }
+
+        newToOld = calloc(reloaded->DeviceCount > 0 ? reloaded->DeviceCount : 1, sizeof(int));
+        if (NULL == newToOld) {
+            LogError("Failed to allocate the device mapping of the reloaded config");
+            LEAVE;
+        }
+
+        if (PNPBRIDGE_OK != Configuration_DiffDevices(&pnpBridge->Configuration, reloaded, newToOld, &changeCount)) {
+            LEAVE;
+        }
+
+        restartCount = DiscoveryAdapterManager_StopChangedAdapters(pnpBridge->DiscoveryMgr, &pnpBridge->Configuration,
+                                                                   reloaded, newToOld);
+        if (restartCount < 0) {
+            LEAVE;
+        }
+
+        if (0 == changeCount && 0 == restartCount) {
+            LogInfo("The devices in %s are unchanged", pnpBridge->ConfigPath);
+            LEAVE;
+        }
+
+        LogInfo("Reloading %s: %d device(s) added or removed, %d discovery adapter(s) restarted. "
+                "The other settings take effect when the bridge is restarted.",
+                pnpBridge->ConfigPath, changeCount, restartCount);
+
+        PNPBRIDGE_RELOAD reload = { 0 };
+        int applyResult = PNPBRIDGE_FAILED;
+
+        reload.Bridge = pnpBridge;
+        reload.Configuration = reloaded;
+        reload.NewToOld = newToOld;
+
+        // The stopped adapters stay stopped if the bridge is torn down
+        if (PNPBRIDGE_OK != PnpMessageQueue_RunOnWorker(pnpBridge->MessageQueue, PnpBridge_ApplyConfiguration,
+                                                        &reload, &applyResult)) {
+            LEAVE;
+        }
+
+        retire = (PNPBRIDGE_OK == applyResult);
+
+        // Started with the reloaded devices, or again with the running ones if
+        // they couldn't be applied
+        DiscoveryAdapterManager_StartChangedAdapters(pnpBridge->DiscoveryMgr, &pnpBridge->Configuration);
+    } FINALLY {
+        if (NULL != newToOld) {
+            free(newToOld);
+        }
+
+        // The reloaded config now holds the replaced devices
+        if (retire && NULL == singlylinkedlist_add(pnpBridge->RetiredConfigurations, reloaded)) {
+            LogError("Failed to retire the replaced config, it is leaked");
+        }
+        else if (!retire && NULL != reloaded) {
+            PnpBridgeConfig_ReleaseConfiguration(reloaded);
+            free(reloaded);
+        }
+    }
+}
+
+#ifndef WIN32
+// Reads the pending inotify events and sets Changed if one of them is for the
+// config file. Returns false once the watch has been removed.
+static bool
+PnpBridge_ReadConfigWatchEvents(
+    PPNP_BRIDGE pnpBridge,
+    const char* FileName,
+    bool* Changed
+    )
+{
+    char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t length = read(pnpBridge->ConfigWatchFd, buffer, sizeof(buffer));
+
+    if (length < 0) {
+        return (EINTR == errno);
+    }
+
+    for (char* position = buffer; position < buffer + length; ) {
+        const struct inotify_event* event = (const struct inotify_event*)position;
+        if (0 != (event->mask & IN_IGNORED)) {
+            return false;
+        }
+
+        if (event->len > 0 && 0 == strcmp(event->name, FileName)) {
+            *Changed = true;
+        }
+
+        position += sizeof(struct inotify_event) + event->len;
+    }
+
+    return (length > 0);
+}
+
+static void*
+PnpBridge_ConfigWatchWorker(
+    void* ThreadArgument
+    )
+{
+    PPNP_BRIDGE pnpBridge = (PPNP_BRIDGE)ThreadArgument;
+    const char* separator = strrchr(pnpBridge->ConfigPath, '/');
+    const char* fileName = (NULL != separator) ? separator + 1 : pnpBridge->ConfigPath;
+
+    for (;;) {
+        bool changed = false;
+        if (!PnpBridge_ReadConfigWatchEvents(pnpBridge, fileName, &changed)) {
+            break;
+        }
+
+        if (!changed) {
+            continue;
+        }
+
+        // Wait for the file to settle
+        struct pollfd watch = { pnpBridge->ConfigWatchFd, POLLIN, 0 };
+        bool watching = true;
+        while (watching && poll(&watch, 1, PNPBRIDGE_CONFIG_RELOAD_SETTLE_MS) > 0) {
+            watching = PnpBridge_ReadConfigWatchEvents(pnpBridge, fileName, &changed);
+        }
+
+        if (!watching) {
+            break;
+        }
+
+        LogInfo("%s has changed, reloading it", pnpBridge->ConfigPath);
+
+        Lock(pnpBridge->ExitLock);
+        pnpBridge->ReloadPending = true;
+        Condition_Post(pnpBridge->ExitCondition);
+        Unlock(pnpBridge->ExitLock);
+    }
+
+    return NULL;
+}
+
+// The directory of the config file is watched rather than the file, since
+// editors usually save by replacing the file
+static void
+PnpBridge_StartConfigWatch(
+    PPNP_BRIDGE pnpBridge
+    )
+{
+    char directory[PNPBRIDGE_MAX_PATH] = ".";
+    const char* separator = strrchr(pnpBridge->ConfigPath, '/');
+
+    if (NULL != separator) {
+        size_t length = (separator == pnpBridge->ConfigPath) ? 1 : (size_t)(separator - pnpBridge->ConfigPath);
+        if (length >= sizeof(directory)) {
+            LogError("The path of %s is too long to be watched", pnpBridge->ConfigPath);
+            return;
+        }
+
+        memcpy(directory, pnpBridge->ConfigPath, length);
+        directory[length] = '\0';
+    }
+
+    pnpBridge->ConfigWatchFd = inotify_init1(IN_CLOEXEC);
+    if (pnpBridge->ConfigWatchFd < 0) {
+        LogError("Failed to create the config watch, %d. Config changes are applied when the bridge is restarted.", errno);
+        return;
+    }
+
+    pnpBridge->ConfigWatchDescriptor = inotify_add_watch(pnpBridge->ConfigWatchFd, directory, IN_CLOSE_WRITE | IN_MOVED_TO);
+    if (pnpBridge->ConfigWatchDescriptor < 0) {
+        LogError("Failed to watch %s, %d. Config changes are applied when the bridge is restarted.", directory, errno);
+        close(pnpBridge->ConfigWatchFd);
+        return;
+    }
+
+    if (0 != pthread_create(&pnpBridge->ConfigWatchThread, NULL, PnpBridge_ConfigWatchWorker, pnpBridge)) {
+        LogError("Failed to create the config watch thread");
+        close(pnpBridge->ConfigWatchFd);
+        return;
+    }
+
+    pnpBridge->ConfigWatchThreadStarted = true;
+    LogInfo("Watching %s for changes", pnpBridge->ConfigPath);
+}
+
+static void
+PnpBridge_StopConfigWatch(
+    PPNP_BRIDGE pnpBridge
+    )
+{
+    if (pnpBridge->ConfigWatchThreadStarted) {
+        // Removing the watch queues an IN_IGNORED event, which ends the thread
+        inotify_rm_watch(pnpBridge->ConfigWatchFd, pnpBridge->ConfigWatchDescriptor);
+        pthread_join(pnpBridge->ConfigWatchThread, NULL);
+        close(pnpBridge->ConfigWatchFd);
+        pnpBridge->ConfigWatchThreadStarted = false;
+    }
+}
+#endif
+
 int
-PnpBridge_Main()
+PnpBridge_Main(
+    const char* ConfigPath,
+    bool UseConfigSnapshot
+    )
 {
     PNPBRIDGE_RESULT result = PNPBRIDGE_OK;
     PPNP_BRIDGE pnpBridge = NULL;
@@ -396,13 +1254,21 @@ PnpBridge_Main()
     TRY {
         LogInfo("Starting Azure PnpBridge");
 
+#ifndef WIN32
+        PnpBridge_BlockMetricsSignal();
+#endif
+
         if (IoTHub_Init() != 0) {
             LogError("IoTHub_Init failed\n");
             result = PNPBRIDGE_FAILED;
             LEAVE;
         }
 
-        result = PnpBridge_Initialize(&pnpBridge);
+        if (NULL == ConfigPath) {
+            ConfigPath = PNPBRIDGE_DEFAULT_CONFIG_PATH;
+        }
+
+        result = PnpBridge_Initialize(&pnpBridge, ConfigPath, UseConfigSnapshot);
         if (PNPBRIDGE_OK != result) {
             LogError("PnpBridge_Initialize failed: %d", result);
             LEAVE;
@@ -415,7 +1281,7 @@ PnpBridge_Main()
         // Load all the adapters in interface manifest that implement Azure IoT PnP Interface
         // PnpBridge will call into corresponding adapter when a device is reported by 
         // DiscoveryExtension
-        result = PnpAdapterManager_Create(&pnpBridge->PnpMgr, pnpBridge->Configuration.JsonConfig);
+        result = PnpAdapterManager_Create(&pnpBridge->PnpMgr, &pnpBridge->Configuration);
         if (PNPBRIDGE_OK != result) {
             LogError("PnpAdapterManager_Create failed: %d", result);
             LEAVE;
@@ -431,16 +1297,53 @@ PnpBridge_Main()
 
         PnpBridge_Worker(pnpBridge);
 
+        PnpBridge_StartConnectionMonitor(pnpBridge);
+
+#ifndef WIN32
+        PnpBridge_StartMetricsSignalThread(pnpBridge);
+
+        if (pnpBridge->Configuration.WatchConfig) {
+            PnpBridge_StartConfigWatch(pnpBridge);
+        }
+#else
+        if (pnpBridge->Configuration.WatchConfig) {
+            LogError("%s is not supported on Windows", PNP_CONFIG_WATCH_CONFIG);
+        }
+#endif
+
         // Prevent main thread from returning by waiting for the
         // exit condition to be set. This condition will be set when
         // the bridge has received a stop signal
         // ExitLock was taken in call to PnpBridge_Initialize so does not need to be reacquired.
-        Condition_Wait(pnpBridge->ExitCondition, pnpBridge->ExitLock, 0);
+        // The metrics are logged every time the wait times out, and the config
+        // is reloaded when the config watch posts the condition.
+        while (PNP_BRIDGE_INITIALIZED == g_PnpBridgeState) {
+            if (!pnpBridge->ReloadPending &&
+                COND_TIMEOUT == Condition_Wait(pnpBridge->ExitCondition, pnpBridge->ExitLock,
+                                               (int)pnpBridge->Configuration.MetricsIntervalMs) &&
+                0 != pnpBridge->Configuration.MetricsIntervalMs) {
+                PnpBridge_LogMetrics(pnpBridge);
+            }
+
+            if (pnpBridge->ReloadPending && PNP_BRIDGE_INITIALIZED == g_PnpBridgeState) {
+                pnpBridge->ReloadPending = false;
+
+                // PnpBridge_Stop takes ExitLock, so it isn't held while reloading
+                Unlock(pnpBridge->ExitLock);
+                PnpBridge_ReloadConfiguration(pnpBridge);
+                Lock(pnpBridge->ExitLock);
+            }
+        }
         Unlock(pnpBridge->ExitLock);
     } FINALLY  {
         g_PnpBridge = NULL;
 
         if (pnpBridge) {
+#ifndef WIN32
+            PnpBridge_StopConfigWatch(pnpBridge);
+            PnpBridge_StopMetricsSignalThread(pnpBridge);
+#endif
+            PnpBridge_StopConnectionMonitor(pnpBridge);
             PnpBridge_Release(pnpBridge);
         }
     }
@@ -464,6 +1367,32 @@ PnpBridge_Stop()
     IoTHub_Deinit();
 }
 
+int
+PnpBridge_SendTelemetry(
+    DIGITALTWIN_INTERFACE_CLIENT_HANDLE digitalTwinInterface,
+    const char* telemetryName,
+    const char* telemetryData,
+    unsigned int flags
+    )
+{
+    if (NULL == digitalTwinInterface || NULL == telemetryName || NULL == telemetryData) {
+        return PNPBRIDGE_INVALID_ARGS;
+    }
+
+    if (NULL == g_PnpBridge || NULL == g_PnpBridge->TelemetryQueue) {
+        return PNPBRIDGE_FAILED;
+    }
+
+    return PnpTelemetryQueue_Add(g_PnpBridge->TelemetryQueue, digitalTwinInterface,
+                                 telemetryName, telemetryData, flags);
+}
+
+bool
+PnpBridge_IsTelemetrySpooled()
+{
+    return NULL != g_PnpBridge && NULL != g_PnpBridge->TelemetryQueue && NULL != g_PnpBridge->TelemetryQueue->Spool;
+}
+
 // Note: PnpBridge_UploadToBlobAsync method is not synchronized 
 // with the g_PnpBridge cleanup path
 
@@ -1,10 +1,397 @@
 #include <stdio.h>
 #include "azure_c_shared_utility/refcount.h"
+#include "pnpbridge_common.h"
 #include "pnpbridge_memory.h"
 
+#ifndef PNPBRIDGE_MEMORY_USE_MALLOC
+
+#ifndef WIN32
+#include <pthread.h>
+#endif
+
+// PNPMEMORY blocks, header included, are carved from power of two size
+// classes of 64 to 4096 bytes. Larger blocks come straight from the heap.
+#define PNPMEMORY_MIN_CLASS_SHIFT 6
+#define PNPMEMORY_SIZE_CLASS_COUNT 7
+#define PNPMEMORY_CLASS_SIZE(SizeClass) ((size_t)1 << (PNPMEMORY_MIN_CLASS_SHIFT + (SizeClass)))
+#define PNPMEMORY_HEAP_BLOCK -1
+
+// Each thread keeps up to PNPMEMORY_THREAD_CACHE_DEPTH free blocks of every
+// class and trades them with the shared depot PNPMEMORY_BATCH at a time.
+// The depot returns blocks beyond PNPMEMORY_DEPOT_DEPTH to the heap.
+#define PNPMEMORY_THREAD_CACHE_DEPTH 16
+#define PNPMEMORY_BATCH 8
+#define PNPMEMORY_DEPOT_DEPTH 64
+
+typedef struct _PNPMEMORY_FREE_BLOCK {
+    struct _PNPMEMORY_FREE_BLOCK* Next;
+} PNPMEMORY_FREE_BLOCK, *PPNPMEMORY_FREE_BLOCK;
+
+typedef struct _PNPMEMORY_FREE_LIST {
+    PPNPMEMORY_FREE_BLOCK Head;
+    int Count;
+} PNPMEMORY_FREE_LIST, *PPNPMEMORY_FREE_LIST;
+
+typedef struct _PNPMEMORY_THREAD_CACHE {
+    PNPMEMORY_FREE_LIST Classes[PNPMEMORY_SIZE_CLASS_COUNT];
+} PNPMEMORY_THREAD_CACHE, *PPNPMEMORY_THREAD_CACHE;
+
+static struct {
+    LOCK_HANDLE Lock;
+    PNPMEMORY_FREE_LIST Classes[PNPMEMORY_SIZE_CLASS_COUNT];
+} g_PnpMemoryDepot;
+
+static volatile long g_PnpMemoryHits;
+static volatile long g_PnpMemoryMisses;
+static volatile long g_PnpMemoryResidentBytes;
+
+static void PnpMemory_ReleaseThreadCache(void* cache);
+
+#ifdef WIN32
+static INIT_ONCE g_PnpMemoryInitOnce = INIT_ONCE_STATIC_INIT;
+static DWORD g_PnpMemoryCacheKey = FLS_OUT_OF_INDEXES;
+
+static VOID WINAPI PnpMemory_FlsCallback(PVOID cache) {
+    PnpMemory_ReleaseThreadCache(cache);
+}
+
+static BOOL CALLBACK PnpMemory_InitPool(PINIT_ONCE initOnce, PVOID parameter, PVOID* context) {
+    AZURE_UNREFERENCED_PARAMETER(initOnce);
+    AZURE_UNREFERENCED_PARAMETER(parameter);
+    AZURE_UNREFERENCED_PARAMETER(context);
+
+    g_PnpMemoryDepot.Lock = Lock_Init();
+    g_PnpMemoryCacheKey = FlsAlloc(PnpMemory_FlsCallback);
+    return TRUE;
+}
+
+static PPNPMEMORY_THREAD_CACHE PnpMemory_GetThreadCacheValue() {
+    InitOnceExecuteOnce(&g_PnpMemoryInitOnce, PnpMemory_InitPool, NULL, NULL);
+    if (NULL == g_PnpMemoryDepot.Lock || FLS_OUT_OF_INDEXES == g_PnpMemoryCacheKey) {
+        return NULL;
+    }
+    return (PPNPMEMORY_THREAD_CACHE)FlsGetValue(g_PnpMemoryCacheKey);
+}
+
+static bool PnpMemory_SetThreadCacheValue(PPNPMEMORY_THREAD_CACHE cache) {
+    return FlsSetValue(g_PnpMemoryCacheKey, cache) ? true : false;
+}
+#else
+static pthread_once_t g_PnpMemoryInitOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t g_PnpMemoryCacheKey;
+static bool g_PnpMemoryCacheKeyValid;
+
+static void PnpMemory_InitPool() {
+    g_PnpMemoryDepot.Lock = Lock_Init();
+    g_PnpMemoryCacheKeyValid = (0 == pthread_key_create(&g_PnpMemoryCacheKey, PnpMemory_ReleaseThreadCache));
+}
+
+static PPNPMEMORY_THREAD_CACHE PnpMemory_GetThreadCacheValue() {
+    (void)pthread_once(&g_PnpMemoryInitOnce, PnpMemory_InitPool);
+    if (NULL == g_PnpMemoryDepot.Lock || !g_PnpMemoryCacheKeyValid) {
+        return NULL;
+    }
+    return (PPNPMEMORY_THREAD_CACHE)pthread_getspecific(g_PnpMemoryCacheKey);
+}
+
+static bool PnpMemory_SetThreadCacheValue(PPNPMEMORY_THREAD_CACHE cache) {
+    return 0 == pthread_setspecific(g_PnpMemoryCacheKey, cache);
+}
+#endif
+
+// Returns the calling thread's cache, or NULL if the pool can't be used
+// and blocks should come from the heap
+static PPNPMEMORY_THREAD_CACHE PnpMemory_GetThreadCache() {
+    PPNPMEMORY_THREAD_CACHE cache = PnpMemory_GetThreadCacheValue();
+    if (NULL == cache && NULL != g_PnpMemoryDepot.Lock) {
+        cache = calloc(1, sizeof(PNPMEMORY_THREAD_CACHE));
+        if (NULL != cache && !PnpMemory_SetThreadCacheValue(cache)) {
+            free(cache);
+            cache = NULL;
+        }
+    }
+    return cache;
+}
+
+static int PnpMemory_GetSizeClass(size_t blockSize) {
+    for (int sizeClass = 0; sizeClass < PNPMEMORY_SIZE_CLASS_COUNT; sizeClass++) {
+        if (blockSize <= PNPMEMORY_CLASS_SIZE(sizeClass)) {
+            return sizeClass;
+        }
+    }
+    return PNPMEMORY_HEAP_BLOCK;
+}
+
+static PPNPMEMORY_FREE_BLOCK PnpMemory_Pop(PPNPMEMORY_FREE_LIST list) {
+    PPNPMEMORY_FREE_BLOCK block = list->Head;
+    if (NULL != block) {
+        list->Head = block->Next;
+        list->Count--;
+    }
+    return block;
+}
+
+static void PnpMemory_Push(PPNPMEMORY_FREE_LIST list, PPNPMEMORY_FREE_BLOCK block) {
+    block->Next = list->Head;
+    list->Head = block;
+    list->Count++;
+}
+
+// Moves up to count blocks from the thread cache to the depot. Blocks that
+// don't fit in the depot go back to the heap.
+static void PnpMemory_SpillToDepot(PPNPMEMORY_FREE_LIST list, int sizeClass, int count) {
+    PPNPMEMORY_FREE_BLOCK excess = NULL;
+
+    Lock(g_PnpMemoryDepot.Lock);
+    for (int i = 0; i < count && NULL != list->Head; i++) {
+        PPNPMEMORY_FREE_BLOCK block = PnpMemory_Pop(list);
+        if (g_PnpMemoryDepot.Classes[sizeClass].Count < PNPMEMORY_DEPOT_DEPTH) {
+            PnpMemory_Push(&g_PnpMemoryDepot.Classes[sizeClass], block);
+        }
+        else {
+            block->Next = excess;
+            excess = block;
+        }
+    }
+    Unlock(g_PnpMemoryDepot.Lock);
+
+    while (NULL != excess) {
+        PPNPMEMORY_FREE_BLOCK next = excess->Next;
+        free(excess);
+        PNPBRIDGE_INTERLOCKED_ADD(&g_PnpMemoryResidentBytes, -(long)PNPMEMORY_CLASS_SIZE(sizeClass));
+        excess = next;
+    }
+}
+
+static void PnpMemory_ReleaseThreadCache(void* threadCache) {
+    PPNPMEMORY_THREAD_CACHE cache = (PPNPMEMORY_THREAD_CACHE)threadCache;
+    for (int sizeClass = 0; sizeClass < PNPMEMORY_SIZE_CLASS_COUNT; sizeClass++) {
+        PnpMemory_SpillToDepot(&cache->Classes[sizeClass], sizeClass, cache->Classes[sizeClass].Count);
+    }
+    free(cache);
+}
+
+// Returns a zeroed block of at least blockSize bytes
+static PPNPBRIDGE_MEMORY_TAG PnpMemory_AllocBlock(size_t blockSize) {
+    PPNPBRIDGE_MEMORY_TAG mem = NULL;
+    PPNPMEMORY_THREAD_CACHE cache = NULL;
+    int sizeClass = PnpMemory_GetSizeClass(blockSize);
+
+    if (PNPMEMORY_HEAP_BLOCK != sizeClass) {
+        cache = PnpMemory_GetThreadCache();
+    }
+
+    if (NULL == cache) {
+        PNPBRIDGE_INTERLOCKED_INCREMENT(&g_PnpMemoryMisses);
+        mem = calloc(1, blockSize);
+        if (NULL != mem) {
+            mem->sizeClass = PNPMEMORY_HEAP_BLOCK;
+        }
+        return mem;
+    }
+
+    PPNPMEMORY_FREE_LIST list = &cache->Classes[sizeClass];
+
+    // Refill an empty thread cache from the depot
+    if (NULL == list->Head) {
+        Lock(g_PnpMemoryDepot.Lock);
+        for (int i = 0; i < PNPMEMORY_BATCH && NULL != g_PnpMemoryDepot.Classes[sizeClass].Head; i++) {
+            PnpMemory_Push(list, PnpMemory_Pop(&g_PnpMemoryDepot.Classes[sizeClass]));
+        }
+        Unlock(g_PnpMemoryDepot.Lock);
+    }
+
+    mem = (PPNPBRIDGE_MEMORY_TAG)PnpMemory_Pop(list);
+    if (NULL != mem) {
+        PNPBRIDGE_INTERLOCKED_INCREMENT(&g_PnpMemoryHits);
+    }
+    else {
+        PNPBRIDGE_INTERLOCKED_INCREMENT(&g_PnpMemoryMisses);
+        mem = malloc(PNPMEMORY_CLASS_SIZE(sizeClass));
+        if (NULL == mem) {
+            return NULL;
+        }
+        PNPBRIDGE_INTERLOCKED_ADD(&g_PnpMemoryResidentBytes, (long)PNPMEMORY_CLASS_SIZE(sizeClass));
+    }
+
+    memset(mem, 0, blockSize);
+    mem->sizeClass = sizeClass;
+    return mem;
+}
+
+static void PnpMemory_FreeBlock(PPNPBRIDGE_MEMORY_TAG mem) {
+    int sizeClass = mem->sizeClass;
+    PPNPMEMORY_THREAD_CACHE cache = NULL;
+
+    if (PNPMEMORY_HEAP_BLOCK == sizeClass) {
+        free(mem);
+        return;
+    }
+
+    // A block can be freed by a thread other than the one that allocated it.
+    // It simply joins the cache of the thread that frees it.
+    cache = PnpMemory_GetThreadCache();
+    if (NULL == cache) {
+        free(mem);
+        PNPBRIDGE_INTERLOCKED_ADD(&g_PnpMemoryResidentBytes, -(long)PNPMEMORY_CLASS_SIZE(sizeClass));
+        return;
+    }
+
+    PPNPMEMORY_FREE_LIST list = &cache->Classes[sizeClass];
+    if (list->Count >= PNPMEMORY_THREAD_CACHE_DEPTH) {
+        PnpMemory_SpillToDepot(list, sizeClass, PNPMEMORY_BATCH);
+    }
+
+    PnpMemory_Push(list, (PPNPMEMORY_FREE_BLOCK)mem);
+}
+
+#else
+
+static volatile long g_PnpMemoryMisses;
+
+static PPNPBRIDGE_MEMORY_TAG PnpMemory_AllocBlock(size_t blockSize) {
+    PPNPBRIDGE_MEMORY_TAG mem = calloc(1, blockSize);
+    PNPBRIDGE_INTERLOCKED_INCREMENT(&g_PnpMemoryMisses);
+    if (NULL != mem) {
+        mem->sizeClass = -1;
+    }
+    return mem;
+}
+
+static void PnpMemory_FreeBlock(PPNPBRIDGE_MEMORY_TAG mem) {
+    free(mem);
+}
+
+#endif /* PNPBRIDGE_MEMORY_USE_MALLOC */
+
+// Usage shrinks by this share of the limit before a shedding level is left,
+// so that the bridge doesn't flip between levels on every allocation
+#define PNPMEMORY_BUDGET_HYSTERESIS_PERCENT 5
+
+static PNPMEMORY_BUDGET g_PnpMemoryBudget;
+static volatile long g_PnpMemoryBudgetUsed;
+static volatile long g_PnpMemoryBudgetPeak;
+static volatile long g_PnpMemoryRefused;
+static volatile long g_PnpMemorySheddingLevel;
+
+static const char* g_PnpMemorySheddingLevelNames[] = {
+    "none",
+    "sampled telemetry",
+    "sampled telemetry and device arrivals"
+};
+
+const char* PnpMemory_GetSheddingLevelName(PNPMEMORY_SHEDDING_LEVEL level) {
+    if (level < PNPMEMORY_SHED_NONE || level > PNPMEMORY_SHED_ARRIVALS) {
+        return "unknown";
+    }
+    return g_PnpMemorySheddingLevelNames[level];
+}
+
+static PNPMEMORY_SHEDDING_LEVEL PnpMemory_ComputeSheddingLevel(long used, PNPMEMORY_SHEDDING_LEVEL current) {
+    long onePercent = g_PnpMemoryBudget.LimitBytes / 100;
+    long hysteresis = onePercent * PNPMEMORY_BUDGET_HYSTERESIS_PERCENT;
+    long arrivals = onePercent * g_PnpMemoryBudget.RefuseArrivalsPercent;
+    long samples = onePercent * g_PnpMemoryBudget.ShedSamplesPercent;
+
+    if (0 == g_PnpMemoryBudget.LimitBytes) {
+        return PNPMEMORY_SHED_NONE;
+    }
+
+    if (used >= arrivals || (current >= PNPMEMORY_SHED_ARRIVALS && used >= arrivals - hysteresis)) {
+        return PNPMEMORY_SHED_ARRIVALS;
+    }
+
+    if (used >= samples || (current >= PNPMEMORY_SHED_SAMPLES && used >= samples - hysteresis)) {
+        return PNPMEMORY_SHED_SAMPLES;
+    }
+
+    return PNPMEMORY_SHED_NONE;
+}
+
+// Moves to the shedding level of the current usage and reports the change
+static void PnpMemory_UpdateSheddingLevel(long used) {
+    long current = PNPBRIDGE_INTERLOCKED_READ(&g_PnpMemorySheddingLevel);
+    long level = (long)PnpMemory_ComputeSheddingLevel(used, (PNPMEMORY_SHEDDING_LEVEL)current);
+
+    if (level == current ||
+        current != PNPBRIDGE_INTERLOCKED_COMPARE_EXCHANGE(&g_PnpMemorySheddingLevel, level, current)) {
+        return;
+    }
+
+    if (level > current) {
+        LogError("Memory budget: %ld of %ld bytes used, shedding %s",
+                 used, g_PnpMemoryBudget.LimitBytes, PnpMemory_GetSheddingLevelName((PNPMEMORY_SHEDDING_LEVEL)level));
+    }
+    else if (PNPMEMORY_SHED_NONE == level) {
+        LogInfo("Memory budget: %ld of %ld bytes used, stopped shedding", used, g_PnpMemoryBudget.LimitBytes);
+    }
+    else {
+        LogInfo("Memory budget: %ld of %ld bytes used, shedding %s only",
+                used, g_PnpMemoryBudget.LimitBytes, PnpMemory_GetSheddingLevelName((PNPMEMORY_SHEDDING_LEVEL)level));
+    }
+}
+
+void PnpMemory_SetBudget(const PNPMEMORY_BUDGET* budget) {
+    PNPMEMORY_BUDGET disabled = { 0 };
+
+    // Set before the bridge threads start and cleared after they exit
+    g_PnpMemoryBudget = (NULL != budget) ? *budget : disabled;
+    PnpMemory_UpdateSheddingLevel(PNPBRIDGE_INTERLOCKED_READ(&g_PnpMemoryBudgetUsed));
+}
+
+bool PnpMemory_ChargeBudget(long bytes) {
+    long used = PNPBRIDGE_INTERLOCKED_READ(&g_PnpMemoryBudgetUsed);
+    long peak;
+
+    for (;;) {
+        long previous;
+        if (0 != g_PnpMemoryBudget.LimitBytes && used + bytes > g_PnpMemoryBudget.LimitBytes) {
+            PnpMemory_UpdateSheddingLevel(used);
+            return false;
+        }
+
+        previous = PNPBRIDGE_INTERLOCKED_COMPARE_EXCHANGE(&g_PnpMemoryBudgetUsed, used + bytes, used);
+        if (previous == used) {
+            break;
+        }
+        used = previous;
+    }
+
+    used += bytes;
+    peak = PNPBRIDGE_INTERLOCKED_READ(&g_PnpMemoryBudgetPeak);
+    while (used > peak) {
+        long previous = PNPBRIDGE_INTERLOCKED_COMPARE_EXCHANGE(&g_PnpMemoryBudgetPeak, used, peak);
+        if (previous == peak) {
+            break;
+        }
+        peak = previous;
+    }
+
+    PnpMemory_UpdateSheddingLevel(used);
+    return true;
+}
+
+void PnpMemory_ReleaseBudget(long bytes) {
+    PNPBRIDGE_INTERLOCKED_ADD(&g_PnpMemoryBudgetUsed, -bytes);
+    PnpMemory_UpdateSheddingLevel(PNPBRIDGE_INTERLOCKED_READ(&g_PnpMemoryBudgetUsed));
+}
+
+PNPMEMORY_SHEDDING_LEVEL PnpMemory_GetSheddingLevel() {
+    return (PNPMEMORY_SHEDDING_LEVEL)PNPBRIDGE_INTERLOCKED_READ(&g_PnpMemorySheddingLevel);
+}
+
 int PnpMemory_Create(PPNPMEMORY_ATTRIBUTES params, int size, PNPMEMORY* memory) {
-    PPNPBRIDGE_MEMORY_TAG mem = calloc(1, sizeof(PNPBRIDGE_MEMORY_TAG) + size);
+    size_t blockSize = sizeof(PNPBRIDGE_MEMORY_TAG) + size;
+    PPNPBRIDGE_MEMORY_TAG mem = NULL;
+
+    if (!PnpMemory_ChargeBudget((long)blockSize)) {
+        PNPBRIDGE_INTERLOCKED_INCREMENT(&g_PnpMemoryRefused);
+        return -1;
+    }
+
+    mem = PnpMemory_AllocBlock(blockSize);
     if (NULL == mem) {
+        PnpMemory_ReleaseBudget((long)blockSize);
         return -1;
     }
 
@@ -18,7 +405,7 @@ int PnpMemory_Create(PPNPMEMORY_ATTRIBUTES params, int size, PNPMEMORY* memory)
     mem->memory = mem + 1;
 
     *memory = (PNPMEMORY*)mem;
- 
+
     return 0;
 }
 
@@ -30,11 +417,14 @@ void PnpMemory_AddReference(PNPMEMORY memory) {
 void PnpMemory_ReleaseReference(PNPMEMORY memory) {
     PPNPBRIDGE_MEMORY_TAG mem = (PPNPBRIDGE_MEMORY_TAG)memory;
     if (DEC_RETURN_ZERO == DEC_REF_VAR(mem->count)) {
+        long blockSize = (long)sizeof(PNPBRIDGE_MEMORY_TAG) + mem->size;
+
         if (NULL != mem->params.destroyCallback) {
             mem->params.destroyCallback(memory);
         }
 
-        free(mem);
+        PnpMemory_FreeBlock(mem);
+        PnpMemory_ReleaseBudget(blockSize);
     }
 }
 
@@ -44,4 +434,20 @@ void* PnpMemory_GetBuffer(PNPMEMORY memory, int* size) {
         *size = mem->size;
     }
     return mem->memory;
-}
\ No newline at end of file
+}
+
+void PnpMemory_GetStatistics(PPNPMEMORY_STATISTICS statistics) {
+#ifndef PNPBRIDGE_MEMORY_USE_MALLOC
+    statistics->Hits = PNPBRIDGE_INTERLOCKED_READ(&g_PnpMemoryHits);
+    statistics->ResidentBytes = PNPBRIDGE_INTERLOCKED_READ(&g_PnpMemoryResidentBytes);
+#else
+    statistics->Hits = 0;
+    statistics->ResidentBytes = 0;
+#endif
+    statistics->Misses = PNPBRIDGE_INTERLOCKED_READ(&g_PnpMemoryMisses);
+    statistics->BudgetLimitBytes = g_PnpMemoryBudget.LimitBytes;
+    statistics->BudgetUsedBytes = PNPBRIDGE_INTERLOCKED_READ(&g_PnpMemoryBudgetUsed);
+    statistics->BudgetPeakBytes = PNPBRIDGE_INTERLOCKED_READ(&g_PnpMemoryBudgetPeak);
+    statistics->Refused = PNPBRIDGE_INTERLOCKED_READ(&g_PnpMemoryRefused);
+    statistics->SheddingLevel = PnpMemory_GetSheddingLevel();
+}
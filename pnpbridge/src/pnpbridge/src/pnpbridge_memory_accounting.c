@@ -0,0 +1,545 @@
+// Copyright (c) Microsoft. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+// This file is never compiled with PNPMEMORY_TAG_FOR_THIS. Its own malloc and
+// free are the real ones.
+#include <stdio.h>
+#include "pnpbridge_common.h"
+#include "pnpbridge_memory.h"
+
+static const char* g_PnpMemoryTagNames[PNPMEMORY_TAG_COUNT] = {
+    "bridge",
+    "message queue",
+    "pnpmemory",
+    "config",
+    "serial adapter",
+    "modbus adapter",
+    "adapter",
+    "sdk"
+};
+
+const char*
+PnpMemory_GetTagName(
+    PNPMEMORY_TAG tag
+    )
+{
+    if (tag < 0 || tag >= PNPMEMORY_TAG_COUNT) {
+        return "unknown";
+    }
+
+    return g_PnpMemoryTagNames[tag];
+}
+
+#ifdef PNPBRIDGE_MEMORY_ACCOUNTING
+
+#ifdef WIN32
+typedef SRWLOCK PNPMEMORY_ACCOUNTING_LOCK;
+#define PNPMEMORY_ACCOUNTING_LOCK_INIT SRWLOCK_INIT
+#define PnpMemoryAccounting_Lock(Lock) AcquireSRWLockExclusive(Lock)
+#define PnpMemoryAccounting_Unlock(Lock) ReleaseSRWLockExclusive(Lock)
+#else
+#include <pthread.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+typedef pthread_mutex_t PNPMEMORY_ACCOUNTING_LOCK;
+#define PNPMEMORY_ACCOUNTING_LOCK_INIT PTHREAD_MUTEX_INITIALIZER
+#define PnpMemoryAccounting_Lock(Lock) pthread_mutex_lock(Lock)
+#define PnpMemoryAccounting_Unlock(Lock) pthread_mutex_unlock(Lock)
+#endif
+
+// Live tagged blocks are kept in open addressed tables, sharded by address
+// so that threads allocating at the same time rarely share a lock. The size
+// and tag are looked up on free instead of being stored in a header, so a
+// block allocated by untagged code (parson strings, SDK buffers) can be freed
+// by tagged code: the lookup misses and the block is simply freed.
+//
+// The other way around isn't supported. A block allocated by tagged code must
+// be freed by tagged code, since the free of untagged code never reaches the
+// table. Its bytes would stay charged to the tag and its entry would be found
+// again when the heap hands the address out to a later allocation. That reuse
+// is the only place this can be seen, so debug builds assert on it, and other
+// builds drop the stale entry and its bytes there.
+#define PNPMEMORY_ACCOUNTING_SHARD_COUNT 16
+#define PNPMEMORY_ACCOUNTING_INITIAL_CAPACITY 256
+
+typedef struct _PNPMEMORY_ACCOUNTING_ENTRY {
+    void* Block;
+    size_t Size;
+    PNPMEMORY_TAG Tag;
+} PNPMEMORY_ACCOUNTING_ENTRY, *PPNPMEMORY_ACCOUNTING_ENTRY;
+
+typedef struct _PNPMEMORY_ACCOUNTING_SHARD {
+    PNPMEMORY_ACCOUNTING_LOCK Lock;
+    PPNPMEMORY_ACCOUNTING_ENTRY Entries;
+    size_t Capacity;
+    size_t Count;
+} PNPMEMORY_ACCOUNTING_SHARD, *PPNPMEMORY_ACCOUNTING_SHARD;
+
+typedef struct _PNPMEMORY_TAG_COUNTERS {
+    volatile long CurrentBytes;
+    volatile long PeakBytes;
+    volatile long Allocations;
+    volatile long Frees;
+} PNPMEMORY_TAG_COUNTERS, *PPNPMEMORY_TAG_COUNTERS;
+
+static PNPMEMORY_ACCOUNTING_SHARD g_PnpMemoryShards[PNPMEMORY_ACCOUNTING_SHARD_COUNT] = {
+#define PNPMEMORY_SHARD_INIT { PNPMEMORY_ACCOUNTING_LOCK_INIT, NULL, 0, 0 }
+    PNPMEMORY_SHARD_INIT, PNPMEMORY_SHARD_INIT, PNPMEMORY_SHARD_INIT, PNPMEMORY_SHARD_INIT,
+    PNPMEMORY_SHARD_INIT, PNPMEMORY_SHARD_INIT, PNPMEMORY_SHARD_INIT, PNPMEMORY_SHARD_INIT,
+    PNPMEMORY_SHARD_INIT, PNPMEMORY_SHARD_INIT, PNPMEMORY_SHARD_INIT, PNPMEMORY_SHARD_INIT,
+    PNPMEMORY_SHARD_INIT, PNPMEMORY_SHARD_INIT, PNPMEMORY_SHARD_INIT, PNPMEMORY_SHARD_INIT
+#undef PNPMEMORY_SHARD_INIT
+};
+
+static PNPMEMORY_TAG_COUNTERS g_PnpMemoryTagCounters[PNPMEMORY_TAG_COUNT];
+
+// State of the previous PnpMemory_LogTagStatistics, to compute the rates
+static struct {
+    PNPMEMORY_ACCOUNTING_LOCK Lock;
+    TICK_COUNTER_HANDLE TickCounter;
+    tickcounter_ms_t Time;
+    long Allocations[PNPMEMORY_TAG_COUNT];
+    long Rates[PNPMEMORY_TAG_COUNT];
+    long SdkPeakBytes;
+} g_PnpMemoryReport = { PNPMEMORY_ACCOUNTING_LOCK_INIT };
+
+static size_t
+PnpMemoryAccounting_Hash(
+    void* Block
+    )
+{
+    // Blocks are at least 8 byte aligned. Mix the rest of the address bits.
+    unsigned long long hash = ((unsigned long long)(uintptr_t)Block >> 3) * 0x9E3779B97F4A7C15ull;
+    return (size_t)(hash >> 32);
+}
+
+static PPNPMEMORY_ACCOUNTING_SHARD
+PnpMemoryAccounting_GetShard(
+    void* Block
+    )
+{
+    // The low bits pick the slot within the shard, so use the high ones here
+    return &g_PnpMemoryShards[(PnpMemoryAccounting_Hash(Block) >> 28) % PNPMEMORY_ACCOUNTING_SHARD_COUNT];
+}
+
+static void
+PnpMemoryAccounting_AddBytes(
+    PNPMEMORY_TAG Tag,
+    long Size
+    )
+{
+    PPNPMEMORY_TAG_COUNTERS counters = &g_PnpMemoryTagCounters[Tag];
+    long current;
+    long peak;
+
+    PNPBRIDGE_INTERLOCKED_ADD(&counters->CurrentBytes, Size);
+    PNPBRIDGE_INTERLOCKED_INCREMENT(&counters->Allocations);
+
+    current = PNPBRIDGE_INTERLOCKED_READ(&counters->CurrentBytes);
+    peak = PNPBRIDGE_INTERLOCKED_READ(&counters->PeakBytes);
+    while (current > peak) {
+        long previous = PNPBRIDGE_INTERLOCKED_COMPARE_EXCHANGE(&counters->PeakBytes, current, peak);
+        if (previous == peak) {
+            break;
+        }
+        peak = previous;
+    }
+}
+
+static void
+PnpMemoryAccounting_RemoveBytes(
+    PNPMEMORY_TAG Tag,
+    long Size
+    )
+{
+    PNPBRIDGE_INTERLOCKED_ADD(&g_PnpMemoryTagCounters[Tag].CurrentBytes, -Size);
+    PNPBRIDGE_INTERLOCKED_INCREMENT(&g_PnpMemoryTagCounters[Tag].Frees);
+}
+
+// Must be called with the shard lock held
+static bool
+PnpMemoryAccounting_Grow(
+    PPNPMEMORY_ACCOUNTING_SHARD Shard
+    )
+{
+    size_t capacity = Shard->Capacity ? Shard->Capacity * 2 : PNPMEMORY_ACCOUNTING_INITIAL_CAPACITY;
+    PPNPMEMORY_ACCOUNTING_ENTRY entries = calloc(capacity, sizeof(PNPMEMORY_ACCOUNTING_ENTRY));
+    if (NULL == entries) {
+        return false;
+    }
+
+    for (size_t i = 0; i < Shard->Capacity; i++) {
+        PPNPMEMORY_ACCOUNTING_ENTRY entry = &Shard->Entries[i];
+        if (NULL != entry->Block) {
+            size_t slot = PnpMemoryAccounting_Hash(entry->Block) & (capacity - 1);
+            while (NULL != entries[slot].Block) {
+                slot = (slot + 1) & (capacity - 1);
+            }
+            entries[slot] = *entry;
+        }
+    }
+
+    free(Shard->Entries);
+    Shard->Entries = entries;
+    Shard->Capacity = capacity;
+    return true;
+}
+
+static void
+PnpMemoryAccounting_Track(
+    PNPMEMORY_TAG Tag,
+    void* Block,
+    size_t Size
+    )
+{
+    PPNPMEMORY_ACCOUNTING_SHARD shard = PnpMemoryAccounting_GetShard(Block);
+    PNPMEMORY_ACCOUNTING_ENTRY stale = { 0 };
+    bool tracked = false;
+
+    PnpMemoryAccounting_Lock(&shard->Lock);
+
+    // Keep the load factor under one half. If the table can't grow the
+    // block is simply not accounted.
+    if ((shard->Count + 1) * 2 <= shard->Capacity || PnpMemoryAccounting_Grow(shard)) {
+        size_t slot = PnpMemoryAccounting_Hash(Block) & (shard->Capacity - 1);
+        while (NULL != shard->Entries[slot].Block && Block != shard->Entries[slot].Block) {
+            slot = (slot + 1) & (shard->Capacity - 1);
+        }
+
+        // The address is still tracked, so its previous block was freed by
+        // untagged code. The new block takes over its entry.
+        if (NULL != shard->Entries[slot].Block) {
+            stale = shard->Entries[slot];
+        }
+        else {
+            shard->Count++;
+        }
+
+        shard->Entries[slot].Block = Block;
+        shard->Entries[slot].Size = Size;
+        shard->Entries[slot].Tag = Tag;
+        tracked = true;
+    }
+
+    PnpMemoryAccounting_Unlock(&shard->Lock);
+
+    if (NULL != stale.Block) {
+        LogError("Block of memory tag %s was freed by untagged code", g_PnpMemoryTagNames[stale.Tag]);
+        PnpMemoryAccounting_RemoveBytes(stale.Tag, (long)stale.Size);
+    }
+    assert(NULL == stale.Block);
+
+    if (tracked) {
+        PnpMemoryAccounting_AddBytes(Tag, (long)Size);
+    }
+}
+
+// Returns false if the block isn't tracked
+static bool
+PnpMemoryAccounting_Untrack(
+    void* Block,
+    PPNPMEMORY_ACCOUNTING_ENTRY Removed
+    )
+{
+    PPNPMEMORY_ACCOUNTING_SHARD shard = PnpMemoryAccounting_GetShard(Block);
+    PNPMEMORY_ACCOUNTING_ENTRY removed = { 0 };
+
+    PnpMemoryAccounting_Lock(&shard->Lock);
+
+    if (shard->Count > 0) {
+        size_t mask = shard->Capacity - 1;
+        size_t slot = PnpMemoryAccounting_Hash(Block) & mask;
+
+        while (NULL != shard->Entries[slot].Block && Block != shard->Entries[slot].Block) {
+            slot = (slot + 1) & mask;
+        }
+
+        if (NULL != shard->Entries[slot].Block) {
+            size_t hole = slot;
+
+            removed = shard->Entries[slot];
+            shard->Entries[hole].Block = NULL;
+            shard->Count--;
+
+            // Shift the rest of the probe run back so lookups don't stop
+            // early at the hole.
+            for (slot = (hole + 1) & mask; NULL != shard->Entries[slot].Block; slot = (slot + 1) & mask) {
+                size_t home = PnpMemoryAccounting_Hash(shard->Entries[slot].Block) & mask;
+                if (((slot - home) & mask) >= ((slot - hole) & mask)) {
+                    shard->Entries[hole] = shard->Entries[slot];
+                    shard->Entries[slot].Block = NULL;
+                    hole = slot;
+                }
+            }
+        }
+    }
+
+    PnpMemoryAccounting_Unlock(&shard->Lock);
+
+    if (NULL == removed.Block) {
+        return false;
+    }
+
+    PnpMemoryAccounting_RemoveBytes(removed.Tag, (long)removed.Size);
+    if (NULL != Removed) {
+        *Removed = removed;
+    }
+
+    return true;
+}
+
+void*
+PnpMemory_TaggedMalloc(
+    PNPMEMORY_TAG tag,
+    size_t size
+    )
+{
+    void* block = malloc(size);
+    if (NULL != block) {
+        PnpMemoryAccounting_Track(tag, block, size);
+    }
+
+    return block;
+}
+
+void*
+PnpMemory_TaggedCalloc(
+    PNPMEMORY_TAG tag,
+    size_t count,
+    size_t size
+    )
+{
+    void* block = calloc(count, size);
+    if (NULL != block) {
+        PnpMemoryAccounting_Track(tag, block, count * size);
+    }
+
+    return block;
+}
+
+void*
+PnpMemory_TaggedRealloc(
+    PNPMEMORY_TAG tag,
+    void* ptr,
+    size_t size
+    )
+{
+    PNPMEMORY_ACCOUNTING_ENTRY previous = { 0 };
+    bool tracked;
+    void* block;
+
+    if (NULL == ptr) {
+        return PnpMemory_TaggedMalloc(tag, size);
+    }
+
+    // The old block is untracked first since realloc may hand its address
+    // to another thread as soon as it is freed.
+    tracked = PnpMemoryAccounting_Untrack(ptr, &previous);
+
+    block = realloc(ptr, size);
+    if (NULL != block) {
+        PnpMemoryAccounting_Track(tag, block, size);
+    }
+    else if (tracked && 0 != size) {
+        // ptr is still valid and owned by the caller
+        PnpMemoryAccounting_Track(previous.Tag, ptr, previous.Size);
+    }
+
+    return block;
+}
+
+void
+PnpMemory_TaggedFree(
+    void* ptr
+    )
+{
+    if (NULL != ptr) {
+        (void)PnpMemoryAccounting_Untrack(ptr, NULL);
+        free(ptr);
+    }
+}
+
+// Bytes of the process heap that are in use, or -1 if unknown
+static long
+PnpMemoryAccounting_GetHeapInUse()
+{
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+    struct mallinfo2 info = mallinfo2();
+    return (long)(info.uordblks + info.hblkhd);
+#elif defined(__GLIBC__)
+    struct mallinfo info = mallinfo();
+    return (long)((unsigned int)info.uordblks + (unsigned int)info.hblkhd);
+#else
+    return -1;
+#endif
+}
+
+// Must be called with the report lock held
+static void
+PnpMemoryAccounting_GetStatistics(
+    PNPMEMORY_TAG Tag,
+    PPNPMEMORY_TAG_STATISTICS Statistics
+    )
+{
+    memset(Statistics, 0, sizeof(*Statistics));
+
+    if (PNPMEMORY_TAG_SDK == Tag) {
+        long heapInUse = PnpMemoryAccounting_GetHeapInUse();
+        long tracked = 0;
+
+        if (heapInUse < 0) {
+            Statistics->CurrentBytes = -1;
+            Statistics->PeakBytes = -1;
+            return;
+        }
+
+        for (int i = 0; i < PNPMEMORY_TAG_COUNT; i++) {
+            tracked += PNPBRIDGE_INTERLOCKED_READ(&g_PnpMemoryTagCounters[i].CurrentBytes);
+        }
+
+        // The heap also counts the chunk overhead of the tracked blocks, so
+        // this is an upper bound of what the SDK holds. Its peak is only
+        // sampled when statistics are read.
+        Statistics->CurrentBytes = heapInUse > tracked ? heapInUse - tracked : 0;
+        if (Statistics->CurrentBytes > g_PnpMemoryReport.SdkPeakBytes) {
+            g_PnpMemoryReport.SdkPeakBytes = Statistics->CurrentBytes;
+        }
+        Statistics->PeakBytes = g_PnpMemoryReport.SdkPeakBytes;
+        return;
+    }
+
+    Statistics->CurrentBytes = PNPBRIDGE_INTERLOCKED_READ(&g_PnpMemoryTagCounters[Tag].CurrentBytes);
+    Statistics->PeakBytes = PNPBRIDGE_INTERLOCKED_READ(&g_PnpMemoryTagCounters[Tag].PeakBytes);
+    Statistics->Allocations = PNPBRIDGE_INTERLOCKED_READ(&g_PnpMemoryTagCounters[Tag].Allocations);
+    Statistics->Frees = PNPBRIDGE_INTERLOCKED_READ(&g_PnpMemoryTagCounters[Tag].Frees);
+    Statistics->AllocationRate = g_PnpMemoryReport.Rates[Tag];
+}
+
+int
+PnpMemory_GetTagStatistics(
+    PNPMEMORY_TAG tag,
+    PPNPMEMORY_TAG_STATISTICS statistics
+    )
+{
+    if (tag < 0 || tag >= PNPMEMORY_TAG_COUNT || NULL == statistics) {
+        return -1;
+    }
+
+    PnpMemoryAccounting_Lock(&g_PnpMemoryReport.Lock);
+    PnpMemoryAccounting_GetStatistics(tag, statistics);
+    PnpMemoryAccounting_Unlock(&g_PnpMemoryReport.Lock);
+    return 0;
+}
+
+void
+PnpMemory_LogTagStatistics(
+    const char* reason
+    )
+{
+    tickcounter_ms_t now = 0;
+    tickcounter_ms_t elapsed = 0;
+
+    PnpMemoryAccounting_Lock(&g_PnpMemoryReport.Lock);
+
+    if (NULL == g_PnpMemoryReport.TickCounter) {
+        g_PnpMemoryReport.TickCounter = tickcounter_create();
+    }
+
+    if (NULL != g_PnpMemoryReport.TickCounter) {
+        tickcounter_get_current_ms(g_PnpMemoryReport.TickCounter, &now);
+        elapsed = now - g_PnpMemoryReport.Time;
+        g_PnpMemoryReport.Time = now;
+    }
+
+    for (int i = 0; i < PNPMEMORY_TAG_COUNT; i++) {
+        PNPMEMORY_TAG_STATISTICS stats;
+
+        PnpMemoryAccounting_GetStatistics((PNPMEMORY_TAG)i, &stats);
+
+        if (PNPMEMORY_TAG_SDK == i) {
+            LogInfo("%s: memory tag %s current %ld bytes, peak %ld bytes (untracked heap)",
+                    reason, g_PnpMemoryTagNames[i], stats.CurrentBytes, stats.PeakBytes);
+            continue;
+        }
+
+        if (elapsed > 0) {
+            stats.AllocationRate = (long)((stats.Allocations - g_PnpMemoryReport.Allocations[i]) * 1000LL / (long long)elapsed);
+            g_PnpMemoryReport.Rates[i] = stats.AllocationRate;
+        }
+        g_PnpMemoryReport.Allocations[i] = stats.Allocations;
+
+        LogInfo("%s: memory tag %s current %ld bytes, peak %ld bytes, allocations %ld, frees %ld, %ld allocations/s",
+                reason, g_PnpMemoryTagNames[i], stats.CurrentBytes, stats.PeakBytes,
+                stats.Allocations, stats.Frees, stats.AllocationRate);
+    }
+
+    PnpMemoryAccounting_Unlock(&g_PnpMemoryReport.Lock);
+}
+
+#else
+
+void*
+PnpMemory_TaggedMalloc(
+    PNPMEMORY_TAG tag,
+    size_t size
+    )
+{
+    AZURE_UNREFERENCED_PARAMETER(tag);
+    return malloc(size);
+}
+
+void*
+PnpMemory_TaggedCalloc(
+    PNPMEMORY_TAG tag,
+    size_t count,
+    size_t size
+    )
+{
+    AZURE_UNREFERENCED_PARAMETER(tag);
+    return calloc(count, size);
+}
+
+void*
+PnpMemory_TaggedRealloc(
+    PNPMEMORY_TAG tag,
+    void* ptr,
+    size_t size
+    )
+{
+    AZURE_UNREFERENCED_PARAMETER(tag);
+    return realloc(ptr, size);
+}
+
+void
+PnpMemory_TaggedFree(
+    void* ptr
+    )
+{
+    free(ptr);
+}
+
+int
+PnpMemory_GetTagStatistics(
+    PNPMEMORY_TAG tag,
+    PPNPMEMORY_TAG_STATISTICS statistics
+    )
+{
+    AZURE_UNREFERENCED_PARAMETER(tag);
+
+    if (NULL != statistics) {
+        memset(statistics, 0, sizeof(*statistics));
+    }
+
+    return -1;
+}
+
+void
+PnpMemory_LogTagStatistics(
+    const char* reason
+    )
+{
+    AZURE_UNREFERENCED_PARAMETER(reason);
+}
+
+#endif
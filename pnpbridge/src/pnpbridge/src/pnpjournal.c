@@ -0,0 +1,559 @@
+// Copyright (c) Microsoft. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#include <errno.h>
+
+#include "pnpbridge_common.h"
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+// The journal file is mapped in memory and holds a header followed by the
+// records. A record is appended by writing it past Used and then moving Used,
+// so a record that was being written when the bridge died is ignored.
+// Records are only moved when the journal is opened, which drops the removed
+// ones and those of devices that haven't been discovered for
+// PNPBRIDGE_JOURNAL_MAX_MISSED_RUNS runs of the bridge.
+#define PNPBRIDGE_JOURNAL_MAGIC 0x4a504e50 // "PNPJ"
+#define PNPBRIDGE_JOURNAL_VERSION 1
+#define PNPBRIDGE_JOURNAL_MAX_MISSED_RUNS 3
+
+// Records are 4 byte aligned so that their header fields can be updated in place
+#define PNPBRIDGE_JOURNAL_ALIGN(Size) (((Size) + 3) & ~((uint32_t)3))
+
+// The record has been superseded by a newer record of the same interface
+#define PNPBRIDGE_JOURNAL_RECORD_REMOVED 0x1
+
+// The record was replayed at startup and its device hasn't been discovered since
+#define PNPBRIDGE_JOURNAL_RECORD_PENDING 0x2
+
+typedef struct _PNPBRIDGE_JOURNAL_HEADER {
+    uint32_t Magic;
+    uint32_t Version;
+
+    // Bytes of the file, header included, that hold records
+    uint32_t Used;
+    uint32_t Reserved;
+} PNPBRIDGE_JOURNAL_HEADER, *PPNPBRIDGE_JOURNAL_HEADER;
+
+// Followed by the adapter identity, interface id, component name and message,
+// each NUL terminated. A device without a component name has an empty one.
+typedef struct _PNPBRIDGE_JOURNAL_RECORD {
+    uint32_t Length;
+    uint32_t Flags;
+
+    // Number of times the bridge was started since the device was last discovered
+    uint32_t MissedRuns;
+    uint32_t Reserved;
+} PNPBRIDGE_JOURNAL_RECORD, *PPNPBRIDGE_JOURNAL_RECORD;
+
+#define PNPBRIDGE_JOURNAL_RECORD_STRINGS 4
+
+typedef struct _PNPBRIDGE_JOURNAL {
+    // Protects the records past the header and Used
+    LOCK_HANDLE Lock;
+
+    PPNPBRIDGE_JOURNAL_HEADER Header;
+    uint32_t Size;
+
+    // Records at or past this offset were added in this run and aren't replayed
+    uint32_t ReplayEnd;
+
+    // Set once an append didn't fit so that it is only logged once
+    bool Full;
+
+#ifdef WIN32
+    HANDLE File;
+    HANDLE Mapping;
+#else
+    int File;
+#endif
+} PNPBRIDGE_JOURNAL;
+
+static PPNPBRIDGE_JOURNAL_RECORD
+PnpJournal_GetRecord(
+    _In_ PNPBRIDGE_JOURNAL_HANDLE Journal,
+    _In_ uint32_t Offset
+    )
+{
+    return (PPNPBRIDGE_JOURNAL_RECORD)((char*)Journal->Header + Offset);
+}
+
+// Reads the strings of the record at Offset. Returns false if the record
+// doesn't fit in Limit or its strings aren't NUL terminated.
+static bool
+PnpJournal_ReadRecord(
+    _In_ PNPBRIDGE_JOURNAL_HANDLE Journal,
+    _In_ uint32_t Offset,
+    _In_ uint32_t Limit,
+    _Out_opt_ PPNPBRIDGE_JOURNAL_ENTRY Entry
+    )
+{
+    PPNPBRIDGE_JOURNAL_RECORD record = PnpJournal_GetRecord(Journal, Offset);
+    const char* strings[PNPBRIDGE_JOURNAL_RECORD_STRINGS];
+    const char* current;
+    const char* end;
+
+    if (Limit - Offset < sizeof(PNPBRIDGE_JOURNAL_RECORD) ||
+        record->Length < sizeof(PNPBRIDGE_JOURNAL_RECORD) ||
+        record->Length > Limit - Offset ||
+        record->Length != PNPBRIDGE_JOURNAL_ALIGN(record->Length)) {
+        return false;
+    }
+
+    current = (const char*)(record + 1);
+    end = (const char*)record + record->Length;
+    for (int i = 0; i < PNPBRIDGE_JOURNAL_RECORD_STRINGS; i++) {
+        const char* terminator = memchr(current, '\0', end - current);
+        if (NULL == terminator) {
+            return false;
+        }
+
+        strings[i] = current;
+        current = terminator + 1;
+    }
+
+    if (NULL != Entry) {
+        Entry->AdapterIdentity = strings[0];
+        Entry->InterfaceId = strings[1];
+        Entry->ComponentName = ('\0' != *strings[2]) ? strings[2] : NULL;
+        Entry->Message = strings[3];
+    }
+
+    return true;
+}
+
+// Returns the offset of the live record of InterfaceId or 0 if there is none.
+// Must be called with the journal lock held.
+static uint32_t
+PnpJournal_FindRecord(
+    _In_ PNPBRIDGE_JOURNAL_HANDLE Journal,
+    _In_ const char* InterfaceId,
+    _Out_opt_ PPNPBRIDGE_JOURNAL_ENTRY Entry
+    )
+{
+    uint32_t offset = sizeof(PNPBRIDGE_JOURNAL_HEADER);
+
+    while (offset < Journal->Header->Used) {
+        PPNPBRIDGE_JOURNAL_RECORD record = PnpJournal_GetRecord(Journal, offset);
+        PNPBRIDGE_JOURNAL_ENTRY entry;
+
+        // Compact only keeps valid records, so a bad one was torn after the
+        // journal was opened and the scan can't step past it
+        if (!PnpJournal_ReadRecord(Journal, offset, Journal->Header->Used, &entry)) {
+            LogError("Device journal record at offset %u is not valid", offset);
+            break;
+        }
+
+        if (0 == (record->Flags & PNPBRIDGE_JOURNAL_RECORD_REMOVED) &&
+            0 == strcmp(entry.InterfaceId, InterfaceId)) {
+            if (NULL != Entry) {
+                *Entry = entry;
+            }
+            return offset;
+        }
+
+        offset += record->Length;
+    }
+
+    return 0;
+}
+
+// Writes back the pages holding Length bytes at Offset. Appends and flag
+// updates only flush what they changed, so a device arrival doesn't wait on
+// the writeback of the whole journal.
+static void
+PnpJournal_Flush(
+    _In_ PNPBRIDGE_JOURNAL_HANDLE Journal,
+    _In_ uint32_t Offset,
+    _In_ uint32_t Length,
+    _In_ bool Wait
+    )
+{
+#ifdef WIN32
+    AZURE_UNREFERENCED_PARAMETER(Wait);
+    FlushViewOfFile((char*)Journal->Header + Offset, Length);
+#else
+    // msync needs a page aligned address
+    uint32_t start = Offset & ~((uint32_t)sysconf(_SC_PAGESIZE) - 1);
+    msync((char*)Journal->Header + start, Offset + Length - start, Wait ? MS_SYNC : MS_ASYNC);
+#endif
+}
+
+// Drops the corrupt, removed and stale records and marks the others as
+// pending until their device is discovered again
+static void
+PnpJournal_Compact(
+    _In_ PNPBRIDGE_JOURNAL_HANDLE Journal
+    )
+{
+    PPNPBRIDGE_JOURNAL_HEADER header = Journal->Header;
+    uint32_t readOffset = sizeof(PNPBRIDGE_JOURNAL_HEADER);
+    uint32_t writeOffset = sizeof(PNPBRIDGE_JOURNAL_HEADER);
+    int kept = 0;
+    int dropped = 0;
+
+    if (PNPBRIDGE_JOURNAL_MAGIC != header->Magic || PNPBRIDGE_JOURNAL_VERSION != header->Version ||
+        header->Used < sizeof(PNPBRIDGE_JOURNAL_HEADER) || header->Used > Journal->Size) {
+        if (0 != header->Magic) {
+            LogError("Device journal is not valid and is reset");
+        }
+        header->Magic = PNPBRIDGE_JOURNAL_MAGIC;
+        header->Version = PNPBRIDGE_JOURNAL_VERSION;
+        header->Used = sizeof(PNPBRIDGE_JOURNAL_HEADER);
+        header->Reserved = 0;
+        return;
+    }
+
+    while (readOffset < header->Used) {
+        PPNPBRIDGE_JOURNAL_RECORD record = PnpJournal_GetRecord(Journal, readOffset);
+        uint32_t length;
+
+        if (!PnpJournal_ReadRecord(Journal, readOffset, header->Used, NULL)) {
+            LogError("Device journal is truncated at offset %u", readOffset);
+            break;
+        }
+
+        length = record->Length;
+        if (0 != (record->Flags & PNPBRIDGE_JOURNAL_RECORD_REMOVED) ||
+            record->MissedRuns >= PNPBRIDGE_JOURNAL_MAX_MISSED_RUNS) {
+            if (0 == (record->Flags & PNPBRIDGE_JOURNAL_RECORD_REMOVED)) {
+                dropped++;
+            }
+            readOffset += length;
+            continue;
+        }
+
+        if (writeOffset != readOffset) {
+            memmove(PnpJournal_GetRecord(Journal, writeOffset), record, length);
+            record = PnpJournal_GetRecord(Journal, writeOffset);
+        }
+
+        record->MissedRuns++;
+        record->Flags = PNPBRIDGE_JOURNAL_RECORD_PENDING;
+
+        writeOffset += length;
+        readOffset += length;
+        kept++;
+    }
+
+    header->Used = writeOffset;
+    PnpJournal_Flush(Journal, 0, Journal->Size, true);
+
+    LogInfo("Device journal holds %d device(s), %d not discovered for %d runs were dropped",
+            kept, dropped, PNPBRIDGE_JOURNAL_MAX_MISSED_RUNS);
+}
+
+#ifdef WIN32
+static PNPBRIDGE_RESULT
+PnpJournal_Map(
+    _In_ PNPBRIDGE_JOURNAL_HANDLE Journal,
+    _In_ const char* Path
+    )
+{
+    LARGE_INTEGER size;
+
+    Journal->File = CreateFileA(Path, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_ALWAYS,
+                                FILE_ATTRIBUTE_NORMAL, NULL);
+    if (INVALID_HANDLE_VALUE == Journal->File) {
+        Journal->File = NULL;
+        LogError("Failed to open the device journal %s: %lu", Path, GetLastError());
+        return PNPBRIDGE_FILE_NOT_FOUND;
+    }
+
+    size.QuadPart = Journal->Size;
+    if (!SetFilePointerEx(Journal->File, size, NULL, FILE_BEGIN) || !SetEndOfFile(Journal->File)) {
+        LogError("Failed to size the device journal %s: %lu", Path, GetLastError());
+        return PNPBRIDGE_FAILED;
+    }
+
+    Journal->Mapping = CreateFileMappingA(Journal->File, NULL, PAGE_READWRITE, 0, Journal->Size, NULL);
+    if (NULL == Journal->Mapping) {
+        LogError("Failed to map the device journal %s: %lu", Path, GetLastError());
+        return PNPBRIDGE_FAILED;
+    }
+
+    Journal->Header = MapViewOfFile(Journal->Mapping, FILE_MAP_ALL_ACCESS, 0, 0, Journal->Size);
+    if (NULL == Journal->Header) {
+        LogError("Failed to map the device journal %s: %lu", Path, GetLastError());
+        return PNPBRIDGE_FAILED;
+    }
+
+    return PNPBRIDGE_OK;
+}
+
+static void
+PnpJournal_Unmap(
+    _In_ PNPBRIDGE_JOURNAL_HANDLE Journal
+    )
+{
+    if (NULL != Journal->Header) {
+        UnmapViewOfFile(Journal->Header);
+    }
+
+    if (NULL != Journal->Mapping) {
+        CloseHandle(Journal->Mapping);
+    }
+
+    if (NULL != Journal->File) {
+        CloseHandle(Journal->File);
+    }
+}
+#else
+static PNPBRIDGE_RESULT
+PnpJournal_Map(
+    _In_ PNPBRIDGE_JOURNAL_HANDLE Journal,
+    _In_ const char* Path
+    )
+{
+    void* view;
+
+    Journal->File = open(Path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+    if (Journal->File < 0) {
+        LogError("Failed to open the device journal %s: %d", Path, errno);
+        return PNPBRIDGE_FILE_NOT_FOUND;
+    }
+
+    if (0 != ftruncate(Journal->File, Journal->Size)) {
+        LogError("Failed to size the device journal %s: %d", Path, errno);
+        return PNPBRIDGE_FAILED;
+    }
+
+    view = mmap(NULL, Journal->Size, PROT_READ | PROT_WRITE, MAP_SHARED, Journal->File, 0);
+    if (MAP_FAILED == view) {
+        LogError("Failed to map the device journal %s: %d", Path, errno);
+        return PNPBRIDGE_FAILED;
+    }
+
+    Journal->Header = view;
+
+    return PNPBRIDGE_OK;
+}
+
+static void
+PnpJournal_Unmap(
+    _In_ PNPBRIDGE_JOURNAL_HANDLE Journal
+    )
+{
+    if (NULL != Journal->Header) {
+        munmap(Journal->Header, Journal->Size);
+    }
+
+    if (Journal->File >= 0) {
+        close(Journal->File);
+    }
+}
+#endif
+
+PNPBRIDGE_RESULT
+PnpJournal_Open(
+    _In_ const char* Path,
+    _In_ unsigned int SizeBytes,
+    _Out_ PNPBRIDGE_JOURNAL_HANDLE* Journal
+    )
+{
+    PNPBRIDGE_RESULT result = PNPBRIDGE_OK;
+    PNPBRIDGE_JOURNAL_HANDLE journal = NULL;
+
+    TRY {
+        if (NULL == Path || NULL == Journal || SizeBytes < PNPBRIDGE_JOURNAL_MIN_SIZE_BYTES) {
+            result = PNPBRIDGE_INVALID_ARGS;
+            LEAVE;
+        }
+
+        journal = calloc(1, sizeof(PNPBRIDGE_JOURNAL));
+        if (NULL == journal) {
+            result = PNPBRIDGE_INSUFFICIENT_MEMORY;
+            LEAVE;
+        }
+
+#ifndef WIN32
+        journal->File = -1;
+#endif
+        journal->Size = PNPBRIDGE_JOURNAL_ALIGN(SizeBytes);
+
+        journal->Lock = Lock_Init();
+        if (NULL == journal->Lock) {
+            result = PNPBRIDGE_INSUFFICIENT_MEMORY;
+            LEAVE;
+        }
+
+        result = PnpJournal_Map(journal, Path);
+        if (PNPBRIDGE_OK != result) {
+            LEAVE;
+        }
+
+        PnpJournal_Compact(journal);
+        journal->ReplayEnd = journal->Header->Used;
+
+        *Journal = journal;
+    } FINALLY {
+        if (PNPBRIDGE_OK != result && NULL != journal) {
+            PnpJournal_Close(journal);
+        }
+    }
+
+    return result;
+}
+
+void
+PnpJournal_Close(
+    _In_ PNPBRIDGE_JOURNAL_HANDLE Journal
+    )
+{
+    if (NULL == Journal) {
+        return;
+    }
+
+    if (NULL != Journal->Header) {
+        PnpJournal_Flush(Journal, 0, Journal->Size, true);
+    }
+
+    PnpJournal_Unmap(Journal);
+
+    if (NULL != Journal->Lock) {
+        Lock_Deinit(Journal->Lock);
+    }
+
+    free(Journal);
+}
+
+int
+PnpJournal_Replay(
+    _In_ PNPBRIDGE_JOURNAL_HANDLE Journal,
+    _In_ PNPBRIDGE_JOURNAL_CALLBACK Callback,
+    _In_opt_ void* Context
+    )
+{
+    uint32_t offset = sizeof(PNPBRIDGE_JOURNAL_HEADER);
+    int count = 0;
+
+    // The records that are replayed were written before the journal was
+    // opened. They are never moved and only their flags change, so they
+    // are read without the lock while the callback queues them.
+    while (offset < Journal->ReplayEnd) {
+        PPNPBRIDGE_JOURNAL_RECORD record = PnpJournal_GetRecord(Journal, offset);
+        PNPBRIDGE_JOURNAL_ENTRY entry;
+
+        if (!PnpJournal_ReadRecord(Journal, offset, Journal->ReplayEnd, &entry)) {
+            LogError("Device journal record at offset %u is not valid", offset);
+            break;
+        }
+        offset += record->Length;
+
+        if (0 != (record->Flags & PNPBRIDGE_JOURNAL_RECORD_REMOVED)) {
+            continue;
+        }
+
+        Callback(Context, &entry);
+        count++;
+    }
+
+    return count;
+}
+
+PNPBRIDGE_RESULT
+PnpJournal_Record(
+    _In_ PNPBRIDGE_JOURNAL_HANDLE Journal,
+    _In_ const PNPBRIDGE_JOURNAL_ENTRY* Entry
+    )
+{
+    PNPBRIDGE_RESULT result = PNPBRIDGE_OK;
+    const char* componentName = (NULL != Entry->ComponentName) ? Entry->ComponentName : "";
+    const char* strings[PNPBRIDGE_JOURNAL_RECORD_STRINGS] = {
+        Entry->AdapterIdentity, Entry->InterfaceId, componentName, Entry->Message
+    };
+    size_t length = sizeof(PNPBRIDGE_JOURNAL_RECORD);
+    PNPBRIDGE_JOURNAL_ENTRY existing;
+    uint32_t existingOffset;
+
+    for (int i = 0; i < PNPBRIDGE_JOURNAL_RECORD_STRINGS; i++) {
+        length += strlen(strings[i]) + 1;
+    }
+
+    Lock(Journal->Lock);
+
+    TRY {
+        // A device that is reported again the same way only has its record refreshed
+        existingOffset = PnpJournal_FindRecord(Journal, Entry->InterfaceId, &existing);
+        if (0 != existingOffset &&
+            0 == strcmp(existing.AdapterIdentity, Entry->AdapterIdentity) &&
+            0 == strcmp(existing.Message, Entry->Message) &&
+            0 == strcmp(existing.ComponentName ? existing.ComponentName : "", componentName)) {
+            PPNPBRIDGE_JOURNAL_RECORD record = PnpJournal_GetRecord(Journal, existingOffset);
+            record->MissedRuns = 0;
+            record->Flags &= ~PNPBRIDGE_JOURNAL_RECORD_PENDING;
+            PnpJournal_Flush(Journal, existingOffset, sizeof(PNPBRIDGE_JOURNAL_RECORD), false);
+            LEAVE;
+        }
+
+        if (PNPBRIDGE_JOURNAL_ALIGN(length) > Journal->Size - Journal->Header->Used) {
+            if (!Journal->Full) {
+                LogError("Device journal is full. Interface %s and later ones are not journaled until the bridge restarts",
+                         Entry->InterfaceId);
+                Journal->Full = true;
+            }
+            result = PNPBRIDGE_INSUFFICIENT_MEMORY;
+            LEAVE;
+        }
+
+        // Write the record back before making it visible in Used
+        {
+            uint32_t offset = Journal->Header->Used;
+            PPNPBRIDGE_JOURNAL_RECORD record = PnpJournal_GetRecord(Journal, offset);
+            char* buffer = (char*)(record + 1);
+
+            memset(record, 0, PNPBRIDGE_JOURNAL_ALIGN(length));
+            record->Length = PNPBRIDGE_JOURNAL_ALIGN(length);
+            for (int i = 0; i < PNPBRIDGE_JOURNAL_RECORD_STRINGS; i++) {
+                size_t size = strlen(strings[i]) + 1;
+                memcpy(buffer, strings[i], size);
+                buffer += size;
+            }
+
+            PnpJournal_Flush(Journal, offset, record->Length, true);
+            Journal->Header->Used += record->Length;
+            PnpJournal_Flush(Journal, 0, sizeof(PNPBRIDGE_JOURNAL_HEADER), true);
+        }
+
+        // The old record is only removed once the new one is published
+        if (0 != existingOffset) {
+            PnpJournal_GetRecord(Journal, existingOffset)->Flags |= PNPBRIDGE_JOURNAL_RECORD_REMOVED;
+            PnpJournal_Flush(Journal, existingOffset, sizeof(PNPBRIDGE_JOURNAL_RECORD), true);
+        }
+    } FINALLY {
+        Unlock(Journal->Lock);
+    }
+
+    return result;
+}
+
+bool
+PnpJournal_Confirm(
+    _In_ PNPBRIDGE_JOURNAL_HANDLE Journal,
+    _In_ const char* InterfaceId
+    )
+{
+    bool pending = false;
+    uint32_t offset;
+
+    Lock(Journal->Lock);
+
+    offset = PnpJournal_FindRecord(Journal, InterfaceId, NULL);
+    if (0 != offset) {
+        PPNPBRIDGE_JOURNAL_RECORD record = PnpJournal_GetRecord(Journal, offset);
+
+        pending = (0 != (record->Flags & PNPBRIDGE_JOURNAL_RECORD_PENDING));
+        record->Flags &= ~PNPBRIDGE_JOURNAL_RECORD_PENDING;
+        record->MissedRuns = 0;
+        PnpJournal_Flush(Journal, offset, sizeof(PNPBRIDGE_JOURNAL_RECORD), false);
+    }
+
+    Unlock(Journal->Lock);
+
+    return pending;
+}
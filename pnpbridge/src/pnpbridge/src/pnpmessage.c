@@ -1,24 +1,69 @@
 #include "pnpbridge_common.h"
 
-// Custom destroy method for PNPMESSAGE's PNPMEMORY
-void 
-PnpMessage_Destroy(
-    _In_ PNPMEMORY Message
+// Strings of a message created by PnpMessage_CreateMessageWithPayload are
+// stored in the message's own block, after the PNPBRIDGE_CHANGE_PAYLOAD,
+// and must not be freed
+static bool
+PnpMessage_IsInline(
+    _In_ PNPMESSAGE Message,
+    _In_opt_ const void* Buffer
     )
 {
-    PPNPBRIDGE_CHANGE_PAYLOAD msg = (PPNPBRIDGE_CHANGE_PAYLOAD)PnpMemory_GetBuffer(Message, NULL);
+    int size = 0;
+    const char* base = (const char*)PnpMemory_GetBuffer(Message, &size);
+    const char* buffer = (const char*)Buffer;
+
+    return buffer >= base + sizeof(PNPBRIDGE_CHANGE_PAYLOAD) && buffer < base + size;
+}
 
-    if (msg->Message) {
-        free((void*)msg->Message);
+static void
+PnpMessage_FreeString(
+    _In_ PNPMESSAGE Message,
+    _In_opt_ const char* String
+    )
+{
+    if (NULL != String && !PnpMessage_IsInline(Message, String)) {
+        free((void*)String);
     }
+}
 
-    if (msg->InterfaceId) {
-        free((void*)msg->InterfaceId);
+// Replaces one of the strings of a message with a copy of Value. A string
+// that already has this value is kept, so that reprocessing a message
+// doesn't allocate.
+static int
+PnpMessage_ReplaceString(
+    _In_ PNPMESSAGE Message,
+    _Inout_ char** Field,
+    _In_ const char* Value
+    )
+{
+    char* copy = NULL;
+
+    if (NULL != *Field && 0 == strcmp(*Field, Value)) {
+        return 0;
     }
 
-    if (msg->Properties.ComponentName) {
-        free(msg->Properties.ComponentName);
+    if (0 != mallocAndStrcpy_s(&copy, Value)) {
+        return -1;
     }
+
+    PnpMessage_FreeString(Message, *Field);
+    *Field = copy;
+
+    return 0;
+}
+
+// Custom destroy method for PNPMESSAGE's PNPMEMORY
+void 
+PnpMessage_Destroy(
+    _In_ PNPMEMORY Message
+    )
+{
+    PPNPBRIDGE_CHANGE_PAYLOAD msg = (PPNPBRIDGE_CHANGE_PAYLOAD)PnpMemory_GetBuffer(Message, NULL);
+
+    PnpMessage_FreeString(Message, msg->Message);
+    PnpMessage_FreeString(Message, msg->InterfaceId);
+    PnpMessage_FreeString(Message, msg->Properties.ComponentName);
 }
 
 const char* 
@@ -46,7 +91,10 @@ PnpMessage_CreateMessage(
     PNPMESSAGE* message = NULL;
     attrib.destroyCallback = PnpMessage_Destroy;
 
-    PnpMemory_Create(&attrib, sizeof(PNPBRIDGE_CHANGE_PAYLOAD), (PNPMEMORY*)&message);
+    // Fails when the memory budget refuses the allocation
+    if (0 != PnpMemory_Create(&attrib, sizeof(PNPBRIDGE_CHANGE_PAYLOAD), (PNPMEMORY*)&message)) {
+        return -1;
+    }
 
     PPNPBRIDGE_CHANGE_PAYLOAD msg = (PPNPBRIDGE_CHANGE_PAYLOAD) PnpMemory_GetBuffer(message, NULL);
     /* msg->MessageLength = MessageSize;
@@ -59,6 +107,52 @@ PnpMessage_CreateMessage(
     return 0;
 }
 
+int
+PnpMessage_CreateMessageWithPayload(
+    _Out_ PNPMESSAGE* Message,
+    _In_ const char* Payload,
+    _In_opt_ const char* InterfaceId,
+    _In_opt_ const char* ComponentName
+    )
+{
+    PNPMEMORY_ATTRIBUTES attrib = { 0 };
+    PNPMESSAGE message = NULL;
+    size_t payloadSize = strlen(Payload) + 1;
+    size_t interfaceIdSize = (NULL != InterfaceId) ? strlen(InterfaceId) + 1 : 0;
+    size_t componentNameSize = (NULL != ComponentName) ? strlen(ComponentName) + 1 : 0;
+    attrib.destroyCallback = PnpMessage_Destroy;
+
+    if (0 != PnpMemory_Create(&attrib, (int)(sizeof(PNPBRIDGE_CHANGE_PAYLOAD) + payloadSize + interfaceIdSize + componentNameSize), &message)) {
+        return -1;
+    }
+
+    PPNPBRIDGE_CHANGE_PAYLOAD msg = (PPNPBRIDGE_CHANGE_PAYLOAD) PnpMemory_GetBuffer(message, NULL);
+    char* strings = (char*)(msg + 1);
+
+    DList_InitializeListHead(&msg->Entry);
+    msg->Self = message;
+
+    memcpy(strings, Payload, payloadSize);
+    msg->Message = strings;
+    msg->MessageLength = (int)payloadSize;
+    strings += payloadSize;
+
+    if (NULL != InterfaceId) {
+        memcpy(strings, InterfaceId, interfaceIdSize);
+        msg->InterfaceId = strings;
+        strings += interfaceIdSize;
+    }
+
+    if (NULL != ComponentName) {
+        memcpy(strings, ComponentName, componentNameSize);
+        msg->Properties.ComponentName = strings;
+    }
+
+    *Message = message;
+
+    return 0;
+}
+
 int 
 PnpMessage_SetMessage(
     _In_ PNPMESSAGE Message,
@@ -75,11 +169,40 @@ PnpMessage_SetMessage(
     int length = (int) strlen(payload);
     int size = (length + 1) * sizeof(char);
 
-    msg->MessageLength = length + 1;
-    msg->Message = (char*)malloc(size);
+    char* message = (char*)malloc(size);
+    if (NULL == message) {
+        return -1;
+    }
 
     // Copy the payload
-    strcpy_s((char*)msg->Message, msg->MessageLength, payload);
+    strcpy_s(message, size, payload);
+
+    // Replace a previously set payload
+    PnpMessage_FreeString(Message, msg->Message);
+
+    msg->MessageLength = length + 1;
+    msg->Message = message;
+
+    return 0;
+}
+
+int
+PnpMessage_SetMessageOwned(
+    _In_ PNPMESSAGE Message,
+    _In_ char* Payload
+    )
+{
+    PPNPBRIDGE_CHANGE_PAYLOAD msg;
+
+    assert(NULL != Message);
+
+    msg = (PPNPBRIDGE_CHANGE_PAYLOAD)PnpMemory_GetBuffer(Message, NULL);
+
+    // Replace a previously set payload
+    PnpMessage_FreeString(Message, msg->Message);
+
+    msg->MessageLength = (int) strlen(Payload) + 1;
+    msg->Message = Payload;
 
     return 0;
 }
@@ -110,16 +233,23 @@ PnpMessage_SetInterfaceId(
 
     msg = (PPNPBRIDGE_CHANGE_PAYLOAD)PnpMemory_GetBuffer(Message, NULL);
 
-    // Allocate memory for the payload
-    int length = (int) strlen(InterfaceId);
-    int size = (length + 1) * sizeof(char);
+    // Replace a previously set interface id
+    return PnpMessage_ReplaceString(Message, &msg->InterfaceId, InterfaceId);
+}
 
-    msg->InterfaceId = (char*)malloc(size);
+int
+PnpMessage_SetComponentName(
+    _In_ PNPMESSAGE Message,
+    _In_ const char* ComponentName
+    )
+{
+    PPNPBRIDGE_CHANGE_PAYLOAD msg;
 
-    // Copy the payload
-    strcpy_s(msg->InterfaceId, size, InterfaceId);
+    assert(NULL != Message);
 
-    return 0;
+    msg = (PPNPBRIDGE_CHANGE_PAYLOAD)PnpMemory_GetBuffer(Message, NULL);
+
+    return PnpMessage_ReplaceString(Message, &msg->Properties.ComponentName, ComponentName);
 }
 
 const char*
@@ -164,6 +294,49 @@ PnpMessage_ReleaseReference(
     PnpMemory_ReleaseReference(Message);
 }
 
+// createPnpInterface callback of a PNPMESSAGE submitted to the work pool
+typedef struct _PNPMESSAGE_CREATE_JOB {
+    DLIST_ENTRY Entry;
+    PMESSAGE_QUEUE Queue;
+    PNPMESSAGE Message;
+    PNPBRIDGE_WORK_ITEM_HANDLE Work;
+    bool Created;
+} PNPMESSAGE_CREATE_JOB, *PPNPMESSAGE_CREATE_JOB;
+
+static int
+PnpMessageQueue_CreateWork(
+    _In_ void* Context
+    )
+{
+    PPNPMESSAGE_CREATE_JOB job = (PPNPMESSAGE_CREATE_JOB)Context;
+    return PnpBridge_CreatePnpInterface(job->Message);
+}
+
+// Called on the work pool when a create timed out. The worker publishes
+// the interface in its next cycle if it was created after all.
+static void
+PnpMessageQueue_CreateLate(
+    _In_ void* Context,
+    _In_ bool Ran,
+    _In_ int Result
+    )
+{
+    PPNPMESSAGE_CREATE_JOB job = (PPNPMESSAGE_CREATE_JOB)Context;
+    PMESSAGE_QUEUE queue = job->Queue;
+
+    if (!Ran) {
+        PnpBridge_CancelPnpMessage(job->Message);
+    }
+
+    job->Created = Ran && PNPBRIDGE_OK == Result;
+
+    Lock(queue->WaitConditionLock);
+    DList_InsertTailList(&queue->LateCreates, &job->Entry);
+    queue->LateCount++;
+    Condition_Post(queue->WaitCondition);
+    Unlock(queue->WaitConditionLock);
+}
+
 int 
 PnpMessageQueue_Worker(
     _In_ void* threadArgument
@@ -176,6 +349,8 @@ PnpMessageQueue_Worker(
     while (true)
     {
         PNPMESSAGE message = NULL;
+        tickcounter_ms_t cycleStart = 0;
+        tickcounter_ms_t cycleEnd = 0;
 
         // TODO: check status
         Lock(queue->WaitConditionLock);
@@ -185,7 +360,11 @@ PnpMessageQueue_Worker(
             ThreadAPI_Exit(0);
         }
 
-        if (0 == queue->InCount) {
+        // InCount is checked under WaitConditionLock and producers post the
+        // condition under the same lock after incrementing it, so an arrival
+        // can't be missed between the check and the wait
+        while (PNPBRIDGE_INTERLOCKED_READ(&queue->InCount) <= 0 && 0 == queue->LateCount &&
+               NULL == queue->PendingCall && !queue->TearDown) {
             Condition_Wait(queue->WaitCondition, queue->WaitConditionLock, 0);
         }
 
@@ -194,49 +373,164 @@ PnpMessageQueue_Worker(
             ThreadAPI_Exit(0);
         }
 
+        // Run the posted call before the queued messages, which are then
+        // processed against the state it changed
+        if (NULL != queue->PendingCall) {
+            PNPBRIDGE_WORK_CALLBACK call = queue->PendingCall;
+            queue->PendingCall = NULL;
+            queue->CallRunning = true;
+            Unlock(queue->WaitConditionLock);
+
+            int callResult = call(queue->PendingCallContext);
+
+            Lock(queue->WaitConditionLock);
+            queue->PendingCallResult = callResult;
+            queue->CallRunning = false;
+            Condition_Post(queue->CallCondition);
+            Unlock(queue->WaitConditionLock);
+            continue;
+        }
+
+        tickcounter_get_current_ms(queue->TickCounter, &cycleStart);
+
+        // Coalesce arrivals: keep waiting while devices are still being reported,
+        // so that all of them are handled in a single publish pass. Producers
+        // don't signal while the queue is non-empty, so arrivals are detected
+        // by a change in InCount when the wait times out.
+        if (queue->CoalescingWindowMs > 0 && PNPBRIDGE_INTERLOCKED_READ(&queue->InCount) > 0) {
+            while (!queue->TearDown) {
+                tickcounter_ms_t now = 0;
+                long lastCount = PNPBRIDGE_INTERLOCKED_READ(&queue->InCount);
+
+                tickcounter_get_current_ms(queue->TickCounter, &now);
+                if (now - cycleStart >= queue->CoalescingMaxDelayMs) {
+                    break;
+                }
+
+                tickcounter_ms_t remaining = queue->CoalescingMaxDelayMs - (now - cycleStart);
+                int waitMs = (int)(remaining < queue->CoalescingWindowMs ? remaining : queue->CoalescingWindowMs);
+
+                if (COND_TIMEOUT == Condition_Wait(queue->WaitCondition, queue->WaitConditionLock, waitMs) &&
+                    lastCount == PNPBRIDGE_INTERLOCKED_READ(&queue->InCount)) {
+                    break;
+                }
+            }
+
+            if (queue->TearDown) {
+                Unlock(queue->WaitConditionLock);
+                ThreadAPI_Exit(0);
+            }
+        }
+
+        // Take the creates that completed after their timeout in an earlier cycle
+        DLIST_ENTRY lateCreates;
+        DList_InitializeListHead(&lateCreates);
+        while (!DList_IsListEmpty(&queue->LateCreates)) {
+            DList_InsertTailList(&lateCreates, DList_RemoveHeadList(&queue->LateCreates));
+        }
+        queue->LateCount = 0;
+
         Unlock(queue->WaitConditionLock);
 
+        // Only the messages that arrived since the last cycle are processed. Interfaces
+        // created for earlier messages and their worker threads are left running.
         // Due to SDK limitation of not being able to incrementally publish
-        // interface unload all Pnp adapters and re-init the interface
-        // Steps for this:
-        // 1. Unload all the pnp adapters
+        // interfaces, the complete interface list is still re-registered, but only
+        // once per cycle and only if a new interface was created:
+        // 1. Create Pnp interfaces for the newly reported devices
         // 2. Destroy the Digital twin client
         // 3. Recreate Digital twin client
-        // 4. Replay all messages from devices reported by discovery adapters
-        // 5. Publish the interface
-
-        PnpBridge_ReinitPnpAdapters();
+        // 4. Publish all the interfaces
+        // 5. Start the newly published interfaces
+        int newInterfaces = 0;
+        int batchSize = 0;
+        DLIST_ENTRY jobs;
+        DList_InitializeListHead(&jobs);
+
+        while (!DList_IsListEmpty(&lateCreates)) {
+            PPNPMESSAGE_CREATE_JOB job = containingRecord(DList_RemoveHeadList(&lateCreates), PNPMESSAGE_CREATE_JOB, Entry);
+            if (job->Created) {
+                PnpMesssageQueue_AddToPublishQ(queue, job->Message);
+                newInterfaces++;
+            }
+            else {
+                PnpMessage_ReleaseReference(job->Message);
+            }
+            free(job);
+        }
 
-        // Move messages from ingress queue to publish queue
+        // Match the messages and start creating their interfaces. With a work
+        // pool the adapters' createPnpInterface callbacks run concurrently.
         while (true) {
             PnpMesssageQueue_Remove(queue, &message);
             if (NULL == message) {
                 break;
             }
 
+            batchSize++;
+
+            // Process the message
+            if (PNPBRIDGE_OK != PnpBridge_ProcessPnpMessage(message)) {
+                PnpMessage_ReleaseReference(message);
+                continue;
+            }
+
+            PPNPMESSAGE_CREATE_JOB job = NULL;
+            if (NULL != queue->WorkPool) {
+                job = calloc(1, sizeof(PNPMESSAGE_CREATE_JOB));
+            }
+
+            if (NULL != job) {
+                job->Queue = queue;
+                job->Message = message;
+                if (PNPBRIDGE_OK == PnpWorkPool_Submit(queue->WorkPool, PnpMessageQueue_CreateWork,
+                                                       PnpMessageQueue_CreateLate, job, &job->Work)) {
+                    DList_InsertTailList(&jobs, &job->Entry);
+                    continue;
+                }
+                free(job);
+            }
+
+            if (PNPBRIDGE_OK != PnpBridge_CreatePnpInterface(message)) {
+                PnpMessage_ReleaseReference(message);
+                continue;
+            }
+
+            // Hold on to the message for the lifetime of its interface
             PnpMesssageQueue_AddToPublishQ(queue, message);
+            newInterfaces++;
         }
 
-        PDLIST_ENTRY head = &queue->PublishQueue;
-        PDLIST_ENTRY current = head->Flink;
-        while (current->Blink != head->Blink) {
-            PDLIST_ENTRY next = current->Flink;
-            PPNPBRIDGE_CHANGE_PAYLOAD msg = NULL;
+        // Publish only the interfaces that were created in time. The others
+        // are handed back through LateCreates when their callback returns.
+        while (!DList_IsListEmpty(&jobs)) {
+            PPNPMESSAGE_CREATE_JOB job = containingRecord(DList_RemoveHeadList(&jobs), PNPMESSAGE_CREATE_JOB, Entry);
+            int createResult = PNPBRIDGE_FAILED;
 
-            msg = containingRecord(current, PNPBRIDGE_CHANGE_PAYLOAD, Entry);
-            message = msg->Self;
-            if (message) {
-                // Process the message
-                if (PNPBRIDGE_OK != PnpBridge_ProcessPnpMessage(message)) {
-                    DList_RemoveEntryList(current);
-                    PnpMessage_ReleaseReference(message);
-                }
+            if (PNPBRIDGE_OK != PnpWorkPool_Wait(queue->WorkPool, job->Work, queue->CallbackTimeoutMs, &createResult)) {
+                LogError("createPnpInterface adapter callback timed out after %u ms. "
+                         "The interface will be published if it completes.", queue->CallbackTimeoutMs);
+                continue;
+            }
+
+            if (PNPBRIDGE_OK == createResult) {
+                PnpMesssageQueue_AddToPublishQ(queue, job->Message);
+                newInterfaces++;
             }
-            current = next;
+            else {
+                PnpMessage_ReleaseReference(job->Message);
+            }
+            free(job);
         }
 
         // Query all the pnp interface clients and publish them
-        DiscoveryAdapter_PublishInterfaces();
+        if (newInterfaces > 0) {
+            DiscoveryAdapter_PublishInterfaces();
+        }
+
+        tickcounter_get_current_ms(queue->TickCounter, &cycleEnd);
+        LogInfo("PnpMessage cycle: batch of %d message(s), %d new interface(s), latency %lu ms",
+                batchSize, newInterfaces, (unsigned long)(cycleEnd - cycleStart));
     }
 
     return 0;
@@ -244,7 +538,8 @@ PnpMessageQueue_Worker(
 
 PNPBRIDGE_RESULT
 PnpMessageQueue_Create(
-    _In_ PMESSAGE_QUEUE* PnpMessageQueue
+    _In_ PNPBRIDGE_CONFIGURATION* BridgeConfig,
+    _Out_ PMESSAGE_QUEUE* PnpMessageQueue
     )
 {
     PMESSAGE_QUEUE queue = NULL;
@@ -261,13 +556,6 @@ PnpMessageQueue_Create(
 
         queue->TearDown = false;
 
-        queue->QueueLock = Lock_Init();
-        if (NULL == queue->QueueLock) {
-            LogError("Failed to queue lock");
-            result = PNPBRIDGE_INSUFFICIENT_MEMORY;
-            LEAVE;
-        }
-
         queue->WaitConditionLock = Lock_Init();
         if (NULL == queue->WaitConditionLock) {
             LogError("Failed to queue WaitConditionLock");
@@ -282,13 +570,64 @@ PnpMessageQueue_Create(
             LEAVE;
         }
 
-        DList_InitializeListHead(&queue->IngressQueue);
+        queue->CallCondition = Condition_Init();
+        if (NULL == queue->CallCondition) {
+            LogError("Failed to queue CallCondition");
+            result = PNPBRIDGE_INSUFFICIENT_MEMORY;
+            LEAVE;
+        }
+
+        queue->TickCounter = tickcounter_create();
+        if (NULL == queue->TickCounter) {
+            LogError("Failed to create queue TickCounter");
+            result = PNPBRIDGE_INSUFFICIENT_MEMORY;
+            LEAVE;
+        }
+
+        queue->CoalescingWindowMs = BridgeConfig->CoalescingWindowMs;
+        queue->CoalescingMaxDelayMs = BridgeConfig->CoalescingMaxDelayMs;
+
+        DList_InitializeListHead(&queue->LateCreates);
+        queue->CallbackTimeoutMs = BridgeConfig->AdapterCallbackTimeoutMs;
+        if (BridgeConfig->AdapterWorkers > 0) {
+            result = PnpWorkPool_Create((int)BridgeConfig->AdapterWorkers, &queue->WorkPool);
+            if (PNPBRIDGE_OK != result) {
+                LogError("Failed to create the adapter work pool");
+                LEAVE;
+            }
+        }
+
+        queue->Capacity = (long)BridgeConfig->MessageQueueLimits.Capacity;
+        queue->OverflowPolicy = BridgeConfig->MessageQueueLimits.OverflowPolicy;
+
+        if (queue->Capacity > 0 && PNPBRIDGE_QUEUE_OVERFLOW_BLOCK == queue->OverflowPolicy) {
+            queue->SpaceCondition = Condition_Init();
+            if (NULL == queue->SpaceCondition) {
+                LogError("Failed to init queue SpaceCondition");
+                result = PNPBRIDGE_INSUFFICIENT_MEMORY;
+                LEAVE;
+            }
+        }
+
+        if (queue->Capacity > 0 && PNPBRIDGE_QUEUE_OVERFLOW_DROP_OLDEST == queue->OverflowPolicy) {
+            queue->PopLock = Lock_Init();
+            if (NULL == queue->PopLock) {
+                LogError("Failed to init queue PopLock");
+                result = PNPBRIDGE_INSUFFICIENT_MEMORY;
+                LEAVE;
+            }
+        }
+
+        queue->IngressStub.Flink = NULL;
+        queue->IngressHead = &queue->IngressStub;
+        queue->IngressTail = &queue->IngressStub;
 
         DList_InitializeListHead(&queue->PublishQueue);
 
         if (THREADAPI_OK != ThreadAPI_Create(&queue->Worker, PnpMessageQueue_Worker, queue)) {
             LogError("Failed to create PnpMessageQueue_Worker thread");
             queue->Worker = NULL;
+            result = PNPBRIDGE_FAILED;
             LEAVE;
         }
 
@@ -306,6 +645,158 @@ PnpMessageQueue_Create(
     return result;
 }
 
+// Links an entry at the head of the ingress queue. Safe to call from any number of threads.
+static void
+PnpMessageQueue_PushIngress(
+    _In_ PMESSAGE_QUEUE Queue,
+    _In_ PDLIST_ENTRY Entry
+    )
+{
+    PDLIST_ENTRY previous;
+
+    Entry->Flink = NULL;
+
+    previous = PNPBRIDGE_INTERLOCKED_EXCHANGE_POINTER(&Queue->IngressHead, Entry);
+
+    // Until this store the entry is not reachable from IngressTail
+    PNPBRIDGE_INTERLOCKED_WRITE_POINTER(&previous->Flink, Entry);
+}
+
+// Waits for a producer that has already swapped IngressHead to link Entry to its successor
+static PDLIST_ENTRY
+PnpMessageQueue_WaitForLink(
+    _In_ PDLIST_ENTRY Entry
+    )
+{
+    PDLIST_ENTRY next;
+
+    while (NULL == (next = PNPBRIDGE_INTERLOCKED_READ_POINTER(&Entry->Flink))) {
+        ThreadAPI_Sleep(0);
+    }
+
+    return next;
+}
+
+// Unlinks the oldest entry of the ingress queue. Must only be called from the consumer.
+static PDLIST_ENTRY
+PnpMessageQueue_PopIngress(
+    _In_ PMESSAGE_QUEUE Queue
+    )
+{
+    PDLIST_ENTRY tail = Queue->IngressTail;
+    PDLIST_ENTRY next = PNPBRIDGE_INTERLOCKED_READ_POINTER(&tail->Flink);
+
+    // Step over the stub
+    if (tail == &Queue->IngressStub) {
+        if (NULL == next) {
+            if (tail == PNPBRIDGE_INTERLOCKED_READ_POINTER(&Queue->IngressHead)) {
+                return NULL;
+            }
+
+            // A producer is between swapping the head and linking its entry
+            next = PnpMessageQueue_WaitForLink(tail);
+        }
+
+        Queue->IngressTail = next;
+        tail = next;
+        next = PNPBRIDGE_INTERLOCKED_READ_POINTER(&tail->Flink);
+    }
+
+    if (NULL == next) {
+        if (tail != PNPBRIDGE_INTERLOCKED_READ_POINTER(&Queue->IngressHead)) {
+            // A producer is between swapping the head and linking its entry
+            next = PnpMessageQueue_WaitForLink(tail);
+        }
+        else {
+            // tail is the only entry. Put the stub behind it so that it can be unlinked.
+            PnpMessageQueue_PushIngress(Queue, &Queue->IngressStub);
+            next = PnpMessageQueue_WaitForLink(tail);
+        }
+    }
+
+    Queue->IngressTail = next;
+
+    return tail;
+}
+
+// Gives back a slot reserved by PnpMessageQueue_ReserveSlot and wakes up the
+// producers waiting for room
+static void
+PnpMessageQueue_ReleaseSlot(
+    _In_ PMESSAGE_QUEUE Queue
+    )
+{
+    long depth = PNPBRIDGE_INTERLOCKED_DECREMENT(&Queue->Depth);
+
+    // Waiting producers are counted under WaitConditionLock before they check
+    // Depth, so either they see this slot or they are counted here
+    if (depth < Queue->Capacity && PNPBRIDGE_INTERLOCKED_READ(&Queue->WaitingProducers) > 0) {
+        Lock(Queue->WaitConditionLock);
+        Condition_Post(Queue->SpaceCondition);
+        Unlock(Queue->WaitConditionLock);
+    }
+}
+
+// Reserves a slot for a new message according to the overflow policy. Sets
+// *DropOldest if the queue is over capacity and the caller has to drop the
+// oldest message once its own is queued.
+static PNPBRIDGE_RESULT
+PnpMessageQueue_ReserveSlot(
+    _In_ PMESSAGE_QUEUE Queue,
+    _Out_ bool* DropOldest
+    )
+{
+    *DropOldest = false;
+
+    while (true) {
+        long depth = PNPBRIDGE_INTERLOCKED_INCREMENT(&Queue->Depth);
+
+        if (0 == Queue->Capacity || depth <= Queue->Capacity) {
+            long highWaterMark = PNPBRIDGE_INTERLOCKED_READ(&Queue->HighWaterMark);
+            while (depth > highWaterMark) {
+                long previous = PNPBRIDGE_INTERLOCKED_COMPARE_EXCHANGE(&Queue->HighWaterMark, depth, highWaterMark);
+                if (previous == highWaterMark) {
+                    break;
+                }
+                highWaterMark = previous;
+            }
+
+            return PNPBRIDGE_OK;
+        }
+
+        switch (Queue->OverflowPolicy) {
+            case PNPBRIDGE_QUEUE_OVERFLOW_DROP_OLDEST:
+                *DropOldest = true;
+                return PNPBRIDGE_OK;
+
+            case PNPBRIDGE_QUEUE_OVERFLOW_BLOCK:
+                PnpMessageQueue_ReleaseSlot(Queue);
+                PNPBRIDGE_INTERLOCKED_INCREMENT(&Queue->Blocked);
+
+                Lock(Queue->WaitConditionLock);
+                PNPBRIDGE_INTERLOCKED_INCREMENT(&Queue->WaitingProducers);
+                while (PNPBRIDGE_INTERLOCKED_READ(&Queue->Depth) >= Queue->Capacity && !Queue->TearDown) {
+                    Condition_Wait(Queue->SpaceCondition, Queue->WaitConditionLock, 0);
+                }
+                PNPBRIDGE_INTERLOCKED_DECREMENT(&Queue->WaitingProducers);
+
+                if (Queue->TearDown) {
+                    Unlock(Queue->WaitConditionLock);
+                    return PNPBRIDGE_FAILED;
+                }
+
+                Unlock(Queue->WaitConditionLock);
+                break;
+
+            case PNPBRIDGE_QUEUE_OVERFLOW_DROP_NEWEST:
+            default:
+                PnpMessageQueue_ReleaseSlot(Queue);
+                PNPBRIDGE_INTERLOCKED_INCREMENT(&Queue->Dropped);
+                return PNPBRIDGE_FAILED;
+        }
+    }
+}
+
 PNPBRIDGE_RESULT 
 PnpMesssageQueue_Add(
     PMESSAGE_QUEUE Queue,
@@ -313,25 +804,97 @@ PnpMesssageQueue_Add(
     )
 {
     PPNPBRIDGE_CHANGE_PAYLOAD msg = NULL;
+    bool dropOldest = false;
     
     msg = (PPNPBRIDGE_CHANGE_PAYLOAD) PnpMemory_GetBuffer(PnpMessage, NULL);
 
+    if (PNPBRIDGE_OK != PnpMessageQueue_ReserveSlot(Queue, &dropOldest)) {
+        LogError("PnpMessage queue is full. Dropping the change notification");
+        return PNPBRIDGE_FAILED;
+    }
+
     // Take reference on PNPMESSAGE
     PnpMemory_AddReference(PnpMessage);
 
-    // Acquire queue lock
-    Lock(Queue->QueueLock);
+    PnpMessageQueue_PushIngress(Queue, &msg->Entry);
 
-    DList_AppendTailList(&Queue->IngressQueue, &msg->Entry);
+    // Only signal the worker on the empty to non-empty transition. While the
+    // queue is non-empty the worker doesn't wait and will pick this message up.
+    if (1 == PNPBRIDGE_INTERLOCKED_INCREMENT(&Queue->InCount)) {
+        Lock(Queue->WaitConditionLock);
+        Condition_Post(Queue->WaitCondition);
+        Unlock(Queue->WaitConditionLock);
+    }
 
-    Queue->InCount++;
+    // The worker may have made room in the meantime
+    if (dropOldest && PNPBRIDGE_INTERLOCKED_READ(&Queue->Depth) > Queue->Capacity) {
+        PNPMESSAGE oldest = NULL;
 
-    // Release the queue lock
-    Unlock(Queue->QueueLock);
+        PnpMesssageQueue_Remove(Queue, &oldest);
+        if (NULL != oldest) {
+            LogError("PnpMessage queue is full. Dropping the oldest change notification");
+            PNPBRIDGE_INTERLOCKED_INCREMENT(&Queue->Dropped);
+            PnpMemory_ReleaseReference(oldest);
+        }
+    }
 
     return PNPBRIDGE_OK;
 }
 
+void
+PnpMessageQueue_GetStatistics(
+    _In_ PMESSAGE_QUEUE Queue,
+    _Out_ PPNPBRIDGE_QUEUE_STATISTICS Statistics
+    )
+{
+    Statistics->Capacity = Queue->Capacity;
+    Statistics->Depth = PNPBRIDGE_INTERLOCKED_READ(&Queue->Depth);
+    Statistics->HighWaterMark = PNPBRIDGE_INTERLOCKED_READ(&Queue->HighWaterMark);
+    Statistics->Dropped = PNPBRIDGE_INTERLOCKED_READ(&Queue->Dropped);
+    Statistics->Blocked = PNPBRIDGE_INTERLOCKED_READ(&Queue->Blocked);
+}
+
+PNPBRIDGE_RESULT
+PnpMessageQueue_RunOnWorker(
+    _In_ PMESSAGE_QUEUE Queue,
+    _In_ PNPBRIDGE_WORK_CALLBACK Callback,
+    _In_ void* Context,
+    _Out_ int* Result
+    )
+{
+    PNPBRIDGE_RESULT result = PNPBRIDGE_OK;
+
+    Lock(Queue->WaitConditionLock);
+
+    if (Queue->TearDown || NULL != Queue->PendingCall || Queue->CallRunning) {
+        Unlock(Queue->WaitConditionLock);
+        return PNPBRIDGE_FAILED;
+    }
+
+    Queue->PendingCall = Callback;
+    Queue->PendingCallContext = Context;
+    Condition_Post(Queue->WaitCondition);
+
+    // A call the worker has taken is waited for even if the queue is torn
+    // down, since the worker doesn't exit while it runs
+    while ((NULL != Queue->PendingCall && !Queue->TearDown) || Queue->CallRunning) {
+        Condition_Wait(Queue->CallCondition, Queue->WaitConditionLock, 0);
+    }
+
+    if (NULL != Queue->PendingCall) {
+        // Torn down before the worker took the call
+        Queue->PendingCall = NULL;
+        result = PNPBRIDGE_FAILED;
+    }
+    else {
+        *Result = Queue->PendingCallResult;
+    }
+
+    Unlock(Queue->WaitConditionLock);
+
+    return result;
+}
+
 PNPBRIDGE_RESULT
 PnpMesssageQueue_AddToPublishQ(
     _In_ PMESSAGE_QUEUE Queue,
@@ -357,23 +920,29 @@ PnpMesssageQueue_Remove(
     _Out_ PNPMESSAGE* PnpMessage
     )
 {
+    PDLIST_ENTRY currentEntry = NULL;
+
     *PnpMessage = NULL;
 
-    Lock(Queue->QueueLock);
+    if (NULL != Queue->PopLock) {
+        Lock(Queue->PopLock);
+    }
 
-    if (!DList_IsListEmpty(&Queue->IngressQueue)) {
-        // Dequeue a PnpMessage
-        PDLIST_ENTRY currentEntry = DList_RemoveHeadList(&Queue->IngressQueue);
+    // Dequeue a PnpMessage
+    currentEntry = PnpMessageQueue_PopIngress(Queue);
+    if (NULL != currentEntry) {
+        PPNPBRIDGE_CHANGE_PAYLOAD msg = containingRecord(currentEntry, PNPBRIDGE_CHANGE_PAYLOAD, Entry);
+        *PnpMessage = msg->Self;
+        PNPBRIDGE_INTERLOCKED_DECREMENT(&Queue->InCount);
+    }
 
-        PPNPBRIDGE_CHANGE_PAYLOAD msg = NULL;
-        if (NULL != currentEntry) {
-            msg = containingRecord(currentEntry, PNPBRIDGE_CHANGE_PAYLOAD, Entry);
-            *PnpMessage = msg->Self;
-            Queue->InCount--;
-        }
+    if (NULL != Queue->PopLock) {
+        Unlock(Queue->PopLock);
     }
 
-    Unlock(Queue->QueueLock);
+    if (NULL != currentEntry) {
+        PnpMessageQueue_ReleaseSlot(Queue);
+    }
 
     return PNPBRIDGE_OK;
 }
@@ -383,39 +952,93 @@ PnpMessageQueue_Release(
     _In_ PMESSAGE_QUEUE Queue
     )
 {
-    assert(NULL != Queue);
+    PNPMESSAGE message = NULL;
 
-    Queue->TearDown = true;
+    assert(NULL != Queue);
 
-    Lock(Queue->WaitConditionLock);
-    Condition_Post(Queue->WaitCondition);
-    Unlock(Queue->WaitConditionLock);
+    if (NULL != Queue->WaitConditionLock && NULL != Queue->WaitCondition) {
+        Lock(Queue->WaitConditionLock);
+        Queue->TearDown = true;
+        Condition_Post(Queue->WaitCondition);
+        if (NULL != Queue->SpaceCondition) {
+            // Every blocked producer has to see TearDown
+            for (long i = PNPBRIDGE_INTERLOCKED_READ(&Queue->WaitingProducers); i > 0; i--) {
+                Condition_Post(Queue->SpaceCondition);
+            }
+        }
+        if (NULL != Queue->CallCondition) {
+            Condition_Post(Queue->CallCondition);
+        }
+        Unlock(Queue->WaitConditionLock);
+    }
 
     // Wait for message queue worker to complete
     if (NULL != Queue->Worker) {
         ThreadAPI_Join(Queue->Worker, NULL);
     }
 
-    // Release all the PNPMESSAGE's
-    if (!DList_IsListEmpty(&Queue->PublishQueue)) {
-        PDLIST_ENTRY currentEntry = DList_RemoveHeadList(&Queue->PublishQueue);
+    // Wait for the adapter callbacks that timed out. They hand their
+    // messages back through LateCreates.
+    if (NULL != Queue->WorkPool) {
+        PnpWorkPool_Release(Queue->WorkPool);
+    }
+
+    if (NULL != Queue->LateCreates.Flink) {
+        while (!DList_IsListEmpty(&Queue->LateCreates)) {
+            PPNPMESSAGE_CREATE_JOB job = containingRecord(DList_RemoveHeadList(&Queue->LateCreates), PNPMESSAGE_CREATE_JOB, Entry);
+            PnpMemory_ReleaseReference(job->Message);
+            free(job);
+        }
+    }
+
+    // Release the PNPMESSAGE's that were never processed
+    if (NULL != Queue->IngressTail) {
+        while (true) {
+            PnpMesssageQueue_Remove(Queue, &message);
+            if (NULL == message) {
+                break;
+            }
 
-        PPNPBRIDGE_CHANGE_PAYLOAD msg = NULL;
-        if (NULL != currentEntry) {
-            msg = containingRecord(currentEntry, PNPBRIDGE_CHANGE_PAYLOAD, Entry);
-            PnpMemory_ReleaseReference(msg->Self);
+            PnpMemory_ReleaseReference(message);
         }
     }
 
-    if (NULL != Queue->QueueLock) {
-        Lock_Deinit(Queue->QueueLock);
+    // Release all the PNPMESSAGE's
+    if (NULL != Queue->PublishQueue.Flink) {
+        while (!DList_IsListEmpty(&Queue->PublishQueue)) {
+            PDLIST_ENTRY currentEntry = DList_RemoveHeadList(&Queue->PublishQueue);
+
+            PPNPBRIDGE_CHANGE_PAYLOAD msg = NULL;
+            if (NULL != currentEntry) {
+                msg = containingRecord(currentEntry, PNPBRIDGE_CHANGE_PAYLOAD, Entry);
+                PnpMemory_ReleaseReference(msg->Self);
+            }
+        }
     }
 
     if (NULL != Queue->WaitCondition) {
         Condition_Deinit(Queue->WaitCondition);
     }
 
+    if (NULL != Queue->SpaceCondition) {
+        Condition_Deinit(Queue->SpaceCondition);
+    }
+
+    if (NULL != Queue->CallCondition) {
+        Condition_Deinit(Queue->CallCondition);
+    }
+
+    if (NULL != Queue->PopLock) {
+        Lock_Deinit(Queue->PopLock);
+    }
+
     if (NULL != Queue->WaitConditionLock) {
         Lock_Deinit(Queue->WaitConditionLock);
     }
-}
\ No newline at end of file
+
+    if (NULL != Queue->TickCounter) {
+        tickcounter_destroy(Queue->TickCounter);
+    }
+
+    free(Queue);
+}
@@ -0,0 +1,640 @@
+// Copyright (c) Microsoft. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#include <errno.h>
+
+#include "pnpbridge_common.h"
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+// The spool is a ring of segment files, <path>.0 to <path>.<n-1>, that are
+// mapped in memory. Each segment holds a header followed by the records. A
+// record is appended to the newest segment by writing it past Used and then
+// moving Used, so a record that was being written when the bridge died is
+// ignored. Records are replayed from the oldest segment by moving its
+// ReadOffset. When every segment is full the oldest one is dropped and
+// reused.
+#define PNPBRIDGE_SPOOL_MAGIC 0x53504e50 // "PNPS"
+#define PNPBRIDGE_SPOOL_VERSION 1
+
+// Records are 8 byte aligned so that their time can be read in place
+#define PNPBRIDGE_SPOOL_ALIGN(Size) (((Size) + 7) & ~((uint32_t)7))
+
+typedef struct _PNPBRIDGE_SPOOL_SEGMENT_HEADER {
+    uint32_t Magic;
+    uint32_t Version;
+
+    // Order in which the segments were started. 0 if the segment is unused.
+    uint32_t Sequence;
+
+    // Bytes of the segment, header included, that hold records
+    uint32_t Used;
+
+    // Offset of the first record that hasn't been replayed
+    uint32_t ReadOffset;
+
+    // Records appended to the segment and replayed from it
+    uint32_t Records;
+    uint32_t ReadRecords;
+    uint32_t Reserved;
+} PNPBRIDGE_SPOOL_SEGMENT_HEADER, *PPNPBRIDGE_SPOOL_SEGMENT_HEADER;
+
+// Followed by the interface id, component name, telemetry name and data,
+// each NUL terminated. A reading without a component name has an empty one.
+typedef struct _PNPBRIDGE_SPOOL_RECORD {
+    uint32_t Length;
+    uint32_t Flags;
+    int64_t Time;
+} PNPBRIDGE_SPOOL_RECORD, *PPNPBRIDGE_SPOOL_RECORD;
+
+#define PNPBRIDGE_SPOOL_RECORD_STRINGS 4
+
+typedef struct _PNPBRIDGE_SPOOL_SEGMENT {
+    PPNPBRIDGE_SPOOL_SEGMENT_HEADER Header;
+
+#ifdef WIN32
+    HANDLE File;
+    HANDLE Mapping;
+#else
+    int File;
+#endif
+} PNPBRIDGE_SPOOL_SEGMENT, *PPNPBRIDGE_SPOOL_SEGMENT;
+
+typedef struct _PNPBRIDGE_SPOOL {
+    // Protects the segments and the counters below
+    LOCK_HANDLE Lock;
+
+    PPNPBRIDGE_SPOOL_SEGMENT Segments;
+    int SegmentCount;
+    uint32_t SegmentSize;
+
+    // The records that haven't been replayed are in the segments from
+    // ReadSegment to WriteSegment, in ring order
+    int ReadSegment;
+    int WriteSegment;
+    uint32_t NextSequence;
+
+    // Records that haven't been replayed
+    long Depth;
+
+    // Records dropped to make room for newer ones or because they were corrupt
+    long Dropped;
+} PNPBRIDGE_SPOOL;
+
+static PPNPBRIDGE_SPOOL_RECORD
+PnpSpool_GetRecord(
+    _In_ PPNPBRIDGE_SPOOL_SEGMENT Segment,
+    _In_ uint32_t Offset
+    )
+{
+    return (PPNPBRIDGE_SPOOL_RECORD)((char*)Segment->Header + Offset);
+}
+
+// Reads the strings of the record at Offset. Returns false if the record
+// doesn't fit in Limit or its strings aren't NUL terminated.
+static bool
+PnpSpool_ReadRecord(
+    _In_ PPNPBRIDGE_SPOOL_SEGMENT Segment,
+    _In_ uint32_t Offset,
+    _In_ uint32_t Limit,
+    _Out_opt_ PPNPBRIDGE_SPOOL_ENTRY Entry
+    )
+{
+    PPNPBRIDGE_SPOOL_RECORD record = PnpSpool_GetRecord(Segment, Offset);
+    const char* strings[PNPBRIDGE_SPOOL_RECORD_STRINGS];
+    const char* current;
+    const char* end;
+
+    if (Limit - Offset < sizeof(PNPBRIDGE_SPOOL_RECORD) ||
+        record->Length < sizeof(PNPBRIDGE_SPOOL_RECORD) ||
+        record->Length > Limit - Offset ||
+        record->Length != PNPBRIDGE_SPOOL_ALIGN(record->Length)) {
+        return false;
+    }
+
+    current = (const char*)(record + 1);
+    end = (const char*)record + record->Length;
+    for (int i = 0; i < PNPBRIDGE_SPOOL_RECORD_STRINGS; i++) {
+        const char* terminator = memchr(current, '\0', end - current);
+        if (NULL == terminator) {
+            return false;
+        }
+
+        strings[i] = current;
+        current = terminator + 1;
+    }
+
+    if (NULL != Entry) {
+        Entry->InterfaceId = strings[0];
+        Entry->ComponentName = ('\0' != *strings[1]) ? strings[1] : NULL;
+        Entry->TelemetryName = strings[2];
+        Entry->TelemetryData = strings[3];
+        Entry->Flags = record->Flags;
+        Entry->Time = (time_t)record->Time;
+    }
+
+    return true;
+}
+
+static void
+PnpSpool_Flush(
+    _In_ PNPBRIDGE_SPOOL_HANDLE Spool,
+    _In_ PPNPBRIDGE_SPOOL_SEGMENT Segment,
+    _In_ bool Wait
+    )
+{
+#ifdef WIN32
+    AZURE_UNREFERENCED_PARAMETER(Wait);
+    FlushViewOfFile(Segment->Header, Spool->SegmentSize);
+#else
+    msync(Segment->Header, Spool->SegmentSize, Wait ? MS_SYNC : MS_ASYNC);
+#endif
+}
+
+// Empties a segment and gives it the next sequence number
+static void
+PnpSpool_ResetSegment(
+    _In_ PNPBRIDGE_SPOOL_HANDLE Spool,
+    _In_ PPNPBRIDGE_SPOOL_SEGMENT Segment
+    )
+{
+    PPNPBRIDGE_SPOOL_SEGMENT_HEADER header = Segment->Header;
+
+    header->Magic = PNPBRIDGE_SPOOL_MAGIC;
+    header->Version = PNPBRIDGE_SPOOL_VERSION;
+    header->Sequence = Spool->NextSequence++;
+    header->Used = sizeof(PNPBRIDGE_SPOOL_SEGMENT_HEADER);
+    header->ReadOffset = sizeof(PNPBRIDGE_SPOOL_SEGMENT_HEADER);
+    header->Records = 0;
+    header->ReadRecords = 0;
+    header->Reserved = 0;
+}
+
+static bool
+PnpSpool_IsSegmentValid(
+    _In_ PNPBRIDGE_SPOOL_HANDLE Spool,
+    _In_ PPNPBRIDGE_SPOOL_SEGMENT_HEADER Header
+    )
+{
+    return PNPBRIDGE_SPOOL_MAGIC == Header->Magic && PNPBRIDGE_SPOOL_VERSION == Header->Version &&
+           0 != Header->Sequence &&
+           Header->Used >= sizeof(PNPBRIDGE_SPOOL_SEGMENT_HEADER) && Header->Used <= Spool->SegmentSize &&
+           Header->ReadOffset >= sizeof(PNPBRIDGE_SPOOL_SEGMENT_HEADER) && Header->ReadOffset <= Header->Used &&
+           Header->ReadRecords <= Header->Records;
+}
+
+// Finds the oldest and the newest segments and counts the records that
+// haven't been replayed. Segments that aren't valid are emptied.
+static void
+PnpSpool_Recover(
+    _In_ PNPBRIDGE_SPOOL_HANDLE Spool
+    )
+{
+    uint32_t oldestSequence = 0;
+    uint32_t newestSequence = 0;
+
+    Spool->ReadSegment = -1;
+    Spool->WriteSegment = -1;
+
+    for (int i = 0; i < Spool->SegmentCount; i++) {
+        PPNPBRIDGE_SPOOL_SEGMENT_HEADER header = Spool->Segments[i].Header;
+
+        if (!PnpSpool_IsSegmentValid(Spool, header)) {
+            if (0 != header->Magic) {
+                LogError("Telemetry spool segment %d is not valid and is reset", i);
+            }
+            memset(header, 0, sizeof(PNPBRIDGE_SPOOL_SEGMENT_HEADER));
+            continue;
+        }
+
+        if (header->Sequence > newestSequence) {
+            newestSequence = header->Sequence;
+            Spool->WriteSegment = i;
+        }
+
+        if (header->ReadOffset < header->Used && (0 == oldestSequence || header->Sequence < oldestSequence)) {
+            oldestSequence = header->Sequence;
+            Spool->ReadSegment = i;
+        }
+    }
+
+    Spool->NextSequence = newestSequence + 1;
+
+    if (-1 == Spool->WriteSegment) {
+        Spool->WriteSegment = 0;
+        PnpSpool_ResetSegment(Spool, &Spool->Segments[0]);
+    }
+
+    if (-1 == Spool->ReadSegment) {
+        Spool->ReadSegment = Spool->WriteSegment;
+    }
+
+    for (int i = Spool->ReadSegment; ; i = (i + 1) % Spool->SegmentCount) {
+        PPNPBRIDGE_SPOOL_SEGMENT_HEADER header = Spool->Segments[i].Header;
+
+        Spool->Depth += (long)(header->Records - header->ReadRecords);
+        if (i == Spool->WriteSegment) {
+            break;
+        }
+    }
+}
+
+#ifdef WIN32
+static PNPBRIDGE_RESULT
+PnpSpool_MapSegment(
+    _In_ PNPBRIDGE_SPOOL_HANDLE Spool,
+    _In_ PPNPBRIDGE_SPOOL_SEGMENT Segment,
+    _In_ const char* Path
+    )
+{
+    LARGE_INTEGER size;
+
+    Segment->File = CreateFileA(Path, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_ALWAYS,
+                                FILE_ATTRIBUTE_NORMAL, NULL);
+    if (INVALID_HANDLE_VALUE == Segment->File) {
+        Segment->File = NULL;
+        LogError("Failed to open the telemetry spool segment %s: %lu", Path, GetLastError());
+        return PNPBRIDGE_FILE_NOT_FOUND;
+    }
+
+    size.QuadPart = Spool->SegmentSize;
+    if (!SetFilePointerEx(Segment->File, size, NULL, FILE_BEGIN) || !SetEndOfFile(Segment->File)) {
+        LogError("Failed to size the telemetry spool segment %s: %lu", Path, GetLastError());
+        return PNPBRIDGE_FAILED;
+    }
+
+    Segment->Mapping = CreateFileMappingA(Segment->File, NULL, PAGE_READWRITE, 0, Spool->SegmentSize, NULL);
+    if (NULL == Segment->Mapping) {
+        LogError("Failed to map the telemetry spool segment %s: %lu", Path, GetLastError());
+        return PNPBRIDGE_FAILED;
+    }
+
+    Segment->Header = MapViewOfFile(Segment->Mapping, FILE_MAP_ALL_ACCESS, 0, 0, Spool->SegmentSize);
+    if (NULL == Segment->Header) {
+        LogError("Failed to map the telemetry spool segment %s: %lu", Path, GetLastError());
+        return PNPBRIDGE_FAILED;
+    }
+
+    return PNPBRIDGE_OK;
+}
+
+static void
+PnpSpool_UnmapSegment(
+    _In_ PNPBRIDGE_SPOOL_HANDLE Spool,
+    _In_ PPNPBRIDGE_SPOOL_SEGMENT Segment
+    )
+{
+    AZURE_UNREFERENCED_PARAMETER(Spool);
+
+    if (NULL != Segment->Header) {
+        UnmapViewOfFile(Segment->Header);
+    }
+
+    if (NULL != Segment->Mapping) {
+        CloseHandle(Segment->Mapping);
+    }
+
+    if (NULL != Segment->File) {
+        CloseHandle(Segment->File);
+    }
+}
+#else
+static PNPBRIDGE_RESULT
+PnpSpool_MapSegment(
+    _In_ PNPBRIDGE_SPOOL_HANDLE Spool,
+    _In_ PPNPBRIDGE_SPOOL_SEGMENT Segment,
+    _In_ const char* Path
+    )
+{
+    void* view;
+
+    Segment->File = open(Path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+    if (Segment->File < 0) {
+        LogError("Failed to open the telemetry spool segment %s: %d", Path, errno);
+        return PNPBRIDGE_FILE_NOT_FOUND;
+    }
+
+    if (0 != ftruncate(Segment->File, Spool->SegmentSize)) {
+        LogError("Failed to size the telemetry spool segment %s: %d", Path, errno);
+        return PNPBRIDGE_FAILED;
+    }
+
+    view = mmap(NULL, Spool->SegmentSize, PROT_READ | PROT_WRITE, MAP_SHARED, Segment->File, 0);
+    if (MAP_FAILED == view) {
+        LogError("Failed to map the telemetry spool segment %s: %d", Path, errno);
+        return PNPBRIDGE_FAILED;
+    }
+
+    Segment->Header = view;
+
+    return PNPBRIDGE_OK;
+}
+
+static void
+PnpSpool_UnmapSegment(
+    _In_ PNPBRIDGE_SPOOL_HANDLE Spool,
+    _In_ PPNPBRIDGE_SPOOL_SEGMENT Segment
+    )
+{
+    if (NULL != Segment->Header) {
+        munmap(Segment->Header, Spool->SegmentSize);
+    }
+
+    if (Segment->File >= 0) {
+        close(Segment->File);
+    }
+}
+#endif
+
+PNPBRIDGE_RESULT
+PnpSpool_Open(
+    _In_ const char* Path,
+    _In_ unsigned int SizeBytes,
+    _In_ unsigned int SegmentBytes,
+    _Out_ PNPBRIDGE_SPOOL_HANDLE* Spool
+    )
+{
+    PNPBRIDGE_RESULT result = PNPBRIDGE_OK;
+    PNPBRIDGE_SPOOL_HANDLE spool = NULL;
+    char segmentPath[PNPBRIDGE_MAX_PATH];
+
+    TRY {
+        if (NULL == Path || NULL == Spool || SegmentBytes < PNPBRIDGE_SPOOL_MIN_SEGMENT_BYTES ||
+            SizeBytes / SegmentBytes < 2) {
+            result = PNPBRIDGE_INVALID_ARGS;
+            LEAVE;
+        }
+
+        spool = calloc(1, sizeof(PNPBRIDGE_SPOOL));
+        if (NULL == spool) {
+            result = PNPBRIDGE_INSUFFICIENT_MEMORY;
+            LEAVE;
+        }
+
+        spool->SegmentSize = PNPBRIDGE_SPOOL_ALIGN(SegmentBytes);
+        spool->SegmentCount = (int)(SizeBytes / SegmentBytes);
+
+        spool->Lock = Lock_Init();
+        if (NULL == spool->Lock) {
+            result = PNPBRIDGE_INSUFFICIENT_MEMORY;
+            LEAVE;
+        }
+
+        spool->Segments = calloc(spool->SegmentCount, sizeof(PNPBRIDGE_SPOOL_SEGMENT));
+        if (NULL == spool->Segments) {
+            spool->SegmentCount = 0;
+            result = PNPBRIDGE_INSUFFICIENT_MEMORY;
+            LEAVE;
+        }
+
+#ifndef WIN32
+        for (int i = 0; i < spool->SegmentCount; i++) {
+            spool->Segments[i].File = -1;
+        }
+#endif
+
+        for (int i = 0; i < spool->SegmentCount; i++) {
+            if (snprintf(segmentPath, sizeof(segmentPath), "%s.%d", Path, i) >= (int)sizeof(segmentPath)) {
+                result = PNPBRIDGE_INVALID_ARGS;
+                LEAVE;
+            }
+
+            result = PnpSpool_MapSegment(spool, &spool->Segments[i], segmentPath);
+            if (PNPBRIDGE_OK != result) {
+                LEAVE;
+            }
+        }
+
+        PnpSpool_Recover(spool);
+
+        *Spool = spool;
+    } FINALLY {
+        if (PNPBRIDGE_OK != result && NULL != spool) {
+            PnpSpool_Close(spool);
+        }
+    }
+
+    return result;
+}
+
+void
+PnpSpool_Close(
+    _In_ PNPBRIDGE_SPOOL_HANDLE Spool
+    )
+{
+    if (NULL == Spool) {
+        return;
+    }
+
+    for (int i = 0; i < Spool->SegmentCount; i++) {
+        if (NULL != Spool->Segments[i].Header) {
+            PnpSpool_Flush(Spool, &Spool->Segments[i], true);
+        }
+        PnpSpool_UnmapSegment(Spool, &Spool->Segments[i]);
+    }
+
+    free(Spool->Segments);
+
+    if (NULL != Spool->Lock) {
+        Lock_Deinit(Spool->Lock);
+    }
+
+    free(Spool);
+}
+
+PNPBRIDGE_RESULT
+PnpSpool_Append(
+    _In_ PNPBRIDGE_SPOOL_HANDLE Spool,
+    _In_ const PNPBRIDGE_SPOOL_ENTRY* Entry
+    )
+{
+    const char* componentName = (NULL != Entry->ComponentName) ? Entry->ComponentName : "";
+    const char* strings[PNPBRIDGE_SPOOL_RECORD_STRINGS] = {
+        Entry->InterfaceId, componentName, Entry->TelemetryName, Entry->TelemetryData
+    };
+    size_t length = sizeof(PNPBRIDGE_SPOOL_RECORD);
+    PPNPBRIDGE_SPOOL_SEGMENT segment;
+    PPNPBRIDGE_SPOOL_RECORD record;
+    char* buffer;
+
+    for (int i = 0; i < PNPBRIDGE_SPOOL_RECORD_STRINGS; i++) {
+        length += strlen(strings[i]) + 1;
+    }
+
+    if (length > Spool->SegmentSize - sizeof(PNPBRIDGE_SPOOL_SEGMENT_HEADER)) {
+        LogError("Telemetry %s doesn't fit in a spool segment", Entry->TelemetryName);
+        return PNPBRIDGE_INVALID_ARGS;
+    }
+    length = PNPBRIDGE_SPOOL_ALIGN(length);
+
+    Lock(Spool->Lock);
+
+    segment = &Spool->Segments[Spool->WriteSegment];
+    if (length > Spool->SegmentSize - segment->Header->Used) {
+        int next = (Spool->WriteSegment + 1) % Spool->SegmentCount;
+
+        // Every segment is full. The oldest readings make room for the new ones.
+        if (next == Spool->ReadSegment) {
+            PPNPBRIDGE_SPOOL_SEGMENT_HEADER oldest = Spool->Segments[next].Header;
+            long dropped = (long)(oldest->Records - oldest->ReadRecords);
+
+            if (dropped > 0) {
+                LogError("Telemetry spool is full. Dropping the %ld oldest readings", dropped);
+            }
+            Spool->Depth -= dropped;
+            Spool->Dropped += dropped;
+            Spool->ReadSegment = (next + 1) % Spool->SegmentCount;
+        }
+
+        PnpSpool_Flush(Spool, segment, false);
+        segment = &Spool->Segments[next];
+        PnpSpool_ResetSegment(Spool, segment);
+        Spool->WriteSegment = next;
+    }
+
+    // Write the record before making it visible in Used
+    record = PnpSpool_GetRecord(segment, segment->Header->Used);
+    buffer = (char*)(record + 1);
+
+    memset(record, 0, length);
+    record->Length = (uint32_t)length;
+    record->Flags = Entry->Flags;
+    record->Time = (int64_t)Entry->Time;
+    for (int i = 0; i < PNPBRIDGE_SPOOL_RECORD_STRINGS; i++) {
+        size_t size = strlen(strings[i]) + 1;
+        memcpy(buffer, strings[i], size);
+        buffer += size;
+    }
+
+    segment->Header->Used += record->Length;
+    segment->Header->Records++;
+    Spool->Depth++;
+
+    PnpSpool_Flush(Spool, segment, false);
+
+    Unlock(Spool->Lock);
+
+    return PNPBRIDGE_OK;
+}
+
+bool
+PnpSpool_Peek(
+    _In_ PNPBRIDGE_SPOOL_HANDLE Spool,
+    _Out_ PPNPBRIDGE_SPOOL_ENTRY Entry
+    )
+{
+    bool found = false;
+
+    Lock(Spool->Lock);
+
+    for (;;) {
+        PPNPBRIDGE_SPOOL_SEGMENT segment = &Spool->Segments[Spool->ReadSegment];
+        PPNPBRIDGE_SPOOL_SEGMENT_HEADER header = segment->Header;
+
+        if (header->ReadOffset >= header->Used) {
+            if (Spool->ReadSegment != Spool->WriteSegment) {
+                Spool->ReadSegment = (Spool->ReadSegment + 1) % Spool->SegmentCount;
+                continue;
+            }
+
+            // Everything was replayed. The newest segment is filled again
+            // from its start.
+            if (header->Used > sizeof(PNPBRIDGE_SPOOL_SEGMENT_HEADER)) {
+                PnpSpool_ResetSegment(Spool, segment);
+                PnpSpool_Flush(Spool, segment, false);
+            }
+            break;
+        }
+
+        if (!PnpSpool_ReadRecord(segment, header->ReadOffset, header->Used, Entry)) {
+            long dropped = (long)(header->Records - header->ReadRecords);
+
+            LogError("Telemetry spool segment %d is corrupt. Dropping its %ld remaining readings",
+                     Spool->ReadSegment, dropped);
+            Spool->Depth -= dropped;
+            Spool->Dropped += dropped;
+            header->ReadOffset = header->Used;
+            header->ReadRecords = header->Records;
+            continue;
+        }
+
+        found = true;
+        break;
+    }
+
+    Unlock(Spool->Lock);
+
+    return found;
+}
+
+void
+PnpSpool_Pop(
+    _In_ PNPBRIDGE_SPOOL_HANDLE Spool
+    )
+{
+    Lock(Spool->Lock);
+
+    PPNPBRIDGE_SPOOL_SEGMENT segment = &Spool->Segments[Spool->ReadSegment];
+    PPNPBRIDGE_SPOOL_SEGMENT_HEADER header = segment->Header;
+
+    if (header->ReadOffset < header->Used) {
+        header->ReadOffset += PnpSpool_GetRecord(segment, header->ReadOffset)->Length;
+        header->ReadRecords++;
+        Spool->Depth--;
+        PnpSpool_Flush(Spool, segment, false);
+    }
+
+    Unlock(Spool->Lock);
+}
+
+long
+PnpSpool_GetDepth(
+    _In_ PNPBRIDGE_SPOOL_HANDLE Spool
+    )
+{
+    long depth;
+
+    Lock(Spool->Lock);
+    depth = Spool->Depth;
+    Unlock(Spool->Lock);
+
+    return depth;
+}
+
+void
+PnpSpool_GetStatistics(
+    _In_ PNPBRIDGE_SPOOL_HANDLE Spool,
+    _Out_ PPNPBRIDGE_SPOOL_STATISTICS Statistics
+    )
+{
+    memset(Statistics, 0, sizeof(PNPBRIDGE_SPOOL_STATISTICS));
+
+    Lock(Spool->Lock);
+
+    Statistics->Depth = Spool->Depth;
+    Statistics->Dropped = Spool->Dropped;
+    Statistics->CapacityBytes = (long long)Spool->SegmentSize * Spool->SegmentCount;
+
+    for (int i = Spool->ReadSegment; ; i = (i + 1) % Spool->SegmentCount) {
+        PPNPBRIDGE_SPOOL_SEGMENT segment = &Spool->Segments[i];
+        PPNPBRIDGE_SPOOL_SEGMENT_HEADER header = segment->Header;
+
+        if (header->ReadOffset < header->Used) {
+            if (0 == Statistics->OldestTime) {
+                Statistics->OldestTime = (time_t)PnpSpool_GetRecord(segment, header->ReadOffset)->Time;
+            }
+            Statistics->Bytes += header->Used - header->ReadOffset;
+        }
+
+        if (i == Spool->WriteSegment) {
+            break;
+        }
+    }
+
+    Unlock(Spool->Lock);
+}
@@ -0,0 +1,823 @@
+// Copyright (c) Microsoft. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#include "pnpbridge_common.h"
+
+// Interval at which the worker checks whether the hub is back while there are
+// spooled readings to replay
+#define PNPBRIDGE_SPOOL_RECONNECT_POLL_MS 1000
+
+// Telemetry reading queued by PnpBridge_SendTelemetry. Name and Data point to
+// copies stored right after the structure.
+typedef struct _PNPBRIDGE_TELEMETRY {
+    DLIST_ENTRY Entry;
+    DIGITALTWIN_INTERFACE_CLIENT_HANDLE DigitalTwinInterface;
+    unsigned int Flags;
+
+    // Hash of the interface and telemetry name, used to find superseded samples
+    unsigned int Hash;
+    tickcounter_ms_t EnqueueTime;
+    const char* Name;
+    const char* Data;
+
+    // Bytes charged to the memory budget
+    long Size;
+} PNPBRIDGE_TELEMETRY, *PPNPBRIDGE_TELEMETRY;
+
+static void
+PnpTelemetryQueue_FreeTelemetry(
+    _In_ PPNPBRIDGE_TELEMETRY Telemetry
+    )
+{
+    long size = Telemetry->Size;
+
+    free(Telemetry);
+    PnpMemory_ReleaseBudget(size);
+}
+
+// Wakes the producers blocked on a full queue. A post wakes a single one of
+// them. Must be called with the queue lock held.
+static void
+PnpTelemetryQueue_WakeProducers(
+    _In_ PTELEMETRY_QUEUE Queue
+    )
+{
+    for (int i = 0; i < Queue->WaitingProducers; i++) {
+        Condition_Post(Queue->SpaceCondition);
+    }
+}
+
+// Drops every sample in the queue to make room for a reading that must be
+// delivered. Must be called with the queue lock held. Returns the number of
+// dropped samples.
+static int
+PnpTelemetryQueue_ShedSamples(
+    _In_ PTELEMETRY_QUEUE Queue
+    )
+{
+    PDLIST_ENTRY entry = Queue->Queue.Flink;
+    int shed = 0;
+
+    while (entry != &Queue->Queue) {
+        PDLIST_ENTRY next = entry->Flink;
+        PPNPBRIDGE_TELEMETRY telemetry = containingRecord(entry, PNPBRIDGE_TELEMETRY, Entry);
+
+        if (0 != (telemetry->Flags & PNPBRIDGE_TELEMETRY_FLAG_SAMPLE)) {
+            DList_RemoveEntryList(entry);
+            PnpTelemetryQueue_FreeTelemetry(telemetry);
+            shed++;
+        }
+
+        entry = next;
+    }
+
+    Queue->Count -= shed;
+    Queue->Statistics.Shed += shed;
+    if (shed > 0) {
+        PnpTelemetryQueue_WakeProducers(Queue);
+    }
+
+    return shed;
+}
+
+static void
+PnpTelemetryQueue_SendCallback(
+    DIGITALTWIN_CLIENT_RESULT TelemetryStatus,
+    void* UserContextCallback
+    )
+{
+    AZURE_UNREFERENCED_PARAMETER(UserContextCallback);
+
+    if (DIGITALTWIN_CLIENT_OK != TelemetryStatus) {
+        LogError("Telemetry was not delivered, result=%d", TelemetryStatus);
+    }
+}
+
+// Moves all the entries of Source to the empty list Destination
+static void
+PnpTelemetryQueue_MoveList(
+    _In_ PDLIST_ENTRY Source,
+    _Out_ PDLIST_ENTRY Destination
+    )
+{
+    DList_InitializeListHead(Destination);
+
+    if (!DList_IsListEmpty(Source)) {
+        Destination->Flink = Source->Flink;
+        Destination->Blink = Source->Blink;
+        Destination->Flink->Blink = Destination;
+        Destination->Blink->Flink = Destination;
+        DList_InitializeListHead(Source);
+    }
+}
+
+// Drops the samples in Batch that are followed by a newer sample of the same
+// telemetry on the same interface. Returns the number of dropped samples.
+static int
+PnpTelemetryQueue_MergeSamples(
+    _In_ PDLIST_ENTRY Batch,
+    _In_ int Count
+    )
+{
+    PPNPBRIDGE_TELEMETRY* seen = NULL;
+    unsigned int size = 2;
+    int merged = 0;
+
+    while (size < 2 * (unsigned int)Count) {
+        size <<= 1;
+    }
+
+    seen = calloc(size, sizeof(PPNPBRIDGE_TELEMETRY));
+    if (NULL == seen) {
+        // Send every reading rather than fail the batch
+        return 0;
+    }
+
+    // Walk from the newest reading so that the latest sample is the one kept
+    PDLIST_ENTRY entry = Batch->Blink;
+    while (entry != Batch) {
+        PDLIST_ENTRY previous = entry->Blink;
+        PPNPBRIDGE_TELEMETRY telemetry = containingRecord(entry, PNPBRIDGE_TELEMETRY, Entry);
+
+        if (0 != (telemetry->Flags & PNPBRIDGE_TELEMETRY_FLAG_SAMPLE)) {
+            unsigned int slot = telemetry->Hash & (size - 1);
+            bool superseded = false;
+
+            while (NULL != seen[slot]) {
+                if (seen[slot]->DigitalTwinInterface == telemetry->DigitalTwinInterface &&
+                    0 == strcmp(seen[slot]->Name, telemetry->Name)) {
+                    superseded = true;
+                    break;
+                }
+                slot = (slot + 1) & (size - 1);
+            }
+
+            if (superseded) {
+                DList_RemoveEntryList(entry);
+                PnpTelemetryQueue_FreeTelemetry(telemetry);
+                merged++;
+            }
+            else {
+                seen[slot] = telemetry;
+            }
+        }
+
+        entry = previous;
+    }
+
+    free(seen);
+
+    return merged;
+}
+
+// Writes a reading to the spool under the identity of its interface
+static PNPBRIDGE_RESULT
+PnpTelemetryQueue_SpoolTelemetry(
+    _In_ PTELEMETRY_QUEUE Queue,
+    _In_ PPNPBRIDGE_TELEMETRY Telemetry
+    )
+{
+    PNPBRIDGE_SPOOL_ENTRY entry = { 0 };
+
+    if (!Queue->Callbacks.GetIdentity(Queue->Callbacks.Context, Telemetry->DigitalTwinInterface,
+                                      &entry.InterfaceId, &entry.ComponentName)) {
+        LogError("Telemetry %s can't be spooled, its interface has been released", Telemetry->Name);
+        return PNPBRIDGE_FAILED;
+    }
+
+    entry.TelemetryName = Telemetry->Name;
+    entry.TelemetryData = Telemetry->Data;
+    entry.Flags = Telemetry->Flags;
+    entry.Time = time(NULL);
+
+    return PnpSpool_Append(Queue->Spool, &entry);
+}
+
+// Sends and frees the readings in Batch in the order they were queued. If the
+// hub isn't Online, or the SDK refuses a reading, the reading is spooled
+// instead when the spool is configured.
+static void
+PnpTelemetryQueue_SendBatch(
+    _In_ PTELEMETRY_QUEUE Queue,
+    _In_ PDLIST_ENTRY Batch,
+    _In_ int Count,
+    _In_ bool Online,
+    _Inout_ PTELEMETRY_QUEUE_STATISTICS Stats
+    )
+{
+    tickcounter_ms_t now = 0;
+
+    Stats->Merged += PnpTelemetryQueue_MergeSamples(Batch, Count);
+
+    while (!DList_IsListEmpty(Batch)) {
+        PPNPBRIDGE_TELEMETRY telemetry = containingRecord(DList_RemoveHeadList(Batch), PNPBRIDGE_TELEMETRY, Entry);
+        bool sent = false;
+
+        if (Online) {
+            DIGITALTWIN_CLIENT_RESULT dtResult;
+
+            dtResult = DigitalTwin_InterfaceClient_SendTelemetryAsync(telemetry->DigitalTwinInterface,
+                            telemetry->Name, telemetry->Data, PnpTelemetryQueue_SendCallback, NULL);
+            if (DIGITALTWIN_CLIENT_OK != dtResult) {
+                LogError("DigitalTwin_InterfaceClient_SendTelemetryAsync failed for %s, result=%d", telemetry->Name, dtResult);
+            }
+            sent = (DIGITALTWIN_CLIENT_OK == dtResult);
+        }
+
+        if (sent) {
+            tickcounter_get_current_ms(Queue->TickCounter, &now);
+            tickcounter_ms_t latency = now - telemetry->EnqueueTime;
+
+            Stats->Sent++;
+            Stats->TotalLatencyMs += latency;
+            if (latency > Stats->MaxLatencyMs) {
+                Stats->MaxLatencyMs = latency;
+            }
+        }
+        else if (NULL != Queue->Spool && PNPBRIDGE_OK == PnpTelemetryQueue_SpoolTelemetry(Queue, telemetry)) {
+            Stats->Spooled++;
+        }
+        else {
+            Stats->SendFailures++;
+        }
+
+        PnpTelemetryQueue_FreeTelemetry(telemetry);
+    }
+}
+
+// Sends up to Count spooled readings in the order they were spooled. The
+// readings of interfaces that aren't published anymore are dropped. The
+// replay stops at the first reading the SDK refuses, which is retried later.
+static void
+PnpTelemetryQueue_Replay(
+    _In_ PTELEMETRY_QUEUE Queue,
+    _In_ int Count,
+    _Inout_ PTELEMETRY_QUEUE_STATISTICS Stats
+    )
+{
+    PNPBRIDGE_SPOOL_ENTRY entry;
+    long dropped = 0;
+
+    for (int i = 0; i < Count && PnpSpool_Peek(Queue->Spool, &entry); i++) {
+        DIGITALTWIN_INTERFACE_CLIENT_HANDLE digitalTwinInterface;
+        DIGITALTWIN_CLIENT_RESULT dtResult;
+
+        digitalTwinInterface = Queue->Callbacks.FindInterface(Queue->Callbacks.Context, entry.InterfaceId, entry.ComponentName);
+        if (NULL == digitalTwinInterface) {
+            PnpSpool_Pop(Queue->Spool);
+            dropped++;
+            continue;
+        }
+
+        dtResult = DigitalTwin_InterfaceClient_SendTelemetryAsync(digitalTwinInterface, entry.TelemetryName,
+                        entry.TelemetryData, PnpTelemetryQueue_SendCallback, NULL);
+        if (DIGITALTWIN_CLIENT_OK != dtResult) {
+            LogError("Failed to replay spooled telemetry %s, result=%d. It is retried later.", entry.TelemetryName, dtResult);
+            break;
+        }
+
+        PnpSpool_Pop(Queue->Spool);
+        Stats->Replayed++;
+    }
+
+    if (dropped > 0) {
+        LogError("Dropped %ld spooled readings of interfaces that are no longer published", dropped);
+        Stats->ReplayDropped += dropped;
+    }
+}
+
+// Readings are always sent when there is no spool to keep them in
+static bool
+PnpTelemetryQueue_IsOnline(
+    _In_ PTELEMETRY_QUEUE Queue
+    )
+{
+    return NULL == Queue->Spool || Queue->Callbacks.IsConnected(Queue->Callbacks.Context);
+}
+
+// Adds the counters of the readings the worker has sent and lets
+// PnpTelemetryQueue_Suspend return
+static void
+PnpTelemetryQueue_EndSending(
+    _In_ PTELEMETRY_QUEUE Queue,
+    _In_ PTELEMETRY_QUEUE_STATISTICS Stats
+    )
+{
+    Lock(Queue->Lock);
+    Queue->Sending = false;
+    Condition_Post(Queue->IdleCondition);
+    Queue->Statistics.Sent += Stats->Sent;
+    Queue->Statistics.SendFailures += Stats->SendFailures;
+    Queue->Statistics.Merged += Stats->Merged;
+    Queue->Statistics.TotalLatencyMs += Stats->TotalLatencyMs;
+    if (Stats->MaxLatencyMs > Queue->Statistics.MaxLatencyMs) {
+        Queue->Statistics.MaxLatencyMs = Stats->MaxLatencyMs;
+    }
+    Queue->Statistics.Spooled += Stats->Spooled;
+    Queue->Statistics.Replayed += Stats->Replayed;
+    Queue->Statistics.ReplayDropped += Stats->ReplayDropped;
+    Unlock(Queue->Lock);
+}
+
+// Returns the number of spooled readings the worker may replay now. If it is
+// 0, WaitMs is set to how long the worker may wait before checking again, or
+// to 0 if it only needs to wake up for queued readings. Must be called with
+// the queue lock held.
+static int
+PnpTelemetryQueue_GetReplayCount(
+    _In_ PTELEMETRY_QUEUE Queue,
+    _In_ bool Online,
+    _Out_ int* WaitMs
+    )
+{
+    tickcounter_ms_t now = 0;
+    tickcounter_ms_t credit;
+    tickcounter_ms_t elapsed;
+
+    *WaitMs = 0;
+
+    if (NULL == Queue->Spool || Queue->Suspended || Queue->TearDown || 0 == PnpSpool_GetDepth(Queue->Spool)) {
+        return 0;
+    }
+
+    tickcounter_get_current_ms(Queue->TickCounter, &now);
+
+    // The replay starts without credit once the hub is back
+    if (!Online) {
+        Queue->ReplayTime = now;
+        *WaitMs = PNPBRIDGE_SPOOL_RECONNECT_POLL_MS;
+        return 0;
+    }
+
+    // The credit builds up for at most a second, so the replay never sends
+    // more than ReplayRatePerSec readings in a burst
+    elapsed = now - Queue->ReplayTime;
+    credit = elapsed * Queue->ReplayRatePerSec / 1000;
+    if (0 == credit) {
+        *WaitMs = (int)((1000 - elapsed * Queue->ReplayRatePerSec + Queue->ReplayRatePerSec - 1) / Queue->ReplayRatePerSec);
+        return 0;
+    }
+
+    if (credit > Queue->ReplayRatePerSec) {
+        credit = Queue->ReplayRatePerSec;
+    }
+
+    Queue->ReplayTime = now;
+
+    return (int)credit;
+}
+
+int
+PnpTelemetryQueue_Worker(
+    _In_ void* ThreadArgument
+    )
+{
+    PTELEMETRY_QUEUE queue = (PTELEMETRY_QUEUE)ThreadArgument;
+    bool tearDown = false;
+
+    while (!tearDown) {
+        DLIST_ENTRY batch;
+        int count;
+        int replayCount = 0;
+        int waitMs = 0;
+        bool online;
+
+        Lock(queue->Lock);
+
+        // Spooled readings are replayed while no live reading is queued
+        while ((0 == queue->Count || queue->Suspended) && !queue->TearDown) {
+            replayCount = PnpTelemetryQueue_GetReplayCount(queue, PnpTelemetryQueue_IsOnline(queue), &waitMs);
+            if (replayCount > 0) {
+                break;
+            }
+
+            Condition_Wait(queue->WaitCondition, queue->Lock, waitMs);
+        }
+
+        // Give other readings for the same interfaces a chance to arrive so
+        // that superseded samples are merged instead of sent
+        if (queue->MergeWindowMs > 0 && queue->Count > 0 && !queue->TearDown) {
+            tickcounter_ms_t start = 0;
+            tickcounter_ms_t now = 0;
+
+            tickcounter_get_current_ms(queue->TickCounter, &start);
+            now = start;
+            while (!queue->TearDown && now - start < queue->MergeWindowMs) {
+                Condition_Wait(queue->WaitCondition, queue->Lock, (int)(queue->MergeWindowMs - (now - start)));
+                tickcounter_get_current_ms(queue->TickCounter, &now);
+            }
+        }
+
+        // The queue may have been suspended during the merge window
+        if (queue->Suspended && !queue->TearDown) {
+            Unlock(queue->Lock);
+            continue;
+        }
+
+        // Readings still queued at teardown are sent, or spooled, before the
+        // worker exits. The spooled backlog is left for the next run.
+        tearDown = queue->TearDown;
+        count = queue->Count;
+        queue->Count = 0;
+        PnpTelemetryQueue_MoveList(&queue->Queue, &batch);
+
+        online = PnpTelemetryQueue_IsOnline(queue);
+        if (0 == replayCount) {
+            replayCount = PnpTelemetryQueue_GetReplayCount(queue, online, &waitMs);
+        }
+
+        queue->Sending = (count > 0 || replayCount > 0);
+
+        PnpTelemetryQueue_WakeProducers(queue);
+
+        Unlock(queue->Lock);
+
+        if (count > 0 || replayCount > 0) {
+            TELEMETRY_QUEUE_STATISTICS stats = { 0 };
+
+            if (count > 0) {
+                PnpTelemetryQueue_SendBatch(queue, &batch, count, online, &stats);
+            }
+
+            if (replayCount > 0) {
+                PnpTelemetryQueue_Replay(queue, replayCount, &stats);
+            }
+
+            PnpTelemetryQueue_EndSending(queue, &stats);
+        }
+    }
+
+    ThreadAPI_Exit(0);
+    return 0;
+}
+
+PNPBRIDGE_RESULT
+PnpTelemetryQueue_Create(
+    _In_ PNPBRIDGE_CONFIGURATION* BridgeConfig,
+    _In_ const TELEMETRY_QUEUE_CALLBACKS* Callbacks,
+    _Out_ PTELEMETRY_QUEUE* TelemetryQueue
+    )
+{
+    PTELEMETRY_QUEUE queue = NULL;
+    PNPBRIDGE_RESULT result = PNPBRIDGE_OK;
+
+    TRY
+    {
+        queue = calloc(1, sizeof(TELEMETRY_QUEUE));
+        if (NULL == queue) {
+            LogError("Failed to allocate memory for the telemetry queue");
+            result = PNPBRIDGE_INSUFFICIENT_MEMORY;
+            LEAVE;
+        }
+
+        DList_InitializeListHead(&queue->Queue);
+
+        queue->Lock = Lock_Init();
+        if (NULL == queue->Lock) {
+            LogError("Failed to init telemetry queue Lock");
+            result = PNPBRIDGE_INSUFFICIENT_MEMORY;
+            LEAVE;
+        }
+
+        queue->WaitCondition = Condition_Init();
+        if (NULL == queue->WaitCondition) {
+            LogError("Failed to init telemetry queue WaitCondition");
+            result = PNPBRIDGE_INSUFFICIENT_MEMORY;
+            LEAVE;
+        }
+
+        queue->TickCounter = tickcounter_create();
+        if (NULL == queue->TickCounter) {
+            LogError("Failed to create telemetry queue TickCounter");
+            result = PNPBRIDGE_INSUFFICIENT_MEMORY;
+            LEAVE;
+        }
+
+        queue->SpaceCondition = Condition_Init();
+        if (NULL == queue->SpaceCondition) {
+            LogError("Failed to init telemetry queue SpaceCondition");
+            result = PNPBRIDGE_INSUFFICIENT_MEMORY;
+            LEAVE;
+        }
+
+        queue->IdleCondition = Condition_Init();
+        if (NULL == queue->IdleCondition) {
+            LogError("Failed to init telemetry queue IdleCondition");
+            result = PNPBRIDGE_INSUFFICIENT_MEMORY;
+            LEAVE;
+        }
+
+        queue->MergeWindowMs = BridgeConfig->TelemetryMergeWindowMs;
+        queue->Limits = BridgeConfig->TelemetryQueueLimits;
+        queue->Statistics.Queue.Capacity = (long)queue->Limits.Capacity;
+        queue->Callbacks = *Callbacks;
+        queue->ReplayRatePerSec = BridgeConfig->SpoolReplayRatePerSec;
+
+        // The queue still works without its spool, it just can't keep the
+        // readings it fails to send
+        if (NULL != BridgeConfig->SpoolPath) {
+            if (PNPBRIDGE_OK != PnpSpool_Open(BridgeConfig->SpoolPath, BridgeConfig->SpoolSizeBytes,
+                                              BridgeConfig->SpoolSegmentBytes, &queue->Spool)) {
+                LogError("Failed to open the telemetry spool %s. Telemetry won't be kept while the hub is unreachable.",
+                         BridgeConfig->SpoolPath);
+                queue->Spool = NULL;
+            }
+            else {
+                long depth = PnpSpool_GetDepth(queue->Spool);
+                if (depth > 0) {
+                    LogInfo("Telemetry spool holds %ld readings from an earlier run", depth);
+                }
+            }
+        }
+
+        if (THREADAPI_OK != ThreadAPI_Create(&queue->Worker, PnpTelemetryQueue_Worker, queue)) {
+            LogError("Failed to create PnpTelemetryQueue_Worker thread");
+            queue->Worker = NULL;
+            result = PNPBRIDGE_FAILED;
+            LEAVE;
+        }
+
+        *TelemetryQueue = queue;
+    }
+    FINALLY
+    {
+        if (PNPBRIDGE_OK != result) {
+            if (queue) {
+                PnpTelemetryQueue_Stop(queue);
+                PnpTelemetryQueue_Release(queue);
+            }
+        }
+    }
+
+    return result;
+}
+
+void
+PnpTelemetryQueue_Stop(
+    _In_ PTELEMETRY_QUEUE Queue
+    )
+{
+    if (NULL != Queue->Lock) {
+        Lock(Queue->Lock);
+        Queue->TearDown = true;
+        if (NULL != Queue->WaitCondition) {
+            Condition_Post(Queue->WaitCondition);
+        }
+        if (NULL != Queue->SpaceCondition) {
+            PnpTelemetryQueue_WakeProducers(Queue);
+        }
+        Unlock(Queue->Lock);
+    }
+
+    if (NULL != Queue->Worker) {
+        ThreadAPI_Join(Queue->Worker, NULL);
+        Queue->Worker = NULL;
+    }
+}
+
+void
+PnpTelemetryQueue_Release(
+    _In_ PTELEMETRY_QUEUE Queue
+    )
+{
+    TELEMETRY_QUEUE_STATISTICS stats = Queue->Statistics;
+
+    LogInfo("Telemetry: %ld queued, %ld sent, %ld merged, %ld dropped, %ld shed, %ld failed, average latency %lu ms, max latency %lu ms",
+            stats.Enqueued, stats.Sent, stats.Merged, stats.Queue.Dropped, stats.Shed, stats.SendFailures,
+            (unsigned long)(stats.Sent > 0 ? stats.TotalLatencyMs / stats.Sent : 0),
+            (unsigned long)stats.MaxLatencyMs);
+
+    if (NULL != Queue->Spool) {
+        LogInfo("Telemetry: %ld spooled, %ld replayed, %ld left in the spool",
+                stats.Spooled, stats.Replayed, PnpSpool_GetDepth(Queue->Spool));
+        PnpSpool_Close(Queue->Spool);
+    }
+
+    // Readings that couldn't be sent by a worker
+    while (!DList_IsListEmpty(&Queue->Queue)) {
+        PnpTelemetryQueue_FreeTelemetry(containingRecord(DList_RemoveHeadList(&Queue->Queue), PNPBRIDGE_TELEMETRY, Entry));
+    }
+
+    if (NULL != Queue->TickCounter) {
+        tickcounter_destroy(Queue->TickCounter);
+    }
+
+    if (NULL != Queue->WaitCondition) {
+        Condition_Deinit(Queue->WaitCondition);
+    }
+
+    if (NULL != Queue->SpaceCondition) {
+        Condition_Deinit(Queue->SpaceCondition);
+    }
+
+    if (NULL != Queue->IdleCondition) {
+        Condition_Deinit(Queue->IdleCondition);
+    }
+
+    if (NULL != Queue->Lock) {
+        Lock_Deinit(Queue->Lock);
+    }
+
+    free(Queue);
+}
+
+void
+PnpTelemetryQueue_Suspend(
+    _In_ PTELEMETRY_QUEUE Queue
+    )
+{
+    Lock(Queue->Lock);
+
+    Queue->Suspended = true;
+
+    // Producers blocked on a full queue drop their reading instead
+    PnpTelemetryQueue_WakeProducers(Queue);
+
+    while (Queue->Sending) {
+        Condition_Wait(Queue->IdleCondition, Queue->Lock, 0);
+    }
+
+    Unlock(Queue->Lock);
+}
+
+void
+PnpTelemetryQueue_Resume(
+    _In_ PTELEMETRY_QUEUE Queue,
+    _In_ const DIGITALTWIN_INTERFACE_CLIENT_HANDLE* DestroyedInterfaces,
+    _In_ int DestroyedCount
+    )
+{
+    int dropped = 0;
+
+    Lock(Queue->Lock);
+
+    PDLIST_ENTRY entry = Queue->Queue.Flink;
+    while (entry != &Queue->Queue && DestroyedCount > 0) {
+        PDLIST_ENTRY next = entry->Flink;
+        PPNPBRIDGE_TELEMETRY telemetry = containingRecord(entry, PNPBRIDGE_TELEMETRY, Entry);
+
+        for (int i = 0; i < DestroyedCount; i++) {
+            if (telemetry->DigitalTwinInterface == DestroyedInterfaces[i]) {
+                DList_RemoveEntryList(entry);
+                PnpTelemetryQueue_FreeTelemetry(telemetry);
+                dropped++;
+                break;
+            }
+        }
+
+        entry = next;
+    }
+
+    Queue->Count -= dropped;
+    Queue->Statistics.Queue.Dropped += dropped;
+    Queue->Suspended = false;
+
+    // A suspended worker waits without a timeout, so it also has to be woken
+    // up to replay the spooled readings
+    if (Queue->Count > 0 || (NULL != Queue->Spool && PnpSpool_GetDepth(Queue->Spool) > 0)) {
+        Condition_Post(Queue->WaitCondition);
+    }
+
+    PnpTelemetryQueue_WakeProducers(Queue);
+
+    Unlock(Queue->Lock);
+}
+
+PNPBRIDGE_RESULT
+PnpTelemetryQueue_Add(
+    _In_ PTELEMETRY_QUEUE Queue,
+    _In_ DIGITALTWIN_INTERFACE_CLIENT_HANDLE DigitalTwinInterface,
+    _In_ const char* TelemetryName,
+    _In_ const char* TelemetryData,
+    _In_ unsigned int Flags
+    )
+{
+    PPNPBRIDGE_TELEMETRY telemetry = NULL;
+    size_t nameSize = strlen(TelemetryName) + 1;
+    size_t dataSize = strlen(TelemetryData) + 1;
+    long size = (long)(sizeof(PNPBRIDGE_TELEMETRY) + nameSize + dataSize);
+    bool isSample = (0 != (Flags & PNPBRIDGE_TELEMETRY_FLAG_SAMPLE));
+
+    // Samples are the first thing shed as the memory budget fills up. Other
+    // readings make room by dropping the queued samples, and are only
+    // refused when there are none left.
+    if (isSample && PnpMemory_GetSheddingLevel() >= PNPMEMORY_SHED_SAMPLES) {
+        Lock(Queue->Lock);
+        Queue->Statistics.Shed++;
+        Unlock(Queue->Lock);
+        return PNPBRIDGE_FAILED;
+    }
+
+    if (!PnpMemory_ChargeBudget(size)) {
+        bool charged = false;
+
+        Lock(Queue->Lock);
+        if (!isSample && PnpTelemetryQueue_ShedSamples(Queue) > 0) {
+            charged = PnpMemory_ChargeBudget(size);
+        }
+
+        if (!charged) {
+            Queue->Statistics.Shed++;
+        }
+        Unlock(Queue->Lock);
+
+        if (!charged) {
+            LogError("Telemetry %s exceeds the memory budget and is dropped", TelemetryName);
+            return PNPBRIDGE_FAILED;
+        }
+    }
+
+    telemetry = malloc(size);
+    if (NULL == telemetry) {
+        LogError("Failed to allocate telemetry %s", TelemetryName);
+        PnpMemory_ReleaseBudget(size);
+        return PNPBRIDGE_INSUFFICIENT_MEMORY;
+    }
+
+    char* buffer = (char*)(telemetry + 1);
+    memcpy(buffer, TelemetryName, nameSize);
+    memcpy(buffer + nameSize, TelemetryData, dataSize);
+
+    telemetry->DigitalTwinInterface = DigitalTwinInterface;
+    telemetry->Flags = Flags;
+    telemetry->Size = size;
+    telemetry->Name = buffer;
+    telemetry->Data = buffer + nameSize;
+    telemetry->Hash = PnpBridge_HashString(PNPBRIDGE_HASH_INITIAL_VALUE ^ (unsigned int)(uintptr_t)DigitalTwinInterface,
+                                           TelemetryName);
+    tickcounter_get_current_ms(Queue->TickCounter, &telemetry->EnqueueTime);
+
+    Lock(Queue->Lock);
+
+    if (Queue->Limits.Capacity > 0 && Queue->Count >= (int)Queue->Limits.Capacity && !Queue->TearDown) {
+        switch (Queue->Limits.OverflowPolicy) {
+            case PNPBRIDGE_QUEUE_OVERFLOW_BLOCK:
+                Queue->Statistics.Queue.Blocked++;
+                Queue->WaitingProducers++;
+                while (Queue->Count >= (int)Queue->Limits.Capacity && !Queue->TearDown && !Queue->Suspended) {
+                    Condition_Wait(Queue->SpaceCondition, Queue->Lock, 0);
+                }
+                Queue->WaitingProducers--;
+
+                // The adapter may be the one being released, which must not wait for the queue
+                if (Queue->Count >= (int)Queue->Limits.Capacity && !Queue->TearDown) {
+                    Queue->Statistics.Queue.Dropped++;
+                    Unlock(Queue->Lock);
+                    PnpTelemetryQueue_FreeTelemetry(telemetry);
+                    return PNPBRIDGE_FAILED;
+                }
+                break;
+
+            case PNPBRIDGE_QUEUE_OVERFLOW_DROP_OLDEST:
+                PnpTelemetryQueue_FreeTelemetry(containingRecord(DList_RemoveHeadList(&Queue->Queue), PNPBRIDGE_TELEMETRY, Entry));
+                Queue->Count--;
+                Queue->Statistics.Queue.Dropped++;
+                break;
+
+            case PNPBRIDGE_QUEUE_OVERFLOW_DROP_NEWEST:
+            default:
+                Queue->Statistics.Queue.Dropped++;
+                Unlock(Queue->Lock);
+                PnpTelemetryQueue_FreeTelemetry(telemetry);
+                return PNPBRIDGE_FAILED;
+        }
+    }
+
+    if (Queue->TearDown) {
+        Unlock(Queue->Lock);
+        PnpTelemetryQueue_FreeTelemetry(telemetry);
+        return PNPBRIDGE_FAILED;
+    }
+
+    DList_InsertTailList(&Queue->Queue, &telemetry->Entry);
+    Queue->Statistics.Enqueued++;
+
+    // The worker only waits for an empty queue to become non-empty
+    if (1 == ++Queue->Count) {
+        Condition_Post(Queue->WaitCondition);
+    }
+
+    if (Queue->Count > Queue->Statistics.Queue.HighWaterMark) {
+        Queue->Statistics.Queue.HighWaterMark = Queue->Count;
+    }
+
+    Unlock(Queue->Lock);
+
+    return PNPBRIDGE_OK;
+}
+
+void
+PnpTelemetryQueue_GetStatistics(
+    _In_ PTELEMETRY_QUEUE Queue,
+    _Out_ PTELEMETRY_QUEUE_STATISTICS Statistics
+    )
+{
+    Lock(Queue->Lock);
+    *Statistics = Queue->Statistics;
+    Statistics->Queue.Depth = Queue->Count;
+    Unlock(Queue->Lock);
+
+    if (NULL != Queue->Spool) {
+        PnpSpool_GetStatistics(Queue->Spool, &Statistics->Spool);
+    }
+}
@@ -0,0 +1,302 @@
+// Copyright (c) Microsoft. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#include "pnpbridge_common.h"
+
+typedef enum PNPBRIDGE_WORK_STATE {
+    PNPBRIDGE_WORK_QUEUED,
+    PNPBRIDGE_WORK_RUNNING,
+    PNPBRIDGE_WORK_DONE,
+
+    // The waiter gave up on the item. The worker that runs it calls the
+    // LateCallback and frees it.
+    PNPBRIDGE_WORK_ABANDONED
+} PNPBRIDGE_WORK_STATE;
+
+typedef struct _PNPBRIDGE_WORK_ITEM {
+    DLIST_ENTRY Entry;
+    PNPBRIDGE_WORK_CALLBACK Callback;
+    PNPBRIDGE_WORK_LATE_CALLBACK LateCallback;
+    void* Context;
+    PNPBRIDGE_WORK_STATE State;
+    tickcounter_ms_t StartTime;
+    int Result;
+} PNPBRIDGE_WORK_ITEM, *PPNPBRIDGE_WORK_ITEM;
+
+typedef struct _PNPBRIDGE_WORK_POOL {
+    // Protects everything below, including the state of the queued items
+    LOCK_HANDLE Lock;
+
+    // Workers wait on WorkCondition for items and waiters wait on
+    // DoneCondition for the items to complete. A post wakes a single
+    // thread, so DoneWaiters counts the threads that need to be woken
+    // when any item completes.
+    COND_HANDLE WorkCondition;
+    COND_HANDLE DoneCondition;
+    int DoneWaiters;
+
+    DLIST_ENTRY Queue;
+
+    THREAD_HANDLE* Workers;
+    int WorkerCount;
+
+    bool TearDown;
+
+    TICK_COUNTER_HANDLE TickCounter;
+
+    // Number of items that didn't complete within their timeout
+    long TimedOut;
+} PNPBRIDGE_WORK_POOL;
+
+static int
+PnpWorkPool_Worker(
+    _In_ void* ThreadArgument
+    )
+{
+    PNPBRIDGE_WORK_POOL_HANDLE pool = (PNPBRIDGE_WORK_POOL_HANDLE)ThreadArgument;
+
+    Lock(pool->Lock);
+
+    while (true) {
+        while (DList_IsListEmpty(&pool->Queue) && !pool->TearDown) {
+            Condition_Wait(pool->WorkCondition, pool->Lock, 0);
+        }
+
+        if (DList_IsListEmpty(&pool->Queue)) {
+            break;
+        }
+
+        PPNPBRIDGE_WORK_ITEM item = containingRecord(DList_RemoveHeadList(&pool->Queue), PNPBRIDGE_WORK_ITEM, Entry);
+        item->State = PNPBRIDGE_WORK_RUNNING;
+        tickcounter_get_current_ms(pool->TickCounter, &item->StartTime);
+
+        Unlock(pool->Lock);
+
+        int result = item->Callback(item->Context);
+
+        Lock(pool->Lock);
+
+        if (PNPBRIDGE_WORK_ABANDONED == item->State) {
+            Unlock(pool->Lock);
+            item->LateCallback(item->Context, true, result);
+            free(item);
+            Lock(pool->Lock);
+        }
+        else {
+            item->Result = result;
+            item->State = PNPBRIDGE_WORK_DONE;
+
+            // The waiters may be waiting on different items
+            for (int i = 0; i < pool->DoneWaiters; i++) {
+                Condition_Post(pool->DoneCondition);
+            }
+        }
+    }
+
+    Unlock(pool->Lock);
+
+    ThreadAPI_Exit(0);
+    return 0;
+}
+
+PNPBRIDGE_RESULT
+PnpWorkPool_Create(
+    _In_ int WorkerCount,
+    _Out_ PNPBRIDGE_WORK_POOL_HANDLE* Pool
+    )
+{
+    PNPBRIDGE_RESULT result = PNPBRIDGE_OK;
+    PNPBRIDGE_WORK_POOL_HANDLE pool = NULL;
+
+    TRY
+    {
+        if (WorkerCount <= 0) {
+            result = PNPBRIDGE_INVALID_ARGS;
+            LEAVE;
+        }
+
+        pool = calloc(1, sizeof(PNPBRIDGE_WORK_POOL));
+        if (NULL == pool) {
+            result = PNPBRIDGE_INSUFFICIENT_MEMORY;
+            LEAVE;
+        }
+
+        DList_InitializeListHead(&pool->Queue);
+
+        pool->Lock = Lock_Init();
+        pool->WorkCondition = Condition_Init();
+        pool->DoneCondition = Condition_Init();
+        pool->TickCounter = tickcounter_create();
+        pool->Workers = calloc(WorkerCount, sizeof(THREAD_HANDLE));
+        if (NULL == pool->Lock || NULL == pool->WorkCondition || NULL == pool->DoneCondition ||
+            NULL == pool->TickCounter || NULL == pool->Workers) {
+            LogError("Failed to allocate the adapter work pool");
+            result = PNPBRIDGE_INSUFFICIENT_MEMORY;
+            LEAVE;
+        }
+
+        for (int i = 0; i < WorkerCount; i++) {
+            if (THREADAPI_OK != ThreadAPI_Create(&pool->Workers[i], PnpWorkPool_Worker, pool)) {
+                LogError("Failed to create PnpWorkPool_Worker thread");
+                result = PNPBRIDGE_FAILED;
+                LEAVE;
+            }
+            pool->WorkerCount++;
+        }
+
+        *Pool = pool;
+    }
+    FINALLY
+    {
+        if (PNPBRIDGE_OK != result && NULL != pool) {
+            PnpWorkPool_Release(pool);
+        }
+    }
+
+    return result;
+}
+
+void
+PnpWorkPool_Release(
+    _In_ PNPBRIDGE_WORK_POOL_HANDLE Pool
+    )
+{
+    if (NULL != Pool->Lock) {
+        Lock(Pool->Lock);
+        Pool->TearDown = true;
+
+        // Wake every idle worker, a single post would only wake one of them
+        if (NULL != Pool->WorkCondition) {
+            for (int i = 0; i < Pool->WorkerCount; i++) {
+                Condition_Post(Pool->WorkCondition);
+            }
+        }
+        Unlock(Pool->Lock);
+    }
+
+    // Items that are still running were abandoned by their waiters. The
+    // workers call their LateCallback before exiting.
+    for (int i = 0; i < Pool->WorkerCount; i++) {
+        ThreadAPI_Join(Pool->Workers[i], NULL);
+    }
+
+    if (Pool->TimedOut > 0) {
+        LogInfo("%ld adapter callback(s) did not complete within their timeout", Pool->TimedOut);
+    }
+
+    free(Pool->Workers);
+
+    if (NULL != Pool->TickCounter) {
+        tickcounter_destroy(Pool->TickCounter);
+    }
+
+    if (NULL != Pool->DoneCondition) {
+        Condition_Deinit(Pool->DoneCondition);
+    }
+
+    if (NULL != Pool->WorkCondition) {
+        Condition_Deinit(Pool->WorkCondition);
+    }
+
+    if (NULL != Pool->Lock) {
+        Lock_Deinit(Pool->Lock);
+    }
+
+    free(Pool);
+}
+
+PNPBRIDGE_RESULT
+PnpWorkPool_Submit(
+    _In_ PNPBRIDGE_WORK_POOL_HANDLE Pool,
+    _In_ PNPBRIDGE_WORK_CALLBACK Callback,
+    _In_ PNPBRIDGE_WORK_LATE_CALLBACK LateCallback,
+    _In_ void* Context,
+    _Out_ PNPBRIDGE_WORK_ITEM_HANDLE* Item
+    )
+{
+    PPNPBRIDGE_WORK_ITEM item = calloc(1, sizeof(PNPBRIDGE_WORK_ITEM));
+    if (NULL == item) {
+        return PNPBRIDGE_INSUFFICIENT_MEMORY;
+    }
+
+    item->Callback = Callback;
+    item->LateCallback = LateCallback;
+    item->Context = Context;
+    item->State = PNPBRIDGE_WORK_QUEUED;
+
+    Lock(Pool->Lock);
+    DList_InsertTailList(&Pool->Queue, &item->Entry);
+    Condition_Post(Pool->WorkCondition);
+    Unlock(Pool->Lock);
+
+    *Item = item;
+
+    return PNPBRIDGE_OK;
+}
+
+PNPBRIDGE_RESULT
+PnpWorkPool_Wait(
+    _In_ PNPBRIDGE_WORK_POOL_HANDLE Pool,
+    _In_ PNPBRIDGE_WORK_ITEM_HANDLE Item,
+    _In_ unsigned int TimeoutMs,
+    _Out_ int* Result
+    )
+{
+    tickcounter_ms_t waitStart = 0;
+    tickcounter_ms_t now = 0;
+    bool started = true;
+
+    tickcounter_get_current_ms(Pool->TickCounter, &waitStart);
+    now = waitStart;
+
+    Lock(Pool->Lock);
+
+    while (PNPBRIDGE_WORK_DONE != Item->State) {
+        if (0 == TimeoutMs) {
+            Pool->DoneWaiters++;
+            Condition_Wait(Pool->DoneCondition, Pool->Lock, 0);
+            Pool->DoneWaiters--;
+            continue;
+        }
+
+        // A running item gets TimeoutMs from the time it started. An item that is
+        // still queued because the workers are busy gets TimeoutMs from now.
+        tickcounter_ms_t since = (PNPBRIDGE_WORK_RUNNING == Item->State) ? Item->StartTime : waitStart;
+        tickcounter_ms_t elapsed = (now > since) ? now - since : 0;
+        if (elapsed >= TimeoutMs) {
+            break;
+        }
+
+        Pool->DoneWaiters++;
+        Condition_Wait(Pool->DoneCondition, Pool->Lock, (int)(TimeoutMs - elapsed));
+        Pool->DoneWaiters--;
+        tickcounter_get_current_ms(Pool->TickCounter, &now);
+    }
+
+    if (PNPBRIDGE_WORK_DONE == Item->State) {
+        Unlock(Pool->Lock);
+        *Result = Item->Result;
+        free(Item);
+        return PNPBRIDGE_OK;
+    }
+
+    Pool->TimedOut++;
+
+    if (PNPBRIDGE_WORK_QUEUED == Item->State) {
+        DList_RemoveEntryList(&Item->Entry);
+        started = false;
+    }
+    else {
+        Item->State = PNPBRIDGE_WORK_ABANDONED;
+    }
+
+    Unlock(Pool->Lock);
+
+    // The callback never ran, so nothing else will call the LateCallback
+    if (!started) {
+        Item->LateCallback(Item->Context, false, 0);
+        free(Item);
+    }
+
+    return PNPBRIDGE_TIMED_OUT;
+}
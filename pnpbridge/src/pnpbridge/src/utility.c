@@ -3,25 +3,362 @@
 
 #include "pnpbridge_common.h"
 
-MAP_RESULT 
-Map_Add_Index(
-    MAP_HANDLE handle,
-    const char* key,
-    int value
+PNPBRIDGE_RESULT
+PnpIdentityTable_Create(
+    PPNPBRIDGE_IDENTITY_TABLE Table,
+    int Capacity
     )
 {
-    char str[12];
-    sprintf(str, "%d", value);
+    memset(Table, 0, sizeof(PNPBRIDGE_IDENTITY_TABLE));
 
-    return Map_Add(handle, key, str);
+    Table->Entries = calloc(Capacity > 0 ? Capacity : 1, sizeof(PNPBRIDGE_IDENTITY_ENTRY));
+    if (NULL == Table->Entries) {
+        return PNPBRIDGE_INSUFFICIENT_MEMORY;
+    }
+
+    Table->Capacity = Capacity;
+
+    return PNPBRIDGE_OK;
+}
+
+void
+PnpIdentityTable_Destroy(
+    PPNPBRIDGE_IDENTITY_TABLE Table
+    )
+{
+    if (NULL != Table->Entries) {
+        free(Table->Entries);
+    }
+
+    memset(Table, 0, sizeof(PNPBRIDGE_IDENTITY_TABLE));
+}
+
+PNPBRIDGE_RESULT
+PnpIdentityTable_Add(
+    PPNPBRIDGE_IDENTITY_TABLE Table,
+    const char* Identity,
+    int Index
+    )
+{
+    int position = 0;
+
+    if (NULL == Identity) {
+        return PNPBRIDGE_INVALID_ARGS;
+    }
+
+    if (Table->Count == Table->Capacity) {
+        return PNPBRIDGE_FAILED;
+    }
+
+    // The table only changes at startup and on a config reload so a sorted
+    // insert is good enough
+    while (position < Table->Count) {
+        int compare = strcmp(Table->Entries[position].Identity, Identity);
+        if (0 == compare) {
+            return PNPBRIDGE_DUPLICATE_ENTRY;
+        }
+        else if (compare > 0) {
+            break;
+        }
+        position++;
+    }
+
+    memmove(&Table->Entries[position + 1], &Table->Entries[position],
+            (Table->Count - position) * sizeof(PNPBRIDGE_IDENTITY_ENTRY));
+
+    Table->Entries[position].Identity = Identity;
+    Table->Entries[position].Index = Index;
+    Table->Count++;
+
+    return PNPBRIDGE_OK;
 }
 
-int 
-Map_GetIndexValueFromKey(
-    MAP_HANDLE handle,
-    const char* key
+int
+PnpIdentityTable_Find(
+    PPNPBRIDGE_IDENTITY_TABLE Table,
+    const char* Identity
     )
 {
-    const char* index = Map_GetValueFromKey(handle, key);
-    return atoi(index);
-}
\ No newline at end of file
+    int low = 0;
+    int high = Table->Count - 1;
+
+    if (NULL == Identity) {
+        return -1;
+    }
+
+    while (low <= high) {
+        int middle = low + (high - low) / 2;
+        int compare = strcmp(Table->Entries[middle].Identity, Identity);
+        if (0 == compare) {
+            return Table->Entries[middle].Index;
+        }
+        else if (compare < 0) {
+            low = middle + 1;
+        }
+        else {
+            high = middle - 1;
+        }
+    }
+
+    return -1;
+}
+
+void
+PnpIdentityTable_Remove(
+    PPNPBRIDGE_IDENTITY_TABLE Table,
+    const char* Identity
+    )
+{
+    if (NULL == Identity) {
+        return;
+    }
+
+    for (int position = 0; position < Table->Count; position++) {
+        if (0 == strcmp(Table->Entries[position].Identity, Identity)) {
+            memmove(&Table->Entries[position], &Table->Entries[position + 1],
+                    (Table->Count - position - 1) * sizeof(PNPBRIDGE_IDENTITY_ENTRY));
+            Table->Count--;
+            return;
+        }
+    }
+}
+
+unsigned int
+PnpBridge_HashString(
+    unsigned int hash,
+    const char* str
+    )
+{
+    // FNV-1a. The terminating NUL is hashed as well so that hashing strings
+    // one after the other doesn't collide with hashing their concatenation.
+    const unsigned char* p = (const unsigned char*)str;
+    do {
+        hash ^= *p;
+        hash *= 16777619u;
+    } while ('\0' != *p++);
+
+    return hash;
+}
+
+// Set of strings that can be read and updated from any thread. The buckets are
+// split into stripes that each have their own lock, so that readers only
+// contend with writers that touch the same stripe. A string can be added more
+// than once and stays in the set until it has been removed as many times.
+#define PNPBRIDGE_STRING_SET_STRIPE_BITS 4
+#define PNPBRIDGE_STRING_SET_STRIPES (1 << PNPBRIDGE_STRING_SET_STRIPE_BITS)
+#define PNPBRIDGE_STRING_SET_MIN_BUCKETS 8
+
+typedef struct _PNPBRIDGE_STRING_SET_ENTRY {
+    struct _PNPBRIDGE_STRING_SET_ENTRY* Next;
+    unsigned int Hash;
+    int Count;
+    char* String;
+} PNPBRIDGE_STRING_SET_ENTRY, *PPNPBRIDGE_STRING_SET_ENTRY;
+
+typedef struct _PNPBRIDGE_STRING_SET_STRIPE {
+    LOCK_HANDLE Lock;
+
+    // Power of 2 number of bucket chains
+    PPNPBRIDGE_STRING_SET_ENTRY* Buckets;
+    unsigned int BucketCount;
+    unsigned int EntryCount;
+} PNPBRIDGE_STRING_SET_STRIPE, *PPNPBRIDGE_STRING_SET_STRIPE;
+
+typedef struct _PNPBRIDGE_STRING_SET {
+    PNPBRIDGE_STRING_SET_STRIPE Stripes[PNPBRIDGE_STRING_SET_STRIPES];
+} PNPBRIDGE_STRING_SET;
+
+static PPNPBRIDGE_STRING_SET_ENTRY*
+PnpStringSet_FindEntry(
+    PPNPBRIDGE_STRING_SET_STRIPE stripe,
+    unsigned int hash,
+    const char* str
+    )
+{
+    PPNPBRIDGE_STRING_SET_ENTRY* link = &stripe->Buckets[(hash >> PNPBRIDGE_STRING_SET_STRIPE_BITS) & (stripe->BucketCount - 1)];
+    while (NULL != *link && ((*link)->Hash != hash || 0 != strcmp((*link)->String, str))) {
+        link = &(*link)->Next;
+    }
+
+    return link;
+}
+
+static void
+PnpStringSet_Grow(
+    PPNPBRIDGE_STRING_SET_STRIPE stripe
+    )
+{
+    const unsigned int bucketCount = stripe->BucketCount << 1;
+    PPNPBRIDGE_STRING_SET_ENTRY* buckets = calloc(bucketCount, sizeof(PPNPBRIDGE_STRING_SET_ENTRY));
+    if (NULL == buckets) {
+        // Keep using the current buckets. Lookups just get slower.
+        return;
+    }
+
+    for (unsigned int i = 0; i < stripe->BucketCount; i++) {
+        PPNPBRIDGE_STRING_SET_ENTRY entry = stripe->Buckets[i];
+        while (NULL != entry) {
+            PPNPBRIDGE_STRING_SET_ENTRY next = entry->Next;
+            PPNPBRIDGE_STRING_SET_ENTRY* bucket = &buckets[(entry->Hash >> PNPBRIDGE_STRING_SET_STRIPE_BITS) & (bucketCount - 1)];
+            entry->Next = *bucket;
+            *bucket = entry;
+            entry = next;
+        }
+    }
+
+    free(stripe->Buckets);
+    stripe->Buckets = buckets;
+    stripe->BucketCount = bucketCount;
+}
+
+PNPBRIDGE_RESULT
+PnpStringSet_Create(
+    PNPBRIDGE_STRING_SET_HANDLE* Set
+    )
+{
+    PNPBRIDGE_RESULT result = PNPBRIDGE_OK;
+    PNPBRIDGE_STRING_SET_HANDLE set = NULL;
+
+    TRY {
+        set = calloc(1, sizeof(PNPBRIDGE_STRING_SET));
+        if (NULL == set) {
+            result = PNPBRIDGE_INSUFFICIENT_MEMORY;
+            LEAVE;
+        }
+
+        for (int i = 0; i < PNPBRIDGE_STRING_SET_STRIPES; i++) {
+            PPNPBRIDGE_STRING_SET_STRIPE stripe = &set->Stripes[i];
+            stripe->Lock = Lock_Init();
+            stripe->Buckets = calloc(PNPBRIDGE_STRING_SET_MIN_BUCKETS, sizeof(PPNPBRIDGE_STRING_SET_ENTRY));
+            stripe->BucketCount = PNPBRIDGE_STRING_SET_MIN_BUCKETS;
+            if (NULL == stripe->Lock || NULL == stripe->Buckets) {
+                result = PNPBRIDGE_INSUFFICIENT_MEMORY;
+                LEAVE;
+            }
+        }
+
+        *Set = set;
+    }
+    FINALLY
+    {
+        if (PNPBRIDGE_OK != result) {
+            PnpStringSet_Destroy(set);
+        }
+    }
+
+    return result;
+}
+
+void
+PnpStringSet_Destroy(
+    PNPBRIDGE_STRING_SET_HANDLE Set
+    )
+{
+    if (NULL == Set) {
+        return;
+    }
+
+    for (int i = 0; i < PNPBRIDGE_STRING_SET_STRIPES; i++) {
+        PPNPBRIDGE_STRING_SET_STRIPE stripe = &Set->Stripes[i];
+        if (NULL != stripe->Buckets) {
+            for (unsigned int j = 0; j < stripe->BucketCount; j++) {
+                PPNPBRIDGE_STRING_SET_ENTRY entry = stripe->Buckets[j];
+                while (NULL != entry) {
+                    PPNPBRIDGE_STRING_SET_ENTRY next = entry->Next;
+                    free(entry->String);
+                    free(entry);
+                    entry = next;
+                }
+            }
+            free(stripe->Buckets);
+        }
+
+        if (NULL != stripe->Lock) {
+            Lock_Deinit(stripe->Lock);
+        }
+    }
+
+    free(Set);
+}
+
+PNPBRIDGE_RESULT
+PnpStringSet_Add(
+    PNPBRIDGE_STRING_SET_HANDLE Set,
+    const char* String
+    )
+{
+    PNPBRIDGE_RESULT result = PNPBRIDGE_OK;
+    const unsigned int hash = PnpBridge_HashString(PNPBRIDGE_HASH_INITIAL_VALUE, String);
+    PPNPBRIDGE_STRING_SET_STRIPE stripe = &Set->Stripes[hash & (PNPBRIDGE_STRING_SET_STRIPES - 1)];
+
+    Lock(stripe->Lock);
+
+    PPNPBRIDGE_STRING_SET_ENTRY* link = PnpStringSet_FindEntry(stripe, hash, String);
+    if (NULL != *link) {
+        (*link)->Count++;
+    }
+    else {
+        PPNPBRIDGE_STRING_SET_ENTRY entry = calloc(1, sizeof(PNPBRIDGE_STRING_SET_ENTRY));
+        if (NULL == entry || 0 != mallocAndStrcpy_s(&entry->String, String)) {
+            free(entry);
+            result = PNPBRIDGE_INSUFFICIENT_MEMORY;
+        }
+        else {
+            entry->Hash = hash;
+            entry->Count = 1;
+            *link = entry;
+
+            if (++stripe->EntryCount > stripe->BucketCount) {
+                PnpStringSet_Grow(stripe);
+            }
+        }
+    }
+
+    Unlock(stripe->Lock);
+
+    return result;
+}
+
+void
+PnpStringSet_Remove(
+    PNPBRIDGE_STRING_SET_HANDLE Set,
+    const char* String
+    )
+{
+    const unsigned int hash = PnpBridge_HashString(PNPBRIDGE_HASH_INITIAL_VALUE, String);
+    PPNPBRIDGE_STRING_SET_STRIPE stripe = &Set->Stripes[hash & (PNPBRIDGE_STRING_SET_STRIPES - 1)];
+    PPNPBRIDGE_STRING_SET_ENTRY removed = NULL;
+
+    Lock(stripe->Lock);
+
+    PPNPBRIDGE_STRING_SET_ENTRY* link = PnpStringSet_FindEntry(stripe, hash, String);
+    if (NULL != *link && 0 == --(*link)->Count) {
+        removed = *link;
+        *link = removed->Next;
+        stripe->EntryCount--;
+    }
+
+    Unlock(stripe->Lock);
+
+    if (NULL != removed) {
+        free(removed->String);
+        free(removed);
+    }
+}
+
+bool
+PnpStringSet_Contains(
+    PNPBRIDGE_STRING_SET_HANDLE Set,
+    const char* String
+    )
+{
+    const unsigned int hash = PnpBridge_HashString(PNPBRIDGE_HASH_INITIAL_VALUE, String);
+    PPNPBRIDGE_STRING_SET_STRIPE stripe = &Set->Stripes[hash & (PNPBRIDGE_STRING_SET_STRIPES - 1)];
+    bool found;
+
+    Lock(stripe->Lock);
+    found = NULL != *PnpStringSet_FindEntry(stripe, hash, String);
+    Unlock(stripe->Lock);
+
+    return found;
+}
@@ -10,6 +10,7 @@
 #include <stddef.h>
 #include <stdint.h>
 #endif
+#include <time.h>
 
 static void* my_gballoc_malloc(size_t size)
 {
@@ -145,6 +146,354 @@ TEST_FUNCTION(PnpBridgeConfig_RetrieveConfigurationTest)
 
     result = PnpBridgeConfig_RetrieveConfiguration(value, &pnpbridge_config);
     ASSERT_ARE_EQUAL(PNPBRIDGE_RESULT, result, PNPBRIDGE_OK);
+
+    json_value_free(value);
+    PnpBridgeConfig_ReleaseConfiguration(&pnpbridge_config);
+}
+
+#define CONFIGURATION_SNAPSHOT_TEST_FILE "config_snapshot_test.json"
+#define CONFIGURATION_SNAPSHOT_TEST_SNAPSHOT CONFIGURATION_SNAPSHOT_TEST_FILE ".snapshot"
+
+static void WriteTestConfigFile(const char* contents)
+{
+    FILE* file = fopen(CONFIGURATION_SNAPSHOT_TEST_FILE, "wb");
+    ASSERT_IS_NOT_NULL(file);
+    ASSERT_ARE_EQUAL(size_t, strlen(contents), fwrite(contents, 1, strlen(contents), file));
+    fclose(file);
+}
+
+TEST_FUNCTION(PnpBridgeConfig_GetJsonValueFromSnapshot_RebuildsTheCompiledConfig)
+{
+    PNPBRIDGE_CONFIG_SNAPSHOT_KEY key = { 0 };
+    JSON_Value* parsed = NULL;
+    JSON_Value* compiled = NULL;
+    bool fromSnapshot = true;
+    PNPBRIDGE_RESULT result;
+
+    remove(CONFIGURATION_SNAPSHOT_TEST_SNAPSHOT);
+    WriteTestConfigFile("{\"pnp_bridge_parameters\": {\"trace_on\": true, \"queue\": [1, 2.5, null, false]},"
+                        " \"devices\": [{\"interface_id\": \"http://test/1\", \"pnp_parameters\": {}}]}");
+
+    // The first start parses the config file and compiles it
+    result = PnpBridgeConfig_GetJsonValueFromSnapshot(CONFIGURATION_SNAPSHOT_TEST_FILE, &parsed, &key, &fromSnapshot);
+    ASSERT_ARE_EQUAL(PNPBRIDGE_RESULT, PNPBRIDGE_OK, result);
+    ASSERT_IS_FALSE(fromSnapshot);
+    result = PnpBridgeConfig_SaveSnapshot(CONFIGURATION_SNAPSHOT_TEST_FILE, &key, parsed);
+    ASSERT_ARE_EQUAL(PNPBRIDGE_RESULT, PNPBRIDGE_OK, result);
+
+    // The next start rebuilds the same tree from the snapshot
+    result = PnpBridgeConfig_GetJsonValueFromSnapshot(CONFIGURATION_SNAPSHOT_TEST_FILE, &compiled, &key, &fromSnapshot);
+    ASSERT_ARE_EQUAL(PNPBRIDGE_RESULT, PNPBRIDGE_OK, result);
+    ASSERT_IS_TRUE(fromSnapshot);
+    ASSERT_IS_TRUE(json_value_equals(parsed, compiled));
+    json_value_free(compiled);
+    compiled = NULL;
+
+    // A changed config file is parsed again
+    WriteTestConfigFile("{\"pnp_bridge_parameters\": {\"trace_on\": false}, \"devices\": []}");
+    result = PnpBridgeConfig_GetJsonValueFromSnapshot(CONFIGURATION_SNAPSHOT_TEST_FILE, &compiled, &key, &fromSnapshot);
+    ASSERT_ARE_EQUAL(PNPBRIDGE_RESULT, PNPBRIDGE_OK, result);
+    ASSERT_IS_FALSE(fromSnapshot);
+    ASSERT_IS_FALSE(json_object_dotget_boolean(json_value_get_object(compiled), "pnp_bridge_parameters.trace_on"));
+
+    json_value_free(parsed);
+    json_value_free(compiled);
+    remove(CONFIGURATION_SNAPSHOT_TEST_SNAPSHOT);
+    remove(CONFIGURATION_SNAPSHOT_TEST_FILE);
+}
+
+#define CONFIGURATION_BENCHMARK_DEVICE_COUNT 10000
+#define CONFIGURATION_BENCHMARK_LOOKUP_COUNT 1000
+
+static JSON_Object* CreateTestDevice(JSON_Array* devices, const char* matchType, const char* hardwareId)
+{
+    JSON_Value* device = json_value_init_object();
+    JSON_Object* deviceObj = json_value_get_object(device);
+
+    json_object_dotset_string(deviceObj, "pnp_parameters.identity", "core-device-health");
+    json_object_set_string(deviceObj, "interface_id", "http://windows.com/coredevicehealth/v1");
+    if (NULL != hardwareId) {
+        json_object_dotset_string(deviceObj, "match_filters.match_type", matchType);
+        json_object_dotset_string(deviceObj, "match_filters.match_parameters.hardware_id", hardwareId);
+    }
+    json_array_append_value(devices, device);
+
+    return deviceObj;
+}
+
+static JSON_Value* CreateTestConfig(JSON_Array** devices)
+{
+    JSON_Value* config = json_value_init_object();
+    json_object_set_value(json_value_get_object(config), "devices", json_value_init_array());
+    *devices = json_object_get_array(json_value_get_object(config), "devices");
+    return config;
+}
+
+static JSON_Value* CreateTestMessage(const char* hardwareId)
+{
+    JSON_Value* message = json_value_init_object();
+    json_object_set_string(json_value_get_object(message), "identity", "core-device-discovery");
+    json_object_dotset_string(json_value_get_object(message), "match_parameters.hardware_id", hardwareId);
+    return message;
+}
+
+static void GetTestHardwareId(char* buffer, size_t size, int device)
+{
+    (void)snprintf(buffer, size, "USB\\VID_%04X&PID_%04X", device / 100, device % 100);
+}
+
+static void CompileTestConfig(JSON_Value* config, PNPBRIDGE_CONFIGURATION* bridgeConfig)
+{
+    ASSERT_ARE_EQUAL(PNPBRIDGE_RESULT, PNPBRIDGE_OK, Configuration_CompileDevices(config, bridgeConfig));
+
+    // The compiled devices don't point into the config document
+    json_value_free(config);
+}
+
+TEST_FUNCTION(Configuration_CompileDevices_CopiesTheDevices)
+{
+    JSON_Array* devices;
+    JSON_Value* config = CreateTestConfig(&devices);
+    PNPBRIDGE_CONFIGURATION bridgeConfig = { 0 };
+    JSON_Object* device;
+
+    CreateTestDevice(devices, "exact", "USB\\VID_045E");
+    device = CreateTestDevice(devices, "equals", "USB\\VID_045F");
+    json_object_dotset_string(device, "match_filters.match_parameters.serial", "1234");
+    device = CreateTestDevice(devices, NULL, NULL);
+    json_object_remove(device, "interface_id");
+    json_object_set_string(device, "self_describing", "true");
+    json_object_dotset_string(device, "discovery_parameters.identity", "core-device-discovery");
+    json_object_dotset_number(device, "discovery_parameters.port", 12);
+
+    CompileTestConfig(config, &bridgeConfig);
+
+    ASSERT_ARE_EQUAL(int, 3, bridgeConfig.DeviceCount);
+    ASSERT_IS_TRUE(bridgeConfig.Devices[0].ExactMatch);
+    ASSERT_IS_FALSE(bridgeConfig.Devices[0].SelfDescribing);
+    ASSERT_ARE_EQUAL(char_ptr, "http://windows.com/coredevicehealth/v1", bridgeConfig.Devices[0].InterfaceId);
+    ASSERT_ARE_EQUAL(int, -1, bridgeConfig.Devices[0].PnpAdapterKey);
+    ASSERT_IS_NULL(bridgeConfig.Devices[0].DiscoveryParameters);
+
+    // Match parameters are sorted by name
+    ASSERT_ARE_EQUAL(int, 2, bridgeConfig.Devices[1].MatchParameterCount);
+    ASSERT_ARE_EQUAL(char_ptr, "hardware_id", bridgeConfig.Devices[1].MatchParameters[0].Name);
+    ASSERT_ARE_EQUAL(char_ptr, "serial", bridgeConfig.Devices[1].MatchParameters[1].Name);
+    ASSERT_ARE_EQUAL(char_ptr, "1234", bridgeConfig.Devices[1].MatchParameters[1].Value);
+
+    // Strings shared by devices are only copied once
+    ASSERT_ARE_EQUAL(void_ptr, bridgeConfig.Devices[0].PnpAdapterIdentity, bridgeConfig.Devices[2].PnpAdapterIdentity);
+    ASSERT_ARE_EQUAL(void_ptr, bridgeConfig.Devices[0].MatchParameters[0].Name, bridgeConfig.Devices[1].MatchParameters[0].Name);
+
+    ASSERT_IS_TRUE(bridgeConfig.Devices[2].SelfDescribing);
+    ASSERT_IS_NULL(bridgeConfig.Devices[2].InterfaceId);
+    ASSERT_ARE_EQUAL(char_ptr, "core-device-discovery", bridgeConfig.Devices[2].DiscoveryAdapterIdentity);
+    ASSERT_ARE_EQUAL(int, 12, (int)json_object_get_number(json_value_get_object(bridgeConfig.Devices[2].DiscoveryParameters), "port"));
+
+    PnpBridgeConfig_ReleaseConfiguration(&bridgeConfig);
+    ASSERT_IS_NULL(bridgeConfig.Devices);
+    ASSERT_IS_NULL(bridgeConfig.Strings);
+}
+
+TEST_FUNCTION(Configuration_DiffDevices_FindsTheUnchangedDevices)
+{
+    JSON_Array* devices;
+    JSON_Value* config = CreateTestConfig(&devices);
+    PNPBRIDGE_CONFIGURATION oldConfig = { 0 };
+    PNPBRIDGE_CONFIGURATION newConfig = { 0 };
+    JSON_Object* device;
+    int newToOld[3];
+    int changeCount;
+
+    CreateTestDevice(devices, "exact", "USB\\VID_045E");
+    CreateTestDevice(devices, "exact", "USB\\VID_045F");
+    device = CreateTestDevice(devices, NULL, NULL);
+    json_object_dotset_string(device, "discovery_parameters.identity", "core-device-discovery");
+    json_object_dotset_number(device, "discovery_parameters.port", 12);
+    CompileTestConfig(config, &oldConfig);
+
+    // The first device moves, the second is removed, the discovery parameters
+    // of the third change and a device is added
+    config = CreateTestConfig(&devices);
+    CreateTestDevice(devices, "exact", "USB\\VID_0460");
+    CreateTestDevice(devices, "exact", "USB\\VID_045E");
+    device = CreateTestDevice(devices, NULL, NULL);
+    json_object_dotset_string(device, "discovery_parameters.identity", "core-device-discovery");
+    json_object_dotset_number(device, "discovery_parameters.port", 13);
+    CompileTestConfig(config, &newConfig);
+
+    ASSERT_ARE_EQUAL(PNPBRIDGE_RESULT, PNPBRIDGE_OK, Configuration_DiffDevices(&oldConfig, &newConfig, newToOld, &changeCount));
+    ASSERT_ARE_EQUAL(int, -1, newToOld[0]);
+    ASSERT_ARE_EQUAL(int, 0, newToOld[1]);
+    ASSERT_ARE_EQUAL(int, -1, newToOld[2]);
+    ASSERT_ARE_EQUAL(int, 4, changeCount);
+
+    // A config is unchanged against itself
+    ASSERT_ARE_EQUAL(PNPBRIDGE_RESULT, PNPBRIDGE_OK, Configuration_DiffDevices(&newConfig, &newConfig, newToOld, &changeCount));
+    ASSERT_ARE_EQUAL(int, 2, newToOld[2]);
+    ASSERT_ARE_EQUAL(int, 0, changeCount);
+
+    PnpBridgeConfig_ReleaseConfiguration(&oldConfig);
+    PnpBridgeConfig_ReleaseConfiguration(&newConfig);
+}
+
+TEST_FUNCTION(Configuration_ExpandDeviceTemplates_DevicesOverrideTheirTemplate)
+{
+    JSON_Array* devices;
+    JSON_Value* config = CreateTestConfig(&devices);
+    JSON_Object* configObj = json_value_get_object(config);
+    JSON_Object* device;
+
+    json_object_dotset_string(configObj, "device_templates.meter.pnp_parameters.identity", "modbus-pnp-interface");
+    json_object_dotset_string(configObj, "device_templates.meter.self_describing", "true");
+    json_object_dotset_string(configObj, "device_templates.meter.discovery_parameters.identity", "modbus-pnp-discovery");
+    json_object_dotset_number(configObj, "device_templates.meter.discovery_parameters.deviceConfig.unitId", 1);
+    json_object_dotset_string(configObj, "device_templates.meter.discovery_parameters.deviceConfig.tcp.host", "10.0.0.1");
+    json_object_dotset_string(configObj, "device_templates.meter.discovery_parameters.interfaceConfig.interfaceId", "urn:test:meter:1");
+
+    device = CreateTestDevice(devices, NULL, NULL);
+    json_object_remove(device, "pnp_parameters");
+    json_object_remove(device, "interface_id");
+    json_object_set_string(device, "template", "meter");
+    json_object_dotset_number(device, "discovery_parameters.deviceConfig.unitId", 7);
+    CreateTestDevice(devices, NULL, NULL);
+
+    ASSERT_ARE_EQUAL(PNPBRIDGE_RESULT, PNPBRIDGE_OK, Configuration_ExpandDeviceTemplates(config));
+
+    // The device keeps its own unit id and takes everything else from the template
+    device = json_array_get_object(devices, 0);
+    ASSERT_IS_NULL(json_object_get_value(device, "template"));
+    ASSERT_ARE_EQUAL(char_ptr, "modbus-pnp-interface", json_object_dotget_string(device, "pnp_parameters.identity"));
+    ASSERT_ARE_EQUAL(char_ptr, "true", json_object_get_string(device, "self_describing"));
+    ASSERT_ARE_EQUAL(int, 7, (int)json_object_dotget_number(device, "discovery_parameters.deviceConfig.unitId"));
+    ASSERT_ARE_EQUAL(char_ptr, "10.0.0.1", json_object_dotget_string(device, "discovery_parameters.deviceConfig.tcp.host"));
+    ASSERT_ARE_EQUAL(char_ptr, "urn:test:meter:1", json_object_dotget_string(device, "discovery_parameters.interfaceConfig.interfaceId"));
+
+    // A device without a template is left alone
+    device = json_array_get_object(devices, 1);
+    ASSERT_ARE_EQUAL(char_ptr, "core-device-health", json_object_dotget_string(device, "pnp_parameters.identity"));
+    ASSERT_IS_NULL(json_object_get_value(device, "discovery_parameters"));
+
+    // A template that isn't defined is an error
+    device = CreateTestDevice(devices, NULL, NULL);
+    json_object_set_string(device, "template", "missing");
+    ASSERT_ARE_EQUAL(PNPBRIDGE_RESULT, PNPBRIDGE_INVALID_ARGS, Configuration_ExpandDeviceTemplates(config));
+
+    json_value_free(config);
+}
+
+TEST_FUNCTION(Configuration_IsDeviceConfigured_FirstMatchWins)
+{
+    JSON_Array* devices;
+    JSON_Value* config = CreateTestConfig(&devices);
+    JSON_Value* message = CreateTestMessage("USB\\VID_045E&PID_0779&REV_0100");
+    PNPBRIDGE_CONFIGURATION bridgeConfig = { 0 };
+    PPNPBRIDGE_DEVICE_CONFIG device;
+    PNPBRIDGE_RESULT result;
+
+    CreateTestDevice(devices, "equals", "USB\\VID_045E");
+    CreateTestDevice(devices, "exact", "USB\\VID_045E&PID_0779");
+    CreateTestDevice(devices, "equals", "USB\\VID_045E&PID_0779&REV_0100");
+    CreateTestDevice(devices, "exact", "USB\\VID_045E");
+
+    CompileTestConfig(config, &bridgeConfig);
+    result = Configuration_CreateDeviceIndex(bridgeConfig.Devices, bridgeConfig.DeviceCount, &bridgeConfig.DeviceIndex);
+    ASSERT_ARE_EQUAL(PNPBRIDGE_RESULT, PNPBRIDGE_OK, result);
+
+    // A substring match that comes first in the config wins over an equality match
+    result = Configuration_IsDeviceConfigured(&bridgeConfig, json_value_get_object(message), &device);
+    ASSERT_ARE_EQUAL(PNPBRIDGE_RESULT, PNPBRIDGE_OK, result);
+    ASSERT_ARE_EQUAL(void_ptr, &bridgeConfig.Devices[1], device);
+
+    // A device is not matched on a parameter that the message doesn't report
+    json_value_free(message);
+    message = json_value_init_object();
+    json_object_dotset_string(json_value_get_object(message), "match_parameters.symbolic_link", "USB\\VID_045E");
+    result = Configuration_IsDeviceConfigured(&bridgeConfig, json_value_get_object(message), &device);
+    ASSERT_ARE_EQUAL(PNPBRIDGE_RESULT, PNPBRIDGE_INVALID_ARGS, result);
+    ASSERT_IS_NULL(device);
+
+    PnpBridgeConfig_ReleaseConfiguration(&bridgeConfig);
+    json_value_free(message);
+}
+
+TEST_FUNCTION(Configuration_IsDeviceConfigured_Benchmark)
+{
+    JSON_Array* devices;
+    JSON_Value* config = CreateTestConfig(&devices);
+    PNPBRIDGE_CONFIGURATION indexedConfig = { 0 };
+    PNPBRIDGE_CONFIGURATION scannedConfig;
+    JSON_Value* messages[CONFIGURATION_BENCHMARK_LOOKUP_COUNT];
+    int expected[CONFIGURATION_BENCHMARK_LOOKUP_COUNT];
+    char hardwareId[64];
+    clock_t indexedTicks;
+    clock_t scannedTicks;
+
+    // Every 100th device is matched on a hardware id prefix
+    for (int i = 0; i < CONFIGURATION_BENCHMARK_DEVICE_COUNT; i++) {
+        GetTestHardwareId(hardwareId, sizeof(hardwareId), i);
+        if (0 == i % 100) {
+            CreateTestDevice(devices, "exact", hardwareId);
+        }
+        else {
+            CreateTestDevice(devices, "equals", hardwareId);
+        }
+    }
+
+    for (int i = 0; i < CONFIGURATION_BENCHMARK_LOOKUP_COUNT; i++) {
+        expected[i] = (i * 7919) % (CONFIGURATION_BENCHMARK_DEVICE_COUNT + 1000);
+        if (expected[i] >= CONFIGURATION_BENCHMARK_DEVICE_COUNT) {
+            // Not configured
+            GetTestHardwareId(hardwareId, sizeof(hardwareId), expected[i] + 100000);
+            expected[i] = -1;
+        }
+        else {
+            GetTestHardwareId(hardwareId, sizeof(hardwareId), expected[i]);
+            if (0 == expected[i] % 100) {
+                strcat(hardwareId, "&REV_0001");
+            }
+        }
+        messages[i] = CreateTestMessage(hardwareId);
+    }
+
+    CompileTestConfig(config, &indexedConfig);
+    ASSERT_ARE_EQUAL(PNPBRIDGE_RESULT, PNPBRIDGE_OK,
+                     Configuration_CreateDeviceIndex(indexedConfig.Devices, indexedConfig.DeviceCount, &indexedConfig.DeviceIndex));
+
+    // Same devices without the index
+    scannedConfig = indexedConfig;
+    scannedConfig.DeviceIndex = NULL;
+
+    indexedTicks = clock();
+    for (int i = 0; i < CONFIGURATION_BENCHMARK_LOOKUP_COUNT; i++) {
+        PPNPBRIDGE_DEVICE_CONFIG device;
+        PNPBRIDGE_RESULT result = Configuration_IsDeviceConfigured(&indexedConfig, json_value_get_object(messages[i]), &device);
+        if (expected[i] < 0) {
+            ASSERT_ARE_EQUAL(PNPBRIDGE_RESULT, PNPBRIDGE_INVALID_ARGS, result);
+        }
+        else {
+            ASSERT_ARE_EQUAL(PNPBRIDGE_RESULT, PNPBRIDGE_OK, result);
+            ASSERT_ARE_EQUAL(void_ptr, &indexedConfig.Devices[expected[i]], device);
+        }
+    }
+    indexedTicks = clock() - indexedTicks;
+
+    scannedTicks = clock();
+    for (int i = 0; i < CONFIGURATION_BENCHMARK_LOOKUP_COUNT; i++) {
+        PPNPBRIDGE_DEVICE_CONFIG device;
+        PNPBRIDGE_RESULT result = Configuration_IsDeviceConfigured(&scannedConfig, json_value_get_object(messages[i]), &device);
+        ASSERT_ARE_EQUAL(PNPBRIDGE_RESULT, expected[i] < 0 ? PNPBRIDGE_INVALID_ARGS : PNPBRIDGE_OK, result);
+    }
+    scannedTicks = clock() - scannedTicks;
+
+    LogInfo("%d lookups over %d devices: indexed %.3f ms, scanned %.3f ms",
+            CONFIGURATION_BENCHMARK_LOOKUP_COUNT, CONFIGURATION_BENCHMARK_DEVICE_COUNT,
+            indexedTicks * 1000.0 / CLOCKS_PER_SEC, scannedTicks * 1000.0 / CLOCKS_PER_SEC);
+
+    for (int i = 0; i < CONFIGURATION_BENCHMARK_LOOKUP_COUNT; i++) {
+        json_value_free(messages[i]);
+    }
+    PnpBridgeConfig_ReleaseConfiguration(&indexedConfig);
 }
 
 // TEST_FUNCTION(PnP_ModuleClient_CreateFromModuleHandle_NULL_handle_fails)
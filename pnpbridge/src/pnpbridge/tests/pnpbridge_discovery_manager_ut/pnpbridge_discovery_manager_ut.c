@@ -11,61 +11,172 @@
 #include <stdint.h>
 #endif
 
-static void* my_gballoc_malloc(size_t size)
+#include "testrunnerswitcher.h"
+
+#include "pnpbridge.h"
+#include "pnpbridge_common.h"
+#include "discoveryadapter_manager.h"
+
+#define TEST_DISCOVERY_MAX_DEVICES 4
+#define TEST_DISCOVERY_MAX_VALUE 64
+
+// Config with two devices for the parsed parameters adapter and one for the
+// adapter that takes json strings
+static const char* g_testConfig =
+    "{"
+    "  \"pnp_bridge_parameters\": {"
+    "    \"connection_parameters\": {"
+    "      \"connection_type\": \"connection_string\","
+    "      \"device_capability_model_uri\": \"http://contoso.com/SensorDevice/1\","
+    "      \"connection_string\": \"HostName=test.azure-devices.net;DeviceId=test\","
+    "      \"auth_parameters\": { \"auth_type\": \"symmetric_key\", \"symmetric_key\": \"a2V5\" }"
+    "    }"
+    "  },"
+    "  \"devices\": ["
+    "    {"
+    "      \"match_filters\": { \"match_type\": \"equals\", \"match_parameters\": { \"sensor_id\": \"10\" } },"
+    "      \"interface_id\": \"http://contoso.com/Sensor/1\","
+    "      \"pnp_parameters\": { \"identity\": \"test-pnp-adapter\" },"
+    "      \"discovery_parameters\": { \"identity\": \"test-parsed-discovery-adapter\", \"sensor_id\": \"10\" }"
+    "    },"
+    "    {"
+    "      \"match_filters\": { \"match_type\": \"equals\", \"match_parameters\": { \"sensor_id\": \"11\" } },"
+    "      \"interface_id\": \"http://contoso.com/Sensor/1\","
+    "      \"pnp_parameters\": { \"identity\": \"test-pnp-adapter\" },"
+    "      \"discovery_parameters\": { \"identity\": \"test-parsed-discovery-adapter\", \"sensor_id\": \"11\" }"
+    "    },"
+    "    {"
+    "      \"match_filters\": { \"match_type\": \"equals\", \"match_parameters\": { \"sensor_id\": \"20\" } },"
+    "      \"interface_id\": \"http://contoso.com/Sensor/1\","
+    "      \"pnp_parameters\": { \"identity\": \"test-pnp-adapter\" },"
+    "      \"discovery_parameters\": { \"identity\": \"test-serialized-discovery-adapter\", \"sensor_id\": \"20\" }"
+    "    }"
+    "  ],"
+    "  \"discovery_adapters\": {"
+    "    \"parameters\": ["
+    "      { \"identity\": \"test-parsed-discovery-adapter\", \"poll_interval\": 5 },"
+    "      { \"identity\": \"test-serialized-discovery-adapter\", \"poll_interval\": 7 }"
+    "    ]"
+    "  }"
+    "}";
+
+// What a test adapter was handed by StartDiscovery. The parameters are only
+// valid while it runs, so they are copied.
+typedef struct _TEST_DISCOVERY_CALL {
+    int StartCount;
+    int StopCount;
+    int DeviceCount;
+    char SensorIds[TEST_DISCOVERY_MAX_DEVICES][TEST_DISCOVERY_MAX_VALUE];
+    int PollInterval;
+    bool Serialized;
+} TEST_DISCOVERY_CALL;
+
+static TEST_DISCOVERY_CALL g_parsedCall;
+static TEST_DISCOVERY_CALL g_serializedCall;
+
+static void TestDiscovery_CopySensorId(TEST_DISCOVERY_CALL* call, int index, const JSON_Object* params)
 {
-    return malloc(size);
+    const char* sensorId = json_object_get_string(params, "sensor_id");
+    (void)snprintf(call->SensorIds[index], TEST_DISCOVERY_MAX_VALUE, "%s", (NULL != sensorId) ? sensorId : "");
 }
 
-static void* my_gballoc_calloc(size_t num, size_t size)
+static int TestParsedDiscovery_Start(PNPMEMORY deviceArgs, PNPMEMORY adapterArgs)
 {
-    return calloc(num, size);
+    g_parsedCall.StartCount++;
+
+    for (int i = 0; i < TEST_DISCOVERY_MAX_DEVICES; i++) {
+        const JSON_Object* params = DiscoveryAdapter_GetDeviceParameters(deviceArgs, i);
+        if (NULL == params) {
+            break;
+        }
+
+        // Parsed adapters don't pay for the json strings
+        g_parsedCall.Serialized = g_parsedCall.Serialized ||
+            (NULL != ((PDEVICE_ADAPTER_PARMAETERS)PnpMemory_GetBuffer(deviceArgs, NULL))->AdapterParameters[i]);
+        TestDiscovery_CopySensorId(&g_parsedCall, i, params);
+        g_parsedCall.DeviceCount++;
+    }
+
+    g_parsedCall.PollInterval = (int)json_object_get_number(DiscoveryAdapter_GetAdapterParameters(adapterArgs), "poll_interval");
+
+    return 0;
 }
 
-static void my_gballoc_free(void* ptr)
+static int TestParsedDiscovery_Stop()
 {
-    free(ptr);
+    g_parsedCall.StopCount++;
+    return 0;
 }
 
-#include "testrunnerswitcher.h"
+static int TestSerializedDiscovery_Start(PNPMEMORY deviceArgs, PNPMEMORY adapterArgs)
+{
+    PDEVICE_ADAPTER_PARMAETERS deviceParams = (PDEVICE_ADAPTER_PARMAETERS)PnpMemory_GetBuffer(deviceArgs, NULL);
 
-#include "azure_c_shared_utility/macro_utils.h"
-#include "umock_c.h"
-#include "umock_c_negative_tests.h"
-#include "../../../serializer/tests/serializer_dt_ut/real_crt_abstractions.h"
+    g_serializedCall.StartCount++;
+    g_serializedCall.Serialized = true;
 
-#define ENABLE_MOCKS
-#include "azure_c_shared_utility/crt_abstractions.h"
-#include "azure_c_shared_utility/strings.h"
-#include "iothub_module_client.h"
+    for (int i = 0; i < deviceParams->Count && i < TEST_DISCOVERY_MAX_DEVICES; i++) {
+        JSON_Value* params = json_parse_string(deviceParams->AdapterParameters[i]);
+        ASSERT_IS_NOT_NULL(params);
+        TestDiscovery_CopySensorId(&g_serializedCall, i, json_value_get_object(params));
+        json_value_free(params);
+        g_serializedCall.DeviceCount++;
+    }
 
+    JSON_Value* adapterParams = json_parse_string((const char*)PnpMemory_GetBuffer(adapterArgs, NULL));
+    ASSERT_IS_NOT_NULL(adapterParams);
+    g_serializedCall.PollInterval = (int)json_object_get_number(json_value_get_object(adapterParams), "poll_interval");
+    json_value_free(adapterParams);
 
-//#include "pnp_module_client.h"
+    return 0;
+}
 
-#include "pnpbridge.h"
-#include "pnpbridge_common.h"
-#include "discoveryadapter_manager.h"
-#undef ENABLE_MOCKS
+static int TestSerializedDiscovery_Stop()
+{
+    g_serializedCall.StopCount++;
+    return 0;
+}
+
+DISCOVERY_ADAPTER TestParsedDiscovery = {
+    .Identity = "test-parsed-discovery-adapter",
+    .StartDiscovery = TestParsedDiscovery_Start,
+    .StopDiscovery = TestParsedDiscovery_Stop,
+    .Flags = DISCOVERY_ADAPTER_FLAG_PARSED_PARAMETERS
+};
 
-DISCOVERY_ADAPTER EnvironmentSensorDiscovery = {
-    .Identity = "environment-sensor-sample-discovery-adapter",
-    .StartDiscovery = NULL,
-    .StopDiscovery = NULL
+DISCOVERY_ADAPTER TestSerializedDiscovery = {
+    .Identity = "test-serialized-discovery-adapter",
+    .StartDiscovery = TestSerializedDiscovery_Start,
+    .StopDiscovery = TestSerializedDiscovery_Stop,
+    .Flags = 0
 };
 
 PDISCOVERY_ADAPTER DISCOVERY_ADAPTER_MANIFEST[] = {
-    &EnvironmentSensorDiscovery
+    &TestParsedDiscovery,
+    &TestSerializedDiscovery
 };
 
 const int DiscoveryAdapterCount = sizeof(DISCOVERY_ADAPTER_MANIFEST) / sizeof(PDISCOVERY_ADAPTER);
 
-static void on_umock_c_error(UMOCK_C_ERROR_CODE error_code)
+// The discovery manager hands reported devices to the bridge, which this test
+// doesn't run
+int PnpBridge_ProcessPnpMessage(PNPMESSAGE DeviceChangePayload)
 {
-    char temp_str[256];
-    (void)snprintf(temp_str, sizeof(temp_str), "umock_c reported error :%s", MU_ENUM_TO_STRING(UMOCK_C_ERROR_CODE, error_code));
-    ASSERT_FAIL(temp_str);
+    (void)DeviceChangePayload;
+    return 0;
 }
 
-MU_DEFINE_ENUM_STRINGS(UMOCK_C_ERROR_CODE, UMOCK_C_ERROR_CODE_VALUES)
+// The connection parameters point into the returned document, which is freed
+// after the configuration is released
+static JSON_Value* ParseTestConfig(PNPBRIDGE_CONFIGURATION* bridgeConfig)
+{
+    JSON_Value* config = json_parse_string(g_testConfig);
+    ASSERT_IS_NOT_NULL(config);
+
+    ASSERT_ARE_EQUAL(int, PNPBRIDGE_OK, PnpBridgeConfig_RetrieveConfiguration(config, bridgeConfig));
+
+    return config;
+}
 
 BEGIN_TEST_SUITE(pnpbridge_discovery_manager_ut)
 
@@ -75,42 +186,90 @@ TEST_SUITE_INITIALIZE(suite_init)
 
 TEST_FUNCTION_INITIALIZE(TestMethodInit)
 {
-    umock_c_reset_all_calls();
+    memset(&g_parsedCall, 0, sizeof(g_parsedCall));
+    memset(&g_serializedCall, 0, sizeof(g_serializedCall));
 }
 
 TEST_FUNCTION_CLEANUP(TestMethodCleanup)
 {
-    //;
 }
 
-static void set_expected_calls_for_PnpAdapterManager_InitializeAdapter()
+TEST_FUNCTION(PnpAdapterManager_InitializeAdapter_ok)
 {
-    //STRICT_EXPECTED_CALL(PnP_ClientCore_Create(IGNORED_PTR_ARG));
+    // arrange
+    PDISCOVERY_MANAGER discoveryMgr = NULL;
+
+    //act
+    PNPBRIDGE_RESULT result = DiscoveryAdapterManager_Create(&discoveryMgr);
+
+    //assert
+    ASSERT_ARE_EQUAL(int, PNPBRIDGE_OK, result);
+    ASSERT_IS_NOT_NULL(discoveryMgr);
+
+    //cleanup
+    DiscoveryAdapterManager_Release(discoveryMgr);
+    ASSERT_ARE_EQUAL(int, 0, g_parsedCall.StopCount);
 }
 
-///////////////////////////////////////////////////////////////////////////////
-// PnpAdapterManager_InitializeAdapter
-///////////////////////////////////////////////////////////////////////////////
-TEST_FUNCTION(PnpAdapterManager_InitializeAdapter_ok)
+TEST_FUNCTION(DiscoveryAdapterManager_Start_PassesParsedParameters)
 {
     // arrange
-    //PPNP_ADAPTER_TAG h;
-    //PPNP_ADAPTER pnpAdapter;
-    
-    PDISCOVERY_MANAGER discoveryMgr;
-    PNPBRIDGE_RESULT result;
-    //set_expected_calls_for_PnpAdapterManager_InitializeAdapter();
+    PNPBRIDGE_CONFIGURATION bridgeConfig = { 0 };
+    PDISCOVERY_MANAGER discoveryMgr = NULL;
+    JSON_Value* config = ParseTestConfig(&bridgeConfig);
+
+    ASSERT_ARE_EQUAL(int, PNPBRIDGE_OK, DiscoveryAdapterManager_Create(&discoveryMgr));
 
     //act
-    result = DiscoveryAdapterManager_Create(&discoveryMgr);
+    PNPBRIDGE_RESULT result = DiscoveryAdapterManager_Start(discoveryMgr, &bridgeConfig);
+
+    //assert
+    ASSERT_ARE_EQUAL(int, PNPBRIDGE_OK, result);
+    ASSERT_ARE_EQUAL(int, 1, g_parsedCall.StartCount);
+    ASSERT_ARE_EQUAL(int, 2, g_parsedCall.DeviceCount);
+    ASSERT_ARE_EQUAL(char_ptr, "10", g_parsedCall.SensorIds[0]);
+    ASSERT_ARE_EQUAL(char_ptr, "11", g_parsedCall.SensorIds[1]);
+    ASSERT_ARE_EQUAL(int, 5, g_parsedCall.PollInterval);
+    ASSERT_IS_FALSE(g_parsedCall.Serialized);
 
-    //assert    
-    ASSERT_IS_NOT_NULL(discoveryMgr);
-    //ASSERT_ARE_EQUAL(PNPBRIDGE_RESULT, result, PNPBRIDGE_OK);
-        
     //cleanup
     DiscoveryAdapterManager_Release(discoveryMgr);
+    ASSERT_ARE_EQUAL(int, 1, g_parsedCall.StopCount);
+    PnpBridgeConfig_ReleaseConfiguration(&bridgeConfig);
+    json_value_free(config);
 }
 
-END_TEST_SUITE(pnpbridge_discovery_manager_ut)
+TEST_FUNCTION(DiscoveryAdapterManager_Start_SerializesParametersForOtherAdapters)
+{
+    // arrange
+    PNPBRIDGE_CONFIGURATION bridgeConfig = { 0 };
+    PDISCOVERY_MANAGER discoveryMgr = NULL;
+    JSON_Value* config = ParseTestConfig(&bridgeConfig);
+
+    ASSERT_ARE_EQUAL(int, PNPBRIDGE_OK, DiscoveryAdapterManager_Create(&discoveryMgr));
+
+    //act
+    PNPBRIDGE_RESULT result = DiscoveryAdapterManager_Start(discoveryMgr, &bridgeConfig);
+
+    //assert
+    ASSERT_ARE_EQUAL(int, PNPBRIDGE_OK, result);
+    ASSERT_ARE_EQUAL(int, 1, g_serializedCall.StartCount);
+    ASSERT_ARE_EQUAL(int, 1, g_serializedCall.DeviceCount);
+    ASSERT_ARE_EQUAL(char_ptr, "20", g_serializedCall.SensorIds[0]);
+    ASSERT_ARE_EQUAL(int, 7, g_serializedCall.PollInterval);
+
+    //cleanup
+    DiscoveryAdapterManager_Release(discoveryMgr);
+    ASSERT_ARE_EQUAL(int, 1, g_serializedCall.StopCount);
+    PnpBridgeConfig_ReleaseConfiguration(&bridgeConfig);
+    json_value_free(config);
+}
 
+TEST_FUNCTION(DiscoveryAdapter_GetDeviceParameters_InvalidArguments)
+{
+    //assert
+    ASSERT_IS_NULL(DiscoveryAdapter_GetDeviceParameters(NULL, 0));
+    ASSERT_IS_NULL(DiscoveryAdapter_GetAdapterParameters(NULL));
+}
+
+END_TEST_SUITE(pnpbridge_discovery_manager_ut)
@@ -0,0 +1,230 @@
+// Copyright (c) Microsoft. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#ifdef __cplusplus
+#include <cstdlib>
+#include <cstddef>
+#include <cstdint>
+#else
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#endif
+
+#include "testrunnerswitcher.h"
+
+#include "pnpbridge.h"
+#include "pnpbridge_common.h"
+
+#define TEST_JOURNAL_PATH "pnpbridge_journal_ut.journal"
+#define TEST_JOURNAL_SIZE PNPBRIDGE_JOURNAL_MIN_SIZE_BYTES
+#define MAX_REPLAYED 8
+
+static PNPBRIDGE_JOURNAL_ENTRY g_replayed[MAX_REPLAYED];
+static int g_replayedCount;
+
+static void Journal_Collect(void* context, const PNPBRIDGE_JOURNAL_ENTRY* entry)
+{
+    AZURE_UNREFERENCED_PARAMETER(context);
+
+    if (g_replayedCount < MAX_REPLAYED) {
+        g_replayed[g_replayedCount] = *entry;
+    }
+    g_replayedCount++;
+}
+
+static PNPBRIDGE_JOURNAL_HANDLE Journal_Reopen(void)
+{
+    PNPBRIDGE_JOURNAL_HANDLE journal = NULL;
+
+    ASSERT_ARE_EQUAL(int, PNPBRIDGE_OK, PnpJournal_Open(TEST_JOURNAL_PATH, TEST_JOURNAL_SIZE, &journal));
+    ASSERT_IS_NOT_NULL(journal);
+
+    g_replayedCount = 0;
+    ASSERT_ARE_EQUAL(int, PnpJournal_Replay(journal, Journal_Collect, NULL), g_replayedCount);
+
+    return journal;
+}
+
+static void Journal_RecordDevice(PNPBRIDGE_JOURNAL_HANDLE journal, const char* interfaceId, const char* componentName, const char* message)
+{
+    PNPBRIDGE_JOURNAL_ENTRY entry = { 0 };
+
+    entry.AdapterIdentity = "test-adapter";
+    entry.InterfaceId = interfaceId;
+    entry.ComponentName = componentName;
+    entry.Message = message;
+    ASSERT_ARE_EQUAL(int, PNPBRIDGE_OK, PnpJournal_Record(journal, &entry));
+}
+
+BEGIN_TEST_SUITE(pnpbridge_journal_ut)
+
+TEST_FUNCTION_INITIALIZE(method_init)
+{
+    remove(TEST_JOURNAL_PATH);
+}
+
+TEST_SUITE_CLEANUP(suite_cleanup)
+{
+    remove(TEST_JOURNAL_PATH);
+}
+
+TEST_FUNCTION(PnpJournal_Record_IsReplayedAfterReopen)
+{
+    // arrange
+    PNPBRIDGE_JOURNAL_HANDLE journal = Journal_Reopen();
+    ASSERT_ARE_EQUAL(int, 0, g_replayedCount);
+
+    Journal_RecordDevice(journal, "http://test/sensor/1", "sensor1", "{\"id\":1}");
+    Journal_RecordDevice(journal, "http://test/sensor/2", NULL, "{\"id\":2}");
+
+    // Devices recorded in this run aren't replayed in it
+    g_replayedCount = 0;
+    ASSERT_ARE_EQUAL(int, 0, PnpJournal_Replay(journal, Journal_Collect, NULL));
+    PnpJournal_Close(journal);
+
+    //act
+    journal = Journal_Reopen();
+
+    //assert
+    ASSERT_ARE_EQUAL(int, 2, g_replayedCount);
+    ASSERT_ARE_EQUAL(char_ptr, "test-adapter", g_replayed[0].AdapterIdentity);
+    ASSERT_ARE_EQUAL(char_ptr, "http://test/sensor/1", g_replayed[0].InterfaceId);
+    ASSERT_ARE_EQUAL(char_ptr, "sensor1", g_replayed[0].ComponentName);
+    ASSERT_ARE_EQUAL(char_ptr, "{\"id\":1}", g_replayed[0].Message);
+    ASSERT_ARE_EQUAL(char_ptr, "http://test/sensor/2", g_replayed[1].InterfaceId);
+    ASSERT_IS_NULL(g_replayed[1].ComponentName);
+    ASSERT_ARE_EQUAL(char_ptr, "{\"id\":2}", g_replayed[1].Message);
+
+    PnpJournal_Close(journal);
+}
+
+TEST_FUNCTION(PnpJournal_Confirm_ReturnsTrueOnceForReplayedDevices)
+{
+    // arrange
+    PNPBRIDGE_JOURNAL_HANDLE journal = Journal_Reopen();
+    Journal_RecordDevice(journal, "http://test/sensor/1", "sensor1", "{\"id\":1}");
+
+    // A device recorded in this run isn't pending
+    ASSERT_IS_FALSE(PnpJournal_Confirm(journal, "http://test/sensor/1"));
+    PnpJournal_Close(journal);
+
+    journal = Journal_Reopen();
+
+    //act
+    bool first = PnpJournal_Confirm(journal, "http://test/sensor/1");
+    bool second = PnpJournal_Confirm(journal, "http://test/sensor/1");
+
+    //assert
+    ASSERT_IS_TRUE(first);
+    ASSERT_IS_FALSE(second);
+    ASSERT_IS_FALSE(PnpJournal_Confirm(journal, "http://test/unknown"));
+
+    PnpJournal_Close(journal);
+}
+
+TEST_FUNCTION(PnpJournal_Record_ReplacesTheRecordOfTheSameInterface)
+{
+    // arrange
+    PNPBRIDGE_JOURNAL_HANDLE journal = Journal_Reopen();
+    Journal_RecordDevice(journal, "http://test/sensor/1", "sensor1", "{\"id\":1}");
+
+    //act
+    Journal_RecordDevice(journal, "http://test/sensor/1", "sensor1", "{\"id\":1,\"port\":2}");
+    PnpJournal_Close(journal);
+    journal = Journal_Reopen();
+
+    //assert
+    ASSERT_ARE_EQUAL(int, 1, g_replayedCount);
+    ASSERT_ARE_EQUAL(char_ptr, "{\"id\":1,\"port\":2}", g_replayed[0].Message);
+
+    PnpJournal_Close(journal);
+}
+
+TEST_FUNCTION(PnpJournal_Open_DropsDevicesThatAreNotDiscovered)
+{
+    // arrange
+    PNPBRIDGE_JOURNAL_HANDLE journal = Journal_Reopen();
+    Journal_RecordDevice(journal, "http://test/sensor/1", "sensor1", "{\"id\":1}");
+    Journal_RecordDevice(journal, "http://test/sensor/2", "sensor2", "{\"id\":2}");
+    PnpJournal_Close(journal);
+
+    //act
+    // Only the first device is discovered in the following runs
+    for (int run = 0; run < 3; run++) {
+        journal = Journal_Reopen();
+        ASSERT_ARE_EQUAL(int, 2, g_replayedCount);
+        ASSERT_IS_TRUE(PnpJournal_Confirm(journal, "http://test/sensor/1"));
+        PnpJournal_Close(journal);
+    }
+
+    journal = Journal_Reopen();
+
+    //assert
+    ASSERT_ARE_EQUAL(int, 1, g_replayedCount);
+    ASSERT_ARE_EQUAL(char_ptr, "http://test/sensor/1", g_replayed[0].InterfaceId);
+
+    PnpJournal_Close(journal);
+}
+
+TEST_FUNCTION(PnpJournal_Open_IgnoresATruncatedRecord)
+{
+    // arrange
+    PNPBRIDGE_JOURNAL_HANDLE journal = Journal_Reopen();
+    Journal_RecordDevice(journal, "http://test/sensor/1", "sensor1", "{\"id\":1}");
+    PnpJournal_Close(journal);
+
+    // Pretend the bridge died after moving Used past a record it didn't write
+    uint32_t header[4];
+    FILE* file = fopen(TEST_JOURNAL_PATH, "r+b");
+    ASSERT_IS_NOT_NULL(file);
+    ASSERT_ARE_EQUAL(size_t, 1, fread(header, sizeof(header), 1, file));
+    header[2] += 64;
+    ASSERT_ARE_EQUAL(int, 0, fseek(file, 0, SEEK_SET));
+    ASSERT_ARE_EQUAL(size_t, 1, fwrite(header, sizeof(header), 1, file));
+    fclose(file);
+
+    //act
+    journal = Journal_Reopen();
+
+    //assert
+    ASSERT_ARE_EQUAL(int, 1, g_replayedCount);
+    ASSERT_ARE_EQUAL(char_ptr, "http://test/sensor/1", g_replayed[0].InterfaceId);
+
+    // The journal still accepts records after the truncated one was dropped
+    Journal_RecordDevice(journal, "http://test/sensor/2", "sensor2", "{\"id\":2}");
+    PnpJournal_Close(journal);
+    journal = Journal_Reopen();
+    ASSERT_ARE_EQUAL(int, 2, g_replayedCount);
+
+    PnpJournal_Close(journal);
+}
+
+TEST_FUNCTION(PnpJournal_Confirm_StopsAtACorruptRecord)
+{
+    // arrange
+    PNPBRIDGE_JOURNAL_HANDLE journal = Journal_Reopen();
+    Journal_RecordDevice(journal, "http://test/sensor/1", "sensor1", "{\"id\":1}");
+
+    // Tear the strings of the record while the journal is open, so that none
+    // of them is terminated. They follow the journal and record headers, which
+    // are 16 bytes each.
+    char torn[52];
+    memset(torn, 'x', sizeof(torn));
+    FILE* file = fopen(TEST_JOURNAL_PATH, "r+b");
+    ASSERT_IS_NOT_NULL(file);
+    ASSERT_ARE_EQUAL(int, 0, fseek(file, 32, SEEK_SET));
+    ASSERT_ARE_EQUAL(size_t, 1, fwrite(torn, sizeof(torn), 1, file));
+    fclose(file);
+
+    //act
+    bool pending = PnpJournal_Confirm(journal, "http://test/sensor/1");
+
+    //assert
+    ASSERT_IS_FALSE(pending);
+    Journal_RecordDevice(journal, "http://test/sensor/2", "sensor2", "{\"id\":2}");
+
+    PnpJournal_Close(journal);
+}
+
+END_TEST_SUITE(pnpbridge_journal_ut)
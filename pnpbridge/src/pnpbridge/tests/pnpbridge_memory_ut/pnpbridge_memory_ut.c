@@ -0,0 +1,323 @@
+// Copyright (c) Microsoft. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#ifdef __cplusplus
+#include <cstdlib>
+#include <cstddef>
+#include <cstdint>
+#else
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#endif
+
+#include "testrunnerswitcher.h"
+
+#include "pnpbridge.h"
+#include "pnpbridge_common.h"
+
+#define REUSE_ITERATIONS 1000
+#define THREAD_COUNT 4
+#define BLOCKS_PER_THREAD 256
+#define BENCHMARK_ITERATIONS 1000000
+#define BUDGET_BLOCKS 64
+#define BUDGET_BLOCK_SIZE 1024
+
+// Payload sizes of a PNPMESSAGE, a device argument blob and an oversized block
+static const int g_benchmarkSizes[] = { sizeof(PNPBRIDGE_CHANGE_PAYLOAD), 400, 8192 };
+
+static TICK_COUNTER_HANDLE g_tickCounter;
+static PNPMEMORY g_blocks[THREAD_COUNT][BLOCKS_PER_THREAD];
+
+static int Allocator_Worker(void* context)
+{
+    int thread = (int)(intptr_t)context;
+
+    for (int i = 0; i < BLOCKS_PER_THREAD; i++) {
+        if (0 != PnpMemory_Create(NULL, 64 + i, &g_blocks[thread][i])) {
+            g_blocks[thread][i] = NULL;
+        }
+    }
+
+    return 0;
+}
+
+static double Benchmark_PnpMemory(int size)
+{
+    tickcounter_ms_t start = 0;
+    tickcounter_ms_t end = 0;
+    PNPMEMORY memory = NULL;
+
+    tickcounter_get_current_ms(g_tickCounter, &start);
+    for (int i = 0; i < BENCHMARK_ITERATIONS; i++) {
+        (void)PnpMemory_Create(NULL, size, &memory);
+        PnpMemory_ReleaseReference(memory);
+    }
+    tickcounter_get_current_ms(g_tickCounter, &end);
+
+    return (double)(end - start) * 1000000.0 / BENCHMARK_ITERATIONS;
+}
+
+static double Benchmark_Calloc(int size)
+{
+    tickcounter_ms_t start = 0;
+    tickcounter_ms_t end = 0;
+    void* volatile memory = NULL;
+
+    tickcounter_get_current_ms(g_tickCounter, &start);
+    for (int i = 0; i < BENCHMARK_ITERATIONS; i++) {
+        memory = calloc(1, sizeof(PNPBRIDGE_MEMORY_TAG) + size);
+        free(memory);
+    }
+    tickcounter_get_current_ms(g_tickCounter, &end);
+
+    return (double)(end - start) * 1000000.0 / BENCHMARK_ITERATIONS;
+}
+
+BEGIN_TEST_SUITE(pnpbridge_memory_ut)
+
+TEST_SUITE_INITIALIZE(suite_init)
+{
+    g_tickCounter = tickcounter_create();
+    ASSERT_IS_NOT_NULL(g_tickCounter);
+}
+
+TEST_SUITE_CLEANUP(suite_cleanup)
+{
+    tickcounter_destroy(g_tickCounter);
+}
+
+TEST_FUNCTION(PnpMemory_Create_ReturnsZeroedBuffer)
+{
+    // arrange
+    PNPMEMORY memory = NULL;
+    int size = 0;
+
+    // Leave a dirty block in the pool
+    ASSERT_ARE_EQUAL(int, 0, PnpMemory_Create(NULL, 100, &memory));
+    memset(PnpMemory_GetBuffer(memory, NULL), 0xA5, 100);
+    PnpMemory_ReleaseReference(memory);
+
+    //act
+    ASSERT_ARE_EQUAL(int, 0, PnpMemory_Create(NULL, 100, &memory));
+
+    //assert
+    unsigned char* buffer = (unsigned char*)PnpMemory_GetBuffer(memory, &size);
+    ASSERT_ARE_EQUAL(int, 100, size);
+    for (int i = 0; i < size; i++) {
+        ASSERT_ARE_EQUAL(int, 0, buffer[i]);
+    }
+
+    PnpMemory_ReleaseReference(memory);
+}
+
+TEST_FUNCTION(PnpMemory_ReleasedBlocks_AreReused)
+{
+    // arrange
+    PNPMEMORY_STATISTICS before;
+    PNPMEMORY_STATISTICS after;
+    PNPMEMORY memory = NULL;
+
+    PnpMemory_GetStatistics(&before);
+
+    //act
+    for (int i = 0; i < REUSE_ITERATIONS; i++) {
+        ASSERT_ARE_EQUAL(int, 0, PnpMemory_Create(NULL, sizeof(PNPBRIDGE_CHANGE_PAYLOAD), &memory));
+        PnpMemory_ReleaseReference(memory);
+    }
+
+    //assert
+    PnpMemory_GetStatistics(&after);
+#ifndef PNPBRIDGE_MEMORY_USE_MALLOC
+    ASSERT_IS_TRUE(after.Hits - before.Hits >= REUSE_ITERATIONS - 1);
+    ASSERT_IS_TRUE(after.Misses - before.Misses <= 1);
+    ASSERT_IS_TRUE(after.ResidentBytes - before.ResidentBytes <= 4096);
+#else
+    ASSERT_ARE_EQUAL(long, REUSE_ITERATIONS, after.Misses - before.Misses);
+#endif
+}
+
+TEST_FUNCTION(PnpMemory_ReleasedOnOtherThread_ResidentBytesStayBounded)
+{
+    // arrange
+    THREAD_HANDLE workers[THREAD_COUNT];
+    PNPMEMORY_STATISTICS first;
+    PNPMEMORY_STATISTICS second;
+    long roundBytes = 0;
+
+    for (int j = 0; j < BLOCKS_PER_THREAD; j++) {
+        roundBytes += THREAD_COUNT * (long)(sizeof(PNPBRIDGE_MEMORY_TAG) + 64 + j);
+    }
+
+    //act
+    // Blocks are allocated on worker threads, which exit, and released here
+    for (int round = 0; round < 2; round++) {
+        for (int i = 0; i < THREAD_COUNT; i++) {
+            ASSERT_ARE_EQUAL(int, THREADAPI_OK, ThreadAPI_Create(&workers[i], Allocator_Worker, (void*)(intptr_t)i));
+        }
+
+        for (int i = 0; i < THREAD_COUNT; i++) {
+            ThreadAPI_Join(workers[i], NULL);
+        }
+
+        for (int i = 0; i < THREAD_COUNT; i++) {
+            for (int j = 0; j < BLOCKS_PER_THREAD; j++) {
+                ASSERT_IS_NOT_NULL(g_blocks[i][j]);
+                PnpMemory_ReleaseReference(g_blocks[i][j]);
+            }
+        }
+
+        PnpMemory_GetStatistics(0 == round ? &first : &second);
+    }
+
+    //assert
+#ifndef PNPBRIDGE_MEMORY_USE_MALLOC
+    // The second round is partly served from the blocks released in the
+    // first one, and the pools give back what exceeds their cache limits
+    ASSERT_IS_TRUE(second.Misses - first.Misses < THREAD_COUNT * BLOCKS_PER_THREAD);
+    ASSERT_IS_TRUE(second.ResidentBytes < roundBytes);
+#else
+    ASSERT_ARE_EQUAL(long, THREAD_COUNT * BLOCKS_PER_THREAD, second.Misses - first.Misses);
+#endif
+}
+
+TEST_FUNCTION(PnpMemory_AllocFree_Benchmark)
+{
+    for (size_t i = 0; i < sizeof(g_benchmarkSizes) / sizeof(g_benchmarkSizes[0]); i++) {
+        //act
+        double pooled = Benchmark_PnpMemory(g_benchmarkSizes[i]);
+        double heap = Benchmark_Calloc(g_benchmarkSizes[i]);
+
+        //assert
+        LogInfo("PnpMemory_Create/Release of %d bytes: %.1f ns, calloc/free: %.1f ns",
+                g_benchmarkSizes[i], pooled, heap);
+    }
+}
+
+TEST_FUNCTION(PnpMemory_TaggedAllocations_AreAccountedToTheirTag)
+{
+    // arrange
+    PNPMEMORY_TAG_STATISTICS before;
+    PNPMEMORY_TAG_STATISTICS grown;
+    PNPMEMORY_TAG_STATISTICS after;
+    PNPMEMORY_TAG_STATISTICS other;
+    void* blocks[16];
+
+    ASSERT_ARE_EQUAL(int, 0, PnpMemory_GetTagStatistics(PNPMEMORY_TAG_SERIAL_ADAPTER, &before));
+
+    //act
+    for (int i = 0; i < 16; i++) {
+        blocks[i] = PnpMemory_TaggedMalloc(PNPMEMORY_TAG_SERIAL_ADAPTER, 100);
+        ASSERT_IS_NOT_NULL(blocks[i]);
+    }
+    blocks[0] = PnpMemory_TaggedRealloc(PNPMEMORY_TAG_SERIAL_ADAPTER, blocks[0], 1000);
+    ASSERT_IS_NOT_NULL(blocks[0]);
+    PnpMemory_GetTagStatistics(PNPMEMORY_TAG_SERIAL_ADAPTER, &grown);
+
+    for (int i = 0; i < 16; i++) {
+        PnpMemory_TaggedFree(blocks[i]);
+    }
+    PnpMemory_GetTagStatistics(PNPMEMORY_TAG_SERIAL_ADAPTER, &after);
+    PnpMemory_GetTagStatistics(PNPMEMORY_TAG_MODBUS_ADAPTER, &other);
+
+    //assert
+    ASSERT_ARE_EQUAL(long, 15 * 100 + 1000, grown.CurrentBytes - before.CurrentBytes);
+    ASSERT_IS_TRUE(grown.PeakBytes >= grown.CurrentBytes);
+    ASSERT_ARE_EQUAL(long, before.CurrentBytes, after.CurrentBytes);
+    ASSERT_ARE_EQUAL(long, grown.PeakBytes, after.PeakBytes);
+    ASSERT_ARE_EQUAL(long, 17, after.Allocations - before.Allocations);
+    ASSERT_ARE_EQUAL(long, 17, after.Frees - before.Frees);
+    ASSERT_ARE_EQUAL(long, 0, other.CurrentBytes);
+}
+
+TEST_FUNCTION(PnpMemory_TaggedFree_AcceptsUntrackedBlocks)
+{
+    // arrange
+    PNPMEMORY_TAG_STATISTICS before;
+    PNPMEMORY_TAG_STATISTICS after;
+
+    // Like a string returned by parson, which is not built with the tags
+    void* block = malloc(64);
+    ASSERT_IS_NOT_NULL(block);
+    PnpMemory_GetTagStatistics(PNPMEMORY_TAG_BRIDGE, &before);
+
+    //act
+    PnpMemory_TaggedFree(block);
+
+    //assert
+    PnpMemory_GetTagStatistics(PNPMEMORY_TAG_BRIDGE, &after);
+    ASSERT_ARE_EQUAL(long, before.CurrentBytes, after.CurrentBytes);
+    ASSERT_ARE_EQUAL(long, before.Frees, after.Frees);
+    PnpMemory_LogTagStatistics("pnpbridge_memory_ut");
+}
+
+// Debug builds assert when a block turns out to have been freed by untagged code
+#ifdef NDEBUG
+TEST_FUNCTION(PnpMemory_TaggedBlockFreedByUntaggedCode_IsDroppedOnReuse)
+{
+    // arrange
+    PNPMEMORY_TAG_STATISTICS before;
+    PNPMEMORY_TAG_STATISTICS after;
+
+    PnpMemory_GetTagStatistics(PNPMEMORY_TAG_MODBUS_ADAPTER, &before);
+    void* block = PnpMemory_TaggedMalloc(PNPMEMORY_TAG_MODBUS_ADAPTER, 48);
+    ASSERT_IS_NOT_NULL(block);
+    free(block);
+
+    //act
+    void* reused = PnpMemory_TaggedMalloc(PNPMEMORY_TAG_SERIAL_ADAPTER, 48);
+    ASSERT_IS_NOT_NULL(reused);
+
+    //assert
+    // The heap usually hands the freed address out again right away. Only
+    // then is the stale entry found.
+    PnpMemory_GetTagStatistics(PNPMEMORY_TAG_MODBUS_ADAPTER, &after);
+    if (reused == block) {
+        ASSERT_ARE_EQUAL(long, before.CurrentBytes, after.CurrentBytes);
+    }
+
+    PnpMemory_TaggedFree(reused);
+}
+#endif
+
+TEST_FUNCTION(PnpMemory_Budget_RefusesAndSheds)
+{
+    // arrange
+    PNPMEMORY memory[BUDGET_BLOCKS] = { 0 };
+    PNPMEMORY_STATISTICS before;
+    PNPMEMORY_STATISTICS after;
+    PNPMEMORY_BUDGET budget;
+    int created = 0;
+
+    PnpMemory_GetStatistics(&before);
+    budget.LimitBytes = before.BudgetUsedBytes + (BUDGET_BLOCKS / 2) * BUDGET_BLOCK_SIZE;
+    budget.ShedSamplesPercent = 75;
+    budget.RefuseArrivalsPercent = 90;
+    PnpMemory_SetBudget(&budget);
+    ASSERT_ARE_EQUAL(int, PNPMEMORY_SHED_NONE, PnpMemory_GetSheddingLevel());
+
+    //act
+    while (created < BUDGET_BLOCKS &&
+           0 == PnpMemory_Create(NULL, BUDGET_BLOCK_SIZE, &memory[created])) {
+        created++;
+    }
+
+    //assert
+    PnpMemory_GetStatistics(&after);
+    ASSERT_IS_TRUE(created < BUDGET_BLOCKS);
+    ASSERT_IS_TRUE(after.BudgetUsedBytes <= budget.LimitBytes);
+    ASSERT_ARE_EQUAL(long, 1, after.Refused - before.Refused);
+    ASSERT_ARE_EQUAL(int, PNPMEMORY_SHED_ARRIVALS, PnpMemory_GetSheddingLevel());
+
+    for (int i = 0; i < created; i++) {
+        PnpMemory_ReleaseReference(memory[i]);
+    }
+
+    ASSERT_ARE_EQUAL(int, PNPMEMORY_SHED_NONE, PnpMemory_GetSheddingLevel());
+    PnpMemory_GetStatistics(&after);
+    ASSERT_ARE_EQUAL(long, before.BudgetUsedBytes, after.BudgetUsedBytes);
+
+    PnpMemory_SetBudget(NULL);
+}
+
+END_TEST_SUITE(pnpbridge_memory_ut)
@@ -0,0 +1,454 @@
+// Copyright (c) Microsoft. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#ifdef __cplusplus
+#include <cstdlib>
+#include <cstddef>
+#include <cstdint>
+#else
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#endif
+
+#include "testrunnerswitcher.h"
+
+#include "pnpbridge.h"
+#include "pnpbridge_common.h"
+
+#define PRODUCER_COUNT 16
+#define MESSAGES_PER_PRODUCER 2000
+#define WAKEUP_ITERATIONS 50
+#define WAKEUP_LATENCY_BOUND_MS 100
+#define DRAIN_TIMEOUT_MS 60000
+#define BOUNDED_QUEUE_CAPACITY 4
+#define OVERFLOW_MESSAGES 10
+#define CREATE_TIMEOUT_MS 50
+#define SLOW_CREATE_MS 300
+#define SLOW_PRODUCER 1
+
+static PMESSAGE_QUEUE g_queue;
+static TICK_COUNTER_HANDLE g_tickCounter;
+
+// State below is only written by the queue worker
+static int g_lastSequence[PRODUCER_COUNT];
+static int g_orderViolations;
+static tickcounter_ms_t g_processedAt;
+static volatile long g_processedCount;
+static volatile long g_publishCount;
+
+// While g_holdWorker is set the worker waits in PnpBridge_ProcessPnpMessage so
+// that the ingress queue fills up
+static volatile long g_holdWorker;
+static volatile long g_workerHeld;
+
+// While g_acceptMessages is set the messages are accepted and their interfaces
+// created. The ones from SLOW_PRODUCER take SLOW_CREATE_MS to create.
+static volatile long g_acceptMessages;
+static volatile long g_cancelCount;
+static int g_publishedInterfaces[2];
+
+// The queue worker hands every message to the bridge. Record the order in which
+// each producer's messages are seen and fail them so that the queue drops them.
+int PnpBridge_ProcessPnpMessage(PNPMESSAGE PnpMessage)
+{
+    int producer = -1;
+    int sequence = -1;
+
+    if (PNPBRIDGE_INTERLOCKED_READ(&g_holdWorker)) {
+        PNPBRIDGE_INTERLOCKED_INCREMENT(&g_workerHeld);
+        while (PNPBRIDGE_INTERLOCKED_READ(&g_holdWorker)) {
+            ThreadAPI_Sleep(1);
+        }
+    }
+
+    if (2 != sscanf(PnpMessage_GetMessage(PnpMessage), "%d:%d", &producer, &sequence) ||
+        producer < 0 || producer >= PRODUCER_COUNT) {
+        g_orderViolations++;
+    }
+    else {
+        if (sequence != g_lastSequence[producer] + 1) {
+            g_orderViolations++;
+        }
+        g_lastSequence[producer] = sequence;
+    }
+
+    tickcounter_get_current_ms(g_tickCounter, &g_processedAt);
+    PNPBRIDGE_INTERLOCKED_INCREMENT(&g_processedCount);
+
+    return PNPBRIDGE_INTERLOCKED_READ(&g_acceptMessages) ? PNPBRIDGE_OK : PNPBRIDGE_FAILED;
+}
+
+int PnpBridge_CreatePnpInterface(PNPMESSAGE PnpMessage)
+{
+    int producer = -1;
+    int sequence = -1;
+
+    if (2 == sscanf(PnpMessage_GetMessage(PnpMessage), "%d:%d", &producer, &sequence) &&
+        SLOW_PRODUCER == producer) {
+        ThreadAPI_Sleep(SLOW_CREATE_MS);
+    }
+
+    return PNPBRIDGE_OK;
+}
+
+void PnpBridge_CancelPnpMessage(PNPMESSAGE PnpMessage)
+{
+    AZURE_UNREFERENCED_PARAMETER(PnpMessage);
+    PNPBRIDGE_INTERLOCKED_INCREMENT(&g_cancelCount);
+}
+
+int DiscoveryAdapter_PublishInterfaces(void)
+{
+    // Called on the queue worker, which owns PublishCount
+    long publishCount = PNPBRIDGE_INTERLOCKED_READ(&g_publishCount);
+    if (publishCount < 2) {
+        g_publishedInterfaces[publishCount] = g_queue->PublishCount;
+    }
+
+    PNPBRIDGE_INTERLOCKED_INCREMENT(&g_publishCount);
+    return 0;
+}
+
+static void ReportMessage(int producer, int sequence)
+{
+    PNPMESSAGE msg = NULL;
+    char payload[32];
+
+    ASSERT_ARE_EQUAL(int, 0, PnpMessage_CreateMessage(&msg));
+    (void)snprintf(payload, sizeof(payload), "%d:%d", producer, sequence);
+    PnpMessage_SetMessage(msg, payload);
+
+    PnpMesssageQueue_Add(g_queue, msg);
+
+    // The queue holds its own reference
+    PnpMessage_ReleaseReference(msg);
+}
+
+static int Producer_Worker(void* context)
+{
+    int producer = (int)(intptr_t)context;
+
+    for (int i = 1; i <= MESSAGES_PER_PRODUCER; i++) {
+        ReportMessage(producer, i);
+    }
+
+    return 0;
+}
+
+static int OverflowProducer_Worker(void* context)
+{
+    AZURE_UNREFERENCED_PARAMETER(context);
+
+    for (int i = 2; i <= OVERFLOW_MESSAGES + 1; i++) {
+        ReportMessage(0, i);
+    }
+
+    return 0;
+}
+
+static bool WaitForValue(volatile long* value, long expected, unsigned int timeoutMs)
+{
+    tickcounter_ms_t start = 0;
+    tickcounter_ms_t now = 0;
+
+    tickcounter_get_current_ms(g_tickCounter, &start);
+    while (PNPBRIDGE_INTERLOCKED_READ(value) < expected) {
+        tickcounter_get_current_ms(g_tickCounter, &now);
+        if (now - start > timeoutMs) {
+            return false;
+        }
+        ThreadAPI_Sleep(1);
+    }
+
+    return true;
+}
+
+// Replaces the unbounded queue created for each test with a bounded one whose
+// worker is stuck processing the first message
+static void CreateFullQueue(PNPBRIDGE_QUEUE_OVERFLOW_POLICY policy)
+{
+    PNPBRIDGE_CONFIGURATION config = { 0 };
+
+    PnpMessageQueue_Release(g_queue);
+
+    config.MessageQueueLimits.Capacity = BOUNDED_QUEUE_CAPACITY;
+    config.MessageQueueLimits.OverflowPolicy = policy;
+    ASSERT_ARE_EQUAL(int, PNPBRIDGE_OK, PnpMessageQueue_Create(&config, &g_queue));
+
+    PNPBRIDGE_INTERLOCKED_INCREMENT(&g_holdWorker);
+    ReportMessage(0, 1);
+    ASSERT_IS_TRUE(WaitForValue(&g_workerHeld, 1, DRAIN_TIMEOUT_MS));
+}
+
+static bool WaitForProcessedCount(long expected, unsigned int timeoutMs)
+{
+    tickcounter_ms_t start = 0;
+    tickcounter_ms_t now = 0;
+
+    tickcounter_get_current_ms(g_tickCounter, &start);
+    while (PNPBRIDGE_INTERLOCKED_READ(&g_processedCount) < expected) {
+        tickcounter_get_current_ms(g_tickCounter, &now);
+        if (now - start > timeoutMs) {
+            return false;
+        }
+        ThreadAPI_Sleep(1);
+    }
+
+    return true;
+}
+
+BEGIN_TEST_SUITE(pnpbridge_message_queue_ut)
+
+TEST_SUITE_INITIALIZE(suite_init)
+{
+    g_tickCounter = tickcounter_create();
+    ASSERT_IS_NOT_NULL(g_tickCounter);
+}
+
+TEST_SUITE_CLEANUP(suite_cleanup)
+{
+    tickcounter_destroy(g_tickCounter);
+}
+
+TEST_FUNCTION_INITIALIZE(TestMethodInit)
+{
+    PNPBRIDGE_CONFIGURATION config = { 0 };
+
+    memset(g_lastSequence, 0, sizeof(g_lastSequence));
+    g_orderViolations = 0;
+    g_processedAt = 0;
+    g_processedCount = 0;
+    g_publishCount = 0;
+    g_holdWorker = 0;
+    g_workerHeld = 0;
+    g_acceptMessages = 0;
+    g_cancelCount = 0;
+    memset(g_publishedInterfaces, 0, sizeof(g_publishedInterfaces));
+
+    ASSERT_ARE_EQUAL(int, PNPBRIDGE_OK, PnpMessageQueue_Create(&config, &g_queue));
+}
+
+TEST_FUNCTION_CLEANUP(TestMethodCleanup)
+{
+    PnpMessageQueue_Release(g_queue);
+    g_queue = NULL;
+}
+
+TEST_FUNCTION(PnpMessageQueue_ManyProducers_AllMessagesDeliveredInOrder)
+{
+    // arrange
+    THREAD_HANDLE producers[PRODUCER_COUNT];
+
+    //act
+    for (int i = 0; i < PRODUCER_COUNT; i++) {
+        ASSERT_ARE_EQUAL(int, THREADAPI_OK, ThreadAPI_Create(&producers[i], Producer_Worker, (void*)(intptr_t)i));
+    }
+
+    for (int i = 0; i < PRODUCER_COUNT; i++) {
+        ThreadAPI_Join(producers[i], NULL);
+    }
+
+    //assert
+    ASSERT_IS_TRUE(WaitForProcessedCount(PRODUCER_COUNT * MESSAGES_PER_PRODUCER, DRAIN_TIMEOUT_MS));
+    ASSERT_ARE_EQUAL(int, 0, g_orderViolations);
+    for (int i = 0; i < PRODUCER_COUNT; i++) {
+        ASSERT_ARE_EQUAL(int, MESSAGES_PER_PRODUCER, g_lastSequence[i]);
+    }
+    ASSERT_ARE_EQUAL(long, 0, PNPBRIDGE_INTERLOCKED_READ(&g_queue->InCount));
+
+    // No interface was created so nothing should have been published
+    ASSERT_ARE_EQUAL(long, 0, PNPBRIDGE_INTERLOCKED_READ(&g_publishCount));
+}
+
+TEST_FUNCTION(PnpMessageQueue_IdleWorker_WakesUpWithinBound)
+{
+    // arrange
+    tickcounter_ms_t maxLatency = 0;
+
+    for (int i = 1; i <= WAKEUP_ITERATIONS; i++) {
+        tickcounter_ms_t reportedAt = 0;
+
+        // Let the worker go back to waiting on an empty queue
+        ThreadAPI_Sleep(10);
+
+        //act
+        tickcounter_get_current_ms(g_tickCounter, &reportedAt);
+        ReportMessage(0, i);
+
+        //assert
+        ASSERT_IS_TRUE(WaitForProcessedCount(i, DRAIN_TIMEOUT_MS));
+        if (g_processedAt - reportedAt > maxLatency) {
+            maxLatency = g_processedAt - reportedAt;
+        }
+    }
+
+    ASSERT_ARE_EQUAL(int, 0, g_orderViolations);
+    ASSERT_IS_TRUE(maxLatency <= WAKEUP_LATENCY_BOUND_MS);
+}
+
+TEST_FUNCTION(PnpMessageQueue_FullQueue_DropNewest_KeepsQueuedMessages)
+{
+    // arrange
+    PNPBRIDGE_QUEUE_STATISTICS stats;
+    CreateFullQueue(PNPBRIDGE_QUEUE_OVERFLOW_DROP_NEWEST);
+
+    //act
+    for (int i = 2; i <= OVERFLOW_MESSAGES + 1; i++) {
+        ReportMessage(0, i);
+    }
+
+    PNPBRIDGE_INTERLOCKED_DECREMENT(&g_holdWorker);
+
+    //assert
+    ASSERT_IS_TRUE(WaitForProcessedCount(BOUNDED_QUEUE_CAPACITY + 1, DRAIN_TIMEOUT_MS));
+    ASSERT_ARE_EQUAL(int, 0, g_orderViolations);
+    ASSERT_ARE_EQUAL(int, BOUNDED_QUEUE_CAPACITY + 1, g_lastSequence[0]);
+
+    PnpMessageQueue_GetStatistics(g_queue, &stats);
+    ASSERT_ARE_EQUAL(long, OVERFLOW_MESSAGES - BOUNDED_QUEUE_CAPACITY, stats.Dropped);
+    ASSERT_ARE_EQUAL(long, BOUNDED_QUEUE_CAPACITY, stats.HighWaterMark);
+    ASSERT_ARE_EQUAL(long, 0, stats.Depth);
+}
+
+TEST_FUNCTION(PnpMessageQueue_FullQueue_DropOldest_KeepsLatestMessages)
+{
+    // arrange
+    PNPBRIDGE_QUEUE_STATISTICS stats;
+    CreateFullQueue(PNPBRIDGE_QUEUE_OVERFLOW_DROP_OLDEST);
+
+    //act
+    for (int i = 2; i <= OVERFLOW_MESSAGES + 1; i++) {
+        ReportMessage(0, i);
+    }
+
+    PNPBRIDGE_INTERLOCKED_DECREMENT(&g_holdWorker);
+
+    //assert
+    ASSERT_IS_TRUE(WaitForProcessedCount(BOUNDED_QUEUE_CAPACITY + 1, DRAIN_TIMEOUT_MS));
+    ASSERT_ARE_EQUAL(int, OVERFLOW_MESSAGES + 1, g_lastSequence[0]);
+
+    PnpMessageQueue_GetStatistics(g_queue, &stats);
+    ASSERT_ARE_EQUAL(long, OVERFLOW_MESSAGES - BOUNDED_QUEUE_CAPACITY, stats.Dropped);
+    ASSERT_ARE_EQUAL(long, 0, stats.Depth);
+}
+
+TEST_FUNCTION(PnpMessageQueue_FullQueue_Block_WaitsForRoom)
+{
+    // arrange
+    PNPBRIDGE_QUEUE_STATISTICS stats;
+    THREAD_HANDLE producer;
+    CreateFullQueue(PNPBRIDGE_QUEUE_OVERFLOW_BLOCK);
+
+    //act
+    ASSERT_ARE_EQUAL(int, THREADAPI_OK, ThreadAPI_Create(&producer, OverflowProducer_Worker, NULL));
+    ASSERT_IS_TRUE(WaitForValue(&g_queue->Blocked, 1, DRAIN_TIMEOUT_MS));
+
+    PNPBRIDGE_INTERLOCKED_DECREMENT(&g_holdWorker);
+    ThreadAPI_Join(producer, NULL);
+
+    //assert
+    ASSERT_IS_TRUE(WaitForProcessedCount(OVERFLOW_MESSAGES + 1, DRAIN_TIMEOUT_MS));
+    ASSERT_ARE_EQUAL(int, 0, g_orderViolations);
+    ASSERT_ARE_EQUAL(int, OVERFLOW_MESSAGES + 1, g_lastSequence[0]);
+
+    PnpMessageQueue_GetStatistics(g_queue, &stats);
+    ASSERT_ARE_EQUAL(long, 0, stats.Dropped);
+    ASSERT_IS_TRUE(stats.HighWaterMark <= BOUNDED_QUEUE_CAPACITY);
+}
+
+TEST_FUNCTION(PnpMessageQueue_SlowCreate_PublishedAfterOthers)
+{
+    // arrange
+    PNPBRIDGE_CONFIGURATION config = { 0 };
+
+    PnpMessageQueue_Release(g_queue);
+
+    config.AdapterWorkers = 2;
+    config.AdapterCallbackTimeoutMs = CREATE_TIMEOUT_MS;
+    ASSERT_ARE_EQUAL(int, PNPBRIDGE_OK, PnpMessageQueue_Create(&config, &g_queue));
+
+    PNPBRIDGE_INTERLOCKED_INCREMENT(&g_acceptMessages);
+
+    //act
+    ReportMessage(SLOW_PRODUCER, 1);
+    ReportMessage(0, 1);
+
+    //assert
+    // The fast device is published without waiting for the slow one, which
+    // is published in a later cycle once its create returns
+    ASSERT_IS_TRUE(WaitForValue(&g_publishCount, 2, DRAIN_TIMEOUT_MS));
+    ASSERT_ARE_EQUAL(int, 1, g_publishedInterfaces[0]);
+    ASSERT_ARE_EQUAL(int, 2, g_publishedInterfaces[1]);
+    ASSERT_ARE_EQUAL(long, 0, PNPBRIDGE_INTERLOCKED_READ(&g_cancelCount));
+}
+
+TEST_FUNCTION(PnpMessage_CreateMessageWithPayload_UsesSingleAllocation)
+{
+    // arrange
+    PNPMEMORY_STATISTICS before;
+    PNPMEMORY_STATISTICS after;
+    PNPMESSAGE msg = NULL;
+
+    PnpMemory_GetStatistics(&before);
+
+    //act
+    ASSERT_ARE_EQUAL(int, 0, PnpMessage_CreateMessageWithPayload(&msg, "{}", "http://example.com/Sensor/1", "sensor"));
+
+    //assert
+    PnpMemory_GetStatistics(&after);
+    ASSERT_ARE_EQUAL(long, 1, (after.Hits + after.Misses) - (before.Hits + before.Misses));
+    ASSERT_ARE_EQUAL(char_ptr, "{}", PnpMessage_GetMessage(msg));
+    ASSERT_ARE_EQUAL(char_ptr, "http://example.com/Sensor/1", PnpMessage_GetInterfaceId(msg));
+    ASSERT_ARE_EQUAL(char_ptr, "sensor", PnpMessage_AccessProperties(msg)->ComponentName);
+
+    // Setting the same values again keeps the inline copies and other
+    // values replace them
+    const char* interfaceId = PnpMessage_GetInterfaceId(msg);
+    ASSERT_ARE_EQUAL(int, 0, PnpMessage_SetInterfaceId(msg, "http://example.com/Sensor/1"));
+    ASSERT_IS_TRUE(interfaceId == PnpMessage_GetInterfaceId(msg));
+    ASSERT_ARE_EQUAL(int, 0, PnpMessage_SetComponentName(msg, "other"));
+    ASSERT_ARE_EQUAL(char_ptr, "other", PnpMessage_AccessProperties(msg)->ComponentName);
+
+    PnpMessage_ReleaseReference(msg);
+}
+
+TEST_FUNCTION(PnpMessage_SetMessageOwned_TakesBuffer)
+{
+    // arrange
+    PNPMESSAGE msg = NULL;
+    char* payload = NULL;
+    ASSERT_ARE_EQUAL(int, 0, PnpMessage_CreateMessage(&msg));
+    ASSERT_ARE_EQUAL(int, 0, mallocAndStrcpy_s(&payload, "0:1"));
+
+    //act
+    ASSERT_ARE_EQUAL(int, 0, PnpMessage_SetMessageOwned(msg, payload));
+
+    //assert
+    ASSERT_IS_TRUE(payload == PnpMessage_GetMessage(msg));
+
+    // The payload is freed with the message
+    PnpMessage_ReleaseReference(msg);
+}
+
+TEST_FUNCTION(PnpMessage_CreateMessage_OverBudget_Fails)
+{
+    // arrange
+    PNPMEMORY_STATISTICS before;
+    PNPMEMORY_BUDGET budget = { 0 };
+    PNPMESSAGE msg = NULL;
+
+    PnpMemory_GetStatistics(&before);
+    budget.LimitBytes = before.BudgetUsedBytes + 1;
+    PnpMemory_SetBudget(&budget);
+
+    //act
+    int result = PnpMessage_CreateMessage(&msg);
+
+    //assert
+    PnpMemory_SetBudget(NULL);
+    ASSERT_ARE_NOT_EQUAL(int, 0, result);
+    ASSERT_IS_NULL(msg);
+}
+
+END_TEST_SUITE(pnpbridge_message_queue_ut)
@@ -0,0 +1,202 @@
+// Copyright (c) Microsoft. All rights reserved.
+// Licensed under the MIT license. See LICENSE file in the project root for full license information.
+
+#ifdef __cplusplus
+#include <cstdlib>
+#include <cstddef>
+#include <cstdint>
+#else
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#endif
+
+#include "testrunnerswitcher.h"
+
+#include "pnpbridge.h"
+#include "pnpbridge_common.h"
+
+#define TEST_SPOOL_PATH "pnpbridge_spool_ut.spool"
+#define TEST_SPOOL_SEGMENT_SIZE PNPBRIDGE_SPOOL_MIN_SEGMENT_BYTES
+#define TEST_SPOOL_SEGMENTS 3
+
+static void Spool_RemoveSegments(void)
+{
+    char path[64];
+
+    for (int i = 0; i < TEST_SPOOL_SEGMENTS; i++) {
+        sprintf(path, "%s.%d", TEST_SPOOL_PATH, i);
+        remove(path);
+    }
+}
+
+static PNPBRIDGE_SPOOL_HANDLE Spool_Reopen(void)
+{
+    PNPBRIDGE_SPOOL_HANDLE spool = NULL;
+
+    ASSERT_ARE_EQUAL(int, PNPBRIDGE_OK, PnpSpool_Open(TEST_SPOOL_PATH, TEST_SPOOL_SEGMENTS * TEST_SPOOL_SEGMENT_SIZE,
+                                                      TEST_SPOOL_SEGMENT_SIZE, &spool));
+    ASSERT_IS_NOT_NULL(spool);
+
+    return spool;
+}
+
+static void Spool_AppendReading(PNPBRIDGE_SPOOL_HANDLE spool, const char* componentName, const char* data)
+{
+    PNPBRIDGE_SPOOL_ENTRY entry = { 0 };
+
+    entry.InterfaceId = "http://test/sensor/1";
+    entry.ComponentName = componentName;
+    entry.TelemetryName = "temperature";
+    entry.TelemetryData = data;
+    entry.Flags = PNPBRIDGE_TELEMETRY_FLAG_SAMPLE;
+    entry.Time = 1000;
+    ASSERT_ARE_EQUAL(int, PNPBRIDGE_OK, PnpSpool_Append(spool, &entry));
+}
+
+// Appends count readings whose data is their index, starting at first
+static void Spool_AppendNumbered(PNPBRIDGE_SPOOL_HANDLE spool, int first, int count)
+{
+    char data[512];
+
+    for (int i = first; i < first + count; i++) {
+        // Pad the data so that a segment only holds a few readings
+        sprintf(data, "%-500d", i);
+        Spool_AppendReading(spool, "sensor1", data);
+    }
+}
+
+BEGIN_TEST_SUITE(pnpbridge_spool_ut)
+
+TEST_FUNCTION_INITIALIZE(method_init)
+{
+    Spool_RemoveSegments();
+}
+
+TEST_SUITE_CLEANUP(suite_cleanup)
+{
+    Spool_RemoveSegments();
+}
+
+TEST_FUNCTION(PnpSpool_Append_IsReplayedInOrderAfterReopen)
+{
+    // arrange
+    PNPBRIDGE_SPOOL_ENTRY entry;
+    PNPBRIDGE_SPOOL_HANDLE spool = Spool_Reopen();
+    ASSERT_IS_FALSE(PnpSpool_Peek(spool, &entry));
+
+    Spool_AppendReading(spool, "sensor1", "21.5");
+    Spool_AppendReading(spool, NULL, "22.0");
+    PnpSpool_Close(spool);
+
+    //act
+    spool = Spool_Reopen();
+
+    //assert
+    ASSERT_ARE_EQUAL(long, 2, PnpSpool_GetDepth(spool));
+
+    ASSERT_IS_TRUE(PnpSpool_Peek(spool, &entry));
+    ASSERT_ARE_EQUAL(char_ptr, "http://test/sensor/1", entry.InterfaceId);
+    ASSERT_ARE_EQUAL(char_ptr, "sensor1", entry.ComponentName);
+    ASSERT_ARE_EQUAL(char_ptr, "temperature", entry.TelemetryName);
+    ASSERT_ARE_EQUAL(char_ptr, "21.5", entry.TelemetryData);
+    ASSERT_ARE_EQUAL(int, PNPBRIDGE_TELEMETRY_FLAG_SAMPLE, entry.Flags);
+    ASSERT_IS_TRUE(1000 == entry.Time);
+    PnpSpool_Pop(spool);
+
+    ASSERT_IS_TRUE(PnpSpool_Peek(spool, &entry));
+    ASSERT_IS_NULL(entry.ComponentName);
+    ASSERT_ARE_EQUAL(char_ptr, "22.0", entry.TelemetryData);
+    PnpSpool_Pop(spool);
+
+    ASSERT_IS_FALSE(PnpSpool_Peek(spool, &entry));
+    ASSERT_ARE_EQUAL(long, 0, PnpSpool_GetDepth(spool));
+
+    PnpSpool_Close(spool);
+}
+
+TEST_FUNCTION(PnpSpool_Pop_IsNotReplayedAgainAfterReopen)
+{
+    // arrange
+    PNPBRIDGE_SPOOL_ENTRY entry;
+    PNPBRIDGE_SPOOL_HANDLE spool = Spool_Reopen();
+    Spool_AppendNumbered(spool, 0, 20);
+
+    //act
+    for (int i = 0; i < 5; i++) {
+        ASSERT_IS_TRUE(PnpSpool_Peek(spool, &entry));
+        PnpSpool_Pop(spool);
+    }
+    PnpSpool_Close(spool);
+    spool = Spool_Reopen();
+
+    //assert
+    ASSERT_ARE_EQUAL(long, 15, PnpSpool_GetDepth(spool));
+    for (int i = 5; i < 20; i++) {
+        ASSERT_IS_TRUE(PnpSpool_Peek(spool, &entry));
+        ASSERT_ARE_EQUAL(int, i, atoi(entry.TelemetryData));
+        PnpSpool_Pop(spool);
+    }
+    ASSERT_IS_FALSE(PnpSpool_Peek(spool, &entry));
+
+    PnpSpool_Close(spool);
+}
+
+TEST_FUNCTION(PnpSpool_Append_DropsTheOldestSegmentWhenFull)
+{
+    // arrange
+    PNPBRIDGE_SPOOL_ENTRY entry;
+    PNPBRIDGE_SPOOL_STATISTICS stats;
+    PNPBRIDGE_SPOOL_HANDLE spool = Spool_Reopen();
+
+    //act
+    Spool_AppendNumbered(spool, 0, 100);
+    PnpSpool_GetStatistics(spool, &stats);
+
+    //assert
+    // The readings that are left are the newest ones, in order
+    ASSERT_IS_TRUE(stats.Dropped > 0);
+    ASSERT_ARE_EQUAL(long, 100, stats.Depth + stats.Dropped);
+    ASSERT_IS_TRUE(stats.Bytes <= stats.CapacityBytes);
+    ASSERT_IS_TRUE(1000 == stats.OldestTime);
+
+    for (int i = (int)stats.Dropped; i < 100; i++) {
+        ASSERT_IS_TRUE(PnpSpool_Peek(spool, &entry));
+        ASSERT_ARE_EQUAL(int, i, atoi(entry.TelemetryData));
+        PnpSpool_Pop(spool);
+    }
+    ASSERT_IS_FALSE(PnpSpool_Peek(spool, &entry));
+
+    PnpSpool_GetStatistics(spool, &stats);
+    ASSERT_ARE_EQUAL(long, 0, stats.Depth);
+    ASSERT_IS_TRUE(0 == stats.OldestTime);
+
+    PnpSpool_Close(spool);
+}
+
+TEST_FUNCTION(PnpSpool_Append_RefusesAReadingLargerThanASegment)
+{
+    // arrange
+    PNPBRIDGE_SPOOL_ENTRY entry = { 0 };
+    PNPBRIDGE_SPOOL_HANDLE spool = Spool_Reopen();
+    char* data = malloc(TEST_SPOOL_SEGMENT_SIZE + 1);
+    ASSERT_IS_NOT_NULL(data);
+    memset(data, 'x', TEST_SPOOL_SEGMENT_SIZE);
+    data[TEST_SPOOL_SEGMENT_SIZE] = '\0';
+
+    entry.InterfaceId = "http://test/sensor/1";
+    entry.TelemetryName = "image";
+    entry.TelemetryData = data;
+
+    //act
+    PNPBRIDGE_RESULT result = PnpSpool_Append(spool, &entry);
+
+    //assert
+    ASSERT_ARE_EQUAL(int, PNPBRIDGE_INVALID_ARGS, result);
+    ASSERT_ARE_EQUAL(long, 0, PnpSpool_GetDepth(spool));
+
+    free(data);
+    PnpSpool_Close(spool);
+}
+
+END_TEST_SUITE(pnpbridge_spool_ut)